@@ -0,0 +1,50 @@
+-- Parallel query scaling of memcache_get()
+--
+-- Run with psql against a database with pgmemcache installed and
+-- pgmemcache.default_servers pointing to a memcached instance, for example:
+--
+--   psql -v rows=10000000 -f bench/parallel_get.sql
+--
+-- The same count(memcache_get(...)) query is executed with an increasing
+-- max_parallel_workers_per_gather, the "Workers Launched" line and the
+-- timings show how the per-row lookups scale across parallel workers.
+
+\set ON_ERROR_STOP 1
+\if :{?rows}
+\else
+\set rows 1000000
+\endif
+
+SELECT count(memcache_set('bench:parallel:' || i, 'value ' || i))
+  FROM generate_series(0, 999) AS i;
+
+DROP TABLE IF EXISTS pgmemcache_bench_parallel;
+CREATE UNLOGGED TABLE pgmemcache_bench_parallel AS
+  SELECT i FROM generate_series(1, :rows) AS i;
+ANALYZE pgmemcache_bench_parallel;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+
+\timing on
+
+SET max_parallel_workers_per_gather = 0;
+EXPLAIN (ANALYZE, COSTS OFF)
+  SELECT count(memcache_get('bench:parallel:' || i % 1000)) FROM pgmemcache_bench_parallel;
+
+SET max_parallel_workers_per_gather = 2;
+EXPLAIN (ANALYZE, COSTS OFF)
+  SELECT count(memcache_get('bench:parallel:' || i % 1000)) FROM pgmemcache_bench_parallel;
+
+SET max_parallel_workers_per_gather = 4;
+EXPLAIN (ANALYZE, COSTS OFF)
+  SELECT count(memcache_get('bench:parallel:' || i % 1000)) FROM pgmemcache_bench_parallel;
+
+SET max_parallel_workers_per_gather = 8;
+EXPLAIN (ANALYZE, COSTS OFF)
+  SELECT count(memcache_get('bench:parallel:' || i % 1000)) FROM pgmemcache_bench_parallel;
+
+\timing off
+
+DROP TABLE pgmemcache_bench_parallel;
@@ -0,0 +1,4 @@
+-- pgbench -n -f bench/pgbench/get_multi.sql -D keys=10000 -D batch_size=100
+\set key random(0, :keys - 1)
+SELECT count(*) FROM memcache_get_multi(ARRAY(
+  SELECT 'bench:' || ((:key + i * 7919) % :keys) FROM generate_series(1, :batch_size) AS i));
@@ -0,0 +1,3 @@
+-- pgbench -n -f bench/pgbench/incr.sql -D keys=10000
+\set key random(0, :keys - 1)
+SELECT memcache_incr('bench:counter:' || :key);
@@ -0,0 +1,6 @@
+-- Store the keys used by the other scripts, run once with psql:
+-- psql -v keys=10000 -v value_size=100 -f bench/pgbench/populate.sql
+SELECT count(memcache_set('bench:' || i, repeat('x', :value_size)))
+  FROM generate_series(0, :keys - 1) AS i;
+SELECT count(memcache_set('bench:counter:' || i, '0'))
+  FROM generate_series(0, :keys - 1) AS i;
@@ -0,0 +1,3 @@
+-- pgbench -n -f bench/pgbench/set.sql -D keys=10000 -D value_size=100
+\set key random(0, :keys - 1)
+SELECT memcache_set('bench:' || :key, repeat('x', :value_size));
@@ -0,0 +1,471 @@
+/*
+ * Throughput and latency benchmark driver for pgmemcache.
+ *
+ * Starts a private memcached instance the same way the regression tests do,
+ * connects a number of clients to PostgreSQL with libpq and runs pgmemcache
+ * operations against it for a fixed duration for every combination of
+ * operation, value size, batch size and client count.  One JSON object is
+ * written per combination so that results of different releases and client
+ * library builds can be compared mechanically.
+ *
+ * With --mock no memcached is started and pgmemcache must be built with
+ * USE_MOCK=1: requests are then served by the in-process mock engine with
+ * a fixed simulated latency, which isolates pgmemcache's own overhead.
+ * The mock's stores are private to each backend so every client populates
+ * its own.
+ *
+ * Copyright (c) 2012-2014 Ohmu Ltd <opensource@ohmu.fi>
+ *
+ * See the file LICENSE for distribution terms.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libpq-fe.h"
+
+#define MAX_LIST 32
+
+typedef struct
+{
+  const char *name;
+  const char *sql;
+  int nparams;     /* key or key batch, and value for set */
+  int uses_value;  /* results depend on the value size */
+  int uses_batch;
+} bench_op;
+
+static const bench_op ops[] = {
+  { "get", "SELECT memcache_get($1)", 1, 1, 0 },
+  { "set", "SELECT memcache_set($1, $2)", 2, 1, 0 },
+  { "get_multi", "SELECT count(*) FROM memcache_get_multi($1::text[])", 1, 1, 1 },
+  { "incr", "SELECT memcache_incr($1)", 1, 0, 0 },
+  { "delete", "SELECT memcache_delete($1)", 1, 0, 0 },
+};
+
+static struct
+{
+  const char *conninfo;
+  const char *memcached;
+  const char *backend;
+  int memcached_port;
+  int mock;
+  int mock_latency;  /* microseconds */
+  int duration;
+  int keys;
+  int nops;
+  const bench_op *ops[MAX_LIST];
+  int nvalue_sizes;
+  int value_sizes[MAX_LIST];
+  int nbatch_sizes;
+  int batch_sizes[MAX_LIST];
+  int nclients;
+  int clients[MAX_LIST];
+  char pidfile[256];
+} opts;
+
+typedef struct
+{
+  pthread_t thread;
+  int id;
+  const bench_op *op;
+  int value_size;
+  int batch_size;
+  unsigned int seed;
+  PGconn *conn;
+  /* per-call latencies in microseconds */
+  double *latencies;
+  long nlatencies;
+  long maxlatencies;
+  long errors;
+  const char *error;
+} bench_client;
+
+static volatile int bench_running;
+
+static double now_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void die(const char *fmt, const char *arg)
+{
+  fprintf(stderr, "pgmemcache_bench: ");
+  fprintf(stderr, fmt, arg);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static int parse_int_list(const char *str, int *list)
+{
+  char *copy = strdup(str), *tok, *saveptr = NULL;
+  int n = 0;
+
+  for (tok = strtok_r(copy, ",", &saveptr); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &saveptr))
+    {
+      list[n] = atoi(tok);
+      if (list[n] <= 0)
+        die("invalid list element: %s", tok);
+      n++;
+    }
+  free(copy);
+  return n;
+}
+
+static int parse_op_list(const char *str, const bench_op **list)
+{
+  char *copy = strdup(str), *tok, *saveptr = NULL;
+  int n = 0;
+  size_t i;
+
+  for (tok = strtok_r(copy, ",", &saveptr); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &saveptr))
+    {
+      for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        if (strcmp(ops[i].name, tok) == 0)
+          break;
+      if (i == sizeof(ops) / sizeof(ops[0]))
+        die("unknown operation: %s", tok);
+      list[n++] = &ops[i];
+    }
+  free(copy);
+  return n;
+}
+
+static void memcached_start(void)
+{
+  char port[16];
+  pid_t pid;
+  int status;
+
+  snprintf(port, sizeof(port), "%d", opts.memcached_port);
+  snprintf(opts.pidfile, sizeof(opts.pidfile), "/tmp/pgmemcache-bench-%d.pid", (int) getpid());
+  pid = fork();
+  if (pid == 0)
+    {
+      execlp(opts.memcached, opts.memcached, "-p", port, "-U", "0", "-m", "1024",
+             "-P", opts.pidfile, "-d", (char *) NULL);
+      _exit(127);
+    }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("could not start %s", opts.memcached);
+  /* memcached -d returns before the pid file and the socket exist */
+  usleep(200000);
+}
+
+static void memcached_stop(void)
+{
+  FILE *fp = fopen(opts.pidfile, "r");
+  int pid;
+
+  if (fp == NULL)
+    return;
+  if (fscanf(fp, "%d", &pid) == 1 && pid > 0)
+    kill(pid, SIGTERM);
+  fclose(fp);
+  unlink(opts.pidfile);
+}
+
+static PGconn *bench_connect(void)
+{
+  PGconn *conn = PQconnectdb(opts.conninfo);
+  PGresult *res;
+  char sql[128];
+
+  if (PQstatus(conn) != CONNECTION_OK)
+    die("connection failed: %s", PQerrorMessage(conn));
+  snprintf(sql, sizeof(sql), "SET pgmemcache.default_servers = 'localhost:%d'", opts.memcached_port);
+  res = PQexec(conn, sql);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    die("could not configure pgmemcache: %s", PQerrorMessage(conn));
+  PQclear(res);
+  if (opts.mock)
+    {
+      snprintf(sql, sizeof(sql), "SET pgmemcache.mock_latency = %d", opts.mock_latency);
+      res = PQexec(conn, sql);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        die("could not configure the mock engine: %s", PQerrorMessage(conn));
+      PQclear(res);
+    }
+  return conn;
+}
+
+static void bench_exec(PGconn *conn, const char *sql)
+{
+  PGresult *res = PQexec(conn, sql);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK && PQresultStatus(res) != PGRES_TUPLES_OK)
+    die("query failed: %s", PQerrorMessage(conn));
+  PQclear(res);
+}
+
+/* Store a value of the given size under every benchmark key. */
+static void bench_populate(PGconn *conn, int value_size)
+{
+  char sql[256];
+
+  snprintf(sql, sizeof(sql),
+           "SELECT count(memcache_set('bench:' || i, repeat('x', %d))) "
+           "FROM generate_series(0, %d) AS i", value_size, opts.keys - 1);
+  bench_exec(conn, sql);
+  snprintf(sql, sizeof(sql),
+           "SELECT count(memcache_set('bench:counter:' || i, '0')) "
+           "FROM generate_series(0, %d) AS i", opts.keys - 1);
+  bench_exec(conn, sql);
+}
+
+static void *bench_client_main(void *arg)
+{
+  bench_client *client = (bench_client *) arg;
+  const bench_op *op = client->op;
+  char *value = NULL, *keybuf;
+  const char *params[2];
+  size_t keybuf_len = 64 + (size_t) client->batch_size * 24;
+  PGresult *res;
+
+  keybuf = malloc(keybuf_len);
+  if (op->nparams > 1)
+    {
+      value = malloc(client->value_size + 1);
+      memset(value, 'x', client->value_size);
+      value[client->value_size] = '\0';
+    }
+
+  res = PQprepare(client->conn, "bench", op->sql, op->nparams, NULL);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    {
+      client->error = strdup(PQerrorMessage(client->conn));
+      PQclear(res);
+      free(keybuf);
+      free(value);
+      return NULL;
+    }
+  PQclear(res);
+
+  while (bench_running)
+    {
+      double start;
+      int key = rand_r(&client->seed) % opts.keys;
+
+      if (op->uses_batch)
+        {
+          size_t len = 0;
+          int i;
+
+          keybuf[len++] = '{';
+          for (i = 0; i < client->batch_size; i++)
+            len += snprintf(keybuf + len, keybuf_len - len, "%sbench:%d", i ? "," : "",
+                            rand_r(&client->seed) % opts.keys);
+          keybuf[len++] = '}';
+          keybuf[len] = '\0';
+        }
+      else
+        snprintf(keybuf, keybuf_len, strcmp(op->name, "incr") == 0 ? "bench:counter:%d" : "bench:%d", key);
+      params[0] = keybuf;
+      params[1] = value;
+
+      start = now_usec();
+      res = PQexecPrepared(client->conn, "bench", op->nparams, params, NULL, NULL, 0);
+      if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        client->errors++;
+      PQclear(res);
+
+      if (client->nlatencies == client->maxlatencies)
+        {
+          client->maxlatencies = client->maxlatencies ? client->maxlatencies * 2 : 65536;
+          client->latencies = realloc(client->latencies, client->maxlatencies * sizeof(double));
+        }
+      client->latencies[client->nlatencies++] = now_usec() - start;
+    }
+
+  free(keybuf);
+  free(value);
+  return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, long n, double p)
+{
+  long idx;
+
+  if (n == 0)
+    return 0.0;
+  idx = (long) (p / 100.0 * (n - 1) + 0.5);
+  return sorted[idx];
+}
+
+static void bench_run(PGconn *setup_conn, const bench_op *op, int value_size, int batch_size, int nclients)
+{
+  bench_client *clients = calloc(nclients, sizeof(bench_client));
+  double *all, elapsed, start;
+  long total = 0, errors = 0, n = 0;
+  int i;
+
+  if (!opts.mock && strcmp(op->name, "set") != 0)
+    bench_populate(setup_conn, value_size);
+
+  for (i = 0; i < nclients; i++)
+    {
+      clients[i].id = i;
+      clients[i].op = op;
+      clients[i].value_size = value_size;
+      clients[i].batch_size = batch_size;
+      clients[i].seed = (unsigned int) (i + 1) * 7919;
+      clients[i].conn = bench_connect();
+      if (opts.mock && strcmp(op->name, "set") != 0)
+        bench_populate(clients[i].conn, value_size);
+    }
+
+  bench_running = 1;
+  start = now_usec();
+  for (i = 0; i < nclients; i++)
+    pthread_create(&clients[i].thread, NULL, bench_client_main, &clients[i]);
+  sleep(opts.duration);
+  bench_running = 0;
+  for (i = 0; i < nclients; i++)
+    pthread_join(clients[i].thread, NULL);
+  elapsed = (now_usec() - start) / 1000000.0;
+
+  for (i = 0; i < nclients; i++)
+    {
+      if (clients[i].error)
+        die("client failed: %s", clients[i].error);
+      total += clients[i].nlatencies;
+      errors += clients[i].errors;
+    }
+  all = malloc((total + 1) * sizeof(double));
+  for (i = 0; i < nclients; i++)
+    {
+      memcpy(all + n, clients[i].latencies, clients[i].nlatencies * sizeof(double));
+      n += clients[i].nlatencies;
+      free(clients[i].latencies);
+      PQfinish(clients[i].conn);
+    }
+  qsort(all, n, sizeof(double), compare_double);
+
+  printf("{\"backend\": \"%s\", \"op\": \"%s\", \"value_size\": %d, \"batch_size\": %d, "
+         "\"clients\": %d, \"duration_s\": %.3f, \"calls\": %ld, \"errors\": %ld, "
+         "\"calls_per_s\": %.1f, \"keys_per_s\": %.1f, "
+         "\"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+         "\"p999\": %.1f, \"max\": %.1f}}\n",
+         opts.backend, op->name, op->uses_value ? value_size : 0,
+         op->uses_batch ? batch_size : 1, nclients, elapsed, n, errors,
+         n / elapsed, n * (op->uses_batch ? batch_size : 1) / elapsed,
+         n ? all[0] : 0.0, percentile(all, n, 50), percentile(all, n, 90),
+         percentile(all, n, 99), percentile(all, n, 99.9), n ? all[n - 1] : 0.0);
+  fflush(stdout);
+
+  free(all);
+  free(clients);
+}
+
+static void usage(void)
+{
+  printf("Usage: pgmemcache_bench [OPTION]...\n"
+         "\n"
+         "  -d, --dbname=CONNINFO      libpq connection string (default: environment)\n"
+         "  -b, --backend=NAME         client library label for the results\n"
+         "  -m, --memcached=PATH       memcached binary (default: memcached)\n"
+         "  -p, --memcached-port=PORT  port for the private memcached (default: 33212)\n"
+         "  -M, --mock[=LATENCY_US]    use the mock engine instead of memcached with the\n"
+         "                             given simulated latency (default: 0)\n"
+         "  -T, --duration=SECS        duration of every run (default: 10)\n"
+         "  -k, --keys=N               number of distinct keys (default: 10000)\n"
+         "  -o, --ops=LIST             operations (default: get,set,get_multi,incr,delete)\n"
+         "  -s, --value-sizes=LIST     value sizes in bytes (default: 10,100,1000,10000)\n"
+         "  -B, --batch-sizes=LIST     get_multi batch sizes (default: 10,100)\n"
+         "  -c, --clients=LIST         client counts (default: 1,4,16)\n");
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option long_options[] = {
+    { "dbname", required_argument, NULL, 'd' },
+    { "backend", required_argument, NULL, 'b' },
+    { "memcached", required_argument, NULL, 'm' },
+    { "memcached-port", required_argument, NULL, 'p' },
+    { "mock", optional_argument, NULL, 'M' },
+    { "duration", required_argument, NULL, 'T' },
+    { "keys", required_argument, NULL, 'k' },
+    { "ops", required_argument, NULL, 'o' },
+    { "value-sizes", required_argument, NULL, 's' },
+    { "batch-sizes", required_argument, NULL, 'B' },
+    { "clients", required_argument, NULL, 'c' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  PGconn *conn;
+  int c, o, v, b, n;
+
+  opts.conninfo = "";
+  opts.backend = "unknown";
+  opts.memcached = "memcached";
+  opts.memcached_port = 33212;
+  opts.duration = 10;
+  opts.keys = 10000;
+  opts.nops = parse_op_list("get,set,get_multi,incr,delete", opts.ops);
+  opts.nvalue_sizes = parse_int_list("10,100,1000,10000", opts.value_sizes);
+  opts.nbatch_sizes = parse_int_list("10,100", opts.batch_sizes);
+  opts.nclients = parse_int_list("1,4,16", opts.clients);
+
+  while ((c = getopt_long(argc, argv, "d:b:m:p:M::T:k:o:s:B:c:h", long_options, NULL)) != -1)
+    {
+      switch (c)
+        {
+        case 'd': opts.conninfo = optarg; break;
+        case 'b': opts.backend = optarg; break;
+        case 'm': opts.memcached = optarg; break;
+        case 'p': opts.memcached_port = atoi(optarg); break;
+        case 'M': opts.mock = 1; opts.mock_latency = optarg ? atoi(optarg) : 0; break;
+        case 'T': opts.duration = atoi(optarg); break;
+        case 'k': opts.keys = atoi(optarg); break;
+        case 'o': opts.nops = parse_op_list(optarg, opts.ops); break;
+        case 's': opts.nvalue_sizes = parse_int_list(optarg, opts.value_sizes); break;
+        case 'B': opts.nbatch_sizes = parse_int_list(optarg, opts.batch_sizes); break;
+        case 'c': opts.nclients = parse_int_list(optarg, opts.clients); break;
+        case 'h': usage(); return 0;
+        default: usage(); return 1;
+        }
+    }
+  if (opts.duration <= 0 || opts.keys <= 0)
+    die("%s", "duration and keys must be positive");
+  if (opts.mock_latency < 0)
+    die("%s", "mock latency must not be negative");
+
+  if (!opts.mock)
+    {
+      memcached_start();
+      atexit(memcached_stop);
+    }
+
+  conn = bench_connect();
+  bench_exec(conn, "CREATE EXTENSION IF NOT EXISTS pgmemcache");
+
+  for (o = 0; o < opts.nops; o++)
+    for (v = 0; v < opts.nvalue_sizes; v++)
+      {
+        /* incr and delete don't depend on the value size */
+        if (!opts.ops[o]->uses_value && v > 0)
+          continue;
+        for (b = 0; b < (opts.ops[o]->uses_batch ? opts.nbatch_sizes : 1); b++)
+          for (n = 0; n < opts.nclients; n++)
+            bench_run(conn, opts.ops[o], opts.value_sizes[v], opts.batch_sizes[b], opts.clients[n]);
+      }
+
+  PQfinish(conn);
+  return 0;
+}
@@ -0,0 +1,200 @@
+\echo Use "ALTER EXTENSION pgmemcache UPDATE TO '2.4.0'" to load this file. \quit
+
+CREATE FUNCTION memcache_snapshot(prefix text, path text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_snapshot'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_restore(path text, parallel int)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_restore'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_restore(path text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_restore'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_get_lease(IN key text, IN lease interval,
+                                   OUT value text, OUT stale bool, OUT win bool)
+RETURNS record
+AS 'MODULE_PATHNAME', 'memcache_get_lease'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_invalidate(key text, stale interval)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'memcache_invalidate'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_invalidate(key text)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'memcache_invalidate'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_counter_flush()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_counter_flush'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_incr(key text, increment bigint, initial bigint, expire interval)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_incr'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_incr(key text, increment bigint, initial bigint)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_incr'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_decr(key text, decrement bigint, initial bigint, expire interval)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_decr'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_decr(key text, decrement bigint, initial bigint)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_decr'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_rate_limit(IN key text, IN max_count bigint, IN period interval,
+                                    OUT allowed bool, OUT count bigint, OUT reset_at timestamptz)
+RETURNS record
+AS 'MODULE_PATHNAME', 'memcache_rate_limit'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_nextval(key text, cache_size bigint)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_nextval'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_nextval(key text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_nextval'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_setval(key text, value bigint)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_setval'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_lock(key text, lease interval, wait_timeout interval)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_lock'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_lock(key text, lease interval)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_lock'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_lock_renew(key text, lease interval)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'memcache_lock_renew'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_unlock(key text)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'memcache_unlock'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_cached_query(sql text, ttl interval)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memcache_cached_query'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_cached_query(sql text, ttl interval, VARIADIC args "any")
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memcache_cached_query'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_cluster_define(name text, servers text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'memcache_cluster_define'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_cluster_define(name text, servers text, behavior text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'memcache_cluster_define'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_migration_stats(OUT new_hits bigint, OUT old_hits bigint,
+                                         OUT misses bigint, OUT warm_ratio float8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'memcache_migration_stats'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_migration_reset()
+RETURNS bool
+AS 'MODULE_PATHNAME', 'memcache_migration_reset'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_get_multi(IN keys text[], IN budget interval, OUT key text, OUT value text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memcache_get_multi'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_get_multi(IN keys bytea[], IN budget interval, OUT key text, OUT value text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memcache_get_multi'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_value_sizes(OUT prefix text, OUT min_size int, OUT max_size int,
+                                     OUT writes bigint, OUT key_bytes bigint, OUT value_bytes bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memcache_value_sizes'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_value_sizes_reset()
+RETURNS bool
+AS 'MODULE_PATHNAME', 'memcache_value_sizes_reset'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_slab_report(OUT server text, OUT slab_class int, OUT chunk_size int,
+                                     OUT total_pages bigint, OUT used_chunks bigint,
+                                     OUT free_chunks bigint, OUT items bigint, OUT evicted bigint,
+                                     OUT outofmemory bigint, OUT local_writes bigint,
+                                     OUT efficiency float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memcache_slab_report'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_slab_advice(OUT growth_factor float8, OUT chunk_size int,
+                                     OUT efficiency float8, OUT current_growth_factor float8,
+                                     OUT current_chunk_size int, OUT current_efficiency float8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'memcache_slab_advice'
+LANGUAGE c;
+
+CREATE FUNCTION memcache_hll_add(key text, elements anyarray)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'memcache_hll_add'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_hll_count(keys text[])
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'memcache_hll_count'
+LANGUAGE c STRICT;
+
+CREATE FUNCTION memcache_key(prefix text, VARIADIC "any")
+RETURNS text
+AS 'MODULE_PATHNAME', 'memcache_key'
+LANGUAGE c STABLE STRICT;
+
+CREATE FUNCTION memcache_hot_keys(OUT key text, OUT reads bigint, OUT hot bool)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'memcache_hot_keys'
+LANGUAGE c;
+
+DO $$
+BEGIN
+  IF current_setting('server_version_num')::int >= 90600 THEN
+    EXECUTE 'ALTER FUNCTION memcache_get(text) PARALLEL SAFE';
+    EXECUTE 'ALTER FUNCTION memcache_get(bytea) PARALLEL SAFE';
+    EXECUTE 'ALTER FUNCTION memcache_get_multi(text[]) PARALLEL SAFE';
+    EXECUTE 'ALTER FUNCTION memcache_get_multi(bytea[]) PARALLEL SAFE';
+    EXECUTE 'ALTER FUNCTION memcache_get_multi(text[], interval) PARALLEL SAFE';
+    EXECUTE 'ALTER FUNCTION memcache_get_multi(bytea[], interval) PARALLEL SAFE';
+    EXECUTE 'ALTER FUNCTION memcache_key(text, "any") PARALLEL SAFE';
+  END IF;
+END;
+$$;
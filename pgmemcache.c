@@ -10,25 +10,13 @@
  * See the file LICENSE for distribution terms.
  */
 
-#ifdef USE_OMCACHE
-#ifndef OMCACHE_READ_TIMEOUT
-#define OMCACHE_READ_TIMEOUT 2000
-#endif // !OMCACHE_READ_TIMEOUT
-#define MEMCACHED_READ_TIMEOUT OMCACHE_READ_TIMEOUT
-#ifndef OMCACHE_WRITE_TIMEOUT
-#define OMCACHE_WRITE_TIMEOUT 20
-#endif // !OMCACHE_WRITE_TIMEOUT
-#define MEMCACHED_WRITE_TIMEOUT OMCACHE_WRITE_TIMEOUT
-#include "omcache_libmemcached.h"
-#include <syslog.h>  /* for log levels */
-#endif /* USE_OMCACHE */
-#ifdef USE_LIBMEMCACHED
-#include <libmemcached/memcached.h>
-#endif /* USE_LIBMEMCACHED */
-
-#include "pgmemcache.h"
+#include "pgmemcache_backend.h"
 
 #define KEY_MAX_LENGTH 250
+/* memcached treats expiration values above 30 days as absolute times */
+#define MEMCACHED_MAX_RELATIVE_EXPIRATION (30 * 86400)
+/* most copies of a replicated key, including the key itself */
+#define REPLICA_MAX_COPIES 16
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
@@ -37,15 +25,99 @@ PG_MODULE_MAGIC;
 /* Internal functions */
 static void pgmemcache_reset_context(void);
 static void pgmemcache_xact_callback(XactEvent event, void *arg);
+static void pgmemcache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                        SubTransactionId parentSubid, void *arg);
+static int64 pgmemcache_flush_counters(void);
+static void pgmemcache_discard_counters(void);
+static void pgmemcache_flush_hll(void);
+static void pgmemcache_discard_hll(void);
+static void hll_subxact_callback(SubXactEvent event, int nest_level);
+static void pgmemcache_release_locks(void);
 static void assign_sasl_params(const char *username, const char *password);
+static void assign_sasl_username_guc(const char *newval, void *extra);
+static void assign_sasl_password_guc(const char *newval, void *extra);
 static void assign_default_servers_guc(const char *newval, void *extra);
 static void assign_default_behavior_guc(const char *newval, void *extra);
-static memcached_behavior get_memcached_behavior_flag(const char *flag);
-static uint64_t get_memcached_behavior_data(const char *flag, const char *data, const char **val);
+static void assign_session_servers_guc(const char *newval, void *extra);
+static void assign_clusters_guc(const char *newval, void *extra);
+static void assign_cluster_guc(const char *newval, void *extra);
+static void apply_behavior_list(List *behaviors);
+static void apply_behavior_string(const char *str);
+static List *parse_behavior_list(const char *str, char **error);
 static Datum memcache_set_cmd(int type, PG_FUNCTION_ARGS);
-static memcached_return do_server_add(const char *host_str);
+static memcached_return add_servers(List *servers);
+static void free_server_list(List *servers);
+static void free_behavior_list(List *behaviors);
+static List *parse_server_list(const char *str, char **error);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+static bool check_server_list_guc(char **newval, void **extra, GucSource source);
+static bool check_behavior_list_guc(char **newval, void **extra, GucSource source);
+static bool check_cluster_list_guc(char **newval, void **extra, GucSource source);
+static bool check_cluster_guc(char **newval, void **extra, GucSource source);
+#endif
+static memcached_return pgmemcache_flush_buffers(void);
 const char *get_arg_cstring(text *text_field, size_t *length, bool is_key);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+static CustomScanMethods memcache_batch_plan_methods;
+static planner_hook_type prev_planner_hook;
+#if PG_VERSION_NUM >= 130000
+static PlannedStmt *pgmemcache_planner(Query *parse, const char *query_string,
+                                       int cursorOptions, ParamListInfo boundParams);
+#else
+static PlannedStmt *pgmemcache_planner(Query *parse, int cursorOptions,
+                                       ParamListInfo boundParams);
+#endif
+static void memcache_get_oid_invalidate(Datum arg, int cacheid, uint32 hashvalue);
+#endif /* PG_VERSION_NUM >= 90500 */
+static ExecutorStart_hook_type prev_executor_start_hook;
+static ExecutorEnd_hook_type prev_executor_end_hook;
+static void pgmemcache_executor_start(QueryDesc *queryDesc, int eflags);
+static void pgmemcache_executor_end(QueryDesc *queryDesc);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 110000)
+static ExplainOneQuery_hook_type prev_explain_one_query_hook;
+static void pgmemcache_explain_one_query(Query *query, int cursorOptions, IntoClause *into,
+                                         ExplainState *es, const char *queryString,
+                                         ParamListInfo params, QueryEnvironment *queryEnv);
+#endif
+
+
+#define MEMCACHED_DEFAULT_PORT 11211
+
+/* A single behavior_flag:behavior_data pair of a behavior list. */
+typedef struct
+{
+  char *flag;
+  char *data;
+} behavior_spec;
+
+/* A named cluster defined in pgmemcache.clusters.  The context of the
+ * active cluster lives in globals, the contexts of the other clusters are
+ * kept here until they're selected again. */
+typedef struct
+{
+  char *name;         /* NULL for the default cluster */
+  char *servers;      /* definition, NULL if the cluster isn't defined */
+  char *behavior;
+  memcached_st *mc;   /* NULL until the cluster is first used */
+  List *server_specs;
+  List *behavior_specs;
+  bool flush_needed;
+} memcache_cluster;
 
+static memcache_cluster default_cluster;
+static void pgmemcache_switch_cluster(memcache_cluster *cluster);
+static void cluster_define(const char *name, const char *servers, const char *behavior);
+static memcache_cluster *cluster_lookup(const char *name);
+static void assign_migrate_from_guc(const char *newval, void *extra);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+static bool check_replicate_keys_guc(char **newval, void **extra, GucSource source);
+#endif
+static void assign_replicate_keys_guc(const char *newval, void *extra);
+static void assign_read_timeout_guc(int newval, void *extra);
+static void assign_write_timeout_guc(int newval, void *extra);
+static void assign_connect_timeout_guc(int newval, void *extra);
+static text *pgmemcache_fetch(const char *key, size_t key_length, memcached_return *rcp);
+static void size_record(const char *key, size_t key_length, size_t value_length);
 
 /* Per-backend global state. */
 static struct memcache_global_s
@@ -57,22 +129,97 @@ static struct memcache_global_s
   char *default_behavior;
   char *sasl_authentication_username;
   char *sasl_authentication_password;
+  char *session_servers;
+  List *servers;    /* server_specs currently in mc */
+  List *behaviors;  /* behavior_specs currently applied to mc */
+  bool defer_counters;
+  int counter_max_keys;
+  int counter_max_delay;
+  HTAB *counters;        /* counter_entrys of the current transaction */
+  List *counter_undo;    /* counter_undo_records of open subtransactions */
+  TimestampTz counters_since;
+  int get_batch_size;
+  int log_min_duration;
+  char *clusters;
+  char *cluster_name;
+  List *cluster_list;         /* memcache_clusters other than the default */
+  memcache_cluster *cluster;  /* the cluster whose context is in mc */
+  char *migrate_from;
+  memcache_cluster *migration_cluster;
+  int migration_backfill_ttl;
+  char *replicate_keys;
+  List *replica_rules;    /* replica_rules parsed from replicate_keys */
+  int hot_key_threshold;
+  int hot_key_copies;
+  int replica_ttl;
+  HTAB *sequences;  /* sequence_entrys of memcache_nextval() */
+  int read_timeout;     /* -1 for the client library's default */
+  int write_timeout;
+  int connect_timeout;
+  List *locks;      /* held_locks of memcache_lock() */
+  bool track_value_sizes;
+  HTAB *value_sizes;                          /* size_histograms by key prefix */
+  struct size_histogram *value_sizes_other;   /* prefixes past the limit */
+  HTAB *hll_sketches;    /* hll_entrys of the current transaction */
+  List *hll_undo;        /* hll_undo_records of open subtransactions */
 } globals;
 
+/* Number of the slowest calls of a statement that are logged and the length
+ * of the key prefix shown for them. */
+#define STMT_SLOWEST_CALLS 3
+#define STMT_KEY_PREFIX 32
+
+typedef struct
+{
+  const char *op;
+  char key[KEY_MAX_LENGTH + 1];
+  size_t key_length;
+  int64 nkeys;
+  double ms;
+} stmt_call;
+
+/* Memcache calls of the current top-level statement, only collected while
+ * pgmemcache.log_min_duration is enabled or EXPLAIN ANALYZE is running. */
+static struct
+{
+  bool active;
+  QueryDesc *query;       /* the outermost query being executed */
+  int nest_level;         /* transaction nesting level of query */
+  ExplainState *explain;  /* the EXPLAIN being run, if any */
+  int64 calls;
+  int64 keys;
+  int64 bytes_sent;
+  int64 bytes_received;
+  instr_time io_time;
+  int nslowest;
+  stmt_call slowest[STMT_SLOWEST_CALLS];
+} stmt_stats;
+
+/* Timing points around memcache requests, these only test a flag unless
+ * statistics are being collected. */
+#define STMT_IO_START(start) \
+  do { if (stmt_stats.active) INSTR_TIME_SET_CURRENT(start); } while (0)
+#define STMT_IO_END(start, op, key, key_length, nkeys, sent, received) \
+  do { if (stmt_stats.active) \
+         stmt_io_done(&(start), (op), (key), (key_length), (nkeys), (sent), (received)); \
+  } while (0)
+
 
 void _PG_init(void)
 {
+  globals.cluster = &default_cluster;
   pgmemcache_reset_context();
 
   DefineCustomStringVariable("pgmemcache.default_servers",
                              "Comma-separated list of memcached servers to connect to.",
-                             "Specified as a comma-separated list of host:port (port is optional).",
+                             "Specified as a comma-separated list of host:port (port is optional) "
+                             "or unix socket paths, optionally followed by ?weight=N.",
                              &globals.default_servers,
                              NULL,
                              PGC_USERSET,
                              GUC_LIST_INPUT,
 #if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
-                             NULL,
+                             check_server_list_guc,
 #endif
                              assign_default_servers_guc,
                              NULL);
@@ -85,7 +232,7 @@ void _PG_init(void)
                              PGC_USERSET,
                              GUC_LIST_INPUT,
 #if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
-                             NULL,
+                             check_behavior_list_guc,
 #endif
                              assign_default_behavior_guc,
                              NULL);
@@ -113,7 +260,7 @@ void _PG_init(void)
 #if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
                              NULL,
 #endif
-                             NULL,
+                             assign_sasl_username_guc,
                              NULL);
 
   DefineCustomStringVariable("pgmemcache.sasl_authentication_password",
@@ -126,14 +273,300 @@ void _PG_init(void)
 #if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
                              NULL,
 #endif
+                             assign_sasl_password_guc,
+                             NULL);
+
+  DefineCustomBoolVariable("pgmemcache.track_value_sizes",
+                           "Whether to count the sizes of stored items per key prefix.",
+                           "The histograms are reported by memcache_value_sizes() and used by "
+                           "memcache_slab_report() and memcache_slab_advice().",
+                           &globals.track_value_sizes,
+                           true,
+                           PGC_USERSET,
+                           0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                           NULL,
+#endif
+                           NULL,
+                           NULL);
+
+  DefineCustomBoolVariable("pgmemcache.defer_counters",
+                           "Whether to coalesce memcache_incr and memcache_decr calls until commit.",
+                           "The deltas are summed per key and sent when the transaction commits, "
+                           "when memcache_counter_flush() is called or when a threshold is reached; "
+                           "the functions return NULL.",
+                           &globals.defer_counters,
+                           false,
+                           PGC_USERSET,
+                           0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                           NULL,
+#endif
+                           NULL,
+                           NULL);
+
+  DefineCustomIntVariable("pgmemcache.counter_max_keys",
+                          "Number of distinct deferred counter keys after which they are sent.",
+                          "Zero means no limit.",
+                          &globals.counter_max_keys,
+                          1000,
+                          0,
+                          INT_MAX,
+                          PGC_USERSET,
+                          0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.counter_max_delay",
+                          "Time after which deferred counters are sent even if the transaction is still open.",
+                          "Zero means the counters are only sent at commit.",
+                          &globals.counter_max_delay,
+                          0,
+                          0,
+                          INT_MAX,
+                          PGC_USERSET,
+                          GUC_UNIT_MS,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.get_batch_size",
+                          "Number of rows whose memcache_get() calls are fetched with a single request.",
+                          "Applies to queries planned after it's set, 0 or 1 disables batching.",
+                          &globals.get_batch_size,
+                          100,
+                          0,
+                          100000,
+                          PGC_USERSET,
+                          0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.log_min_duration",
+                          "Minimum time a statement spends in memcache requests for it to be logged.",
+                          "The log line shows the request statistics and the slowest requests of "
+                          "the statement, -1 disables logging.",
+                          &globals.log_min_duration,
+                          -1,
+                          -1,
+                          INT_MAX,
+                          PGC_SUSET,
+                          GUC_UNIT_MS,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomStringVariable("pgmemcache.clusters",
+                             "Semicolon-separated list of named memcached clusters.",
+                             "Specified as name=servers or name=servers|behavior, the server "
+                             "and behavior lists use the same format as the default ones.",
+                             &globals.clusters,
                              NULL,
+                             PGC_USERSET,
+                             GUC_LIST_INPUT,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                             check_cluster_list_guc,
+#endif
+                             assign_clusters_guc,
                              NULL);
 
-  /* XXX: We should have real assign_hook for these so that memcache sasl data
-   * is updated when the values are changed.  */
-  assign_sasl_params(globals.sasl_authentication_username, globals.sasl_authentication_password);
+  DefineCustomStringVariable("pgmemcache.cluster",
+                             "Name of the memcached cluster used by the pgmemcache functions.",
+                             "Empty or 'default' selects the servers in pgmemcache.default_servers.",
+                             &globals.cluster_name,
+                             NULL,
+                             PGC_USERSET,
+                             0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                             check_cluster_guc,
+#endif
+                             assign_cluster_guc,
+                             NULL);
+
+  DefineCustomStringVariable("pgmemcache.migrate_from",
+                             "Name of the cluster being migrated away from.",
+                             "Writes are also sent to it and keys missing from the active "
+                             "cluster are copied from it, 'default' names the default cluster.",
+                             &globals.migrate_from,
+                             NULL,
+                             PGC_USERSET,
+                             0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                             NULL,
+#endif
+                             assign_migrate_from_guc,
+                             NULL);
+
+  DefineCustomIntVariable("pgmemcache.migration_backfill_ttl",
+                          "Expiration time of the keys copied from the cluster being migrated from.",
+                          "Zero means the copies don't expire.",
+                          &globals.migration_backfill_ttl,
+                          3600,
+                          0,
+                          MEMCACHED_MAX_RELATIVE_EXPIRATION,
+                          PGC_USERSET,
+                          GUC_UNIT_S,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomStringVariable("pgmemcache.replicate_keys",
+                             "Comma-separated list of key prefixes replicated to several servers.",
+                             "Specified as prefix=copies, for example 'config:=4'.  The longest "
+                             "matching prefix applies.",
+                             &globals.replicate_keys,
+                             NULL,
+                             PGC_USERSET,
+                             GUC_LIST_INPUT,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                             check_replicate_keys_guc,
+#endif
+                             assign_replicate_keys_guc,
+                             NULL);
+
+  DefineCustomIntVariable("pgmemcache.hot_key_threshold",
+                          "Number of recent memcache_get() calls that make a key hot.",
+                          "Hot keys are replicated to pgmemcache.hot_key_copies servers, "
+                          "zero disables the detection of hot keys.",
+                          &globals.hot_key_threshold,
+                          0,
+                          0,
+                          INT_MAX,
+                          PGC_USERSET,
+                          0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.hot_key_copies",
+                          "Number of copies of a hot key, including the key itself.",
+                          NULL,
+                          &globals.hot_key_copies,
+                          3,
+                          2,
+                          REPLICA_MAX_COPIES,
+                          PGC_USERSET,
+                          0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.replica_ttl",
+                          "Maximum expiration time of the copies of replicated keys.",
+                          "Copies restored on reads expire after this time, copies written with their key at the latest.",
+                          &globals.replica_ttl,
+                          60,
+                          1,
+                          MEMCACHED_MAX_RELATIVE_EXPIRATION,
+                          PGC_USERSET,
+                          GUC_UNIT_S,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.read_timeout",
+                          "Time to wait for the responses of a memcache request.",
+                          "-1 uses the client library's default.  The query can be "
+                          "canceled while waiting with the meta protocol client only.",
+                          &globals.read_timeout,
+                          -1,
+                          -1,
+                          INT_MAX / 1000,
+                          PGC_USERSET,
+                          GUC_UNIT_MS,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          assign_read_timeout_guc,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.write_timeout",
+                          "Time to wait for sending a memcache request.",
+                          "-1 uses the client library's default.",
+                          &globals.write_timeout,
+                          -1,
+                          -1,
+                          INT_MAX / 1000,
+                          PGC_USERSET,
+                          GUC_UNIT_MS,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          assign_write_timeout_guc,
+                          NULL);
+
+  DefineCustomIntVariable("pgmemcache.connect_timeout",
+                          "Time to wait for a connection to a memcached server.",
+                          "-1 uses the client library's default.",
+                          &globals.connect_timeout,
+                          -1,
+                          -1,
+                          INT_MAX / 1000,
+                          PGC_USERSET,
+                          GUC_UNIT_MS,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          assign_connect_timeout_guc,
+                          NULL);
+
+  if (memcache_backend.init != NULL)
+    memcache_backend.init();
+
+  /* Servers added with memcache_server_add() are tracked in a hidden GUC
+   * so that they're passed on to parallel workers together with the other
+   * GUCs, workers can then set up their own memcache context without any
+   * help from the leader. */
+  DefineCustomStringVariable("pgmemcache.session_servers",
+                             "Servers added with memcache_server_add() in this session.",
+                             "Used to pass the server list to parallel workers, not intended to be set directly.",
+                             &globals.session_servers,
+                             NULL,
+                             PGC_USERSET,
+                             GUC_LIST_INPUT | GUC_NO_SHOW_ALL | GUC_NOT_IN_SAMPLE,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                             NULL,
+#endif
+                             assign_session_servers_guc,
+                             NULL);
 
   RegisterXactCallback(pgmemcache_xact_callback, NULL);
+  RegisterSubXactCallback(pgmemcache_subxact_callback, NULL);
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+#if PG_VERSION_NUM >= 90600
+  RegisterCustomScanMethods(&memcache_batch_plan_methods);
+#endif
+  prev_planner_hook = planner_hook;
+  planner_hook = pgmemcache_planner;
+  CacheRegisterSyscacheCallback(PROCOID, memcache_get_oid_invalidate, (Datum) 0);
+#endif /* PG_VERSION_NUM >= 90500 */
+  prev_executor_start_hook = ExecutorStart_hook;
+  ExecutorStart_hook = pgmemcache_executor_start;
+  prev_executor_end_hook = ExecutorEnd_hook;
+  ExecutorEnd_hook = pgmemcache_executor_end;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 110000)
+  prev_explain_one_query_hook = ExplainOneQuery_hook;
+  ExplainOneQuery_hook = pgmemcache_explain_one_query;
+#endif
 }
 
 /* This is called when we're being unloaded from a process. Note that
@@ -142,10 +575,24 @@ void _PG_init(void)
  * called. */
 void _PG_fini(void)
 {
+  ListCell *lc;
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+  planner_hook = prev_planner_hook;
+#endif
+  ExecutorStart_hook = prev_executor_start_hook;
+  ExecutorEnd_hook = prev_executor_end_hook;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 110000)
+  ExplainOneQuery_hook = prev_explain_one_query_hook;
+#endif
+  pgmemcache_switch_cluster(&default_cluster);
+  foreach(lc, globals.cluster_list)
+    if (((memcache_cluster *) lfirst(lc))->mc)
+      memcached_free(((memcache_cluster *) lfirst(lc))->mc);
   memcached_free(globals.mc);
 }
 
-static time_t interval_to_time_t(Interval *span)
+static float8 interval_to_seconds(Interval *span)
 {
   float8 result;
 
@@ -163,912 +610,6835 @@ static time_t interval_to_time_t(Interval *span)
       result += (30.0 * 86400) * (span->month % 12);
     }
 
-  return (time_t) result;
+  return result;
 }
 
-/* called at end of transaction, flush all buffers to memcache */
-static void pgmemcache_xact_callback(XactEvent event, void *arg)
+static time_t interval_to_time_t(Interval *span)
 {
-  if (globals.flush_on_commit && globals.flush_needed &&
-      (event == XACT_EVENT_COMMIT
-#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90300)
-      || event == XACT_EVENT_PRE_COMMIT
-#endif /* PG_VERSION_NUM >= 90300 */
-      ))
+  return (time_t) interval_to_seconds(span);
+}
+
+/* Account a finished memcache request to the current statement.  Requests
+ * with a NULL op only add to the I/O time and the received bytes, they're
+ * used for reading the results of an earlier request. */
+static void stmt_io_done(instr_time *start, const char *op, const char *key, size_t key_length,
+                         int64 nkeys, int64 sent, int64 received)
+{
+  instr_time end;
+  double ms;
+  int i, slot;
+
+  INSTR_TIME_SET_CURRENT(end);
+  INSTR_TIME_ACCUM_DIFF(stmt_stats.io_time, end, *start);
+  stmt_stats.bytes_received += received;
+  if (op == NULL)
+    return;
+
+  stmt_stats.calls++;
+  stmt_stats.keys += nkeys;
+  stmt_stats.bytes_sent += sent;
+
+  INSTR_TIME_SUBTRACT(end, *start);
+  ms = INSTR_TIME_GET_MILLISEC(end);
+  if (stmt_stats.nslowest < STMT_SLOWEST_CALLS)
+    slot = stmt_stats.nslowest++;
+  else
     {
-#ifdef USE_LIBMEMCACHED
-      memcached_return rc = memcached_flush_buffers(globals.mc);
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-      int rc = omcache_io(globals.mc, NULL, NULL, NULL, NULL, OMCACHE_READ_TIMEOUT);
-#endif /* USE_OMCACHE */
-      if (rc != MEMCACHED_SUCCESS)
-        elog(WARNING, "pgmemcache: memcached_flush_buffers: %s",
-                      memcached_strerror(globals.mc, rc));
-      else
-        globals.flush_needed = false;
+      slot = 0;
+      for (i = 1; i < STMT_SLOWEST_CALLS; i++)
+        if (stmt_stats.slowest[i].ms < stmt_stats.slowest[slot].ms)
+          slot = i;
+      if (stmt_stats.slowest[slot].ms >= ms)
+        return;
     }
+  stmt_stats.slowest[slot].op = op;
+  stmt_stats.slowest[slot].key_length = key ? Min(key_length, KEY_MAX_LENGTH) : 0;
+  memcpy(stmt_stats.slowest[slot].key, key, stmt_stats.slowest[slot].key_length);
+  stmt_stats.slowest[slot].nkeys = nkeys;
+  stmt_stats.slowest[slot].ms = ms;
+}
+
+static int64 sum_lengths(const size_t *lengths, size_t count)
+{
+  int64 sum = 0;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    sum += lengths[i];
+  return sum;
+}
+
+static void stmt_stats_reset(void)
+{
+  stmt_stats.active = false;
+  stmt_stats.query = NULL;
+  stmt_stats.calls = 0;
+  stmt_stats.keys = 0;
+  stmt_stats.bytes_sent = 0;
+  stmt_stats.bytes_received = 0;
+  INSTR_TIME_SET_ZERO(stmt_stats.io_time);
+  stmt_stats.nslowest = 0;
+}
+
+static int stmt_call_cmp(const void *a, const void *b)
+{
+  double ams = ((const stmt_call *) a)->ms, bms = ((const stmt_call *) b)->ms;
+
+  return ams > bms ? -1 : ams < bms ? 1 : 0;
+}
+
+/* Describe the server a call went to; for multi-key calls that's the
+ * server of the first key. */
+static void stmt_call_server(const stmt_call *call, StringInfo buf)
+{
+  if (memcache_backend.server_name(globals.mc, call->key, call->key_length, buf))
+    return;
+  appendStringInfoString(buf, "unknown server");
 }
 
-#ifdef USE_OMCACHE
-static void pgmemcache_log_func(void *context, int syslog_level, const char *msg)
+/* Log the memcache requests of a statement that spent at least
+ * pgmemcache.log_min_duration waiting for them. */
+static void stmt_stats_log(QueryDesc *queryDesc)
 {
-  int pg_level = LOG_INFO;
-  switch (syslog_level)
+  StringInfoData detail;
+  double ms = INSTR_TIME_GET_MILLISEC(stmt_stats.io_time);
+  int i;
+
+  if (ms < globals.log_min_duration)
+    return;
+
+  initStringInfo(&detail);
+  qsort(stmt_stats.slowest, stmt_stats.nslowest, sizeof(stmt_call), stmt_call_cmp);
+  for (i = 0; i < stmt_stats.nslowest; i++)
     {
-    case LOG_ERR:
-    case LOG_WARNING: pg_level = WARNING; break;
-    case LOG_NOTICE: pg_level = NOTICE; break;
+      const stmt_call *call = &stmt_stats.slowest[i];
+
+      appendStringInfo(&detail, "%s%s on ", i ? "\n" : "", call->op);
+      stmt_call_server(call, &detail);
+      appendStringInfo(&detail, ": %.3f ms, key \"%.*s%s\"", call->ms,
+                       (int) Min(call->key_length, STMT_KEY_PREFIX), call->key,
+                       call->key_length > STMT_KEY_PREFIX ? "..." : "");
+      if (call->nkeys > 1)
+        appendStringInfo(&detail, " and " INT64_FORMAT " other keys", call->nkeys - 1);
     }
-  elog(pg_level, "%s", msg);
+
+  ereport(LOG,
+          (errmsg("pgmemcache: %.3f ms in " INT64_FORMAT " memcache requests for " INT64_FORMAT
+                  " keys, " INT64_FORMAT " bytes sent, " INT64_FORMAT " bytes received, "
+                  "statement: %s",
+                  ms, stmt_stats.calls, stmt_stats.keys, stmt_stats.bytes_sent,
+                  stmt_stats.bytes_received, queryDesc->sourceText),
+           errdetail("Slowest requests:\n%s", detail.data),
+           errhidestmt(true)));
+  pfree(detail.data);
 }
-#endif /* USE_OMCACHE */
 
-static void pgmemcache_reset_context(void)
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 110000)
+/* Show the memcache requests of the query in EXPLAIN ANALYZE, this is called
+ * from ExecutorEnd which runs just before the execution time is shown. */
+static void stmt_stats_explain(ExplainState *es)
 {
-  if (globals.mc)
+  double ms = INSTR_TIME_GET_MILLISEC(stmt_stats.io_time);
+
+  if (es->format == EXPLAIN_FORMAT_TEXT)
     {
-      memcached_free(globals.mc);
-      globals.mc = NULL;
+      appendStringInfoSpaces(es->str, es->indent * 2);
+      appendStringInfo(es->str, "Memcache: requests=" INT64_FORMAT " keys=" INT64_FORMAT
+                       " sent=" INT64_FORMAT " received=" INT64_FORMAT,
+                       stmt_stats.calls, stmt_stats.keys,
+                       stmt_stats.bytes_sent, stmt_stats.bytes_received);
+      if (es->timing)
+        appendStringInfo(es->str, " time=%.3f", ms);
+      appendStringInfoChar(es->str, '\n');
+    }
+  else
+    {
+      ExplainPropertyInteger("Memcache Requests", NULL, stmt_stats.calls, es);
+      ExplainPropertyInteger("Memcache Keys", NULL, stmt_stats.keys, es);
+      ExplainPropertyInteger("Memcache Bytes Sent", NULL, stmt_stats.bytes_sent, es);
+      ExplainPropertyInteger("Memcache Bytes Received", NULL, stmt_stats.bytes_received, es);
+      if (es->timing)
+        ExplainPropertyFloat("Memcache I/O Time", "ms", ms, 3, es);
     }
+}
 
-  globals.mc = memcached_create(NULL);
+/* Plan and explain the query like EXPLAIN does without a hook, remembering
+ * the ExplainState for pgmemcache_executor_end. */
+static void pgmemcache_explain_one_query(Query *query, int cursorOptions, IntoClause *into,
+                                         ExplainState *es, const char *queryString,
+                                         ParamListInfo params, QueryEnvironment *queryEnv)
+{
+  ExplainState *save_explain = stmt_stats.explain;
 
-#ifdef USE_OMCACHE
-  omcache_set_log_callback(globals.mc, 0, pgmemcache_log_func, NULL);
-#endif /* USE_OMCACHE */
+  stmt_stats.explain = es;
+  PG_TRY();
+  {
+    if (prev_explain_one_query_hook)
+      prev_explain_one_query_hook(query, cursorOptions, into, es, queryString, params, queryEnv);
+    else
+      {
+#if PG_VERSION_NUM >= 170000
+        standard_ExplainOneQuery(query, cursorOptions, into, es, queryString, params, queryEnv);
+#else
+        PlannedStmt *plan;
+        instr_time planstart, planduration;
+#if PG_VERSION_NUM >= 130000
+        BufferUsage bufusage_start, bufusage;
 
-#ifdef USE_LIBMEMCACHED
-  /* Always use the memcache binary protocol as required for
-     memcached_(increment|decrement)_with_initial. */
+        if (es->buffers)
+          bufusage_start = pgBufferUsage;
+        INSTR_TIME_SET_CURRENT(planstart);
+        plan = pg_plan_query(query, queryString, cursorOptions, params);
+        INSTR_TIME_SET_CURRENT(planduration);
+        INSTR_TIME_SUBTRACT(planduration, planstart);
+        if (es->buffers)
+          {
+            memset(&bufusage, 0, sizeof(BufferUsage));
+            BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+          }
+        ExplainOnePlan(plan, into, es, queryString, params, queryEnv, &planduration,
+                       es->buffers ? &bufusage : NULL);
+#else
+        INSTR_TIME_SET_CURRENT(planstart);
+        plan = pg_plan_query(query, cursorOptions, params);
+        INSTR_TIME_SET_CURRENT(planduration);
+        INSTR_TIME_SUBTRACT(planduration, planstart);
+        ExplainOnePlan(plan, into, es, queryString, params, queryEnv, &planduration);
+#endif /* PG_VERSION_NUM >= 130000 */
+#endif /* PG_VERSION_NUM >= 170000 */
+      }
+  }
+  PG_CATCH();
   {
-    int rc = memcached_behavior_set(globals.mc,
-                                    MEMCACHED_BEHAVIOR_BINARY_PROTOCOL,
-                                    1);
-    if (rc != MEMCACHED_SUCCESS)
-      elog(WARNING, "pgmemcache: memcached_behavior_set(BINARY_PROTOCOL, 1): %s",
-                    memcached_strerror(globals.mc, rc));
+    stmt_stats.explain = save_explain;
+    PG_RE_THROW();
   }
-#endif /* USE_LIBMEMCACHED */
-
-  assign_default_behavior_guc(globals.default_behavior, NULL);
-  assign_sasl_params(globals.sasl_authentication_username, globals.sasl_authentication_password);
+  PG_END_TRY();
+  stmt_stats.explain = save_explain;
 }
+#endif /* PG_VERSION_NUM >= 110000 */
 
-static void assign_sasl_params(const char *username, const char *password)
+/* Collect statistics for the outermost query, nested queries such as the
+ * ones run by functions are accounted to it. */
+static void pgmemcache_executor_start(QueryDesc *queryDesc, int eflags)
 {
-#if LIBMEMCACHED_WITH_SASL_SUPPORT
-  if (username != NULL && strlen(username) > 0 && password != NULL && strlen(password) > 0)
+  if (prev_executor_start_hook)
+    prev_executor_start_hook(queryDesc, eflags);
+  else
+    standard_ExecutorStart(queryDesc, eflags);
+
+  if (stmt_stats.query == NULL)
     {
-      int rc = memcached_set_sasl_auth_data(globals.mc, username, password);
-      if (rc != MEMCACHED_SUCCESS)
-        elog(ERROR, "pgmemcache: memcached_set_sasl_auth_data: %s",
-                    memcached_strerror(globals.mc, rc));
-      rc = sasl_client_init(NULL);
-      if (rc != SASL_OK)
-        elog(ERROR, "pgmemcache: sasl_client_init failed: %d", rc);
+      stmt_stats_reset();
+      stmt_stats.query = queryDesc;
+      stmt_stats.nest_level = GetCurrentTransactionNestLevel();
+      stmt_stats.active = globals.log_min_duration >= 0 ||
+        (stmt_stats.explain != NULL && stmt_stats.explain->analyze);
     }
-#endif
 }
 
-static void assign_default_servers_guc(const char *newval, void *extra)
+static void pgmemcache_executor_end(QueryDesc *queryDesc)
 {
-  if (newval)
+  if (prev_executor_end_hook)
+    prev_executor_end_hook(queryDesc);
+  else
+    standard_ExecutorEnd(queryDesc);
+
+  if (queryDesc != stmt_stats.query)
+    return;
+  if (stmt_stats.active && stmt_stats.calls > 0)
     {
-#ifdef USE_LIBMEMCACHED
-      /* there is no way to remove servers from a memcache context, so
-       * recreate it from scratch when the server list changes */
-      pgmemcache_reset_context();
-#endif /* USE_LIBMEMCACHED */
-      do_server_add(newval);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 110000)
+      if (stmt_stats.explain != NULL && stmt_stats.explain->analyze)
+        stmt_stats_explain(stmt_stats.explain);
+#endif
+      if (globals.log_min_duration >= 0)
+        stmt_stats_log(queryDesc);
     }
+  stmt_stats_reset();
 }
 
-static void assign_default_behavior_guc(const char *newval, void *extra)
+/* Flush buffered requests to the servers. */
+static memcached_return pgmemcache_flush_buffers(void)
+{
+  return memcache_backend.flush_buffers(globals.mc);
+}
+
+/* Flush the buffered requests of a cluster, leaves it active if it had
+ * any. */
+static void pgmemcache_flush_cluster_buffers(memcache_cluster *cluster)
 {
-  int i, len;
-  StringInfoData flag_buf;
-  StringInfoData data_buf;
   memcached_return rc;
-  memcached_behavior bkey;
-  uint64_t bval;
-  const char *bvalstr = "";
 
-  if (!newval)
+  if (cluster != globals.cluster && !cluster->flush_needed)
     return;
+  pgmemcache_switch_cluster(cluster);
+  if (!globals.flush_needed)
+    return;
+  rc = pgmemcache_flush_buffers();
+  if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: memcached_flush_buffers: %s",
+                  memcached_strerror(globals.mc, rc));
+  else
+    globals.flush_needed = false;
+}
 
-  initStringInfo(&flag_buf);
-  initStringInfo(&data_buf);
+/* called at end of transaction, flush all buffers to memcache */
+static void pgmemcache_xact_callback(XactEvent event, void *arg)
+{
+  /* locks are held until the transaction's changes are visible, which for
+   * a prepared transaction is after this backend has moved on */
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90300)
+  if (event == XACT_EVENT_PRE_PREPARE && globals.locks != NIL)
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("pgmemcache: cannot PREPARE a transaction that holds memcache locks"),
+             errhint("Release the locks with memcache_unlock() before preparing the transaction.")));
+#endif /* PG_VERSION_NUM >= 90300 */
 
-  len = strlen(newval);
+  /* deferred counters are sent just before the commit or dropped if the
+   * transaction aborts, their memory is released with the transaction.
+   * Parallel workers, which run memcache_get() and memcache_get_multi(),
+   * send theirs when their part of the transaction commits. */
+  switch (event)
+    {
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90300)
+    case XACT_EVENT_PRE_COMMIT:
+    case XACT_EVENT_PRE_PREPARE:
+#if PG_VERSION_NUM >= 90500
+    case XACT_EVENT_PARALLEL_PRE_COMMIT:
+#endif
+      pgmemcache_flush_counters();
+      pgmemcache_flush_hll();
+      break;
+#else
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PREPARE:
+      pgmemcache_flush_counters();
+      pgmemcache_flush_hll();
+      break;
+#endif /* PG_VERSION_NUM >= 90300 */
+    default:
+      break;
+    }
+  if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT || event == XACT_EVENT_PREPARE
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      || event == XACT_EVENT_PARALLEL_COMMIT || event == XACT_EVENT_PARALLEL_ABORT
+#endif
+      )
+    {
+      pgmemcache_discard_counters();
+      pgmemcache_discard_hll();
+    }
+  if (event == XACT_EVENT_ABORT
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      || event == XACT_EVENT_PARALLEL_ABORT
+#endif
+      )
+    stmt_stats_reset();
+  /* locks are held until the transaction's changes are visible */
+  if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT || event == XACT_EVENT_PREPARE)
+    pgmemcache_release_locks();
 
-  for (i = 0; i < len; i++)
+  if (globals.flush_on_commit &&
+      (event == XACT_EVENT_COMMIT
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90300)
+      || event == XACT_EVENT_PRE_COMMIT
+#endif /* PG_VERSION_NUM >= 90300 */
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      || event == XACT_EVENT_PARALLEL_PRE_COMMIT
+#endif
+      ))
     {
-      char c = newval[i];
+      memcache_cluster *active = globals.cluster;
+      ListCell *lc;
 
-      if (c == ',' || c == ':')
-        {
-          if (flag_buf.len == 0)
-            return;
+      pgmemcache_flush_cluster_buffers(&default_cluster);
+      foreach(lc, globals.cluster_list)
+        pgmemcache_flush_cluster_buffers((memcache_cluster *) lfirst(lc));
+      pgmemcache_switch_cluster(active);
+    }
+}
 
-          if (c == ':')
-            {
-              int j;
-              for (j = i + 1; j < len; j++)
-                {
-                  if (newval[j] == ',')
-                    break;
-                  appendStringInfoChar(&data_buf, newval[j]);
-                }
+/* Apply the timeout settings to a memcache context, settings of -1 leave
+ * the library's defaults or the timeouts set as behaviors in place. */
+static void pgmemcache_apply_timeouts(memcached_st *mc)
+{
+  memcache_backend.set_timeouts(mc, globals.read_timeout, globals.write_timeout,
+                                globals.connect_timeout);
+}
 
-              if (data_buf.len == 0)
-                return;
+static void apply_timeouts_all_clusters(void)
+{
+  memcache_cluster *active = globals.cluster;
+  ListCell *lc;
 
-              i += data_buf.len;
-            }
-          rc = MEMCACHED_FAILURE;
-          bkey = get_memcached_behavior_flag(flag_buf.data);
-          bval = get_memcached_behavior_data(flag_buf.data, data_buf.data, &bvalstr);
-#ifdef USE_OMCACHE
-          if (bkey == NULL)
-            rc = OMCACHE_FAIL;
-          else if (strcmp(bkey, "BINARY_PROTOCOL") == 0)
-            {
-              if (!bval)
-                elog(ERROR, "pgmemcache: omcache always uses binary protocol");
-              rc = OMCACHE_OK;
-            }
-          else if (strcmp(bkey, "BUFFER_REQUESTS") == 0)
-            rc = omcache_set_buffering(globals.mc, bval);
-          else if (strcmp(bkey, "CONNECT_TIMEOUT") == 0)
-            rc = omcache_set_connect_timeout(globals.mc, bval);
-          else if (strcmp(bkey, "DEAD_TIMEOUT") == 0)
-            rc = omcache_set_dead_timeout(globals.mc, bval * 1000);
-          else if (strcmp(bkey, "DISTRIBUTION") == 0)
-            {
-              if (strcmp(bvalstr, "CONSISTENT") && strcmp(bvalstr, "CONSISTENT_KETAMA"))
-                elog(ERROR, "pgmemcache: omcache always uses ketama");
-              rc = OMCACHE_OK;
-            }
-          else if (strcmp(bkey, "HASH") == 0 || strcmp(bkey, "KETAMA_HASH") == 0)
-            {
-              if (strcmp(bvalstr, "DEFAULT"))
-                elog(ERROR, "pgmemcache: omcache always uses the 'default' (bob jenkins' 'one at a time') hash");
-              rc = OMCACHE_OK;
-            }
-          else if (strcmp(bkey, "KETAMA") == 0)
-            {
-              if (!bval)
-                elog(ERROR, "pgmemcache: omcache always uses a ketama distribution method");
-              rc = omcache_set_distribution_method(globals.mc, &omcache_dist_libmemcached_ketama);
-            }
-          else if (strcmp(bkey, "KETAMA_WEIGHTED") == 0)
-            {
-              if (!bval)
-                elog(ERROR, "pgmemcache: omcache always uses a ketama distribution method");
-              rc = omcache_set_distribution_method(globals.mc, &omcache_dist_libmemcached_ketama_weighted);
-            }
-          else if (strcmp(bkey, "KETAMA_PRE1010") == 0)
-            {
-              if (!bval)
-                elog(ERROR, "pgmemcache: omcache always uses a ketama distribution method");
-              rc = omcache_set_distribution_method(globals.mc, &omcache_dist_libmemcached_ketama_pre1010);
-            }
-          else if (strcmp(bkey, "NO_BLOCK") == 0)
-            rc = OMCACHE_OK;  // omcache is non-blocking by default
-          else if (strcmp(bkey, "NOREPLY") == 0)
-            rc = OMCACHE_OK;  // this isn't really a behavior in omcache
-          else if (strcmp(bkey, "REMOVE_FAILED_SERVERS") == 0)
-            rc = OMCACHE_OK;  // omcache doesn't have this concept
-          else if (strcmp(bkey, "RETRY_TIMEOUT") == 0)
-            rc = omcache_set_reconnect_timeout(globals.mc, bval * 1000);
-          else if (strcmp(bkey, "SUPPORT_CAS") == 0)
-            rc = OMCACHE_OK;  // omcache uses binary protocol which always has cas
-          else
-            {
-              elog(ERROR, "pgmemcache: unsupported behavior %s for omcache", flag_buf.data);
-            }
-#endif /* USE_OMCACHE */
-#ifdef USE_LIBMEMCACHED
-          rc = memcached_behavior_set(globals.mc, bkey, bval);
-#endif /* USE_LIBMEMCACHED */
-          if (rc != MEMCACHED_SUCCESS)
-            elog(WARNING, "pgmemcache: memcached_behavior_set: %s",
-                          memcached_strerror(globals.mc, rc));
-          /* Skip the element separator, reset buffers */
-          i++;
-          flag_buf.data[0] = '\0';
-          flag_buf.len = 0;
-          data_buf.data[0] = '\0';
-          data_buf.len = 0;
-        }
-      else
-        {
-          appendStringInfoChar(&flag_buf, c);
-        }
+  if (globals.mc != NULL)
+    pgmemcache_apply_timeouts(globals.mc);
+  if (active != &default_cluster && default_cluster.mc != NULL)
+    pgmemcache_apply_timeouts(default_cluster.mc);
+  foreach(lc, globals.cluster_list)
+    {
+      memcache_cluster *cluster = lfirst(lc);
+
+      if (cluster != active && cluster->mc != NULL)
+        pgmemcache_apply_timeouts(cluster->mc);
     }
-  pfree(flag_buf.data);
-  pfree(data_buf.data);
 }
 
-Datum memcache_add(PG_FUNCTION_ARGS)
+/* The assign hooks run before the setting is stored, store it early for
+ * pgmemcache_apply_timeouts(). */
+static void assign_read_timeout_guc(int newval, void *extra)
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_ADD | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+  globals.read_timeout = newval;
+  apply_timeouts_all_clusters();
 }
 
-Datum memcache_add_absexpire(PG_FUNCTION_ARGS)
+static void assign_write_timeout_guc(int newval, void *extra)
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_ADD | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+  globals.write_timeout = newval;
+  apply_timeouts_all_clusters();
 }
 
-const char *get_arg_cstring(text *text_field, size_t *length, bool is_key)
+static void assign_connect_timeout_guc(int newval, void *extra)
 {
-  *length = VARSIZE(text_field) - VARHDRSZ;
+  globals.connect_timeout = newval;
+  apply_timeouts_all_clusters();
+}
+
+/* Create a new memcache context with pgmemcache's defaults. */
+static memcached_st *pgmemcache_create_context(void)
+{
+  memcached_st *mc = memcache_backend.create();
+
+  pgmemcache_apply_timeouts(mc);
+  return mc;
+}
+
+static void pgmemcache_reset_context(void)
+{
+  if (globals.mc)
+    {
+      memcached_free(globals.mc);
+      globals.mc = NULL;
+    }
+
+  globals.mc = pgmemcache_create_context();
+
+  /* the new context has no servers and only the default behaviors */
+  free_server_list(globals.servers);
+  globals.servers = NIL;
+  free_behavior_list(globals.behaviors);
+  globals.behaviors = NIL;
+
+  apply_behavior_string(globals.cluster == &default_cluster ? globals.default_behavior
+                                                           : globals.cluster->behavior);
+  assign_sasl_params(globals.sasl_authentication_username, globals.sasl_authentication_password);
+}
+
+static void assign_sasl_params(const char *username, const char *password)
+{
+  memcache_backend.set_sasl(globals.mc, username, password);
+}
+
+/* The GUC variable still holds the old value when the assign hook is
+ * called, so pass the new one explicitly. */
+static void assign_sasl_all_clusters(const char *username, const char *password)
+{
+  memcache_cluster *active = globals.cluster;
+  ListCell *lc;
+
+  pgmemcache_switch_cluster(&default_cluster);
+  assign_sasl_params(username, password);
+  foreach(lc, globals.cluster_list)
+    {
+      memcache_cluster *cluster = lfirst(lc);
+
+      if (cluster->mc != NULL)
+        {
+          pgmemcache_switch_cluster(cluster);
+          assign_sasl_params(username, password);
+        }
+    }
+  pgmemcache_switch_cluster(active);
+}
+
+static void assign_sasl_username_guc(const char *newval, void *extra)
+{
+  assign_sasl_all_clusters(newval, globals.sasl_authentication_password);
+}
+
+static void assign_sasl_password_guc(const char *newval, void *extra)
+{
+  assign_sasl_all_clusters(globals.sasl_authentication_username, newval);
+}
+
+static bool server_spec_equal(const server_spec *a, const server_spec *b)
+{
+  return a->port == b->port && a->weight == b->weight && strcmp(a->host, b->host) == 0;
+}
+
+static void free_server_list(List *servers)
+{
+  ListCell *lc;
+
+  foreach(lc, servers)
+    pfree(((server_spec *) lfirst(lc))->host);
+  list_free_deep(servers);
+}
+
+static void free_behavior_list(List *behaviors)
+{
+  ListCell *lc;
+
+  foreach(lc, behaviors)
+    {
+      pfree(((behavior_spec *) lfirst(lc))->flag);
+      pfree(((behavior_spec *) lfirst(lc))->data);
+    }
+  list_free_deep(behaviors);
+}
+
+static bool server_list_member(List *servers, const server_spec *spec)
+{
+  ListCell *lc;
+
+  foreach(lc, servers)
+    if (server_spec_equal((server_spec *) lfirst(lc), spec))
+      return true;
+  return false;
+}
+
+/* Make the servers of the context match the given server list.  Servers
+ * that are already in the context keep their connections: when servers are
+ * only added, the new ones are pushed to the existing context which just
+ * rebuilds the key distribution.  There is no way to remove servers from a
+ * libmemcached context, so it is recreated from scratch when a server is
+ * removed or its weight changes. */
+static void pgmemcache_set_servers(const char *servers_str)
+{
+  List *servers;
+  ListCell *lc;
+  char *error;
+  memcached_return rc;
+  bool removed = false;
+
+  servers = parse_server_list(servers_str, &error);
+  if (error)
+    {
+      elog(WARNING, "pgmemcache: invalid server list \"%s\": %s", servers_str, error);
+      return;
+    }
+
+  foreach(lc, globals.servers)
+    if (!server_list_member(servers, (server_spec *) lfirst(lc)))
+      removed = true;
+
+  if (removed)
+    {
+      /* a backend that replaces the whole server list when servers are
+       * added keeps the connections to the servers that remain on it */
+      if (!memcache_backend.replaces_servers || servers == NIL)
+        pgmemcache_reset_context();
+      else
+        {
+          free_server_list(globals.servers);
+          globals.servers = NIL;
+        }
+    }
+
+  rc = add_servers(servers);
+  if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: memcached_server_push: %s",
+                  memcached_strerror(globals.mc, rc));
+  free_server_list(servers);
+}
+
+/* The servers of the default cluster are the ones in
+ * pgmemcache.default_servers followed by the ones added with
+ * memcache_server_add(), which are kept in pgmemcache.session_servers.  The
+ * assign hooks of both settings rebuild the list from the two values, so it
+ * follows them when they're rolled back with the transaction that set them
+ * and when parallel workers restore them. */
+static void pgmemcache_sync_servers(const char *default_servers, const char *session_servers)
+{
+  memcache_cluster *active = globals.cluster;
+  char *servers;
+
+  if (default_servers == NULL)
+    default_servers = "";
+  if (session_servers == NULL)
+    session_servers = "";
+  if (default_servers[0] && session_servers[0])
+    servers = psprintf("%s,%s", default_servers, session_servers);
+  else
+    servers = pstrdup(default_servers[0] ? default_servers : session_servers);
+
+  pgmemcache_switch_cluster(&default_cluster);
+  pgmemcache_set_servers(servers);
+  pgmemcache_switch_cluster(active);
+  pfree(servers);
+}
+
+static void assign_default_servers_guc(const char *newval, void *extra)
+{
+  pgmemcache_sync_servers(newval, globals.session_servers);
+}
+
+static void assign_session_servers_guc(const char *newval, void *extra)
+{
+  pgmemcache_sync_servers(globals.default_servers, newval);
+}
+
+/* Parse a comma-separated list of behavior_flag:behavior_data pairs into a
+ * list of behavior_specs allocated in the current memory context.  Returns
+ * NIL and an error message in error if a behavior can't be set. */
+static List *parse_behavior_list(const char *str, char **error)
+{
+  List *behaviors = NIL;
+  char *copy = pstrdup(str), *entry, *saveptr = NULL;
+
+  *error = NULL;
+  for (entry = strtok_r(copy, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr))
+    {
+      behavior_spec *spec;
+      char *data, *end;
+
+      while (isspace((unsigned char) *entry))
+        entry++;
+      for (end = entry + strlen(entry); end > entry && isspace((unsigned char) end[-1]); end--)
+        end[-1] = '\0';
+      if (*entry == '\0')
+        continue;
+
+      data = strchr(entry, ':');
+      if (data)
+        *data++ = '\0';
+      *error = memcache_backend.check_behavior(entry, data ? data : "");
+      if (*error != NULL)
+        {
+          free_behavior_list(behaviors);
+          pfree(copy);
+          return NIL;
+        }
+      spec = palloc(sizeof(*spec));
+      spec->flag = pstrdup(entry);
+      spec->data = pstrdup(data ? data : "");
+      behaviors = lappend(behaviors, spec);
+    }
+  pfree(copy);
+  return behaviors;
+}
+
+static void apply_behavior(const char *flag, const char *data)
+{
+  memcached_return rc = memcache_backend.set_behavior(globals.mc, flag, data);
+
+  if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: memcached_behavior_set: %s",
+                  memcached_strerror(globals.mc, rc));
+}
+
+static const behavior_spec *behavior_list_find(List *behaviors, const char *flag)
+{
+  ListCell *lc;
+
+  foreach(lc, behaviors)
+    if (strcmp(((behavior_spec *) lfirst(lc))->flag, flag) == 0)
+      return (behavior_spec *) lfirst(lc);
+  return NULL;
+}
+
+/* A behavior list parsed by the check hook of pgmemcache.default_behavior
+ * for its assign hook.  GUC extras are single malloc'd chunks, so the
+ * strings the specs point to follow them in the same chunk. */
+typedef struct
+{
+  int count;
+  behavior_spec specs[FLEXIBLE_ARRAY_MEMBER];
+} behavior_list_extra;
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+static bool check_behavior_list_guc(char **newval, void **extra, GucSource source)
+{
+  behavior_list_extra *parsed;
+  List *behaviors;
+  ListCell *lc;
+  char *error, *p;
+  Size size;
+  int i = 0;
+
+  if (*newval == NULL)
+    return true;
+  behaviors = parse_behavior_list(*newval, &error);
+  if (error)
+    {
+      GUC_check_errdetail("%s", error);
+      return false;
+    }
+
+  size = offsetof(behavior_list_extra, specs) + list_length(behaviors) * sizeof(behavior_spec);
+  foreach(lc, behaviors)
+    {
+      behavior_spec *spec = (behavior_spec *) lfirst(lc);
+      size += strlen(spec->flag) + strlen(spec->data) + 2;
+    }
+#if PG_VERSION_NUM >= 160000
+  parsed = guc_malloc(LOG, size);
+#else
+  parsed = malloc(size);
+#endif
+  if (parsed == NULL)
+    return false;
+  p = (char *) &parsed->specs[list_length(behaviors)];
+  foreach(lc, behaviors)
+    {
+      behavior_spec *spec = (behavior_spec *) lfirst(lc);
+
+      parsed->specs[i].flag = strcpy(p, spec->flag);
+      p += strlen(p) + 1;
+      parsed->specs[i].data = strcpy(p, spec->data);
+      p += strlen(p) + 1;
+      i++;
+    }
+  parsed->count = i;
+  free_behavior_list(behaviors);
+  *extra = parsed;
+  return true;
+}
+#endif
+
+static void assign_default_behavior_guc(const char *newval, void *extra)
+{
+  memcache_cluster *active = globals.cluster;
+
+  pgmemcache_switch_cluster(&default_cluster);
+  if (extra != NULL)
+    {
+      behavior_list_extra *parsed = (behavior_list_extra *) extra;
+      MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+      List *behaviors = NIL;
+      int i;
+
+      for (i = 0; i < parsed->count; i++)
+        {
+          behavior_spec *spec = palloc(sizeof(*spec));
+
+          spec->flag = pstrdup(parsed->specs[i].flag);
+          spec->data = pstrdup(parsed->specs[i].data);
+          behaviors = lappend(behaviors, spec);
+        }
+      MemoryContextSwitchTo(oldcontext);
+      apply_behavior_list(behaviors);
+    }
+  else
+    apply_behavior_string(newval);
+  pgmemcache_switch_cluster(active);
+}
+
+/* Apply a behavior list that was validated when it was set, such as the
+ * one of the default or a named cluster to a new context. */
+static void apply_behavior_string(const char *str)
+{
+  MemoryContext oldcontext;
+  List *behaviors;
+  char *error;
+
+  if (!str)
+    return;
+
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+  behaviors = parse_behavior_list(str, &error);
+  MemoryContextSwitchTo(oldcontext);
+  if (error)
+    {
+      elog(WARNING, "pgmemcache: invalid behavior list \"%s\": %s", str, error);
+      return;
+    }
+  apply_behavior_list(behaviors);
+}
+
+/* Apply the behaviors that changed since the last time a behavior list was
+ * applied to the current context, the list allocated in TopMemoryContext
+ * replaces globals.behaviors.  Behaviors that were removed from the list
+ * are restored to their defaults, with backends that can't read the
+ * defaults back the context is recreated instead. */
+static void apply_behavior_list(List *behaviors)
+{
+  ListCell *lc;
+
+  foreach(lc, globals.behaviors)
+    {
+      behavior_spec *old = (behavior_spec *) lfirst(lc);
+
+      if (behavior_list_find(behaviors, old->flag) != NULL)
+        continue;
+      if (memcache_backend.copy_behavior != NULL)
+        {
+          memcached_st *defaults = pgmemcache_create_context();
+
+          memcache_backend.copy_behavior(globals.mc, defaults, old->flag);
+          memcached_free(defaults);
+        }
+      else
+        {
+          /* start over with a new context with the same servers, all
+           * behaviors are applied to it below */
+          List *servers = globals.servers;
+
+          memcached_free(globals.mc);
+          globals.mc = pgmemcache_create_context();
+          free_behavior_list(globals.behaviors);
+          globals.behaviors = NIL;
+          globals.servers = NIL;
+          add_servers(servers);
+          free_server_list(servers);
+          break;
+        }
+    }
+
+  foreach(lc, behaviors)
+    {
+      behavior_spec *spec = (behavior_spec *) lfirst(lc);
+      const behavior_spec *old = behavior_list_find(globals.behaviors, spec->flag);
+
+      if (old == NULL || strcmp(old->data, spec->data) != 0)
+        apply_behavior(spec->flag, spec->data);
+    }
+
+  free_behavior_list(globals.behaviors);
+  globals.behaviors = behaviors;
+}
+
+/*
+ * Named clusters: pgmemcache.clusters defines server sets with their own
+ * memcache contexts and behaviors and pgmemcache.cluster selects the one
+ * used by all functions.  The active cluster's context is kept in globals
+ * like the default one, so switching clusters just swaps the contexts.
+ */
+
+static memcache_cluster *cluster_lookup(const char *name)
+{
+  memcache_cluster *cluster;
+  MemoryContext oldcontext;
+  ListCell *lc;
+
+  if (name == NULL || name[0] == '\0' || pg_strcasecmp(name, "default") == 0)
+    return &default_cluster;
+  foreach(lc, globals.cluster_list)
+    {
+      cluster = (memcache_cluster *) lfirst(lc);
+      if (strcmp(cluster->name, name) == 0)
+        return cluster;
+    }
+
+  /* clusters that are selected before they're defined have no servers */
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+  cluster = palloc0(sizeof(memcache_cluster));
+  cluster->name = pstrdup(name);
+  globals.cluster_list = lappend(globals.cluster_list, cluster);
+  MemoryContextSwitchTo(oldcontext);
+  return cluster;
+}
+
+/* Make the cluster's context the current one, creating it on first use. */
+static void pgmemcache_switch_cluster(memcache_cluster *cluster)
+{
+  memcache_cluster *current = globals.cluster;
+
+  if (cluster == current)
+    return;
+
+  current->mc = globals.mc;
+  current->server_specs = globals.servers;
+  current->behavior_specs = globals.behaviors;
+  current->flush_needed = globals.flush_needed;
+
+  globals.cluster = cluster;
+  globals.mc = cluster->mc;
+  globals.servers = cluster->server_specs;
+  globals.behaviors = cluster->behavior_specs;
+  globals.flush_needed = cluster->flush_needed;
+  cluster->mc = NULL;
+  cluster->server_specs = NIL;
+  cluster->behavior_specs = NIL;
+
+  if (globals.mc == NULL)
+    {
+      pgmemcache_reset_context();
+      if (cluster->servers)
+        pgmemcache_set_servers(cluster->servers);
+    }
+}
+
+/* Free the context of a named cluster after its definition changed, the
+ * context is recreated the next time the cluster is used. */
+static void cluster_drop_context(memcache_cluster *cluster)
+{
+  bool active = cluster == globals.cluster;
+
+  if (active)
+    pgmemcache_switch_cluster(&default_cluster);
+  if (cluster->mc)
+    memcached_free(cluster->mc);
+  cluster->mc = NULL;
+  free_server_list(cluster->server_specs);
+  cluster->server_specs = NIL;
+  free_behavior_list(cluster->behavior_specs);
+  cluster->behavior_specs = NIL;
+  cluster->flush_needed = false;
+  if (active)
+    pgmemcache_switch_cluster(cluster);
+}
+
+static char *trim_whitespace(char *str)
+{
+  char *end;
+
+  while (isspace((unsigned char) *str))
+    str++;
+  for (end = str + strlen(str); end > str && isspace((unsigned char) end[-1]); end--)
+    end[-1] = '\0';
+  return str;
+}
+
+static const char *check_cluster_name(const char *name)
+{
+  const char *p;
+
+  if (name[0] == '\0' || pg_strcasecmp(name, "default") == 0)
+    return "invalid cluster name";
+  for (p = name; *p; p++)
+    if (!isalnum((unsigned char) *p) && *p != '_' && *p != '-')
+      return "cluster names may only contain letters, digits, '_' and '-'";
+  return NULL;
+}
+
+/* Parse a semicolon-separated list of name=servers[|behavior] cluster
+ * definitions, for example:
+ *
+ *   counters=cache1:11211,cache2:11211|TCP_NODELAY:1; fragments=/tmp/mc.sock
+ *
+ * Returns a list of memcache_clusters or NIL and an error message in error. */
+static List *parse_cluster_list(const char *str, char **error)
+{
+  List *clusters = NIL;
+  char *copy = pstrdup(str), *entry, *saveptr = NULL;
+
+  *error = NULL;
+  for (entry = strtok_r(copy, ";", &saveptr); entry; entry = strtok_r(NULL, ";", &saveptr))
+    {
+      memcache_cluster *def;
+      char *name, *servers, *behavior, *server_error;
+      const char *name_error;
+      ListCell *lc;
+
+      name = trim_whitespace(entry);
+      if (*name == '\0')
+        continue;
+      servers = strchr(name, '=');
+      if (servers == NULL)
+        {
+          *error = psprintf("cluster \"%s\" has no server list", name);
+          break;
+        }
+      *servers++ = '\0';
+      name = trim_whitespace(name);
+      behavior = strchr(servers, '|');
+      if (behavior)
+        *behavior++ = '\0';
+
+      name_error = check_cluster_name(name);
+      if (name_error)
+        {
+          *error = psprintf("%s: \"%s\"", name_error, name);
+          break;
+        }
+      foreach(lc, clusters)
+        if (strcmp(((memcache_cluster *) lfirst(lc))->name, name) == 0)
+          *error = psprintf("cluster \"%s\" is defined more than once", name);
+      if (*error)
+        break;
+      free_server_list(parse_server_list(servers, &server_error));
+      if (server_error)
+        {
+          *error = psprintf("cluster \"%s\": %s", name, server_error);
+          break;
+        }
+      if (behavior)
+        free_behavior_list(parse_behavior_list(behavior, &server_error));
+      if (behavior && server_error)
+        {
+          *error = psprintf("cluster \"%s\": %s", name, server_error);
+          break;
+        }
+
+      def = palloc0(sizeof(memcache_cluster));
+      def->name = pstrdup(name);
+      def->servers = pstrdup(trim_whitespace(servers));
+      def->behavior = behavior ? pstrdup(trim_whitespace(behavior)) : NULL;
+      clusters = lappend(clusters, def);
+    }
+  pfree(copy);
+  if (*error)
+    return NIL;
+  return clusters;
+}
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+static bool check_cluster_list_guc(char **newval, void **extra, GucSource source)
+{
+  char *error;
+
+  if (*newval == NULL || parse_cluster_list(*newval, &error) != NIL || error == NULL)
+    return true;
+  GUC_check_errdetail("%s", error);
+  return false;
+}
+#endif
+
+static bool strings_equal(const char *a, const char *b)
+{
+  return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+/* Update the cluster definitions, the contexts of the clusters whose
+ * servers or behaviors changed are dropped. */
+static void assign_clusters_guc(const char *newval, void *extra)
+{
+  List *defs;
+  ListCell *lc, *dc;
+  char *error;
+
+  defs = parse_cluster_list(newval ? newval : "", &error);
+  if (error)
+    {
+      elog(WARNING, "pgmemcache: invalid cluster list \"%s\": %s", newval, error);
+      return;
+    }
+
+  foreach(dc, defs)
+    cluster_lookup(((memcache_cluster *) lfirst(dc))->name);
+  foreach(lc, globals.cluster_list)
+    {
+      memcache_cluster *cluster = (memcache_cluster *) lfirst(lc);
+      const char *servers = NULL, *behavior = NULL;
+
+      foreach(dc, defs)
+        {
+          memcache_cluster *def = (memcache_cluster *) lfirst(dc);
+
+          if (strcmp(def->name, cluster->name) == 0)
+            {
+              servers = def->servers;
+              behavior = def->behavior;
+            }
+        }
+      if (strings_equal(cluster->servers, servers) && strings_equal(cluster->behavior, behavior))
+        continue;
+
+      if (cluster->servers)
+        pfree(cluster->servers);
+      if (cluster->behavior)
+        pfree(cluster->behavior);
+      cluster->servers = servers ? MemoryContextStrdup(TopMemoryContext, servers) : NULL;
+      cluster->behavior = behavior ? MemoryContextStrdup(TopMemoryContext, behavior) : NULL;
+      cluster_drop_context(cluster);
+    }
+}
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+/* Reject clusters that aren't defined when the cluster is selected with
+ * SET.  Configuration files, per-database settings and parallel workers
+ * may select a cluster before pgmemcache.clusters has been applied, such a
+ * cluster has no servers until it's defined. */
+static bool check_cluster_guc(char **newval, void **extra, GucSource source)
+{
+  const char *name_error;
+  ListCell *lc;
+
+  if (*newval == NULL || (*newval)[0] == '\0' || pg_strcasecmp(*newval, "default") == 0)
+    return true;
+  name_error = check_cluster_name(*newval);
+  if (name_error)
+    {
+      GUC_check_errdetail("%s", name_error);
+      return false;
+    }
+  if (source < PGC_S_INTERACTIVE)
+    return true;
+#if PG_VERSION_NUM >= 90600
+  if (InitializingParallelWorker)
+    return true;
+#endif
+  foreach(lc, globals.cluster_list)
+    {
+      memcache_cluster *cluster = (memcache_cluster *) lfirst(lc);
+
+      if (cluster->servers && strcmp(cluster->name, *newval) == 0)
+        return true;
+    }
+  GUC_check_errdetail("cluster \"%s\" is not defined in pgmemcache.clusters", *newval);
+  return false;
+}
+#endif
+
+static void assign_cluster_guc(const char *newval, void *extra)
+{
+  pgmemcache_switch_cluster(cluster_lookup(newval));
+}
+
+/* Define or redefine a cluster for the rest of the session by updating
+ * pgmemcache.clusters, which also passes it on to parallel workers. */
+static void cluster_define(const char *name, const char *servers, const char *behavior)
+{
+  StringInfoData buf;
+  const char *name_error = check_cluster_name(name);
+  List *defs = NIL;
+  ListCell *lc;
+  char *error;
+
+  if (name_error)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: %s: \"%s\"", name_error, name)));
+  if (strpbrk(servers, ";|") || (behavior && strchr(behavior, ';')))
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: invalid cluster definition for \"%s\"", name)));
+
+  if (globals.clusters)
+    defs = parse_cluster_list(globals.clusters, &error);
+  initStringInfo(&buf);
+  foreach(lc, defs)
+    {
+      memcache_cluster *def = (memcache_cluster *) lfirst(lc);
+
+      if (strcmp(def->name, name) == 0)
+        continue;
+      appendStringInfo(&buf, "%s=%s%s%s; ", def->name, def->servers,
+                       def->behavior ? "|" : "", def->behavior ? def->behavior : "");
+    }
+  appendStringInfo(&buf, "%s=%s%s%s", name, servers,
+                   behavior ? "|" : "", behavior ? behavior : "");
+
+  SetConfigOption("pgmemcache.clusters", buf.data, PGC_USERSET, PGC_S_SESSION);
+  pfree(buf.data);
+}
+
+Datum memcache_cluster_define(PG_FUNCTION_ARGS)
+{
+  char *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  char *servers = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  char *behavior = NULL;
+
+  if (PG_NARGS() >= 3)
+    behavior = text_to_cstring(PG_GETARG_TEXT_PP(2));
+  cluster_define(name, servers, behavior);
+  PG_RETURN_VOID();
+}
+
+Datum memcache_add(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_ADD | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+}
+
+Datum memcache_add_absexpire(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_ADD | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+}
+
+/*
+ * Keys longer than memcached's limit are replaced by a digest: the key's
+ * prefix, the key up to and including its first ':' if there is one in the
+ * first KEY_DIGEST_PREFIX_MAX bytes, followed by '#' and a 128-bit hash of
+ * the whole key in hex.  Keeping the prefix keeps the digested keys in
+ * their prefix's value size histograms.
+ */
+
+#define KEY_DIGEST_PREFIX_MAX 128
+#define KEY_DIGEST_HEX 32
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64 key_load64(const unsigned char *p)
+{
+  /* little-endian on every platform so digests are portable */
+  return (uint64) p[0] | ((uint64) p[1] << 8) | ((uint64) p[2] << 16) |
+         ((uint64) p[3] << 24) | ((uint64) p[4] << 32) | ((uint64) p[5] << 40) |
+         ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+}
+
+static inline uint64 key_fmix64(uint64 k)
+{
+  k ^= k >> 33;
+  k *= UINT64CONST(0xff51afd7ed558ccd);
+  k ^= k >> 33;
+  k *= UINT64CONST(0xc4ceb9fe1a85ec53);
+  k ^= k >> 33;
+  return k;
+}
+
+/* MurmurHash3's x64 128-bit variant with a zero seed */
+static void key_hash128(const char *data, size_t len, uint64 *h1p, uint64 *h2p)
+{
+  const uint64 c1 = UINT64CONST(0x87c37b91114253d5), c2 = UINT64CONST(0x4cf5ad432745937f);
+  const unsigned char *p = (const unsigned char *) data;
+  unsigned char tail[16];
+  uint64 h1 = 0, h2 = 0, k1, k2;
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      k1 = key_load64(p + i) * c1;
+      k1 = ROTL64(k1, 31) * c2;
+      h1 ^= k1;
+      h1 = (ROTL64(h1, 27) + h2) * 5 + 0x52dce729;
+      k2 = key_load64(p + i + 8) * c2;
+      k2 = ROTL64(k2, 33) * c1;
+      h2 ^= k2;
+      h2 = (ROTL64(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+  /* the zero padded tail leaves the hash unchanged if the length is a
+   * multiple of 16 */
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, p + i, len - i);
+  k1 = key_load64(tail) * c1;
+  h1 ^= ROTL64(k1, 31) * c2;
+  k2 = key_load64(tail + 8) * c2;
+  h2 ^= ROTL64(k2, 33) * c1;
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = key_fmix64(h1);
+  h2 = key_fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  *h1p = h1;
+  *h2p = h2;
+}
+
+static char *key_digest(const char *key, size_t key_length, size_t *length)
+{
+  static const char hex[] = "0123456789abcdef";
+  const char *colon = memchr(key, ':', Min(key_length, KEY_DIGEST_PREFIX_MAX));
+  size_t prefix_length = colon ? (size_t) (colon - key) + 1 : 0;
+  char *digest = palloc(prefix_length + KEY_DIGEST_HEX + 2);
+  char *p = digest + prefix_length;
+  uint64 h[2];
+  int i, j;
+
+  key_hash128(key, key_length, &h[0], &h[1]);
+  memcpy(digest, key, prefix_length);
+  *p++ = '#';
+  for (i = 0; i < 2; i++)
+    for (j = 60; j >= 0; j -= 4)
+      *p++ = hex[(h[i] >> j) & 0xf];
+  *p = '\0';
+  *length = p - digest;
+  return digest;
+}
+
+const char *get_arg_cstring(text *text_field, size_t *length, bool is_key)
+{
+  *length = VARSIZE(text_field) - VARHDRSZ;
   if (is_key && *length < 1)
     elog(ERROR, "pgmemcache: key cannot be an empty string");
   else if (is_key && *length > KEY_MAX_LENGTH)
-    elog(ERROR, "pgmemcache: key too long, maximum is %d characters", KEY_MAX_LENGTH);
+    return key_digest(VARDATA(text_field), *length, length);
   return VARDATA(text_field);
 }
 
-static Datum memcache_delta_op(bool increment, PG_FUNCTION_ARGS)
+/* output functions of memcache_key()'s arguments, cached in fn_extra */
+typedef struct
+{
+  int nargs;
+  Oid *types;
+  FmgrInfo *procs;
+} key_output_cache;
+
+static void key_append_int(StringInfo buf, int64 value)
+{
+  char digits[24], *p = digits + sizeof(digits);
+  uint64 u = value < 0 ? -(uint64) value : (uint64) value;
+
+  do
+    {
+      *--p = '0' + u % 10;
+      u /= 10;
+    }
+  while (u != 0);
+  if (value < 0)
+    *--p = '-';
+  appendBinaryStringInfo(buf, p, digits + sizeof(digits) - p);
+}
+
+static void key_append_uuid(StringInfo buf, const pg_uuid_t *uuid)
+{
+  static const char hex[] = "0123456789abcdef";
+  char out[36], *p = out;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    {
+      if (i == 4 || i == 6 || i == 8 || i == 10)
+        *p++ = '-';
+      *p++ = hex[uuid->data[i] >> 4];
+      *p++ = hex[uuid->data[i] & 0xf];
+    }
+  appendBinaryStringInfo(buf, out, sizeof(out));
+}
+
+/* Appends the text form of a value, the common key component types are
+ * formatted directly, others with their type's output function. */
+static void key_append(StringInfo buf, key_output_cache *cache, int argno, Oid type, Datum value)
+{
+  switch (type)
+    {
+    case INT2OID:
+      key_append_int(buf, DatumGetInt16(value));
+      break;
+    case INT4OID:
+      key_append_int(buf, DatumGetInt32(value));
+      break;
+    case INT8OID:
+      key_append_int(buf, DatumGetInt64(value));
+      break;
+    case UUIDOID:
+      key_append_uuid(buf, DatumGetUUIDP(value));
+      break;
+    case TEXTOID:
+    case VARCHAROID:
+      {
+        struct varlena *v = PG_DETOAST_DATUM_PACKED(value);
+
+        appendBinaryStringInfo(buf, VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v));
+        break;
+      }
+    case UNKNOWNOID:
+    case CSTRINGOID:
+      /* untyped literals are passed as cstrings */
+      appendStringInfoString(buf, DatumGetCString(value));
+      break;
+    default:
+      if (cache->types[argno] != type)
+        {
+          Oid typoutput;
+          bool typisvarlena;
+
+          getTypeOutputInfo(type, &typoutput, &typisvarlena);
+          fmgr_info_cxt(typoutput, &cache->procs[argno], cache->procs[argno].fn_mcxt);
+          cache->types[argno] = type;
+        }
+      appendStringInfoString(buf, OutputFunctionCall(&cache->procs[argno], value));
+      break;
+    }
+}
+
+Datum memcache_key(PG_FUNCTION_ARGS)
+{
+  key_output_cache *cache = fcinfo->flinfo->fn_extra;
+  text *prefix = PG_GETARG_TEXT_PP(0);
+  StringInfoData buf;
+  size_t key_length;
+  const char *key;
+  int i;
+
+  if (cache == NULL)
+    {
+      MemoryContext mcxt = fcinfo->flinfo->fn_mcxt;
+
+      cache = MemoryContextAllocZero(mcxt, sizeof(key_output_cache));
+      cache->nargs = PG_NARGS();
+      cache->types = MemoryContextAllocZero(mcxt, sizeof(Oid) * cache->nargs);
+      cache->procs = MemoryContextAllocZero(mcxt, sizeof(FmgrInfo) * cache->nargs);
+      for (i = 0; i < cache->nargs; i++)
+        cache->procs[i].fn_mcxt = mcxt;
+      fcinfo->flinfo->fn_extra = cache;
+    }
+
+  initStringInfo(&buf);
+  appendBinaryStringInfo(&buf, VARDATA_ANY(prefix), VARSIZE_ANY_EXHDR(prefix));
+
+  if (get_fn_expr_variadic(fcinfo->flinfo))
+    {
+      ArrayType *array = PG_GETARG_ARRAYTYPE_P(1);
+      Oid element_type = ARR_ELEMTYPE(array);
+      int16 typlen;
+      bool typbyval;
+      char typalign;
+      Datum *elems;
+      bool *nulls;
+      int nelems;
+
+      get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+      deconstruct_array(array, element_type, typlen, typbyval, typalign, &elems, &nulls, &nelems);
+      for (i = 0; i < nelems; i++)
+        {
+          if (nulls[i])
+            PG_RETURN_NULL();
+          if (buf.len > 0)
+            appendStringInfoChar(&buf, ':');
+          key_append(&buf, cache, 1, element_type, elems[i]);
+        }
+    }
+  else
+    {
+      for (i = 1; i < PG_NARGS(); i++)
+        {
+          if (buf.len > 0)
+            appendStringInfoChar(&buf, ':');
+          key_append(&buf, cache, i, get_fn_expr_argtype(fcinfo->flinfo, i), PG_GETARG_DATUM(i));
+        }
+    }
+
+  key = buf.data;
+  key_length = buf.len;
+  if (key_length > KEY_MAX_LENGTH)
+    key = key_digest(key, key_length, &key_length);
+  PG_RETURN_TEXT_P(cstring_to_text_with_len(key, key_length));
+}
+
+/*
+ * Deferred counters: with pgmemcache.defer_counters memcache_incr() and
+ * memcache_decr() only add the delta to a per-transaction hash table and
+ * the summed deltas are sent as a single pipelined batch of increments and
+ * decrements at commit.  Changes made in aborted subtransactions are undone
+ * using a log of the deltas made inside subtransactions.
+ */
+
+typedef struct
+{
+  /* the hash key is the cluster and the zero padded memcache key */
+  memcache_cluster *cluster;
+  char key[KEY_MAX_LENGTH + 1];
+  size_t key_length;
+  int64 delta;
+} counter_entry;
+
+typedef struct
+{
+  counter_entry *entry;
+  int64 delta;
+  int nest_level;
+} counter_undo_record;
+
+static void pgmemcache_discard_counters(void)
+{
+  /* both are allocated in TopTransactionContext */
+  globals.counters = NULL;
+  globals.counter_undo = NIL;
+}
+
+static bool counter_add_overflows(int64 a, int64 b)
+{
+  /* keep the sums above INT64_MIN so that they can always be negated */
+  return (b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN + 1 - b);
+}
+
+static void pgmemcache_defer_counter(const char *key, size_t key_length, int64 delta)
+{
+  counter_entry *entry, hkey;
+  bool found;
+  int nest_level = GetCurrentTransactionNestLevel();
+
+  if (globals.counters == NULL)
+    {
+      HASHCTL ctl;
+      int flags = HASH_ELEM | HASH_CONTEXT;
+
+      memset(&ctl, 0, sizeof(ctl));
+      ctl.keysize = offsetof(counter_entry, key_length);
+      ctl.entrysize = sizeof(counter_entry);
+      ctl.hcxt = TopTransactionContext;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      flags |= HASH_BLOBS;
+#else
+      ctl.hash = tag_hash;
+      flags |= HASH_FUNCTION;
+#endif
+      globals.counters = hash_create("pgmemcache deferred counters", 64, &ctl, flags);
+      globals.counters_since = GetCurrentTimestamp();
+    }
+
+  memset(&hkey, 0, sizeof(hkey));
+  hkey.cluster = globals.cluster;
+  memcpy(hkey.key, key, key_length);
+  entry = hash_search(globals.counters, &hkey, HASH_ENTER, &found);
+  if (!found)
+    {
+      entry->key_length = key_length;
+      entry->delta = 0;
+    }
+  if (counter_add_overflows(entry->delta, delta))
+    ereport(ERROR,
+            (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+             errmsg("pgmemcache: deferred counter delta out of range")));
+  entry->delta += delta;
+
+  /* the top level transaction is undone by dropping the whole table */
+  if (nest_level > 1)
+    {
+      MemoryContext oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+      counter_undo_record *undo = palloc(sizeof(counter_undo_record));
+
+      undo->entry = entry;
+      undo->delta = delta;
+      undo->nest_level = nest_level;
+      globals.counter_undo = lcons(undo, globals.counter_undo);
+      MemoryContextSwitchTo(oldcxt);
+    }
+
+  if ((globals.counter_max_keys > 0 &&
+       hash_get_num_entries(globals.counters) >= globals.counter_max_keys) ||
+      (globals.counter_max_delay > 0 &&
+       TimestampDifferenceExceeds(globals.counters_since, GetCurrentTimestamp(),
+                                  globals.counter_max_delay)))
+    pgmemcache_flush_counters();
+}
+
+/* Undo the deltas of an aborted subtransaction, or move the deltas of a
+ * committed one to its parent.  Statement statistics of a query that was
+ * aborted with the subtransaction are dropped as well. */
+static void pgmemcache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                        SubTransactionId parentSubid, void *arg)
+{
+  int nest_level = GetCurrentTransactionNestLevel();
+
+  if (stmt_stats.query != NULL && stmt_stats.nest_level >= nest_level)
+    {
+      if (event == SUBXACT_EVENT_ABORT_SUB)
+        stmt_stats_reset();
+      else if (event == SUBXACT_EVENT_COMMIT_SUB)
+        stmt_stats.nest_level = nest_level - 1;
+    }
+  hll_subxact_callback(event, nest_level);
+
+  if (event == SUBXACT_EVENT_ABORT_SUB)
+    {
+      while (globals.counter_undo != NIL)
+        {
+          counter_undo_record *undo = linitial(globals.counter_undo);
+
+          if (undo->nest_level < nest_level)
+            break;
+          undo->entry->delta -= undo->delta;
+          pfree(undo);
+          globals.counter_undo = list_delete_first(globals.counter_undo);
+        }
+    }
+  else if (event == SUBXACT_EVENT_COMMIT_SUB)
+    {
+      ListCell *lc;
+
+      foreach(lc, globals.counter_undo)
+        {
+          counter_undo_record *undo = lfirst(lc);
+
+          if (undo->nest_level < nest_level)
+            break;
+          undo->nest_level = nest_level - 1;
+        }
+    }
+}
+
+static memcached_return pgmemcache_send_delta(const char *key, size_t key_length, int64 delta)
+{
+  uint64_t val;
+
+  if (delta > 0)
+    return memcache_backend.delta(globals.mc, PG_MEMCACHE_CMD_INCR, key, key_length, delta, 0,
+                                  MEMCACHED_EXPIRATION_NOT_ADD, &val);
+  return memcache_backend.delta(globals.mc, PG_MEMCACHE_CMD_DECR, key, key_length, -delta, 0,
+                                MEMCACHED_EXPIRATION_NOT_ADD, &val);
+}
+
+/* Send the deferred counters of the active cluster as one batch of
+ * buffered requests, returns the number of keys sent. */
+static int64 pgmemcache_send_counters(HTAB *counters)
+{
+  HASH_SEQ_STATUS status;
+  counter_entry *entry;
+  memcached_return rc;
+  int64 count = 0;
+  memcache_send_state send_state;
+
+  memcache_backend.set_buffering(globals.mc, MEMCACHE_SEND_NOREPLY, &send_state);
+  PG_TRY();
+  {
+    hash_seq_init(&status, counters);
+    while ((entry = hash_seq_search(&status)) != NULL)
+      {
+        if (entry->delta == 0 || entry->cluster != globals.cluster)
+          continue;
+        rc = pgmemcache_send_delta(entry->key, entry->key_length, entry->delta);
+        if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED)
+          elog(WARNING, "pgmemcache: deferred counter %s: %s", entry->key,
+                        memcached_strerror(globals.mc, rc));
+        else
+          count++;
+      }
+    rc = pgmemcache_flush_buffers();
+    if (rc != MEMCACHED_SUCCESS)
+      elog(WARNING, "pgmemcache: memcached_flush_buffers: %s",
+                    memcached_strerror(globals.mc, rc));
+  }
+  PG_CATCH();
+  {
+    memcache_backend.restore_buffering(globals.mc, &send_state);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  memcache_backend.restore_buffering(globals.mc, &send_state);
+  return count;
+}
+
+/* Send all deferred counters to the clusters they were made in and forget
+ * them, returns the number of keys sent. */
+static int64 pgmemcache_flush_counters(void)
+{
+  HASH_SEQ_STATUS status;
+  counter_entry *entry;
+  int64 count = 0;
+  HTAB *counters = globals.counters;
+  memcache_cluster *active = globals.cluster;
+  List *clusters = NIL;
+  ListCell *lc;
+
+  if (counters == NULL)
+    return 0;
+  /* the deltas are gone from memcached's point of view once sent even if
+   * something fails below, don't try to send them again */
+  pgmemcache_discard_counters();
+
+  hash_seq_init(&status, counters);
+  while ((entry = hash_seq_search(&status)) != NULL)
+    if (!list_member_ptr(clusters, entry->cluster))
+      clusters = lappend(clusters, entry->cluster);
+
+  PG_TRY();
+  {
+    foreach(lc, clusters)
+      {
+        pgmemcache_switch_cluster((memcache_cluster *) lfirst(lc));
+        count += pgmemcache_send_counters(counters);
+      }
+  }
+  PG_CATCH();
+  {
+    pgmemcache_switch_cluster(active);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  pgmemcache_switch_cluster(active);
+
+  list_free(clusters);
+  hash_destroy(counters);
+  return count;
+}
+
+Datum memcache_counter_flush(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_INT64(pgmemcache_flush_counters());
+}
+
+/*
+ * Cluster migration: while pgmemcache.migrate_from names another cluster,
+ * writes to the active cluster are repeated on that cluster without
+ * waiting for the replies, and keys missing from the active cluster are
+ * looked up in it and copied over.  The hits and misses are counted in
+ * deferred counters on the active cluster so that the progress of all
+ * backends can be seen with memcache_migration_stats().
+ */
+
+/* A write request that can be replayed on another cluster. */
+typedef struct
+{
+  int cmd;             /* PG_MEMCACHE_CMD_* */
+  const char *key;
+  size_t key_length;
+  const char *value;
+  size_t value_length;
+  time_t expiration;
+  uint64_t offset;     /* increments and decrements only */
+  uint64_t initial;
+} write_request;
+
+#define MIGRATION_STATS_PREFIX "pgmemcache:migration:"
+
+static memcached_return pgmemcache_write(const write_request *req, const char **func, uint64_t *val)
+{
+  uint64_t ignored;
+
+  if (val == NULL)
+    val = &ignored;
+  switch (req->cmd)
+    {
+    case PG_MEMCACHE_CMD_ADD:
+      *func = "memcached_add";
+      break;
+    case PG_MEMCACHE_CMD_REPLACE:
+      *func = "memcached_replace";
+      break;
+    case PG_MEMCACHE_CMD_SET:
+      *func = "memcached_set";
+      break;
+    case PG_MEMCACHE_CMD_PREPEND:
+      *func = "memcached_prepend";
+      break;
+    case PG_MEMCACHE_CMD_APPEND:
+      *func = "memcached_append";
+      break;
+    case PG_MEMCACHE_CMD_DELETE:
+      *func = "memcached_delete";
+      return memcache_backend.remove(globals.mc, req->key, req->key_length, req->expiration);
+    case PG_MEMCACHE_CMD_INCR:
+      *func = "memcached_increment_with_initial";
+      return memcache_backend.delta(globals.mc, req->cmd, req->key, req->key_length, req->offset,
+                                    req->initial, req->expiration, val);
+    case PG_MEMCACHE_CMD_DECR:
+      *func = "memcached_decrement_with_initial";
+      return memcache_backend.delta(globals.mc, req->cmd, req->key, req->key_length, req->offset,
+                                    req->initial, req->expiration, val);
+    default:
+      elog(ERROR, "pgmemcache: unknown set command type: %d", req->cmd);
+    }
+  return memcache_backend.store(globals.mc, req->cmd, req->key, req->key_length, req->value,
+                                req->value_length, req->expiration, 0, 0);
+}
+
+static bool migration_active(void)
+{
+  return globals.migration_cluster != NULL && globals.migration_cluster != globals.cluster;
+}
+
+/* Counts from parallel workers are deferred like any other and sent when
+ * the worker's part of the transaction commits. */
+static void migration_count(const char *stat, int64 n)
+{
+  char key[64];
+  int key_length = snprintf(key, sizeof(key), MIGRATION_STATS_PREFIX "%s", stat);
+
+  if (n > 0 && IsTransactionState())
+    pgmemcache_defer_counter(key, key_length, n);
+}
+
+/* Send a write to a cluster without waiting for the reply.  Failures are
+ * only logged at debug level, the cluster being migrated from is on its
+ * way out and missing copies of replicated keys are restored on reads. */
+static void pgmemcache_write_async(memcache_cluster *cluster, const write_request *req)
+{
+  memcache_cluster *active = globals.cluster;
+  const char *func = NULL;
+  memcached_return rc;
+  memcache_send_state send_state;
+  volatile bool buffering = false;
+
+  PG_TRY();
+  {
+    pgmemcache_switch_cluster(cluster);
+    /* the buffered request is sent on flush and the replies are never
+     * read */
+    memcache_backend.set_buffering(globals.mc, MEMCACHE_SEND_NOREPLY, &send_state);
+    buffering = true;
+    rc = pgmemcache_write(req, &func, NULL);
+    if (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_BUFFERED)
+      rc = pgmemcache_flush_buffers();
+    memcache_backend.restore_buffering(globals.mc, &send_state);
+    buffering = false;
+    if (rc != MEMCACHED_SUCCESS)
+      elog(DEBUG1, "pgmemcache: %s on cluster \"%s\": %s", func,
+                   cluster->name ? cluster->name : "default",
+                   memcached_strerror(globals.mc, rc));
+  }
+  PG_CATCH();
+  {
+    if (buffering)
+      memcache_backend.restore_buffering(globals.mc, &send_state);
+    pgmemcache_switch_cluster(active);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  pgmemcache_switch_cluster(active);
+}
+
+/* Look up a key that the active cluster doesn't have in the cluster being
+ * migrated from, and copy it to the active cluster if it's found there. */
+static text *migration_fetch(const char *key, size_t key_length)
+{
+  memcache_cluster *active = globals.cluster;
+  text *ret = NULL;
+  memcached_return rc;
+
+  PG_TRY();
+  {
+    pgmemcache_switch_cluster(globals.migration_cluster);
+    ret = pgmemcache_fetch(key, key_length, &rc);
+    if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+      elog(DEBUG1, "pgmemcache: memcached_get on cluster being migrated from: %s",
+                   memcached_strerror(globals.mc, rc));
+  }
+  PG_CATCH();
+  {
+    pgmemcache_switch_cluster(active);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  pgmemcache_switch_cluster(active);
+
+  if (ret != NULL)
+    {
+      write_request req = { PG_MEMCACHE_CMD_ADD, key, key_length, VARDATA(ret),
+                            VARSIZE(ret) - VARHDRSZ, globals.migration_backfill_ttl, 0, 0 };
+
+      /* add doesn't overwrite a value written since the miss */
+      pgmemcache_write_async(active, &req);
+      migration_count("old_hits", 1);
+    }
+  else
+    migration_count("misses", 1);
+  return ret;
+}
+
+typedef void (*pgmemcache_value_cb)(const char *key, size_t key_len,
+                                    const char *value, size_t value_len,
+                                    uint32_t flags, void *context);
+
+/* Fetch a set of keys from the active cluster with a single multi-get and
+ * call the callback for every key that was found. */
+static memcached_return pgmemcache_mget_cluster(const char **keys, size_t *key_lens, size_t nkeys,
+                                        pgmemcache_value_cb callback, void *context)
+{
+  memcached_return rc;
+  instr_time io_start;
+  int64 received = 0;
+  memcache_mget *mget;
+  memcache_value value;
+
+  STMT_IO_START(io_start);
+  mget = memcache_backend.mget(globals.mc, keys, key_lens, nkeys, 0, &rc);
+  if (rc != MEMCACHED_SUCCESS)
+    {
+      STMT_IO_END(io_start, "memcached_mget", keys[0], key_lens[0], nkeys,
+                  sum_lengths(key_lens, nkeys), 0);
+      memcache_backend.mget_end(globals.mc, mget);
+      return rc;
+    }
+
+  while (memcache_backend.mget_next(globals.mc, mget, &value, &rc) == MEMCACHE_MGET_VALUE)
+    {
+      received += value.value_length;
+      callback(value.key, value.key_length, value.value, value.value_length,
+               value.flags, context);
+    }
+  memcache_backend.mget_end(globals.mc, mget);
+  STMT_IO_END(io_start, "memcached_mget", keys[0], key_lens[0], nkeys,
+              sum_lengths(key_lens, nkeys), received);
+  return rc;
+}
+
+/* State of a multi-get during a cluster migration. */
+typedef struct
+{
+  pgmemcache_value_cb callback;
+  void *context;
+  const char **keys;
+  size_t *key_lens;
+  size_t nkeys;
+  bool *found;
+  size_t next;      /* results usually arrive in the order of the keys */
+  int64 hits;
+  List *backfill;   /* write_requests for the keys found in the old cluster */
+} migration_mget_state;
+
+/* Marks a key returned by the active cluster as found. */
+static void migration_mget_found(migration_mget_state *state, const char *key, size_t key_len)
+{
+  size_t i;
+
+  for (i = 0; i < state->nkeys; i++)
+    {
+      size_t j = (state->next + i) % state->nkeys;
+
+      if (!state->found[j] && state->key_lens[j] == key_len &&
+          memcmp(state->keys[j], key, key_len) == 0)
+        {
+          state->found[j] = true;
+          state->next = j + 1;
+          break;
+        }
+    }
+  state->hits++;
+}
+
+static void migration_mget_cb(const char *key, size_t key_len,
+                              const char *value, size_t value_len,
+                              uint32_t flags, void *context)
+{
+  migration_mget_state *state = (migration_mget_state *) context;
+
+  migration_mget_found(state, key, key_len);
+  state->callback(key, key_len, value, value_len, flags, state->context);
+}
+
+static void migration_backfill_cb(const char *key, size_t key_len,
+                                  const char *value, size_t value_len,
+                                  uint32_t flags, void *context)
+{
+  migration_mget_state *state = (migration_mget_state *) context;
+  write_request *req = palloc0(sizeof(write_request));
+
+  req->cmd = PG_MEMCACHE_CMD_ADD;
+  req->key = pnstrdup(key, key_len);
+  req->key_length = key_len;
+  req->value = pnstrdup(value, value_len);
+  req->value_length = value_len;
+  req->expiration = globals.migration_backfill_ttl;
+  state->backfill = lappend(state->backfill, req);
+  state->hits++;
+  state->callback(key, key_len, value, value_len, flags, state->context);
+}
+
+/* Fetches the keys the active cluster didn't have from the old cluster
+ * with a single multi-get, calls the callback of the state for every key
+ * found there and copies those to the active cluster. */
+static void migration_mget_missing(migration_mget_state *state)
+{
+  memcache_cluster *active = globals.cluster;
+  const char **missing;
+  size_t *missing_lens;
+  size_t nmissing = 0, i;
+  memcached_return rc;
+  ListCell *lc;
+
+  migration_count("new_hits", state->hits);
+
+  missing = palloc(sizeof(char *) * state->nkeys);
+  missing_lens = palloc(sizeof(size_t) * state->nkeys);
+  for (i = 0; i < state->nkeys; i++)
+    if (!state->found[i])
+      {
+        missing[nmissing] = state->keys[i];
+        missing_lens[nmissing++] = state->key_lens[i];
+      }
+
+  if (nmissing > 0)
+    {
+      state->hits = 0;
+      PG_TRY();
+      {
+        pgmemcache_switch_cluster(globals.migration_cluster);
+        rc = pgmemcache_mget_cluster(missing, missing_lens, nmissing, migration_backfill_cb, state);
+        if (rc != MEMCACHED_SUCCESS)
+          elog(DEBUG1, "pgmemcache: memcached_mget on cluster being migrated from: %s",
+                       memcached_strerror(globals.mc, rc));
+      }
+      PG_CATCH();
+      {
+        pgmemcache_switch_cluster(active);
+        PG_RE_THROW();
+      }
+      PG_END_TRY();
+      pgmemcache_switch_cluster(active);
+
+      foreach(lc, state->backfill)
+        pgmemcache_write_async(active, (write_request *) lfirst(lc));
+      migration_count("old_hits", state->hits);
+      migration_count("misses", nmissing - state->hits);
+      list_free_deep(state->backfill);
+      state->backfill = NIL;
+    }
+
+  pfree(missing);
+  pfree(missing_lens);
+}
+
+/* Multi-get from the active cluster, during a migration the keys that
+ * weren't found are fetched from the old cluster with a second request. */
+static memcached_return pgmemcache_mget(const char **keys, size_t *key_lens, size_t nkeys,
+                                        pgmemcache_value_cb callback, void *context)
+{
+  migration_mget_state state;
+  memcached_return rc;
+
+  if (!migration_active() || nkeys == 0)
+    return pgmemcache_mget_cluster(keys, key_lens, nkeys, callback, context);
+
+  memset(&state, 0, sizeof(state));
+  state.callback = callback;
+  state.context = context;
+  state.keys = keys;
+  state.key_lens = key_lens;
+  state.nkeys = nkeys;
+  state.found = palloc0(sizeof(bool) * nkeys);
+  rc = pgmemcache_mget_cluster(keys, key_lens, nkeys, migration_mget_cb, &state);
+  if (rc == MEMCACHED_SUCCESS)
+    migration_mget_missing(&state);
+  pfree(state.found);
+  return rc;
+}
+
+static void assign_migrate_from_guc(const char *newval, void *extra)
+{
+  globals.migration_cluster = (newval && newval[0]) ? cluster_lookup(newval) : NULL;
+}
+
+/*
+ * Hot key replication: keys matching a prefix in pgmemcache.replicate_keys
+ * and, with pgmemcache.hot_key_threshold, the keys this backend reads most
+ * often are also stored as copies named key~n, with the suffixes chosen so
+ * that every copy maps to a different server.  Writes are repeated on the
+ * copies without waiting for the replies, deletes and increments delete
+ * them, and memcache_get() reads a random copy, falling back to the key
+ * itself and restoring the copy if the copy is missing.
+ */
+
+/* candidate suffixes tried per copy before giving up on finding another
+ * server for it */
+#define REPLICA_PROBES 8
+
+/* the read counts of the sampled keys are halved every HOT_KEY_WINDOW
+ * sampled reads */
+#define HOT_KEY_SLOTS 64
+#define HOT_KEY_WINDOW 1024
+
+typedef struct
+{
+  char *prefix;
+  size_t prefix_length;
+  int copies;
+} replica_rule;
+
+typedef struct
+{
+  memcache_cluster *cluster;
+  char key[KEY_MAX_LENGTH + 1];
+  size_t key_length;
+  uint32 reads;
+} hot_key_slot;
+
+/* Space-Saving sampler of the keys read with memcache_get(): a key that
+ * isn't tracked replaces the one with the fewest reads and inherits its
+ * count, so counts are never underestimated. */
+static struct
+{
+  int nslots;
+  uint32 sampled;
+  hot_key_slot slots[HOT_KEY_SLOTS];
+} hot_keys;
+
+/* Parse a comma-separated list of prefix=copies entries.  Returns a list
+ * of replica_rules or NIL and an error message in error. */
+static List *parse_replica_list(const char *str, char **error)
+{
+  List *rules = NIL;
+  char *copy = pstrdup(str), *entry, *saveptr = NULL;
+
+  *error = NULL;
+  for (entry = strtok_r(copy, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr))
+    {
+      replica_rule *rule;
+      char *prefix, *copies, *end;
+      long n;
+
+      prefix = trim_whitespace(entry);
+      if (*prefix == '\0')
+        continue;
+      copies = strrchr(prefix, '=');
+      if (copies == NULL)
+        {
+          *error = psprintf("prefix \"%s\" has no number of copies", prefix);
+          break;
+        }
+      *copies++ = '\0';
+      prefix = trim_whitespace(prefix);
+      n = strtol(copies, &end, 10);
+      if (*prefix == '\0' || strlen(prefix) > KEY_MAX_LENGTH)
+        {
+          *error = psprintf("invalid key prefix \"%s\"", prefix);
+          break;
+        }
+      if (end == copies || *trim_whitespace(end) != '\0' || n < 1 || n > REPLICA_MAX_COPIES)
+        {
+          *error = psprintf("number of copies of \"%s\" must be between 1 and %d",
+                            prefix, REPLICA_MAX_COPIES);
+          break;
+        }
+
+      rule = palloc(sizeof(replica_rule));
+      rule->prefix = pstrdup(prefix);
+      rule->prefix_length = strlen(prefix);
+      rule->copies = (int) n;
+      rules = lappend(rules, rule);
+    }
+  pfree(copy);
+  if (*error)
+    return NIL;
+  return rules;
+}
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+static bool check_replicate_keys_guc(char **newval, void **extra, GucSource source)
+{
+  char *error;
+
+  if (*newval == NULL || parse_replica_list(*newval, &error) != NIL || error == NULL)
+    return true;
+  GUC_check_errdetail("%s", error);
+  return false;
+}
+#endif
+
+static void assign_replicate_keys_guc(const char *newval, void *extra)
+{
+  MemoryContext oldcontext;
+  List *rules;
+  ListCell *lc;
+  char *error;
+
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+  rules = parse_replica_list(newval ? newval : "", &error);
+  MemoryContextSwitchTo(oldcontext);
+  if (error)
+    {
+      elog(WARNING, "pgmemcache: invalid replicated key list \"%s\": %s", newval, error);
+      return;
+    }
+
+  foreach(lc, globals.replica_rules)
+    {
+      replica_rule *rule = (replica_rule *) lfirst(lc);
+
+      pfree(rule->prefix);
+      pfree(rule);
+    }
+  list_free(globals.replica_rules);
+  globals.replica_rules = rules;
+}
+
+/* Returns the number of reads of a key in the sampler, counting this one
+ * if sample is set. */
+static uint32 hot_key_reads(const char *key, size_t key_length, bool sample)
+{
+  hot_key_slot *slot = NULL, *min = NULL;
+  int i;
+
+  for (i = 0; i < hot_keys.nslots; i++)
+    {
+      hot_key_slot *cand = &hot_keys.slots[i];
+
+      if (cand->cluster == globals.cluster && cand->key_length == key_length &&
+          memcmp(cand->key, key, key_length) == 0)
+        {
+          slot = cand;
+          break;
+        }
+      if (min == NULL || cand->reads < min->reads)
+        min = cand;
+    }
+  if (!sample)
+    return slot ? slot->reads : 0;
+
+  if (++hot_keys.sampled >= HOT_KEY_WINDOW)
+    {
+      for (i = 0; i < hot_keys.nslots; i++)
+        hot_keys.slots[i].reads /= 2;
+      hot_keys.sampled = 0;
+    }
+  if (slot == NULL)
+    {
+      if (hot_keys.nslots < HOT_KEY_SLOTS)
+        {
+          slot = &hot_keys.slots[hot_keys.nslots++];
+          slot->reads = 0;
+        }
+      else
+        slot = min;
+      slot->cluster = globals.cluster;
+      memcpy(slot->key, key, key_length);
+      slot->key_length = key_length;
+    }
+  return ++slot->reads;
+}
+
+/* Returns the number of copies of a key including the key itself, 1 if it
+ * isn't replicated.  hot is set if the key is replicated because it's hot
+ * rather than because of its prefix. */
+static int replica_copies(const char *key, size_t key_length, bool sample, bool *hot)
+{
+  size_t best_length = 0;
+  int copies = 1;
+  ListCell *lc;
+
+  *hot = false;
+  foreach(lc, globals.replica_rules)
+    {
+      replica_rule *rule = (replica_rule *) lfirst(lc);
+
+      if (rule->prefix_length > best_length && rule->prefix_length <= key_length &&
+          memcmp(rule->prefix, key, rule->prefix_length) == 0)
+        {
+          best_length = rule->prefix_length;
+          copies = rule->copies;
+        }
+    }
+  if (best_length == 0 && globals.hot_key_threshold > 0 &&
+      hot_key_reads(key, key_length, sample) >= (uint32) globals.hot_key_threshold)
+    {
+      copies = globals.hot_key_copies;
+      *hot = true;
+    }
+  /* each copy needs a server of its own */
+  return Min(copies, list_length(globals.servers));
+}
+
+/* Identifies the server of a key, NULL if it's not known. */
+static const void *replica_server(const char *key, size_t key_length)
+{
+  return memcache_backend.server_for_key(globals.mc, key, key_length);
+}
+
+/* Names the first copies - 1 copies of a key, each on a different server
+ * than the key and the other copies.  The suffixes only depend on the key
+ * and the server list so all backends agree on them.  Returns the number of
+ * copies found, fewer if the servers ran out. */
+static int replica_names(const char *key, size_t key_length, int copies,
+                         const char **names, size_t *lengths)
+{
+  const void *servers[REPLICA_MAX_COPIES];
+  int found = 0, n, i;
+
+  servers[0] = replica_server(key, key_length);
+  if (servers[0] == NULL)
+    return 0;
+  for (n = 1; found < copies - 1 && n <= copies * REPLICA_PROBES; n++)
+    {
+      char *name = psprintf("%.*s~%d", (int) key_length, key, n);
+      size_t length = strlen(name);
+      const void *server;
+
+      if (length > KEY_MAX_LENGTH)
+        name = key_digest(name, length, &length);
+      server = replica_server(name, length);
+      for (i = 0; i <= found && servers[i] != server; i++)
+        ;
+      if (server == NULL || i <= found)
+        {
+          pfree(name);
+          continue;
+        }
+      servers[++found] = server;
+      names[found - 1] = name;
+      lengths[found - 1] = length;
+    }
+  return found;
+}
+
+/* Repeats a write of a replicated key on its copies.  Stores write the
+ * same value to the copies, other writes delete them. */
+static void replica_write(const write_request *req)
+{
+  const char *names[REPLICA_MAX_COPIES];
+  size_t lengths[REPLICA_MAX_COPIES];
+  write_request copy = *req;
+  bool hot;
+  int ncopies, i;
+
+  ncopies = replica_copies(req->key, req->key_length, false, &hot);
+  if (ncopies <= 1)
+    return;
+  ncopies = replica_names(req->key, req->key_length, ncopies, names, lengths);
+
+  switch (req->cmd)
+    {
+    case PG_MEMCACHE_CMD_ADD:
+      /* the key was added, a copy left over from before is overwritten */
+      copy.cmd = PG_MEMCACHE_CMD_SET;
+      break;
+    case PG_MEMCACHE_CMD_SET:
+    case PG_MEMCACHE_CMD_REPLACE:
+    case PG_MEMCACHE_CMD_APPEND:
+    case PG_MEMCACHE_CMD_PREPEND:
+    case PG_MEMCACHE_CMD_DELETE:
+      break;
+    default:
+      /* counters change on the server, readers restore the copies */
+      copy.cmd = PG_MEMCACHE_CMD_DELETE;
+      copy.expiration = 0;
+      break;
+    }
+  /* sessions that don't replicate the key, including other backends that
+   * don't consider it hot, won't update its copies, so they expire after
+   * replica_ttl */
+  if (copy.cmd != PG_MEMCACHE_CMD_DELETE &&
+      (copy.expiration <= 0 || copy.expiration > globals.replica_ttl))
+    copy.expiration = globals.replica_ttl;
+
+  for (i = 0; i < ncopies; i++)
+    {
+      copy.key = names[i];
+      copy.key_length = lengths[i];
+      pgmemcache_write_async(globals.cluster, &copy);
+    }
+}
+
+/* Picks the key to read a replicated key from, returns true if it's a copy
+ * and sets key and key_length to it. */
+static bool replica_pick(const char **key, size_t *key_length)
+{
+  const char *names[REPLICA_MAX_COPIES];
+  size_t lengths[REPLICA_MAX_COPIES];
+  bool hot;
+  int ncopies, pick;
+
+  ncopies = replica_copies(*key, *key_length, true, &hot);
+  if (ncopies <= 1)
+    return false;
+  pick = random() % ncopies;
+  /* only the names up to the picked copy are needed */
+  if (pick == 0 || replica_names(*key, *key_length, pick + 1, names, lengths) < pick)
+    return false;
+  *key = names[pick - 1];
+  *key_length = lengths[pick - 1];
+  return true;
+}
+
+/* Restores a missing copy without overwriting one written since. */
+static void replica_restore(const char *copy, size_t copy_length, const text *value)
+{
+  write_request req = { PG_MEMCACHE_CMD_ADD, copy, copy_length, VARDATA(value),
+                        VARSIZE(value) - VARHDRSZ, globals.replica_ttl, 0, 0 };
+
+  pgmemcache_write_async(globals.cluster, &req);
+}
+
+Datum memcache_hot_keys(PG_FUNCTION_ARGS)
+{
+  FuncCallContext *funcctx;
+  hot_key_slot *slots;
+
+  if (SRF_IS_FIRSTCALL())
+    {
+      MemoryContext oldcontext;
+      TupleDesc tupdesc;
+      int i;
+
+      funcctx = SRF_FIRSTCALL_INIT();
+      oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+      if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function returning record called in context that cannot accept type record")));
+      funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+      /* the sampled keys of the active cluster */
+      slots = palloc(sizeof(hot_key_slot) * (hot_keys.nslots + 1));
+      funcctx->max_calls = 0;
+      for (i = 0; i < hot_keys.nslots; i++)
+        if (hot_keys.slots[i].cluster == globals.cluster)
+          slots[funcctx->max_calls++] = hot_keys.slots[i];
+      funcctx->user_fctx = slots;
+      MemoryContextSwitchTo(oldcontext);
+    }
+
+  funcctx = SRF_PERCALL_SETUP();
+  slots = funcctx->user_fctx;
+  if (funcctx->call_cntr < funcctx->max_calls)
+    {
+      hot_key_slot *slot = &slots[funcctx->call_cntr];
+      Datum values[3];
+      bool nulls[3] = { false, false, false };
+
+      values[0] = PointerGetDatum(cstring_to_text_with_len(slot->key, slot->key_length));
+      values[1] = Int64GetDatum(slot->reads);
+      values[2] = BoolGetDatum(globals.hot_key_threshold > 0 &&
+                               slot->reads >= (uint32) globals.hot_key_threshold);
+      SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+  SRF_RETURN_DONE(funcctx);
+}
+
+static Datum memcache_delta_op(bool increment, PG_FUNCTION_ARGS)
+{
+  uint64_t val;
+  int64_t offset = 1;
+  int64_t initial = 0;
+  time_t expiration = MEMCACHED_EXPIRATION_NOT_ADD;
+  memcached_return rc;
+  instr_time io_start;
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  write_request req = { increment ? PG_MEMCACHE_CMD_INCR : PG_MEMCACHE_CMD_DECR,
+                        key, key_length, NULL, 0, 0, 0, 0 };
+
+  if (PG_NARGS() >= 2)
+    offset = PG_GETARG_INT64(1);
+
+  /* with an initial value a missing key is created with it and the given
+   * expiration instead of failing */
+  if (PG_NARGS() >= 3)
+    {
+      initial = PG_GETARG_INT64(2);
+      if (initial < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pgmemcache: initial value must not be negative")));
+      expiration = 0;
+      if (PG_NARGS() >= 4)
+        expiration = interval_to_time_t(PG_GETARG_INTERVAL_P(3));
+    }
+
+  if (globals.defer_counters && PG_NARGS() <= 2 && IsTransactionState())
+    {
+      if (offset == INT64_MIN)
+        ereport(ERROR,
+                (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                 errmsg("pgmemcache: deferred counter delta out of range")));
+      pgmemcache_defer_counter(key, key_length, increment ? offset : -offset);
+      replica_write(&req);
+      if (migration_active())
+        {
+          memcache_cluster *active = globals.cluster;
+
+          pgmemcache_switch_cluster(globals.migration_cluster);
+          pgmemcache_defer_counter(key, key_length, increment ? offset : -offset);
+          pgmemcache_switch_cluster(active);
+        }
+      PG_RETURN_NULL();
+    }
+
+  if (offset < 0)
+    {
+      /* memcached uses uint64_t but postgresql only has signed types, but
+       * since we have both increment and decrement operations let's just
+       * invert the operation if offset is negative.
+       */
+      offset = abs(offset);
+      increment = !increment;
+    }
+
+  STMT_IO_START(io_start);
+  rc = memcache_backend.delta(globals.mc, increment ? PG_MEMCACHE_CMD_INCR : PG_MEMCACHE_CMD_DECR,
+                              key, key_length, offset, initial, expiration, &val);
+  STMT_IO_END(io_start, increment ? "memcached_increment_with_initial" : "memcached_decrement_with_initial",
+              key, key_length, 1, key_length, 0);
+
+  req.cmd = increment ? PG_MEMCACHE_CMD_INCR : PG_MEMCACHE_CMD_DECR;
+  req.expiration = expiration;
+  req.offset = offset;
+  req.initial = initial;
+  if (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_BUFFERED)
+    replica_write(&req);
+  if (migration_active())
+    pgmemcache_write_async(globals.migration_cluster, &req);
+
+  if (rc == MEMCACHED_BUFFERED)
+    {
+      globals.flush_needed = true;
+      PG_RETURN_NULL();
+    }
+  if (rc != MEMCACHED_SUCCESS)
+    {
+      elog(WARNING, "pgmemcache: memcached_%s_with_initial: %s",
+                    increment ? "increment" : "decrement",
+                    memcached_strerror(globals.mc, rc));
+    }
+  else if (val > 0x7FFFFFFFFFFFFFFFLL && val != UINT64_MAX)
+    {
+      /* Cannot represent uint64_t values above 2^63-1 with BIGINT.  Do
+         not signal error for UINT64_MAX which just means there was no
+         reply.  */
+      elog(ERROR, "pgmemcache: memcached_%s_with_initial: %s",
+                  increment ? "increment" : "decrement",
+                  "value received from memcache is out of BIGINT range");
+    }
+  PG_RETURN_INT64(val);
+}
+
+Datum memcache_decr(PG_FUNCTION_ARGS)
+{
+  return memcache_delta_op(false, fcinfo);
+}
+
+Datum memcache_incr(PG_FUNCTION_ARGS)
+{
+  return memcache_delta_op(true, fcinfo);
+}
+
+/*
+ * Fixed window rate limiter.  Each window has its own key, the window's
+ * start time divided by its length is appended to the given key, so the
+ * whole check is a single increment which creates the window's counter
+ * with an expiration at the end of the window if it doesn't exist yet.
+ */
+Datum memcache_rate_limit(PG_FUNCTION_ARGS)
+{
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  int64 limit = PG_GETARG_INT64(1);
+  time_t window = interval_to_time_t(PG_GETARG_INTERVAL_P(2));
+  time_t now = time(NULL), reset_at, expiration;
+  char bucket_key[KEY_MAX_LENGTH + 32];
+  int bucket_key_length;
+  TupleDesc tupdesc;
+  Datum values[3];
+  bool nulls[3] = { false, false, false };
+  write_request req = { PG_MEMCACHE_CMD_INCR, bucket_key, 0, NULL, 0, 0, 1, 1 };
+  const char *func = "memcached_increment_with_initial";
+  memcached_return rc;
+  instr_time io_start;
+  uint64_t val = 0;
+  memcache_send_state send_state;
+  volatile bool buffering = false;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("function returning record called in context that cannot accept type record")));
+  if (window < 1)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: rate limit window must be at least one second")));
+
+  reset_at = (now / window + 1) * window;
+  bucket_key_length = snprintf(bucket_key, sizeof(bucket_key), "%.*s:%lld",
+                               (int) key_length, key, (long long) (now / window));
+  if (bucket_key_length > KEY_MAX_LENGTH)
+    elog(ERROR, "pgmemcache: key too long, maximum is %d characters including the window suffix",
+                KEY_MAX_LENGTH);
+  /* keep the counter a second longer than the window to allow some clock skew */
+  expiration = reset_at - now + 1;
+  if (expiration > MEMCACHED_MAX_RELATIVE_EXPIRATION)
+    expiration = reset_at + 1;
+
+  req.key_length = bucket_key_length;
+  req.expiration = expiration;
+  PG_TRY();
+  {
+    /* the count is needed even with NOREPLY or BUFFER_REQUESTS */
+    memcache_backend.set_buffering(globals.mc, MEMCACHE_SEND_WAIT, &send_state);
+    buffering = true;
+    STMT_IO_START(io_start);
+    rc = pgmemcache_write(&req, &func, &val);
+    STMT_IO_END(io_start, func, bucket_key, bucket_key_length, 1, bucket_key_length, 0);
+    memcache_backend.restore_buffering(globals.mc, &send_state);
+    buffering = false;
+  }
+  PG_CATCH();
+  {
+    if (buffering)
+      memcache_backend.restore_buffering(globals.mc, &send_state);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  if (rc == MEMCACHED_SUCCESS && val <= (uint64_t) INT64_MAX)
+    {
+      values[0] = BoolGetDatum((int64) val <= limit);
+      values[1] = Int64GetDatum((int64) val);
+    }
+  else
+    {
+      /* allow the request if memcached can't be reached */
+      if (rc != MEMCACHED_SUCCESS)
+        elog(WARNING, "pgmemcache: %s: %s", func, memcached_strerror(globals.mc, rc));
+      values[0] = BoolGetDatum(true);
+      nulls[1] = true;
+    }
+  values[2] = TimestampTzGetDatum(time_t_to_timestamptz(reset_at));
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/*
+ * Block allocated sequences.  The memcache key holds the last value handed
+ * out to any backend, memcache_nextval() reserves cache_size values with a
+ * single increment and returns them one by one from a backend-local cache
+ * like PostgreSQL sequences with CACHE.  Values are unique but not ordered
+ * between backends, and unused values of a block are lost when the backend
+ * exits.  Sequences must be initialized with memcache_setval() and are only
+ * as durable as their key: an evicted key raises an error rather than
+ * restarting the sequence.
+ */
+typedef struct
+{
+  memcache_cluster *cluster;
+  char key[KEY_MAX_LENGTH + 1];
+  int64 next;   /* next value to return, no values are cached if > last */
+  int64 last;   /* last value of the reserved block */
+} sequence_entry;
+
+static sequence_entry *sequence_lookup(const char *key, size_t key_length, HASHACTION action)
+{
+  sequence_entry hkey, *entry;
+  bool found;
+
+  if (globals.sequences == NULL)
+    {
+      HASHCTL ctl;
+      int flags = HASH_ELEM | HASH_CONTEXT;
+
+      if (action == HASH_REMOVE)
+        return NULL;
+      memset(&ctl, 0, sizeof(ctl));
+      ctl.keysize = offsetof(sequence_entry, next);
+      ctl.entrysize = sizeof(sequence_entry);
+      ctl.hcxt = TopMemoryContext;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      flags |= HASH_BLOBS;
+#else
+      ctl.hash = tag_hash;
+      flags |= HASH_FUNCTION;
+#endif
+      globals.sequences = hash_create("pgmemcache sequences", 16, &ctl, flags);
+    }
+
+  memset(&hkey, 0, sizeof(hkey));
+  hkey.cluster = globals.cluster;
+  memcpy(hkey.key, key, key_length);
+  entry = hash_search(globals.sequences, &hkey, action, &found);
+  if (action == HASH_ENTER && !found)
+    {
+      entry->next = 1;
+      entry->last = 0;
+    }
+  return entry;
+}
+
+/* Copies a sequence key missing from the cluster from the cluster being
+ * migrated from so that no values are handed out twice.  Returns
+ * MEMCACHED_NOTFOUND if there's nothing to copy. */
+static memcached_return sequence_migrate(const char *key, size_t key_length)
+{
+  write_request req = { PG_MEMCACHE_CMD_ADD, key, key_length, NULL, 0, 0, 0, 0 };
+  memcache_cluster *active = globals.cluster;
+  text *old = NULL;
+  const char *func;
+  memcached_return rc;
+
+  if (!migration_active())
+    return MEMCACHED_NOTFOUND;
+  PG_TRY();
+  {
+    pgmemcache_switch_cluster(globals.migration_cluster);
+    old = pgmemcache_fetch(key, key_length, &rc);
+  }
+  PG_CATCH();
+  {
+    pgmemcache_switch_cluster(active);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  pgmemcache_switch_cluster(active);
+  if (old == NULL && rc != MEMCACHED_NOTFOUND)
+    elog(ERROR, "pgmemcache: memcached_get on cluster being migrated from: %s",
+                memcached_strerror(globals.mc, rc));
+  if (old == NULL)
+    return MEMCACHED_NOTFOUND;
+  req.value = VARDATA(old);
+  req.value_length = VARSIZE(old) - VARHDRSZ;
+
+  rc = pgmemcache_write(&req, &func, NULL);
+  /* somebody else may have copied it in the meantime */
+  if (rc == MEMCACHED_NOTSTORED || rc == MEMCACHED_DATA_EXISTS)
+    rc = MEMCACHED_SUCCESS;
+  return rc;
+}
+
+/* Reserves the next cache_size values of a sequence, returns the last one. */
+static int64 sequence_reserve(const char *key, size_t key_length, int64 cache_size)
+{
+  write_request req = { PG_MEMCACHE_CMD_INCR, key, key_length, NULL, 0,
+                        MEMCACHED_EXPIRATION_NOT_ADD, cache_size, 0 };
+  const char *func;
+  memcached_return rc;
+  instr_time io_start;
+  uint64_t val = 0;
+
+  STMT_IO_START(io_start);
+  rc = pgmemcache_write(&req, &func, &val);
+  if (rc == MEMCACHED_NOTFOUND)
+    {
+      rc = sequence_migrate(key, key_length);
+      if (rc == MEMCACHED_SUCCESS)
+        rc = pgmemcache_write(&req, &func, &val);
+    }
+  STMT_IO_END(io_start, func, key, key_length, 1, key_length, 0);
+
+  /* restarting a sequence whose key was evicted or flushed would hand out
+   * the same values again */
+  if (rc == MEMCACHED_NOTFOUND)
+    ereport(ERROR,
+            (errcode(ERRCODE_UNDEFINED_OBJECT),
+             errmsg("pgmemcache: sequence \"%.*s\" does not exist", (int) key_length, key),
+             errhint("Initialize the sequence with memcache_setval(), its key may have been evicted or flushed.")));
+  if (rc == MEMCACHED_BUFFERED)
+    elog(ERROR, "pgmemcache: memcache_nextval requires replies, NOREPLY and BUFFER_REQUESTS must be disabled");
+  if (rc != MEMCACHED_SUCCESS)
+    elog(ERROR, "pgmemcache: %s: %s", func, memcached_strerror(globals.mc, rc));
+  /* memcached wraps around at 2^64, values below the increment mean that
+   * the counter was wrapped */
+  if (val > (uint64_t) INT64_MAX || val < (uint64_t) cache_size)
+    ereport(ERROR,
+            (errcode(ERRCODE_SEQUENCE_GENERATOR_LIMIT_EXCEEDED),
+             errmsg("pgmemcache: sequence \"%.*s\" is out of BIGINT range",
+                    (int) key_length, key)));
+
+  if (migration_active())
+    pgmemcache_write_async(globals.migration_cluster, &req);
+  return (int64) val;
+}
+
+Datum memcache_nextval(PG_FUNCTION_ARGS)
+{
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  int64 cache_size = 1;
+  sequence_entry *entry;
+  int64 val;
+
+  if (PG_NARGS() >= 2)
+    cache_size = PG_GETARG_INT64(1);
+  if (cache_size < 1)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: cache size must be at least 1")));
+
+  entry = sequence_lookup(key, key_length, HASH_ENTER);
+  if (entry->next > entry->last)
+    {
+      int64 last = sequence_reserve(key, key_length, cache_size);
+
+      entry->next = last - cache_size + 1;
+      entry->last = last;
+    }
+
+  val = entry->next;
+  if (val == entry->last)
+    {
+      entry->next = 1;
+      entry->last = 0;
+    }
+  else
+    entry->next++;
+  PG_RETURN_INT64(val);
+}
+
+/* Sets the last value of a sequence, the next value returned by any backend
+ * that doesn't have values cached is value + 1. */
+Datum memcache_setval(PG_FUNCTION_ARGS)
+{
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  int64 value = PG_GETARG_INT64(1);
+  char buf[32];
+  write_request req = { PG_MEMCACHE_CMD_SET, key, key_length, buf, 0, 0, 0, 0 };
+  const char *func;
+  memcached_return rc;
+  instr_time io_start;
+
+  if (value < 0)
+    ereport(ERROR,
+            (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+             errmsg("pgmemcache: sequence value must not be negative")));
+  req.value_length = snprintf(buf, sizeof(buf), INT64_FORMAT, value);
+
+  /* drop the values this backend had cached for the sequence */
+  sequence_lookup(key, key_length, HASH_REMOVE);
+
+  STMT_IO_START(io_start);
+  rc = pgmemcache_write(&req, &func, NULL);
+  STMT_IO_END(io_start, func, key, key_length, 1, key_length + req.value_length, 0);
+
+  if (migration_active())
+    pgmemcache_write_async(globals.migration_cluster, &req);
+  if (rc == MEMCACHED_BUFFERED)
+    globals.flush_needed = true;
+  else if (rc != MEMCACHED_SUCCESS)
+    elog(ERROR, "pgmemcache: %s: %s", func, memcached_strerror(globals.mc, rc));
+
+  PG_RETURN_INT64(value);
+}
+
+/*
+ * Lease based locks.  The lock key is added with a value identifying this
+ * backend and the lease as its expiration, so a lock whose holder crashed
+ * is freed when the lease ends.  Once the lock is taken, a fencing token is
+ * taken by incrementing the key followed by ":fence", so each holder of a
+ * lock gets a larger token than the previous ones and the resources the
+ * lock protects can reject writes of holders whose lease has expired.
+ * Locks are released when the transaction commits or aborts, transactions
+ * holding locks can't be prepared as the locks would be released before
+ * the prepared transaction's changes are visible.
+ */
+typedef struct
+{
+  memcache_cluster *cluster;
+  char key[KEY_MAX_LENGTH + 1];
+  size_t key_length;
+  char owner[64];
+  int64 token;
+  TimestampTz expires;  /* the lease can't have ended before this */
+} held_lock;
+
+#define LOCK_FENCE_SUFFIX ":fence"
+#define LOCK_MIN_SLEEP_MS 2
+#define LOCK_MAX_SLEEP_MS 100
+/* memcached expires keys at whole seconds of its own clock, so a lease may
+ * end up to a second earlier than it would by our clock */
+#define LOCK_EXPIRY_MARGIN_MS 1000
+
+static held_lock *lock_find(const char *key, size_t key_length)
+{
+  ListCell *lc;
+
+  foreach(lc, globals.locks)
+    {
+      held_lock *lock = (held_lock *) lfirst(lc);
+
+      if (lock->cluster == globals.cluster && lock->key_length == key_length &&
+          memcmp(lock->key, key, key_length) == 0)
+        return lock;
+    }
+  return NULL;
+}
+
+/* Returns the time before which a lease taken at start can't have ended. */
+static TimestampTz lock_expiry(TimestampTz start, time_t lease)
+{
+  return TimestampTzPlusMilliseconds(start, (int64) lease * 1000 - LOCK_EXPIRY_MARGIN_MS);
+}
+
+/* Sleeps for ms milliseconds or until the latch is set. */
+static void lock_sleep(long ms)
+{
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 120000)
+  WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, ms, PG_WAIT_EXTENSION);
+  ResetLatch(MyLatch);
+#elif defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+  int rc;
+
+#if PG_VERSION_NUM >= 100000
+  rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, ms, PG_WAIT_EXTENSION);
+#else
+  rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, ms);
+#endif
+  if (rc & WL_POSTMASTER_DEATH)
+    proc_exit(1);
+  ResetLatch(MyLatch);
+#else
+  pg_usleep(1000L * ms);
+#endif /* PG_VERSION_NUM >= 120000 */
+  CHECK_FOR_INTERRUPTS();
+}
+
+/* Checks that the lock's key still holds our value, only needed after the
+ * lease may have ended. */
+static bool lock_still_held(held_lock *lock)
+{
+  memcached_return rc;
+  text *value;
+  bool held;
+
+  if (GetCurrentTimestamp() < lock->expires)
+    return true;
+  value = pgmemcache_fetch(lock->key, lock->key_length, &rc);
+  if (value == NULL)
+    return false;
+  held = VARSIZE(value) - VARHDRSZ == strlen(lock->owner) &&
+         memcmp(VARDATA(value), lock->owner, strlen(lock->owner)) == 0;
+  pfree(value);
+  return held;
+}
+
+/* Sets the lease of a lock we hold, returns false if it was lost. */
+static bool lock_renew(held_lock *lock, time_t lease)
+{
+  write_request req = { PG_MEMCACHE_CMD_REPLACE, lock->key, lock->key_length,
+                        lock->owner, strlen(lock->owner), lease, 0, 0 };
+  TimestampTz start = GetCurrentTimestamp();
+  const char *func;
+  memcached_return rc;
+  instr_time io_start;
+
+  if (!lock_still_held(lock))
+    return false;
+  STMT_IO_START(io_start);
+  rc = pgmemcache_write(&req, &func, NULL);
+  STMT_IO_END(io_start, func, lock->key, lock->key_length, 1, lock->key_length + req.value_length, 0);
+  if (rc == MEMCACHED_NOTSTORED || rc == MEMCACHED_NOTFOUND)
+    return false;
+  if (rc != MEMCACHED_SUCCESS)
+    elog(ERROR, "pgmemcache: %s: %s", func, memcached_strerror(globals.mc, rc));
+  lock->expires = lock_expiry(start, lease);
+  return true;
+}
+
+/* Deletes a lock's key if we still hold it and forgets the lock. */
+static bool lock_release(held_lock *lock)
+{
+  memcache_cluster *active = globals.cluster;
+  memcached_return rc = MEMCACHED_NOTFOUND;
+  bool held;
+
+  pgmemcache_switch_cluster(lock->cluster);
+  PG_TRY();
+  {
+    held = lock_still_held(lock);
+    if (held)
+      rc = memcache_backend.remove(globals.mc, lock->key, lock->key_length, 0);
+  }
+  PG_CATCH();
+  {
+    pgmemcache_switch_cluster(active);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  if (held && rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED && rc != MEMCACHED_NOTFOUND)
+    elog(WARNING, "pgmemcache: memcached_delete: %s", memcached_strerror(globals.mc, rc));
+  else if (rc == MEMCACHED_BUFFERED)
+    globals.flush_needed = true;
+  pgmemcache_switch_cluster(active);
+
+  globals.locks = list_delete_ptr(globals.locks, lock);
+  pfree(lock);
+  return held && (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_BUFFERED);
+}
+
+/* Releases all locks at the end of a transaction.  Errors are reported as
+ * warnings as the transaction has already committed or aborted. */
+static void pgmemcache_release_locks(void)
+{
+  MemoryContext oldcxt = CurrentMemoryContext;
+
+  while (globals.locks != NIL)
+    {
+      held_lock *lock = (held_lock *) linitial(globals.locks);
+
+      PG_TRY();
+      {
+        lock_release(lock);
+      }
+      PG_CATCH();
+      {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+        elog(WARNING, "pgmemcache: releasing lock \"%s\": %s", lock->key, edata->message);
+        FreeErrorData(edata);
+        if (globals.locks != NIL && linitial(globals.locks) == lock)
+          {
+            globals.locks = list_delete_first(globals.locks);
+            pfree(lock);
+          }
+      }
+      PG_END_TRY();
+    }
+}
+
+Datum memcache_lock(PG_FUNCTION_ARGS)
+{
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  time_t lease = interval_to_time_t(PG_GETARG_INTERVAL_P(1));
+  float8 wait = 0;
+  write_request req = { PG_MEMCACHE_CMD_ADD, key, key_length, NULL, 0, lease, 0, 0 };
+  char fence[KEY_MAX_LENGTH + sizeof(LOCK_FENCE_SUFFIX)];
+  write_request fence_req = { PG_MEMCACHE_CMD_INCR, fence, 0, NULL, 0, 0, 1, 1 };
+  static uint32 lock_count = 0;
+  char owner[64];
+  held_lock *lock;
+  TimestampTz start, deadline;
+  int sleep_ms = LOCK_MIN_SLEEP_MS;
+  const char *func;
+  memcached_return rc;
+  instr_time io_start;
+  uint64_t token = 0;
+  MemoryContext oldcxt;
+
+  if (PG_NARGS() >= 3)
+    wait = interval_to_seconds(PG_GETARG_INTERVAL_P(2));
+  if (lease < 1)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: lock lease must be at least one second")));
+  if (key_length + strlen(LOCK_FENCE_SUFFIX) > KEY_MAX_LENGTH)
+    elog(ERROR, "pgmemcache: key too long, maximum is %d characters including the fence suffix",
+                (int) (KEY_MAX_LENGTH - strlen(LOCK_FENCE_SUFFIX)));
+
+  /* taking a lock again only renews its lease */
+  lock = lock_find(key, key_length);
+  if (lock != NULL)
+    {
+      if (lock_renew(lock, lease))
+        PG_RETURN_INT64(lock->token);
+      lock_release(lock);
+    }
+
+  snprintf(owner, sizeof(owner), "%d:" INT64_FORMAT ":%u",
+           MyProcPid, (int64) MyStartTime, ++lock_count);
+  req.value = owner;
+  req.value_length = strlen(owner);
+  deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), (int64) (wait * 1000));
+  for (;;)
+    {
+      start = GetCurrentTimestamp();
+      STMT_IO_START(io_start);
+      rc = pgmemcache_write(&req, &func, NULL);
+      STMT_IO_END(io_start, func, key, key_length, 1, key_length + req.value_length, 0);
+      if (rc == MEMCACHED_SUCCESS)
+        break;
+      if (rc == MEMCACHED_BUFFERED)
+        elog(ERROR, "pgmemcache: memcache_lock requires replies, NOREPLY and BUFFER_REQUESTS must be disabled");
+      if (rc != MEMCACHED_NOTSTORED && rc != MEMCACHED_DATA_EXISTS)
+        elog(ERROR, "pgmemcache: %s: %s", func, memcached_strerror(globals.mc, rc));
+      if (start >= deadline)
+        PG_RETURN_NULL();
+
+      /* exponential backoff with jitter so that waiters don't retry in
+       * lockstep */
+      lock_sleep(sleep_ms / 2 + random() % (sleep_ms / 2 + 1));
+      sleep_ms = Min(sleep_ms * 2, LOCK_MAX_SLEEP_MS);
+    }
+
+  /* remember the lock before taking the token so that it's released if
+   * that fails */
+  oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+  lock = palloc0(sizeof(held_lock));
+  lock->cluster = globals.cluster;
+  memcpy(lock->key, key, key_length);
+  lock->key_length = key_length;
+  strlcpy(lock->owner, owner, sizeof(lock->owner));
+  lock->expires = lock_expiry(start, lease);
+  globals.locks = lappend(globals.locks, lock);
+  MemoryContextSwitchTo(oldcxt);
+
+  fence_req.key_length = snprintf(fence, sizeof(fence), "%.*s" LOCK_FENCE_SUFFIX,
+                                  (int) key_length, key);
+  STMT_IO_START(io_start);
+  rc = pgmemcache_write(&fence_req, &func, &token);
+  STMT_IO_END(io_start, func, fence, fence_req.key_length, 1, fence_req.key_length, 0);
+  if (rc != MEMCACHED_SUCCESS)
+    elog(ERROR, "pgmemcache: %s: %s", func, memcached_strerror(globals.mc, rc));
+  if (token > (uint64_t) INT64_MAX)
+    elog(ERROR, "pgmemcache: %s: %s", func, "value received from memcache is out of BIGINT range");
+  lock->token = (int64) token;
+
+  PG_RETURN_INT64(lock->token);
+}
+
+/* Extends the lease of a lock held by this backend. */
+Datum memcache_lock_renew(PG_FUNCTION_ARGS)
+{
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  time_t lease = interval_to_time_t(PG_GETARG_INTERVAL_P(1));
+  held_lock *lock = lock_find(key, key_length);
+
+  if (lease < 1)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: lock lease must be at least one second")));
+  if (lock == NULL)
+    PG_RETURN_BOOL(false);
+  if (lock_renew(lock, lease))
+    PG_RETURN_BOOL(true);
+  lock_release(lock);
+  PG_RETURN_BOOL(false);
+}
+
+/* Releases a lock before the end of the transaction. */
+Datum memcache_unlock(PG_FUNCTION_ARGS)
+{
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  held_lock *lock = lock_find(key, key_length);
+
+  if (lock == NULL)
+    PG_RETURN_BOOL(false);
+  PG_RETURN_BOOL(lock_release(lock));
+}
+
+Datum memcache_delete(PG_FUNCTION_ARGS)
+{
+  time_t hold;
+  memcached_return rc;
+  instr_time io_start;
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  write_request req = { PG_MEMCACHE_CMD_DELETE, key, key_length, NULL, 0, 0, 0, 0 };
+
+  hold = (time_t) 0.0;
+  if (PG_NARGS() >= 2 && PG_ARGISNULL(1) == false)
+    hold = interval_to_time_t(PG_GETARG_INTERVAL_P(1));
+  req.expiration = hold;
+
+  STMT_IO_START(io_start);
+  rc = memcache_backend.remove(globals.mc, key, key_length, hold);
+  STMT_IO_END(io_start, "memcached_delete", key, key_length, 1, key_length, 0);
+
+  /* the copies are deleted even if the key itself was already gone */
+  replica_write(&req);
+  if (migration_active())
+    pgmemcache_write_async(globals.migration_cluster, &req);
+  if (rc == MEMCACHED_BUFFERED)
+    {
+      globals.flush_needed = true;
+      PG_RETURN_NULL();
+    }
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+    elog(WARNING, "pgmemcache: memcached_delete: %s",
+                  memcached_strerror(globals.mc, rc));
+
+  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+}
+
+Datum memcache_flush_all0(PG_FUNCTION_ARGS)
+{
+  static time_t opt_expire = 0;
+  memcached_return rc;
+
+  rc = memcache_backend.flush(globals.mc, opt_expire);
+  if (rc == MEMCACHED_BUFFERED)
+    {
+      globals.flush_needed = true;
+      PG_RETURN_NULL();
+    }
+  if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: memcached_flush: %s",
+                  memcached_strerror(globals.mc, rc));
+
+  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+}
+
+/* Fetch a key from the active cluster, returns NULL if it wasn't found or
+ * the request failed. */
+static text *pgmemcache_fetch(const char *key, size_t key_length, memcached_return *rcp)
+{
+  text *ret;
+  memcached_return rc;
+  instr_time io_start;
+
+  STMT_IO_START(io_start);
+  ret = memcache_backend.get(globals.mc, key, key_length, NULL, &rc);
+  STMT_IO_END(io_start, "memcached_get", key, key_length, 1, key_length,
+              ret != NULL ? VARSIZE(ret) - VARHDRSZ : 0);
+
+  *rcp = rc;
+  return ret;
+}
+
+Datum memcache_get(PG_FUNCTION_ARGS)
+{
+  text *ret;
+  memcached_return rc;
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  const char *read_key = key;
+  size_t read_key_length = key_length;
+  bool copy = replica_pick(&read_key, &read_key_length);
+
+  ret = pgmemcache_fetch(read_key, read_key_length, &rc);
+  if (copy && ret == NULL)
+    {
+      /* a missing or unreachable copy is read from the key itself */
+      ret = pgmemcache_fetch(key, key_length, &rc);
+      if (ret != NULL)
+        replica_restore(read_key, read_key_length, ret);
+    }
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+    elog(ERROR, "pgmemcache: memcached_get: %s",
+                memcached_strerror(globals.mc, rc));
+
+  if (migration_active())
+    {
+      if (ret == NULL)
+        ret = migration_fetch(key, key_length);
+      else
+        migration_count("new_hits", 1);
+    }
+
+  if (ret == NULL)
+    PG_RETURN_NULL();
+  PG_RETURN_TEXT_P(ret);
+}
+
+/* A key of memcache_get_multi() requested under another name */
+typedef struct
+{
+  char name[KEY_MAX_LENGTH + 1];  /* the name requested, zero padded */
+  size_t name_length;
+  text *key;                      /* the caller's key */
+  bool copy;                      /* the name is a copy of the key */
+  bool found;
+} multi_get_name;
+
+/* Returns the name to request a key of memcache_get_multi() as, the
+ * caller's key of a digested key or of a copy is remembered in names. */
+static const char *multi_get_key(text *key, size_t *length, HTAB **names)
+{
+  const char *name = get_arg_cstring(key, length, true);
+  char hkey[KEY_MAX_LENGTH + 1];
+  multi_get_name *entry;
+  bool copy = replica_pick(&name, length);
+
+  if (name == VARDATA(key))
+    return name;
+  if (*names == NULL)
+    {
+      HASHCTL ctl;
+      int flags = HASH_ELEM | HASH_CONTEXT;
+
+      memset(&ctl, 0, sizeof(ctl));
+      ctl.keysize = KEY_MAX_LENGTH + 1;
+      ctl.entrysize = sizeof(multi_get_name);
+      ctl.hcxt = CurrentMemoryContext;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      flags |= HASH_BLOBS;
+#else
+      ctl.hash = tag_hash;
+      flags |= HASH_FUNCTION;
+#endif
+      *names = hash_create("pgmemcache multi-get names", 16, &ctl, flags);
+    }
+  memset(hkey, 0, sizeof(hkey));
+  memcpy(hkey, name, *length);
+  entry = hash_search(*names, hkey, HASH_ENTER, NULL);
+  entry->name_length = *length;
+  entry->key = key;
+  entry->copy = copy;
+  entry->found = false;
+  return name;
+}
+
+/* Returns the caller's key of a name returned by a multi-get, NULL if it's
+ * the caller's key. */
+static text *multi_get_caller_key(HTAB *names, const char *name, size_t name_length)
+{
+  char hkey[KEY_MAX_LENGTH + 1];
+  multi_get_name *entry;
+
+  if (names == NULL || name_length > KEY_MAX_LENGTH)
+    return NULL;
+  memset(hkey, 0, sizeof(hkey));
+  memcpy(hkey, name, name_length);
+  entry = hash_search(names, hkey, HASH_FIND, NULL);
+  if (entry == NULL)
+    return NULL;
+  entry->found = true;
+  return entry->key;
+}
+
+/* Returns a list of the copies a multi-get didn't find. */
+static List *multi_get_missing_copies(HTAB *names)
+{
+  HASH_SEQ_STATUS status;
+  multi_get_name *entry;
+  List *missing = NIL;
+
+  if (names == NULL)
+    return NIL;
+  hash_seq_init(&status, names);
+  while ((entry = hash_seq_search(&status)) != NULL)
+    if (entry->copy && !entry->found)
+      missing = lappend(missing, entry);
+  return missing;
+}
+
+/* Reads the next missing copy of a multi-get from its key and restores
+ * the copy, returns the key's tuple or NULL once they're all read. */
+static HeapTuple multi_get_next_copy(List **missing, AttInMetadata *attinmeta)
+{
+  while (*missing != NIL)
+    {
+      multi_get_name *entry = linitial(*missing);
+      memcached_return rc;
+      size_t key_length;
+      const char *key = get_arg_cstring(entry->key, &key_length, true);
+      text *value = pgmemcache_fetch(key, key_length, &rc);
+      char *values[2];
+
+      *missing = list_delete_first(*missing);
+      if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+        elog(ERROR, "pgmemcache: memcached_get: %s",
+                    memcached_strerror(globals.mc, rc));
+      if (value == NULL)
+        continue;
+      replica_restore(entry->name, entry->name_length, value);
+      values[0] = text_to_cstring(entry->key);
+      values[1] = text_to_cstring(value);
+      return BuildTupleFromCStrings(attinmeta, values);
+    }
+  return NULL;
+}
+
+/* Builds the tuple of a value returned by a multi-get. */
+static HeapTuple multi_get_tuple(HTAB *names, AttInMetadata *attinmeta,
+                                 const char *key, size_t key_length,
+                                 const char *value, size_t value_length)
+{
+  char *values[2];
+  text *caller_key = multi_get_caller_key(names, key, key_length);
+
+  /* BuildTupleFromCStrings needs zero-terminated C-strings */
+  if (caller_key != NULL)
+    values[0] = text_to_cstring(caller_key);
+  else
+    values[0] = pnstrdup(key, key_length);
+  values[1] = pnstrdup(value, value_length);
+  return BuildTupleFromCStrings(attinmeta, values);
+}
+
+/* The values of a multi-get found in the cluster being migrated from */
+typedef struct
+{
+  HTAB *names;
+  AttInMetadata *attinmeta;
+  List *tuples;
+} multi_get_old_values;
+
+static void multi_get_old_value_cb(const char *key, size_t key_len,
+                                   const char *value, size_t value_len,
+                                   uint32_t flags, void *context)
+{
+  multi_get_old_values *old = (multi_get_old_values *) context;
+
+  old->tuples = lappend(old->tuples, multi_get_tuple(old->names, old->attinmeta,
+                                                     key, key_len, value, value_len));
+}
+
+/* Returns the next tuple read after the multi-get itself: first the values
+ * found in the old cluster, then the missing copies. */
+static HeapTuple multi_get_next_fetched(List **old_tuples, List **missing,
+                                        AttInMetadata *attinmeta)
+{
+  HeapTuple tuple;
+
+  if (*old_tuples != NIL)
+    {
+      tuple = linitial(*old_tuples);
+      *old_tuples = list_delete_first(*old_tuples);
+      return tuple;
+    }
+  return multi_get_next_copy(missing, attinmeta);
+}
+
+Datum memcache_get_multi(PG_FUNCTION_ARGS)
+{
+  ArrayType *array;
+  int array_length, array_lbound, i;
+  Oid element_type;
+  memcached_return rc;
+  char typalign;
+  int16 typlen;
+  bool typbyval;
+  memcache_value current;
+  memcache_mget_status status;
+  instr_time io_start;
+  FuncCallContext *funcctx;
+  MemoryContext oldcontext;
+  TupleDesc tupdesc;
+  AttInMetadata *attinmeta;
+  struct internal_fctx {
+      size_t *key_lens;
+      const char **keys;
+      memcache_mget *mget;   /* NULL once all responses have been read */
+      TimestampTz deadline;  /* end of the latency budget or 0 */
+      HTAB *names;           /* the keys requested under other names or NULL */
+      bool fetched;          /* all responses have been read */
+      List *missing;         /* the copies still to read from their keys */
+      migration_mget_state *migration;  /* the keys found during a migration or NULL */
+      List *old_tuples;      /* the values still to return from the old cluster */
+  } *fctx;
+
+  array = PG_GETARG_ARRAYTYPE_P(0);
+  if (ARR_NDIM(array) != 1)
+    elog(ERROR, "pgmemcache: only single dimension ARRAYs are supported, "
+                "not ARRAYs with %d dimensions", ARR_NDIM(array));
+
+  array_lbound = ARR_LBOUND(array)[0];
+  array_length = ARR_DIMS(array)[0];
+  element_type = ARR_ELEMTYPE(array);
+
+  if (SRF_IS_FIRSTCALL())
+    {
+      /* create a function context for cross-call persistence */
+      funcctx = SRF_FIRSTCALL_INIT();
+      oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+      funcctx->max_calls = array_length;
+      if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function returning record called in context that cannot accept type record")));
+      get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+
+      fctx = (struct internal_fctx *) palloc(sizeof(*fctx));
+      /* extra NULL key for last memcached_fetch call */
+      fctx->keys = palloc0(sizeof(char *) * (array_length + 1));
+      fctx->key_lens = palloc0(sizeof(size_t) * (array_length + 1));
+      fctx->keys[array_length] = 0;
+      fctx->key_lens[array_length] = 0;
+      fctx->deadline = 0;
+      fctx->names = NULL;
+      fctx->fetched = false;
+      fctx->missing = NIL;
+      fctx->migration = NULL;
+      fctx->old_tuples = NIL;
+      if (PG_NARGS() >= 2)
+        fctx->deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                     (int64) (interval_to_seconds(PG_GETARG_INTERVAL_P(1)) * 1000));
+
+      for (i = 0; i < array_length; i++)
+        {
+          int offset = array_lbound + i;
+          bool isnull;
+          Datum elem = array_ref(array, 1, &offset, 0, typlen, typbyval, typalign, &isnull);
+          if (!isnull)
+            fctx->keys[i] = multi_get_key(DatumGetTextP(elem), &fctx->key_lens[i], &fctx->names);
+        }
+
+      /* during a migration the keys that weren't found are read from the
+       * old cluster once the new one has answered */
+      if (migration_active() && array_length > 0)
+        {
+          fctx->migration = palloc0(sizeof(migration_mget_state));
+          fctx->migration->keys = fctx->keys;
+          fctx->migration->key_lens = fctx->key_lens;
+          fctx->migration->nkeys = array_length;
+          fctx->migration->found = palloc0(sizeof(bool) * array_length);
+          for (i = 0; i < array_length; i++)
+            fctx->migration->found[i] = fctx->keys[i] == NULL;
+        }
+
+      STMT_IO_START(io_start);
+      fctx->mget = memcache_backend.mget(globals.mc, fctx->keys, fctx->key_lens, array_length,
+                                         fctx->deadline, &rc);
+      STMT_IO_END(io_start, "memcached_mget", fctx->keys[0], fctx->key_lens[0], array_length,
+                  sum_lengths(fctx->key_lens, array_length), 0);
+      if (rc != MEMCACHED_SUCCESS)
+        elog(ERROR, "pgmemcache: memcached_mget: %s",
+                    memcached_strerror(globals.mc, rc));
+
+      attinmeta = TupleDescGetAttInMetadata(tupdesc);
+      funcctx->attinmeta = attinmeta;
+      funcctx->user_fctx = fctx;
+      MemoryContextSwitchTo(oldcontext);
+    }
+
+  funcctx = SRF_PERCALL_SETUP();
+  fctx = funcctx->user_fctx;
+  attinmeta = funcctx->attinmeta;
+
+  if (fctx->fetched)
+    {
+      /* then the old cluster's values and the copies that weren't found */
+      HeapTuple tuple = multi_get_next_fetched(&fctx->old_tuples, &fctx->missing, attinmeta);
+
+      if (tuple != NULL)
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+      SRF_RETURN_DONE(funcctx);
+    }
+
+  STMT_IO_START(io_start);
+  status = memcache_backend.mget_next(globals.mc, fctx->mget, &current, &rc);
+  STMT_IO_END(io_start, NULL, NULL, 0, 0, 0,
+              status == MEMCACHE_MGET_VALUE ? current.value_length : 0);
+  if (status == MEMCACHE_MGET_ERROR)
+    elog(ERROR, "pgmemcache: memcached_fetch: %s",
+                memcached_strerror(globals.mc, rc));
+  if (status != MEMCACHE_MGET_VALUE)
+    {
+      memcache_backend.mget_end(globals.mc, fctx->mget);
+      fctx->mget = NULL;
+      fctx->fetched = true;
+      /* with an expired budget the copies aren't read either */
+      if (status == MEMCACHE_MGET_EXPIRED)
+        {
+          if (fctx->migration != NULL)
+            migration_count("new_hits", fctx->migration->hits);
+          SRF_RETURN_DONE(funcctx);
+        }
+    }
+  if (status == MEMCACHE_MGET_VALUE)
+    {
+      HeapTuple tuple = multi_get_tuple(fctx->names, attinmeta, current.key, current.key_length,
+                                        current.value, current.value_length);
+
+      if (fctx->migration != NULL)
+        migration_mget_found(fctx->migration, current.key, current.key_length);
+      SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+  if (fctx->fetched)
+    {
+      HeapTuple tuple;
+
+      oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+      if (fctx->migration != NULL)
+        {
+          multi_get_old_values old = { fctx->names, attinmeta, NIL };
+
+          fctx->migration->callback = multi_get_old_value_cb;
+          fctx->migration->context = &old;
+          migration_mget_missing(fctx->migration);
+          fctx->old_tuples = old.tuples;
+        }
+      /* the copies are read from their keys if there's time left */
+      if (fctx->deadline == 0 || GetCurrentTimestamp() < fctx->deadline)
+        fctx->missing = multi_get_missing_copies(fctx->names);
+      MemoryContextSwitchTo(oldcontext);
+      tuple = multi_get_next_fetched(&fctx->old_tuples, &fctx->missing, attinmeta);
+      if (tuple != NULL)
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+  SRF_RETURN_DONE(funcctx);
+}
+
+Datum memcache_replace(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_REPLACE | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+}
+
+Datum memcache_replace_absexpire(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_REPLACE | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+}
+
+Datum memcache_set(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_SET | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+}
+
+Datum memcache_set_absexpire(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_SET | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+}
+
+Datum memcache_prepend(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_PREPEND | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+}
+
+Datum memcache_prepend_absexpire(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_PREPEND | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+}
+
+Datum memcache_append(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_APPEND | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+}
+
+Datum memcache_append_absexpire(PG_FUNCTION_ARGS)
+{
+  return memcache_set_cmd(PG_MEMCACHE_CMD_APPEND | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+}
+
+static Datum memcache_set_cmd(int type, PG_FUNCTION_ARGS)
+{
+  memcached_return rc = MEMCACHED_FAILURE;
+  const char *func = NULL;
+  time_t expiration = 0;
+  write_request req;
+  instr_time io_start;
+  size_t key_length, value_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  const char *value = get_arg_cstring(PG_GETARG_TEXT_P(1), &value_length, false);
+
+  if (PG_NARGS() >= 3 && PG_ARGISNULL(2) == false)
+    {
+      if (type & PG_MEMCACHE_TYPE_INTERVAL)
+        {
+          Interval *span = PG_GETARG_INTERVAL_P(2);
+          expiration = interval_to_time_t(span);
+        }
+      else if (type & PG_MEMCACHE_TYPE_TIMESTAMP)
+        {
+          TimestampTz timestamptz;
+          struct pg_tm tm;
+          fsec_t fsec;
+
+          timestamptz = PG_GETARG_TIMESTAMPTZ(2);
+
+          /* convert to timestamptz to produce consistent results */
+          if (timestamp2tm(timestamptz, NULL, &tm, &fsec, NULL, NULL) !=0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+                     errmsg("timestamp out of range")));
+
+#ifdef HAVE_INT64_TIMESTAMP
+          expiration = (time_t) ((timestamptz - SetEpochTimestamp()) / 1000000e0);
+#else
+          expiration = (time_t) timestamptz - SetEpochTimestamp();
+#endif
+        }
+      else
+        {
+          elog(ERROR, "%s():%s:%u: invalid date type", __FUNCTION__, __FILE__, __LINE__);
+        }
+    }
+
+  req.cmd = type & PG_MEMCACHE_CMD_MASK;
+  req.key = key;
+  req.key_length = key_length;
+  req.value = value;
+  req.value_length = value_length;
+  req.expiration = expiration;
+
+  STMT_IO_START(io_start);
+  rc = pgmemcache_write(&req, &func, NULL);
+  STMT_IO_END(io_start, func, key, key_length, 1, key_length + value_length, 0);
+
+  /* appends and prepends change the size of an item by an unknown amount */
+  if (globals.track_value_sizes && (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_BUFFERED) &&
+      (req.cmd == PG_MEMCACHE_CMD_SET || req.cmd == PG_MEMCACHE_CMD_ADD ||
+       req.cmd == PG_MEMCACHE_CMD_REPLACE))
+    size_record(key, key_length, value_length);
+
+  if (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_BUFFERED)
+    replica_write(&req);
+  if (migration_active())
+    pgmemcache_write_async(globals.migration_cluster, &req);
+
+  if (rc == MEMCACHED_BUFFERED)
+    {
+      globals.flush_needed = true;
+      PG_RETURN_NULL();
+    }
+  if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: %s: %s", func,
+                  memcached_strerror(globals.mc, rc));
+
+  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+}
+
+Datum memcache_server_add(PG_FUNCTION_ARGS)
+{
+  size_t host_len;
+  const char *host_buf = get_arg_cstring(PG_GETARG_TEXT_P(0), &host_len, false);
+  char *host = pnstrdup(host_buf, host_len);
+  char *error;
+  List *servers;
+  ListCell *lc;
+  bool added = true;
+
+  servers = parse_server_list(host, &error);
+  if (error)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: invalid server list \"%s\": %s", host, error)));
+
+  /* the servers of named clusters are part of their definition */
+  if (globals.cluster != &default_cluster)
+    {
+      memcache_cluster *cluster = globals.cluster;
+
+      cluster_define(cluster->name,
+                     cluster->servers ? psprintf("%s,%s", cluster->servers, host) : host,
+                     cluster->behavior);
+      PG_RETURN_BOOL(true);
+    }
+
+  /* the assign hook adds the servers to the context, and removes them
+   * again if the transaction aborts */
+  if (globals.session_servers && globals.session_servers[0])
+    SetConfigOption("pgmemcache.session_servers",
+                    psprintf("%s,%s", globals.session_servers, host),
+                    PGC_USERSET, PGC_S_SESSION);
+  else
+    SetConfigOption("pgmemcache.session_servers", host, PGC_USERSET, PGC_S_SESSION);
+
+  foreach(lc, servers)
+    if (!server_list_member(globals.servers, (server_spec *) lfirst(lc)))
+      added = false;
+  free_server_list(servers);
+  PG_RETURN_BOOL(added);
+}
+
+/* Parse a comma-separated server list.  Each entry is either a
+ * hostname with an optional port, an IPv6 address in brackets with an
+ * optional port or an absolute unix socket path, optionally followed by
+ * per-server options, for example:
+ *
+ *   cache1:11211?weight=2, [::1]:11212, /var/run/memcached.sock?weight=4
+ *
+ * Returns a list of server_specs or NULL and an error message in error.
+ */
+static List *parse_server_list(const char *str, char **error)
+{
+  List *servers = NIL;
+  char *copy = pstrdup(str), *entry, *saveptr = NULL;
+
+  *error = NULL;
+  for (entry = strtok_r(copy, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr))
+    {
+      server_spec *spec;
+      char *options, *end, *p;
+
+      while (isspace((unsigned char) *entry))
+        entry++;
+      for (end = entry + strlen(entry); end > entry && isspace((unsigned char) end[-1]); end--)
+        end[-1] = '\0';
+      if (*entry == '\0')
+        continue;
+
+      spec = palloc0(sizeof(*spec));
+      options = strchr(entry, '?');
+      if (options)
+        *options++ = '\0';
+
+      if (entry[0] == '/')
+        spec->host = pstrdup(entry);
+      else
+        {
+          spec->port = MEMCACHED_DEFAULT_PORT;
+          if (entry[0] == '[')
+            {
+              p = strchr(entry, ']');
+              if (p == NULL)
+                {
+                  *error = psprintf("invalid IPv6 address in \"%s\"", entry);
+                  return NULL;
+                }
+              *p++ = '\0';
+              spec->host = pstrdup(entry + 1);
+              if (*p != '\0' && *p != ':')
+                {
+                  *error = psprintf("invalid server \"%s\"", entry);
+                  return NULL;
+                }
+            }
+          else
+            {
+              p = strchr(entry, ':');
+              if (p)
+                *p = '\0';
+              spec->host = pstrdup(entry);
+            }
+          if (p && *p == ':')
+            {
+              long port = strtol(p + 1, &end, 10);
+              if (end == p + 1 || *end != '\0' || port <= 0 || port > 65535)
+                {
+                  *error = psprintf("invalid port \"%s\" for server \"%s\"", p + 1, spec->host);
+                  return NULL;
+                }
+              spec->port = port;
+            }
+          if (spec->host[0] == '\0')
+            {
+              *error = pstrdup("empty hostname in server list");
+              return NULL;
+            }
+        }
+
+      if (options)
+        {
+          char *opt, *optsave = NULL;
+
+          for (opt = strtok_r(options, "&", &optsave); opt; opt = strtok_r(NULL, "&", &optsave))
+            {
+              char *val = strchr(opt, '=');
+
+              if (val)
+                *val++ = '\0';
+              if (strcmp(opt, "weight") == 0 && val)
+                {
+                  long weight = strtol(val, &end, 10);
+                  if (end == val || *end != '\0' || weight <= 0 || weight > PG_INT32_MAX)
+                    {
+                      *error = psprintf("invalid weight \"%s\" for server \"%s\"", val, spec->host);
+                      return NULL;
+                    }
+                  spec->weight = weight;
+                }
+              else
+                {
+                  *error = psprintf("unsupported option \"%s\" for server \"%s\", "
+                                     "supported options are: weight", opt, spec->host);
+                  return NULL;
+                }
+            }
+        }
+
+      *error = memcache_backend.check_server(spec);
+      if (*error != NULL)
+        return NULL;
+
+      servers = lappend(servers, spec);
+    }
+  pfree(copy);
+  return servers;
+}
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+static bool check_server_list_guc(char **newval, void **extra, GucSource source)
+{
+  char *error;
+
+  if (*newval == NULL || parse_server_list(*newval, &error) != NIL || error == NULL)
+    return true;
+  GUC_check_errdetail("%s", error);
+  return false;
+}
+#endif
+
+/* Add the servers that are not yet in the context to it and remember them
+ * in globals.servers. */
+static memcached_return add_servers(List *servers)
+{
+  memcached_return rc;
+  MemoryContext oldcontext;
+  List *added = NIL;
+  ListCell *lc;
+
+  foreach(lc, servers)
+    {
+      server_spec *spec = (server_spec *) lfirst(lc);
+      if (!server_list_member(globals.servers, spec) && !server_list_member(added, spec))
+        added = lappend(added, spec);
+    }
+  if (added == NIL)
+    return MEMCACHED_SUCCESS;
+
+  rc = memcache_backend.add_servers(globals.mc, globals.servers, added);
+  if (rc == MEMCACHED_SUCCESS)
+    {
+      oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+      foreach(lc, added)
+        {
+          server_spec *spec = (server_spec *) lfirst(lc);
+          server_spec *copy = palloc(sizeof(*copy));
+
+          copy->host = pstrdup(spec->host);
+          copy->port = spec->port;
+          copy->weight = spec->weight;
+          globals.servers = lappend(globals.servers, copy);
+        }
+      MemoryContextSwitchTo(oldcontext);
+    }
+  list_free(added);
+  return rc;
+}
+
+/* NOTE: memcached_server_fn specifies that the first argument is const, but
+ * the server_stats operation wants a non-const argument so we don't define
+ * it as const here.
+ */
+static memcached_return_t server_stat_function(memcached_st *mc,
+                                               memcached_server_instance_st server,
+                                               void *context)
+{
+  memcached_return rc;
+  StringInfoData *strbuf = (StringInfoData *) context;
+  const char *hostname = memcached_server_name(server);
+  unsigned int port = memcached_server_port(server);
+
+  appendStringInfo(strbuf, "Server: %s (%u)\n", hostname, port);
+  rc = memcache_backend.server_stats(mc, server, strbuf);
+  if (rc != MEMCACHED_SUCCESS)
+    return rc;
+  appendStringInfo(strbuf, "\n");
+  return MEMCACHED_SUCCESS;
+}
+
+Datum memcache_stats(PG_FUNCTION_ARGS)
+{
+  StringInfoData strbuf;
+  memcached_return rc;
+  memcached_server_fn callbacks[1];
+
+  initStringInfo(&strbuf);
+  callbacks[0] = (memcached_server_fn) server_stat_function;
+  rc = memcached_server_cursor(globals.mc, callbacks, (void *) &strbuf, 1);
+
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_SOME_ERRORS)
+    elog(WARNING, "pgmemcache: memcache_stats: %s",
+                  memcached_strerror(globals.mc, rc));
+
+  PG_RETURN_DATUM(DirectFunctionCall1(textin, CStringGetDatum(strbuf.data)));
+}
+
+/*
+ * Value size histograms and the slab report
+ *
+ * memcached stores each item in a chunk of the smallest slab class that
+ * fits the item's key, value and header, and the rest of the chunk is lost.
+ * With pgmemcache.track_value_sizes on, the sizes of the items stored by
+ * this backend are counted in log-linear histograms per key prefix, the key
+ * up to and including its first ':'.  memcache_slab_report() lays them over
+ * the slab classes reported by the servers and memcache_slab_advice()
+ * searches for the growth factor (-f) and minimum chunk size (-n) that would
+ * waste the least memory on the recorded sizes.
+ */
+
+#define SIZE_PREFIX_MAX 32
+#define SIZE_MAX_PREFIXES 256
+#define SIZE_SUB_BUCKET_BITS 3
+#define SIZE_SUB_BUCKETS (1 << SIZE_SUB_BUCKET_BITS)
+#define SIZE_BUCKETS (21 * SIZE_SUB_BUCKETS)  /* up to 8 megabytes */
+
+/* memcached's item header with CAS, plus the flags, NUL and CRLF bytes */
+#define SLAB_ITEM_HEADER 48
+#define SLAB_ITEM_OVERHEAD (SLAB_ITEM_HEADER + 8 + 1 + 2)
+#define SLAB_MAX_CLASSES 63
+#define SLAB_PAGE_SIZE (1024 * 1024)
+
+typedef struct
+{
+  int64 count;
+  int64 key_bytes;
+  int64 value_bytes;
+} size_bucket;
+
+typedef struct size_histogram
+{
+  char prefix[SIZE_PREFIX_MAX + 1];  /* hash key, zero padded */
+  size_bucket buckets[SIZE_BUCKETS];
+} size_histogram;
+
+/* Each power of two is split into SIZE_SUB_BUCKETS linear buckets, larger
+ * sizes are counted in the last bucket. */
+static int size_bucket_index(int64 size)
+{
+  int msb = 0, idx;
+
+  if (size < SIZE_SUB_BUCKETS)
+    return (int) size;
+  while ((size >> (msb + 1)) != 0)
+    msb++;
+  idx = (msb - SIZE_SUB_BUCKET_BITS + 1) * SIZE_SUB_BUCKETS +
+        (int) ((size >> (msb - SIZE_SUB_BUCKET_BITS)) & (SIZE_SUB_BUCKETS - 1));
+  return Min(idx, SIZE_BUCKETS - 1);
+}
+
+static int64 size_bucket_lower(int idx)
+{
+  if (idx < SIZE_SUB_BUCKETS)
+    return idx;
+  return (int64) (SIZE_SUB_BUCKETS + idx % SIZE_SUB_BUCKETS) << (idx / SIZE_SUB_BUCKETS - 1);
+}
+
+static void size_record(const char *key, size_t key_length, size_t value_length)
+{
+  char prefix[SIZE_PREFIX_MAX + 1];
+  const char *colon = memchr(key, ':', Min(key_length, SIZE_PREFIX_MAX));
+  size_histogram *hist = NULL;
+  size_bucket *bucket;
+
+  if (globals.value_sizes == NULL)
+    {
+      HASHCTL ctl;
+      int flags = HASH_ELEM | HASH_CONTEXT;
+
+      memset(&ctl, 0, sizeof(ctl));
+      ctl.keysize = sizeof(prefix);
+      ctl.entrysize = sizeof(size_histogram);
+      ctl.hcxt = TopMemoryContext;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      flags |= HASH_BLOBS;
+#else
+      ctl.hash = tag_hash;
+      flags |= HASH_FUNCTION;
+#endif
+      globals.value_sizes = hash_create("pgmemcache value sizes", 16, &ctl, flags);
+    }
+
+  memset(prefix, 0, sizeof(prefix));
+  if (colon)
+    memcpy(prefix, key, colon - key + 1);
+  if (hash_get_num_entries(globals.value_sizes) < SIZE_MAX_PREFIXES)
+    {
+      bool found;
+
+      hist = hash_search(globals.value_sizes, prefix, HASH_ENTER, &found);
+      if (!found)
+        memset(hist->buckets, 0, sizeof(hist->buckets));
+    }
+  else
+    hist = hash_search(globals.value_sizes, prefix, HASH_FIND, NULL);
+  if (hist == NULL)
+    {
+      if (globals.value_sizes_other == NULL)
+        globals.value_sizes_other = MemoryContextAllocZero(TopMemoryContext, sizeof(size_histogram));
+      hist = globals.value_sizes_other;
+    }
+
+  bucket = &hist->buckets[size_bucket_index(SLAB_ITEM_OVERHEAD + key_length + value_length)];
+  bucket->count++;
+  bucket->key_bytes += key_length;
+  bucket->value_bytes += value_length;
+}
+
+/* Returns the histograms of all prefixes, the one of the prefixes past the
+ * limit last. */
+static List *size_histograms(void)
+{
+  List *hists = NIL;
+  HASH_SEQ_STATUS status;
+  size_histogram *hist;
+
+  if (globals.value_sizes != NULL)
+    {
+      hash_seq_init(&status, globals.value_sizes);
+      while ((hist = hash_seq_search(&status)) != NULL)
+        hists = lappend(hists, hist);
+    }
+  if (globals.value_sizes_other != NULL)
+    hists = lappend(hists, globals.value_sizes_other);
+  return hists;
+}
+
+/* Sums the histograms of all prefixes, returns the number of writes. */
+static int64 size_totals(size_bucket *totals)
+{
+  List *hists = size_histograms();
+  int64 count = 0;
+  ListCell *lc;
+  int i;
+
+  memset(totals, 0, sizeof(size_bucket) * SIZE_BUCKETS);
+  foreach(lc, hists)
+    {
+      size_histogram *hist = (size_histogram *) lfirst(lc);
+
+      for (i = 0; i < SIZE_BUCKETS; i++)
+        {
+          totals[i].count += hist->buckets[i].count;
+          totals[i].key_bytes += hist->buckets[i].key_bytes;
+          totals[i].value_bytes += hist->buckets[i].value_bytes;
+          count += hist->buckets[i].count;
+        }
+    }
+  list_free(hists);
+  return count;
+}
+
+/* The average item size of the writes in a bucket */
+static double size_bucket_average(const size_bucket *bucket)
+{
+  return SLAB_ITEM_OVERHEAD + (double) (bucket->key_bytes + bucket->value_bytes) / bucket->count;
+}
+
+typedef struct
+{
+  int64 chunk_size;
+  int64 total_pages;
+  int64 used_chunks;
+  int64 free_chunks;
+  int64 mem_requested;  /* -1 when not reported, memcached 1.6 dropped it */
+  int64 items;
+  int64 evicted;
+  int64 outofmemory;
+} slab_class_stats;
+
+typedef struct
+{
+  char *name;
+  double growth_factor;
+  int chunk_size;
+  int64 item_size_max;
+  int64 slab_chunk_max;
+  slab_class_stats classes[SLAB_MAX_CLASSES + 1];  /* by slab class id */
+} slab_server;
+
+static slab_server *slab_server_get(List **servers, const char *hostname, unsigned int port)
+{
+  char *name = psprintf("%s:%u", hostname, port);
+  slab_server *srv;
+  ListCell *lc;
+  int i;
+
+  foreach(lc, *servers)
+    {
+      srv = (slab_server *) lfirst(lc);
+      if (strcmp(srv->name, name) == 0)
+        {
+          pfree(name);
+          return srv;
+        }
+    }
+
+  /* memcached's defaults, older versions don't report all the settings */
+  srv = palloc0(sizeof(slab_server));
+  srv->name = name;
+  srv->growth_factor = 1.25;
+  srv->chunk_size = 48;
+  srv->item_size_max = 1024 * 1024;
+  for (i = 0; i <= SLAB_MAX_CLASSES; i++)
+    srv->classes[i].mem_requested = -1;
+  *servers = lappend(*servers, srv);
+  return srv;
+}
+
+static void slab_stat_add(slab_server *srv, const char *key, size_t key_length,
+                          const char *value, size_t value_length)
+{
+  char name[64], buf[64], *field;
+  slab_class_stats *cls;
+  long id;
+  int64 num;
+
+  if (key_length >= sizeof(name) || value_length >= sizeof(buf))
+    return;
+  memcpy(name, key, key_length);
+  name[key_length] = '\0';
+  memcpy(buf, value, value_length);
+  buf[value_length] = '\0';
+  num = strtoll(buf, NULL, 10);
+
+  if (strcmp(name, "growth_factor") == 0)
+    srv->growth_factor = strtod(buf, NULL);
+  else if (strcmp(name, "chunk_size") == 0)
+    srv->chunk_size = (int) num;
+  else if (strcmp(name, "item_size_max") == 0)
+    srv->item_size_max = num;
+  else if (strcmp(name, "slab_chunk_max") == 0)
+    srv->slab_chunk_max = num;
+
+  /* "N:field" from stats slabs and "items:N:field" from stats items */
+  field = strncmp(name, "items:", 6) == 0 ? name + 6 : name;
+  if (!isdigit((unsigned char) *field))
+    return;
+  id = strtol(field, &field, 10);
+  if (id < 1 || id > SLAB_MAX_CLASSES || *field++ != ':')
+    return;
+  cls = &srv->classes[id];
+
+  if (field - name > 6 && strncmp(name, "items:", 6) == 0)
+    {
+      if (strcmp(field, "number") == 0)
+        cls->items = num;
+      else if (strcmp(field, "evicted") == 0)
+        cls->evicted = num;
+      else if (strcmp(field, "outofmemory") == 0)
+        cls->outofmemory = num;
+    }
+  else if (strcmp(field, "chunk_size") == 0)
+    cls->chunk_size = num;
+  else if (strcmp(field, "total_pages") == 0)
+    cls->total_pages = num;
+  else if (strcmp(field, "used_chunks") == 0)
+    cls->used_chunks = num;
+  else if (strcmp(field, "free_chunks") == 0)
+    cls->free_chunks = num;
+  else if (strcmp(field, "mem_requested") == 0)
+    cls->mem_requested = num;
+}
+
+static void slab_stat_function(const char *hostname, unsigned int port,
+                               const char *key, size_t key_length,
+                               const char *value, size_t value_length,
+                               void *context)
+{
+  slab_server *srv = slab_server_get((List **) context, hostname, port);
+
+  slab_stat_add(srv, key, key_length, value, value_length);
+}
+
+/* Returns a list of slab_servers with the slab statistics of every server. */
+static List *slab_stats_fetch(void)
+{
+  static const char *const groups[] = { "settings", "slabs", "items" };
+  List *servers = NIL;
+  memcached_return rc;
+  int i;
+
+  for (i = 0; i < lengthof(groups); i++)
+    {
+      rc = memcache_backend.group_stats(globals.mc, groups[i], slab_stat_function, &servers);
+      if (rc != MEMCACHED_SUCCESS)
+        elog(WARNING, "pgmemcache: memcached_stat_execute %s: %s",
+                      groups[i], memcached_strerror(globals.mc, rc));
+    }
+  return servers;
+}
+
+/* Computes the chunk sizes of the slab classes like memcached's slabs_init,
+ * returns the number of classes. */
+static int slab_class_sizes(double factor, int chunk_size, int64 chunk_max, int64 *sizes)
+{
+  double size = SLAB_ITEM_HEADER + chunk_size;
+  int n = 0;
+
+  while (n < SLAB_MAX_CLASSES - 1 && size < chunk_max / factor)
+    {
+      int64 aligned = (int64) size;
+
+      if (aligned % 8)
+        aligned += 8 - aligned % 8;
+      sizes[n++] = aligned;
+      size = (double) (int64) (aligned * factor);
+    }
+  sizes[n++] = chunk_max;
+  return n;
+}
+
+static int64 slab_chunk_max(const slab_server *srv)
+{
+  return srv->slab_chunk_max > 0 ? srv->slab_chunk_max : srv->item_size_max;
+}
+
+/* Finds the class of an item, items larger than the largest chunk are
+ * chained over several chunks of the largest class. */
+static int slab_class_for(const int64 *sizes, int n, double size, int64 *nchunks)
+{
+  int lo = 0, hi = n - 1;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (sizes[mid] < size)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *nchunks = (int64) ceil(size / sizes[lo]);
+  return lo;
+}
+
+/*
+ * The share of the allocated memory used by the recorded item sizes when
+ * stored in the given slab classes.  If resident is positive the histogram
+ * is scaled to that many items and each class takes whole pages, otherwise
+ * only the space lost to rounding up to the chunk size is counted.
+ */
+static double slab_efficiency(const size_bucket *totals, const int64 *sizes, int n, double resident)
+{
+  double chunks[SLAB_MAX_CLASSES];
+  double used = 0, allocated = 0, count = 0, scale = 1;
+  int i;
+
+  memset(chunks, 0, sizeof(chunks));
+  for (i = 0; i < SIZE_BUCKETS; i++)
+    {
+      double avg;
+      int64 nchunks;
+      int cls;
+
+      if (totals[i].count == 0)
+        continue;
+      avg = size_bucket_average(&totals[i]);
+      cls = slab_class_for(sizes, n, avg, &nchunks);
+      chunks[cls] += (double) totals[i].count * nchunks;
+      used += totals[i].count * avg;
+      count += totals[i].count;
+    }
+  if (count == 0)
+    return 0;
+  if (resident > 0)
+    scale = resident / count;
+
+  for (i = 0; i < n; i++)
+    {
+      if (resident > 0)
+        {
+          int64 per_page = Max(SLAB_PAGE_SIZE / sizes[i], 1);
+
+          allocated += ceil(chunks[i] * scale / per_page) * per_page * sizes[i];
+        }
+      else
+        allocated += chunks[i] * sizes[i];
+    }
+  return used * scale / allocated;
+}
+
+/* Builds the tuples of a set returning function at its first call. */
+static Datum size_srf_next(FunctionCallInfo fcinfo, List *(*build)(TupleDesc tupdesc))
+{
+  FuncCallContext *funcctx;
+  List *tuples;
+
+  if (SRF_IS_FIRSTCALL())
+    {
+      MemoryContext oldcxt;
+      TupleDesc tupdesc;
+
+      funcctx = SRF_FIRSTCALL_INIT();
+      oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+      if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function returning record called in context that cannot accept type record")));
+      tuples = build(BlessTupleDesc(tupdesc));
+      funcctx->user_fctx = tuples;
+      funcctx->max_calls = list_length(tuples);
+      MemoryContextSwitchTo(oldcxt);
+    }
+
+  funcctx = SRF_PERCALL_SETUP();
+  tuples = funcctx->user_fctx;
+  if (funcctx->call_cntr < funcctx->max_calls)
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum((HeapTuple) list_nth(tuples, funcctx->call_cntr)));
+  SRF_RETURN_DONE(funcctx);
+}
+
+static List *value_sizes_build(TupleDesc tupdesc)
+{
+  List *tuples = NIL;
+  ListCell *lc;
+  int i;
+
+  foreach(lc, size_histograms())
+    {
+      size_histogram *hist = (size_histogram *) lfirst(lc);
+
+      for (i = 0; i < SIZE_BUCKETS; i++)
+        {
+          Datum values[6];
+          bool nulls[6] = { false, false, false, false, false, false };
+
+          if (hist->buckets[i].count == 0)
+            continue;
+          nulls[0] = hist == globals.value_sizes_other;
+          values[0] = nulls[0] ? (Datum) 0 : CStringGetTextDatum(hist->prefix);
+          values[1] = Int32GetDatum((int32) size_bucket_lower(i));
+          values[2] = Int32GetDatum((int32) (size_bucket_lower(i + 1) - 1));
+          values[3] = Int64GetDatum(hist->buckets[i].count);
+          values[4] = Int64GetDatum(hist->buckets[i].key_bytes);
+          values[5] = Int64GetDatum(hist->buckets[i].value_bytes);
+          tuples = lappend(tuples, heap_form_tuple(tupdesc, values, nulls));
+        }
+    }
+  return tuples;
+}
+
+Datum memcache_value_sizes(PG_FUNCTION_ARGS)
+{
+  return size_srf_next(fcinfo, value_sizes_build);
+}
+
+Datum memcache_value_sizes_reset(PG_FUNCTION_ARGS)
+{
+  if (globals.value_sizes != NULL)
+    hash_destroy(globals.value_sizes);
+  if (globals.value_sizes_other != NULL)
+    pfree(globals.value_sizes_other);
+  globals.value_sizes = NULL;
+  globals.value_sizes_other = NULL;
+  PG_RETURN_BOOL(true);
+}
+
+static List *slab_report_build(TupleDesc tupdesc)
+{
+  List *tuples = NIL, *servers = slab_stats_fetch();
+  size_bucket totals[SIZE_BUCKETS];
+  ListCell *lc;
+
+  size_totals(totals);
+  foreach(lc, servers)
+    {
+      slab_server *srv = (slab_server *) lfirst(lc);
+      int64 sizes[SLAB_MAX_CLASSES], writes[SLAB_MAX_CLASSES];
+      double used[SLAB_MAX_CLASSES], allocated[SLAB_MAX_CLASSES];
+      int n = slab_class_sizes(srv->growth_factor, srv->chunk_size, slab_chunk_max(srv), sizes);
+      int i, id;
+
+      /* the local writes laid over the classes this server uses */
+      memset(writes, 0, sizeof(writes));
+      memset(used, 0, sizeof(used));
+      memset(allocated, 0, sizeof(allocated));
+      for (id = 1; id <= n; id++)
+        if (srv->classes[id].chunk_size > 0)
+          sizes[id - 1] = srv->classes[id].chunk_size;
+      for (i = 0; i < SIZE_BUCKETS; i++)
+        {
+          double avg;
+          int64 nchunks;
+          int cls;
+
+          if (totals[i].count == 0)
+            continue;
+          avg = size_bucket_average(&totals[i]);
+          cls = slab_class_for(sizes, n, avg, &nchunks);
+          writes[cls] += totals[i].count;
+          used[cls] += totals[i].count * avg;
+          allocated[cls] += (double) totals[i].count * nchunks * sizes[cls];
+        }
+
+      for (id = 1; id <= SLAB_MAX_CLASSES; id++)
+        {
+          slab_class_stats *cls = &srv->classes[id];
+          int64 local = id <= n ? writes[id - 1] : 0;
+          Datum values[11];
+          bool nulls[11];
+
+          if (cls->chunk_size == 0 && local == 0)
+            continue;
+          memset(nulls, 0, sizeof(nulls));
+          values[0] = CStringGetTextDatum(srv->name);
+          values[1] = Int32GetDatum(id);
+          values[2] = Int32GetDatum((int32) (cls->chunk_size > 0 ? cls->chunk_size : sizes[id - 1]));
+          values[3] = Int64GetDatum(cls->total_pages);
+          values[4] = Int64GetDatum(cls->used_chunks);
+          values[5] = Int64GetDatum(cls->free_chunks);
+          values[6] = Int64GetDatum(cls->items);
+          values[7] = Int64GetDatum(cls->evicted);
+          values[8] = Int64GetDatum(cls->outofmemory);
+          values[9] = Int64GetDatum(local);
+          /* prefer the server's own accounting over the local estimate */
+          if (cls->mem_requested >= 0 && cls->used_chunks > 0)
+            values[10] = Float8GetDatum((double) cls->mem_requested / (cls->used_chunks * cls->chunk_size));
+          else if (local > 0)
+            values[10] = Float8GetDatum(used[id - 1] / allocated[id - 1]);
+          else
+            nulls[10] = true;
+          tuples = lappend(tuples, heap_form_tuple(tupdesc, values, nulls));
+        }
+    }
+  return tuples;
+}
+
+Datum memcache_slab_report(PG_FUNCTION_ARGS)
+{
+  return size_srf_next(fcinfo, slab_report_build);
+}
+
+Datum memcache_slab_advice(PG_FUNCTION_ARGS)
+{
+  Datum values[6];
+  bool nulls[6] = { false, false, false, false, false, false };
+  TupleDesc tupdesc;
+  List *servers;
+  slab_server defaults, *current;
+  size_bucket totals[SIZE_BUCKETS];
+  int64 sizes[SLAB_MAX_CLASSES], chunk_max, resident = 0;
+  double best = -1, best_factor = 0, current_efficiency;
+  int best_chunk_size = 0, n, f, c;
+  ListCell *lc;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "pgmemcache: return type must be a row type");
+
+  /* the current settings of the first server, memcached's defaults if none
+   * answered */
+  servers = slab_stats_fetch();
+  memset(&defaults, 0, sizeof(defaults));
+  defaults.growth_factor = 1.25;
+  defaults.chunk_size = 48;
+  defaults.item_size_max = 1024 * 1024;
+  defaults.slab_chunk_max = SLAB_PAGE_SIZE / 2;
+  current = servers != NIL ? (slab_server *) linitial(servers) : &defaults;
+  chunk_max = slab_chunk_max(current);
+
+  /* size the pages for the average number of items per server */
+  foreach(lc, servers)
+    {
+      slab_server *srv = (slab_server *) lfirst(lc);
+      int id;
+
+      for (id = 1; id <= SLAB_MAX_CLASSES; id++)
+        resident += srv->classes[id].items;
+    }
+  if (servers != NIL)
+    resident /= list_length(servers);
+
+  values[3] = Float8GetDatum(current->growth_factor);
+  values[4] = Int32GetDatum(current->chunk_size);
+  if (size_totals(totals) == 0)
+    {
+      nulls[0] = nulls[1] = nulls[2] = nulls[5] = true;
+      PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+    }
+
+  n = slab_class_sizes(current->growth_factor, current->chunk_size, chunk_max, sizes);
+  current_efficiency = slab_efficiency(totals, sizes, n, resident);
+
+  /* prefer larger growth factors and chunk sizes, they need fewer classes */
+  for (f = 20; f >= 1; f--)
+    for (c = 256; c >= 8; c -= 8)
+      {
+        double factor = (100 + 5 * f) / 100.0, efficiency;
+
+        n = slab_class_sizes(factor, c, chunk_max, sizes);
+        efficiency = slab_efficiency(totals, sizes, n, resident);
+        if (efficiency > best + 1e-9)
+          {
+            best = efficiency;
+            best_factor = factor;
+            best_chunk_size = c;
+          }
+      }
+
+  values[0] = Float8GetDatum(best_factor);
+  values[1] = Int32GetDatum(best_chunk_size);
+  values[2] = Float8GetDatum(best);
+  values[5] = Float8GetDatum(current_efficiency);
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/*
+ * Cache snapshots
+ *
+ * memcache_snapshot() enumerates the keys held by every server with the
+ * "lru_crawler metadump all" command (memcached 1.4.31 and newer) and writes
+ * the matching items to a file in the following sequential format, all
+ * integers are in network byte order so that snapshots can be restored on
+ * hosts of any architecture:
+ *
+ *   header:  "PGMCSNAP" uint32 version, uint32 reserved
+ *   record:  uint32 key_len, uint32 value_len, uint32 flags,
+ *            int64 expiration (unix time, 0 = never), key, value
+ *
+ * memcache_restore() maps a snapshot file into memory and replays it with
+ * buffered (quiet) set commands, keeping the remaining time-to-live of each
+ * item and skipping items that have expired since the snapshot was taken.
+ */
+
+#define SNAPSHOT_MAGIC "PGMCSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_FETCH_BATCH 100
+#define SNAPSHOT_IO_TIMEOUT 5000
+#define SNAPSHOT_POLL_INTERVAL 100
+#define SNAPSHOT_HEADER_SIZE 16
+#define SNAPSHOT_RECORD_SIZE 20
+
+typedef struct
+{
+  uint32_t key_len;
+  uint32_t value_len;
+  uint32_t flags;
+  int64_t expiration;
+} snapshot_record;
+
+typedef struct
+{
+  const char *prefix;
+  size_t prefix_len;
+  FILE *file;
+  const char *path;
+  int64 count;
+  /* keys and expiration times of the current server, in dump order */
+  int nkeys;
+  int maxkeys;
+  char **keys;
+  size_t *key_lens;
+  int64_t *expirations;
+} snapshot_state;
+
+static const char *migration_stats[] = { "new_hits", "old_hits", "misses" };
+
+static void migration_stats_cb(const char *key, size_t key_len,
+                               const char *value, size_t value_len,
+                               uint32_t flags, void *context)
+{
+  int64 *counts = (int64 *) context;
+  char buf[32];
+  int i;
+
+  for (i = 0; i < lengthof(migration_stats); i++)
+    if (key_len == strlen(MIGRATION_STATS_PREFIX) + strlen(migration_stats[i]) &&
+        strncmp(key + strlen(MIGRATION_STATS_PREFIX), migration_stats[i],
+                key_len - strlen(MIGRATION_STATS_PREFIX)) == 0)
+      {
+        snprintf(buf, sizeof(buf), "%.*s", (int) Min(value_len, sizeof(buf) - 1), value);
+        counts[i] = strtoll(buf, NULL, 10);
+      }
+}
+
+/* Returns the migration counters stored in the active cluster. */
+Datum memcache_migration_stats(PG_FUNCTION_ARGS)
+{
+  const char *keys[lengthof(migration_stats)];
+  size_t key_lens[lengthof(migration_stats)];
+  int64 counts[lengthof(migration_stats)] = { -1, -1, -1 };
+  Datum values[4];
+  bool nulls[4] = { false, false, false, false };
+  TupleDesc tupdesc;
+  memcached_return rc;
+  int i;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "pgmemcache: return type must be a row type");
+
+  for (i = 0; i < lengthof(migration_stats); i++)
+    {
+      keys[i] = psprintf(MIGRATION_STATS_PREFIX "%s", migration_stats[i]);
+      key_lens[i] = strlen(keys[i]);
+    }
+  rc = pgmemcache_mget_cluster(keys, key_lens, lengthof(migration_stats), migration_stats_cb, counts);
+  if (rc != MEMCACHED_SUCCESS)
+    elog(ERROR, "pgmemcache: memcached_mget: %s", memcached_strerror(globals.mc, rc));
+
+  for (i = 0; i < lengthof(migration_stats); i++)
+    {
+      values[i] = Int64GetDatum(counts[i]);
+      nulls[i] = counts[i] < 0;
+    }
+  /* the share of the keys found in either cluster that had already moved */
+  nulls[3] = nulls[0] || nulls[1] || counts[0] + counts[1] == 0;
+  values[3] = Float8GetDatum(nulls[3] ? 0.0 : (double) counts[0] / (counts[0] + counts[1]));
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/* Creates or zeroes the migration counters in the active cluster. */
+Datum memcache_migration_reset(PG_FUNCTION_ARGS)
+{
+  memcached_return rc = MEMCACHED_SUCCESS;
+  int i;
+
+  for (i = 0; i < lengthof(migration_stats) && rc == MEMCACHED_SUCCESS; i++)
+    {
+      char *key = psprintf(MIGRATION_STATS_PREFIX "%s", migration_stats[i]);
+
+      rc = memcache_backend.store(globals.mc, PG_MEMCACHE_CMD_SET, key, strlen(key), "0", 1, 0, 0, 0);
+      if (rc == MEMCACHED_BUFFERED)
+        {
+          globals.flush_needed = true;
+          rc = MEMCACHED_SUCCESS;
+        }
+    }
+  if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: memcached_set: %s", memcached_strerror(globals.mc, rc));
+
+  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+}
+
+static void snapshot_put_uint32(unsigned char *buf, uint32 value)
+{
+  buf[0] = (unsigned char) (value >> 24);
+  buf[1] = (unsigned char) (value >> 16);
+  buf[2] = (unsigned char) (value >> 8);
+  buf[3] = (unsigned char) value;
+}
+
+static uint32 snapshot_get_uint32(const unsigned char *buf)
+{
+  return ((uint32) buf[0] << 24) | ((uint32) buf[1] << 16) |
+         ((uint32) buf[2] << 8) | (uint32) buf[3];
+}
+
+static void snapshot_encode_header(unsigned char *buf)
+{
+  memcpy(buf, SNAPSHOT_MAGIC, 8);
+  snapshot_put_uint32(buf + 8, SNAPSHOT_VERSION);
+  snapshot_put_uint32(buf + 12, 0);
+}
+
+static void snapshot_encode_record(unsigned char *buf, const snapshot_record *rec)
+{
+  snapshot_put_uint32(buf, rec->key_len);
+  snapshot_put_uint32(buf + 4, rec->value_len);
+  snapshot_put_uint32(buf + 8, rec->flags);
+  snapshot_put_uint32(buf + 12, (uint32) ((uint64) rec->expiration >> 32));
+  snapshot_put_uint32(buf + 16, (uint32) rec->expiration);
+}
+
+static void snapshot_decode_record(snapshot_record *rec, const unsigned char *buf)
+{
+  rec->key_len = snapshot_get_uint32(buf);
+  rec->value_len = snapshot_get_uint32(buf + 4);
+  rec->flags = snapshot_get_uint32(buf + 8);
+  rec->expiration = (int64_t) (((uint64) snapshot_get_uint32(buf + 12) << 32) |
+                               snapshot_get_uint32(buf + 16));
+}
+
+/* Wait until an admin connection is ready for events, checking for
+ * interrupts while waiting.  Returns false with errno set if it isn't ready
+ * within SNAPSHOT_IO_TIMEOUT.  The callers close the connection on errors. */
+static bool pgmemcache_admin_wait(int fd, short events)
+{
+  int waited;
+
+  for (waited = 0; waited < SNAPSHOT_IO_TIMEOUT; waited += SNAPSHOT_POLL_INTERVAL)
+    {
+      struct pollfd pfd;
+      int rc;
+
+      CHECK_FOR_INTERRUPTS();
+      pfd.fd = fd;
+      pfd.events = events;
+      pfd.revents = 0;
+      rc = poll(&pfd, 1, SNAPSHOT_POLL_INTERVAL);
+      if (rc > 0)
+        return true;
+      if (rc < 0 && errno != EINTR)
+        return false;
+    }
+  errno = ETIMEDOUT;
+  return false;
+}
+
+/* Connect a non-blocking socket, returns -1 with errno set on failure. */
+static int pgmemcache_admin_connect_addr(int family, const struct sockaddr *addr, socklen_t addrlen)
+{
+  int fd, err = 0, save_errno;
+  socklen_t errlen = sizeof(err);
+  bool ready = false;
+
+  fd = socket(family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) == 0)
+    {
+      if (connect(fd, addr, addrlen) == 0)
+        return fd;
+      if (errno == EINPROGRESS)
+        {
+          PG_TRY();
+          {
+            ready = pgmemcache_admin_wait(fd, POLLOUT);
+          }
+          PG_CATCH();
+          {
+            close(fd);
+            PG_RE_THROW();
+          }
+          PG_END_TRY();
+        }
+      if (ready && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0)
+        {
+          if (err == 0)
+            return fd;
+          errno = err;
+        }
+    }
+  save_errno = errno;
+  close(fd);
+  errno = save_errno;
+  return -1;
+}
+
+/* Open a plain text protocol connection to a server for commands that the
+ * client libraries do not expose.  The socket is non-blocking, use
+ * pgmemcache_admin_wait() before reading or writing. */
+static int pgmemcache_admin_connect(const char *hostname, unsigned int port)
+{
+  int fd = -1;
+
+  if (hostname[0] == '/')
+    {
+      struct sockaddr_un sun;
+
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      strlcpy(sun.sun_path, hostname, sizeof(sun.sun_path));
+      fd = pgmemcache_admin_connect_addr(AF_UNIX, (struct sockaddr *) &sun, sizeof(sun));
+    }
+  else
+    {
+      struct addrinfo hints, *res, *ai;
+      char portstr[16];
+
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      snprintf(portstr, sizeof(portstr), "%u", port);
+      if (getaddrinfo(hostname, portstr, &hints, &res) != 0)
+        return -1;
+      PG_TRY();
+      {
+        for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next)
+          fd = pgmemcache_admin_connect_addr(ai->ai_family, ai->ai_addr, ai->ai_addrlen);
+      }
+      PG_CATCH();
+      {
+        freeaddrinfo(res);
+        PG_RE_THROW();
+      }
+      PG_END_TRY();
+      freeaddrinfo(res);
+    }
+  return fd;
+}
+
+/* Decode the URI encoded keys returned by metadump, in place. */
+static size_t snapshot_uri_decode(char *str, size_t len)
+{
+  size_t i, o = 0;
+
+  for (i = 0; i < len; i++)
+    {
+      if (str[i] == '%' && i + 2 < len && isxdigit((unsigned char) str[i + 1]) &&
+          isxdigit((unsigned char) str[i + 2]))
+        {
+          char hex[3] = { str[i + 1], str[i + 2], '\0' };
+          str[o++] = (char) strtol(hex, NULL, 16);
+          i += 2;
+        }
+      else
+        str[o++] = str[i];
+    }
+  return o;
+}
+
+/* Parse a single metadump line and remember the key if it matches. */
+static void snapshot_parse_metadump_line(snapshot_state *state, char *line)
+{
+  char *tok, *saveptr = NULL;
+  char *key = NULL;
+  size_t key_len = 0;
+  int64_t expiration = 0;
+
+  for (tok = strtok_r(line, " ", &saveptr); tok; tok = strtok_r(NULL, " ", &saveptr))
+    {
+      if (strncmp(tok, "key=", 4) == 0)
+        {
+          key = tok + 4;
+          key_len = snapshot_uri_decode(key, strlen(key));
+        }
+      else if (strncmp(tok, "exp=", 4) == 0)
+        {
+          expiration = strtoll(tok + 4, NULL, 10);
+          if (expiration < 0)
+            expiration = 0;
+        }
+    }
+
+  if (key == NULL || key_len == 0 || key_len > KEY_MAX_LENGTH)
+    return;
+  if (key_len < state->prefix_len || memcmp(key, state->prefix, state->prefix_len) != 0)
+    return;
+
+  if (state->nkeys == state->maxkeys)
+    {
+      state->maxkeys *= 2;
+      state->keys = repalloc(state->keys, sizeof(char *) * state->maxkeys);
+      state->key_lens = repalloc(state->key_lens, sizeof(size_t) * state->maxkeys);
+      state->expirations = repalloc(state->expirations, sizeof(int64_t) * state->maxkeys);
+    }
+  state->keys[state->nkeys] = pnstrdup(key, key_len);
+  state->key_lens[state->nkeys] = key_len;
+  state->expirations[state->nkeys] = expiration;
+  state->nkeys++;
+}
+
+/* Send "lru_crawler metadump all" to a connected server and read its
+ * output.  Returns true if the whole dump was read. */
+static bool snapshot_metadump_read(snapshot_state *state, int fd, const char *hostname,
+                                   unsigned int port)
+{
+  static const char cmd[] = "lru_crawler metadump all\r\n";
+  StringInfoData buf;
+  char chunk[8192];
+  bool done = false;
+
+  if (!pgmemcache_admin_wait(fd, POLLOUT) || write(fd, cmd, sizeof(cmd) - 1) != sizeof(cmd) - 1)
+    {
+      elog(WARNING, "pgmemcache: could not send metadump command to %s:%u: %m", hostname, port);
+      return false;
+    }
+
+  initStringInfo(&buf);
+  while (!done && pgmemcache_admin_wait(fd, POLLIN))
+    {
+      char *line, *eol;
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        continue;
+      if (n <= 0)
+        break;
+      appendBinaryStringInfo(&buf, chunk, n);
+
+      line = buf.data;
+      while ((eol = memchr(line, '\n', buf.len - (line - buf.data))) != NULL)
+        {
+          *eol = '\0';
+          if (eol > line && eol[-1] == '\r')
+            eol[-1] = '\0';
+          if (strcmp(line, "END") == 0)
+            {
+              done = true;
+              break;
+            }
+          else if (strncmp(line, "key=", 4) == 0)
+            snapshot_parse_metadump_line(state, line);
+          else if (line[0] != '\0')
+            {
+              elog(WARNING, "pgmemcache: metadump on %s:%u failed: %s", hostname, port, line);
+              pfree(buf.data);
+              return false;
+            }
+          line = eol + 1;
+        }
+      /* keep the partial line at the end of the buffer */
+      buf.len -= line - buf.data;
+      memmove(buf.data, line, buf.len);
+      buf.data[buf.len] = '\0';
+    }
+  pfree(buf.data);
+
+  if (!done)
+    elog(WARNING, "pgmemcache: metadump on %s:%u ended prematurely", hostname, port);
+  return done;
+}
+
+/* Read the keys of a server with metadump. */
+static bool snapshot_metadump(snapshot_state *state, const char *hostname, unsigned int port)
+{
+  bool done;
+  int fd;
+
+  fd = pgmemcache_admin_connect(hostname, port);
+  if (fd < 0)
+    {
+      elog(WARNING, "pgmemcache: could not connect to %s:%u for metadump: %m", hostname, port);
+      return false;
+    }
+  /* the socket isn't closed by the error cleanup */
+  PG_TRY();
+  {
+    done = snapshot_metadump_read(state, fd, hostname, port);
+  }
+  PG_CATCH();
+  {
+    close(fd);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  close(fd);
+  return done;
+}
+
+static void snapshot_write_value(const char *key, size_t key_len,
+                                 const char *value, size_t value_len,
+                                 uint32_t flags, void *context)
+{
+  snapshot_state *state = (snapshot_state *) context;
+  snapshot_record rec;
+  unsigned char buf[SNAPSHOT_RECORD_SIZE];
+  int i;
+
+  rec.key_len = key_len;
+  rec.value_len = value_len;
+  rec.flags = flags;
+  rec.expiration = 0;
+  /* the batch is small, find the expiration time of this key linearly */
+  for (i = 0; i < state->nkeys; i++)
+    if (state->key_lens[i] == key_len && memcmp(state->keys[i], key, key_len) == 0)
+      {
+        rec.expiration = state->expirations[i];
+        break;
+      }
+
+  snapshot_encode_record(buf, &rec);
+  if (fwrite(buf, sizeof(buf), 1, state->file) != 1 ||
+      fwrite(key, 1, key_len, state->file) != key_len ||
+      fwrite(value, 1, value_len, state->file) != value_len)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not write file \"%s\": %m", state->path)));
+  state->count++;
+}
+
+static memcached_return_t snapshot_server_function(const memcached_st *mc,
+                                                   memcached_server_instance_st server,
+                                                   void *context)
+{
+  snapshot_state *state = (snapshot_state *) context;
+  snapshot_state batch;
+  int i;
+
+  state->nkeys = 0;
+  if (!snapshot_metadump(state, memcached_server_name(server), memcached_server_port(server)))
+    return MEMCACHED_SUCCESS;
+
+  /* fetch the values in batches, reusing the state for the batch's keys */
+  batch = *state;
+  for (i = 0; i < state->nkeys; i += SNAPSHOT_FETCH_BATCH)
+    {
+      memcached_return rc;
+
+      batch.nkeys = Min(SNAPSHOT_FETCH_BATCH, state->nkeys - i);
+      batch.keys = state->keys + i;
+      batch.key_lens = state->key_lens + i;
+      batch.expirations = state->expirations + i;
+      /* a snapshot only reads the active cluster, even during a migration */
+      rc = pgmemcache_mget_cluster((const char **) batch.keys, batch.key_lens, batch.nkeys,
+                                   snapshot_write_value, &batch);
+      if (rc != MEMCACHED_SUCCESS)
+        elog(WARNING, "pgmemcache: memcache_snapshot: %s",
+                      memcached_strerror(globals.mc, rc));
+      CHECK_FOR_INTERRUPTS();
+    }
+  state->count = batch.count;
+
+  for (i = 0; i < state->nkeys; i++)
+    pfree(state->keys[i]);
+  return MEMCACHED_SUCCESS;
+}
+
+Datum memcache_snapshot(PG_FUNCTION_ARGS)
+{
+  snapshot_state state;
+  unsigned char header[SNAPSHOT_HEADER_SIZE];
+  memcached_server_fn callbacks[1];
+  memcached_return rc;
+  char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+  if (!superuser())
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+             errmsg("must be superuser to write memcache snapshots")));
+
+  memset(&state, 0, sizeof(state));
+  state.prefix = get_arg_cstring(PG_GETARG_TEXT_P(0), &state.prefix_len, false);
+  state.path = path;
+  state.maxkeys = 1024;
+  state.keys = palloc(sizeof(char *) * state.maxkeys);
+  state.key_lens = palloc(sizeof(size_t) * state.maxkeys);
+  state.expirations = palloc(sizeof(int64_t) * state.maxkeys);
+
+  state.file = AllocateFile(path, PG_BINARY_W);
+  if (state.file == NULL)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not create file \"%s\": %m", path)));
+
+  snapshot_encode_header(header);
+  if (fwrite(header, sizeof(header), 1, state.file) != 1)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not write file \"%s\": %m", path)));
+
+  callbacks[0] = (memcached_server_fn) snapshot_server_function;
+  rc = memcached_server_cursor(globals.mc, callbacks, (void *) &state, 1);
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_SOME_ERRORS)
+    elog(WARNING, "pgmemcache: memcache_snapshot: %s",
+                  memcached_strerror(globals.mc, rc));
+
+  if (FreeFile(state.file) != 0)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not close file \"%s\": %m", path)));
+
+  PG_RETURN_INT64(state.count);
+}
+
+Datum memcache_restore(PG_FUNCTION_ARGS)
+{
+  char *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  int parallel = 100;
+  int fd, in_flight = 0;
+  struct stat st;
+  const char *map, *ptr, *end;
+  time_t now = time(NULL);
+  int64 count = 0;
+  memcached_return rc = MEMCACHED_SUCCESS;
+  memcache_send_state send_state;
+
+  if (PG_NARGS() >= 2)
+    parallel = PG_GETARG_INT32(1);
+  if (parallel < 1)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: parallel must be at least 1")));
+
+  if (!superuser())
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+             errmsg("must be superuser to restore memcache snapshots")));
+
+  fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+  if (fd < 0)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not open file \"%s\": %m", path)));
+  if (fstat(fd, &st) != 0)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not stat file \"%s\": %m", path)));
+  if (st.st_size < SNAPSHOT_HEADER_SIZE)
+    ereport(ERROR,
+            (errcode(ERRCODE_DATA_CORRUPTED),
+             errmsg("pgmemcache: \"%s\" is not a memcache snapshot", path)));
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not map file \"%s\": %m", path)));
+  CloseTransientFile(fd);
+  madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+  end = map + st.st_size;
+  if (memcmp(map, SNAPSHOT_MAGIC, 8) != 0 ||
+      snapshot_get_uint32((const unsigned char *) map + 8) != SNAPSHOT_VERSION)
+    {
+      munmap((void *) map, st.st_size);
+      ereport(ERROR,
+              (errcode(ERRCODE_DATA_CORRUPTED),
+               errmsg("pgmemcache: \"%s\" is not a memcache snapshot", path)));
+    }
+
+  /* buffered requests are sent with the quiet binary protocol commands */
+  memcache_backend.set_buffering(globals.mc, MEMCACHE_SEND_BUFFER, &send_state);
+
+  PG_TRY();
+  {
+    for (ptr = map + SNAPSHOT_HEADER_SIZE; ptr < end; )
+      {
+        snapshot_record rec;
+        const char *key, *value;
+        time_t expiration = 0;
+
+        if (end - ptr < SNAPSHOT_RECORD_SIZE)
+          ereport(ERROR,
+                  (errcode(ERRCODE_DATA_CORRUPTED),
+                   errmsg("pgmemcache: truncated record in snapshot \"%s\"", path)));
+        snapshot_decode_record(&rec, (const unsigned char *) ptr);
+        key = ptr + SNAPSHOT_RECORD_SIZE;
+        value = key + rec.key_len;
+        if (rec.key_len > KEY_MAX_LENGTH || (size_t) (end - key) < (size_t) rec.key_len + rec.value_len)
+          ereport(ERROR,
+                  (errcode(ERRCODE_DATA_CORRUPTED),
+                   errmsg("pgmemcache: truncated record in snapshot \"%s\"", path)));
+        ptr = value + rec.value_len;
+
+        if (rec.expiration != 0)
+          {
+            if (rec.expiration <= now)
+              continue;
+            expiration = rec.expiration - now;
+            if (expiration > MEMCACHED_MAX_RELATIVE_EXPIRATION)
+              expiration = rec.expiration;
+          }
+
+        rc = memcache_backend.store(globals.mc, PG_MEMCACHE_CMD_SET, key, rec.key_len,
+                                    value, rec.value_len, expiration, rec.flags, 0);
+        if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED)
+          elog(WARNING, "pgmemcache: memcache_restore: %s",
+                        memcached_strerror(globals.mc, rc));
+        else
+          count++;
+
+        if (++in_flight >= parallel)
+          {
+            rc = pgmemcache_flush_buffers();
+            if (rc != MEMCACHED_SUCCESS)
+              elog(WARNING, "pgmemcache: memcache_restore: %s",
+                            memcached_strerror(globals.mc, rc));
+            in_flight = 0;
+            CHECK_FOR_INTERRUPTS();
+          }
+      }
+    if (in_flight > 0)
+      {
+        rc = pgmemcache_flush_buffers();
+        if (rc != MEMCACHED_SUCCESS)
+          elog(WARNING, "pgmemcache: memcache_restore: %s",
+                        memcached_strerror(globals.mc, rc));
+      }
+  }
+  PG_CATCH();
+  {
+    memcache_backend.restore_buffering(globals.mc, &send_state);
+    munmap((void *) map, st.st_size);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  memcache_backend.restore_buffering(globals.mc, &send_state);
+  munmap((void *) map, st.st_size);
+
+  PG_RETURN_INT64(count);
+}
+
+/*
+ * Leases and stale items, only available with the meta protocol engine.
+ */
+
+Datum memcache_get_lease(PG_FUNCTION_ARGS)
+{
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  time_t lease = interval_to_time_t(PG_GETARG_INTERVAL_P(1));
+  TupleDesc tupdesc;
+  Datum values[3];
+  bool nulls[3] = { false, false, false };
+  memcached_return rc;
+  bool stale, win;
+  text *value;
+
+  if (memcache_backend.get_lease == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("pgmemcache: memcache_get_lease() requires pgmemcache built with USE_META=1")));
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("function returning record called in context that cannot accept type record")));
+  if (lease <= 0)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pgmemcache: lease must be at least one second")));
+
+  value = memcache_backend.get_lease(globals.mc, key, key_length, lease, &stale, &win, &rc);
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+    elog(ERROR, "pgmemcache: meta_get_lease: %s",
+                memcached_strerror(globals.mc, rc));
+
+  if (value == NULL)
+    nulls[0] = true;
+  else
+    values[0] = PointerGetDatum(value);
+  values[1] = BoolGetDatum(stale);
+  values[2] = BoolGetDatum(win);
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+Datum memcache_invalidate(PG_FUNCTION_ARGS)
+{
+  time_t stale = 0;
+  memcached_return rc;
+  size_t key_length;
+  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+
+  if (memcache_backend.invalidate == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("pgmemcache: memcache_invalidate() requires pgmemcache built with USE_META=1")));
+  if (PG_NARGS() >= 2)
+    stale = interval_to_time_t(PG_GETARG_INTERVAL_P(1));
+
+  rc = memcache_backend.invalidate(globals.mc, key, key_length, stale);
+  if (rc == MEMCACHED_BUFFERED)
+    {
+      globals.flush_needed = true;
+      PG_RETURN_NULL();
+    }
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+    elog(WARNING, "pgmemcache: meta_invalidate: %s",
+                  memcached_strerror(globals.mc, rc));
+
+  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+}
+
+/*
+ * Query result cache.
+ *
+ * memcache_cached_query() stores the result of a query as a header followed
+ * by the result rows as MAXALIGNed minimal tuples which are returned
+ * directly from the fetched buffer.  Results larger than a single memcache
+ * item are split into chunks; the first chunk holding the header is stored
+ * under the query's key and written last, the others use keys containing a
+ * random stamp so that chunks of different writes are never mixed.
+ */
+
+#define QUERY_CACHE_MAGIC "PGMCQRY1"
+#define QUERY_CACHE_CHUNK_SIZE (512 * 1024)
+#define QUERY_CACHE_MAX_SIZE (256 * 1024 * 1024)
+#define QUERY_CACHE_KEY_LENGTH 64
+
+typedef struct
+{
+  char magic[8];
+  uint64 stamp;        /* random tag of the chunk keys of this write */
+  uint64 fingerprint;  /* of the result tuple descriptor */
+  uint64 ntuples;
+  uint64 length;       /* total length including this header */
+  uint32 nchunks;
+  uint32 natts;
+} query_cache_header;
+
+#define QUERY_CACHE_HEADER_SIZE MAXALIGN(sizeof(query_cache_header))
+
+typedef struct
+{
+  char *data;
+  char *pos;
+  char *end;
+  uint64 remaining;
+} query_cache_state;
+
+typedef struct
+{
+  char *data;
+  uint64 length;
+  uint32 nchunks;
+  bool *received;
+  uint32 count;
+} query_cache_fetch_state;
+
+static uint64 fnv1a_64(uint64 hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+
+  while (len-- > 0)
+    hash = (hash ^ *p++) * UINT64CONST(0x100000001b3);
+  return hash;
+}
+
+#define FNV1A_64_INIT UINT64CONST(0xcbf29ce484222325)
+
+static uint64 query_cache_fingerprint(TupleDesc tupdesc)
+{
+  uint64 hash = fnv1a_64(FNV1A_64_INIT, &tupdesc->natts, sizeof(tupdesc->natts));
+  int i;
+
+  for (i = 0; i < tupdesc->natts; i++)
+    {
+      Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+      hash = fnv1a_64(hash, &attr->atttypid, sizeof(attr->atttypid));
+      hash = fnv1a_64(hash, &attr->atttypmod, sizeof(attr->atttypmod));
+    }
+  return hash;
+}
+
+/* The key covers everything the result depends on besides the data: the
+ * query and its parameters, the database and role running it, search_path
+ * and the PostgreSQL major version which defines the tuple format. */
+static int query_cache_key(char *key, const char *sql, int nargs, Oid *argtypes,
+                           Datum *args, const char *argnulls, uint64 fingerprint)
+{
+  uint64 hash = FNV1A_64_INIT;
+  int version = PG_VERSION_NUM / 100;
+  Oid userid = GetUserId();
+  int i;
+
+  hash = fnv1a_64(hash, &version, sizeof(version));
+  hash = fnv1a_64(hash, &MyDatabaseId, sizeof(MyDatabaseId));
+  hash = fnv1a_64(hash, &userid, sizeof(userid));
+  hash = fnv1a_64(hash, namespace_search_path, strlen(namespace_search_path) + 1);
+  hash = fnv1a_64(hash, sql, strlen(sql) + 1);
+  for (i = 0; i < nargs; i++)
+    {
+      hash = fnv1a_64(hash, &argtypes[i], sizeof(argtypes[i]));
+      if (argnulls[i] == 'n')
+        hash = fnv1a_64(hash, "n", 1);
+      else
+        {
+          Oid typoutput;
+          bool typisvarlena;
+          char *str;
+
+          getTypeOutputInfo(argtypes[i], &typoutput, &typisvarlena);
+          str = OidOutputFunctionCall(typoutput, args[i]);
+          hash = fnv1a_64(hash, str, strlen(str) + 1);
+          pfree(str);
+        }
+    }
+  return snprintf(key, QUERY_CACHE_KEY_LENGTH, "pgmemcache:query:%016" PRIx64 "%016" PRIx64,
+                  hash, fingerprint);
+}
+
+static int query_cache_chunk_key(char *key, const char *base_key, uint64 stamp, uint32 chunk)
+{
+  return snprintf(key, QUERY_CACHE_KEY_LENGTH * 2, "%s:%016" PRIx64 ":%u",
+                  base_key, stamp, chunk);
+}
+
+static void query_cache_chunk_cb(const char *key, size_t key_len,
+                                 const char *value, size_t value_len,
+                                 uint32_t flags, void *context)
+{
+  query_cache_fetch_state *state = context;
+  uint64 offset;
+  uint32 chunk = 0, mult = 1;
+
+  /* the chunk number follows the last colon of the key */
+  while (key_len > 0 && isdigit((unsigned char) key[key_len - 1]))
+    {
+      chunk += (key[--key_len] - '0') * mult;
+      mult *= 10;
+    }
+  if (chunk == 0 || chunk >= state->nchunks || state->received[chunk])
+    return;
+  offset = (uint64) chunk * QUERY_CACHE_CHUNK_SIZE;
+  if (value_len != Min(state->length - offset, QUERY_CACHE_CHUNK_SIZE))
+    return;
+  memcpy(state->data + offset, value, value_len);
+  state->received[chunk] = true;
+  state->count++;
+}
+
+/* Look up a cached result, returns NULL if it's missing or incomplete. */
+static query_cache_state *query_cache_fetch(const char *key, int key_length, uint64 fingerprint,
+                                            int natts)
+{
+  query_cache_header hdr;
+  query_cache_state *state = NULL;
+  char *data = NULL;
+  size_t value_length;
+  memcached_return rc;
+  text *fetched = pgmemcache_fetch(key, key_length, &rc);
+  const char *value;
+
+  if (fetched == NULL && rc != MEMCACHED_NOTFOUND)
+    {
+      elog(WARNING, "pgmemcache: memcached_get: %s",
+                    memcached_strerror(globals.mc, rc));
+      return NULL;
+    }
+  /* the header is read like memcache_get(), the chunks like the batched
+   * reads */
+  if (migration_active())
+    {
+      if (fetched == NULL)
+        fetched = migration_fetch(key, key_length);
+      else
+        migration_count("new_hits", 1);
+    }
+  if (fetched == NULL)
+    return NULL;
+
+  value = VARDATA(fetched);
+  value_length = VARSIZE(fetched) - VARHDRSZ;
+  if (value_length >= QUERY_CACHE_HEADER_SIZE)
+    {
+      memcpy(&hdr, value, sizeof(hdr));
+      if (memcmp(hdr.magic, QUERY_CACHE_MAGIC, sizeof(hdr.magic)) == 0 &&
+          hdr.fingerprint == fingerprint && hdr.natts == (uint32) natts &&
+          hdr.length >= QUERY_CACHE_HEADER_SIZE && hdr.length <= QUERY_CACHE_MAX_SIZE &&
+          hdr.nchunks == (hdr.length + QUERY_CACHE_CHUNK_SIZE - 1) / QUERY_CACHE_CHUNK_SIZE &&
+          value_length == Min(hdr.length, QUERY_CACHE_CHUNK_SIZE))
+        {
+          data = palloc(hdr.length);
+          memcpy(data, value, value_length);
+        }
+    }
+  pfree(fetched);
+  if (data == NULL)
+    return NULL;
+
+  if (hdr.nchunks > 1)
+    {
+      query_cache_fetch_state fetch;
+      uint32 nkeys = hdr.nchunks - 1, i;
+      const char **keys = palloc(sizeof(char *) * nkeys);
+      size_t *key_lens = palloc(sizeof(size_t) * nkeys);
+
+      for (i = 0; i < nkeys; i++)
+        {
+          char *chunk_key = palloc(QUERY_CACHE_KEY_LENGTH * 2);
+
+          key_lens[i] = query_cache_chunk_key(chunk_key, key, hdr.stamp, i + 1);
+          keys[i] = chunk_key;
+        }
+      fetch.data = data;
+      fetch.length = hdr.length;
+      fetch.nchunks = hdr.nchunks;
+      fetch.received = palloc0(sizeof(bool) * hdr.nchunks);
+      fetch.count = 0;
+      rc = pgmemcache_mget(keys, key_lens, nkeys, query_cache_chunk_cb, &fetch);
+      if (rc != MEMCACHED_SUCCESS)
+        elog(WARNING, "pgmemcache: memcached_mget: %s",
+                      memcached_strerror(globals.mc, rc));
+      for (i = 0; i < nkeys; i++)
+        pfree((char *) keys[i]);
+      pfree(keys);
+      pfree(key_lens);
+      pfree(fetch.received);
+      if (fetch.count != nkeys)
+        {
+          pfree(data);
+          return NULL;
+        }
+    }
+
+  state = palloc(sizeof(query_cache_state));
+  state->data = data;
+  state->pos = data + QUERY_CACHE_HEADER_SIZE;
+  state->end = data + hdr.length;
+  state->remaining = hdr.ntuples;
+  return state;
+}
+
+/* Run the query and serialize its result in the current memory context. */
+static query_cache_state *query_cache_run(const char *sql, int nargs, Oid *argtypes,
+                                          Datum *args, const char *argnulls,
+                                          TupleDesc tupdesc, uint64 fingerprint)
+{
+  MemoryContext cxt = CurrentMemoryContext;
+  query_cache_header hdr;
+  query_cache_state *state;
+  StringInfoData buf;
+  TupleDesc spi_tupdesc;
+  Datum *values;
+  bool *nulls;
+  uint64 row;
+  int ret, i;
+
+  initStringInfo(&buf);
+  enlargeStringInfo(&buf, QUERY_CACHE_HEADER_SIZE);
+  memset(buf.data, 0, QUERY_CACHE_HEADER_SIZE);
+  buf.len = QUERY_CACHE_HEADER_SIZE;
+
+  if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+    elog(ERROR, "pgmemcache: SPI_connect: %s", SPI_result_code_string(ret));
+  ret = SPI_execute_with_args(sql, nargs, argtypes, args, argnulls, true, 0);
+  if (ret != SPI_OK_SELECT)
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("pgmemcache: memcache_cached_query() can only cache SELECT queries")));
+
+  spi_tupdesc = SPI_tuptable->tupdesc;
+  if (spi_tupdesc->natts != tupdesc->natts)
+    ereport(ERROR,
+            (errcode(ERRCODE_DATATYPE_MISMATCH),
+             errmsg("pgmemcache: query returns %d columns but the column definition list has %d",
+                    spi_tupdesc->natts, tupdesc->natts)));
+  for (i = 0; i < tupdesc->natts; i++)
+    if (TupleDescAttr(spi_tupdesc, i)->atttypid != TupleDescAttr(tupdesc, i)->atttypid)
+      ereport(ERROR,
+              (errcode(ERRCODE_DATATYPE_MISMATCH),
+               errmsg("pgmemcache: query column %d type %s does not match the column definition list type %s",
+                      i + 1, format_type_with_typemod(TupleDescAttr(spi_tupdesc, i)->atttypid,
+                                                      TupleDescAttr(spi_tupdesc, i)->atttypmod),
+                      format_type_with_typemod(TupleDescAttr(tupdesc, i)->atttypid,
+                                               TupleDescAttr(tupdesc, i)->atttypmod))));
+
+  values = palloc(sizeof(Datum) * tupdesc->natts);
+  nulls = palloc(sizeof(bool) * tupdesc->natts);
+  for (row = 0; row < SPI_processed; row++)
+    {
+      MinimalTuple mtup;
+
+      heap_deform_tuple(SPI_tuptable->vals[row], spi_tupdesc, values, nulls);
+      /* toast pointers must not end up in the cache */
+      for (i = 0; i < tupdesc->natts; i++)
+        if (!nulls[i] && TupleDescAttr(tupdesc, i)->attlen == -1)
+          values[i] = PointerGetDatum(PG_DETOAST_DATUM(values[i]));
+      mtup = heap_form_minimal_tuple(tupdesc, values, nulls);
+      if ((uint64) buf.len + MAXALIGN(mtup->t_len) > QUERY_CACHE_MAX_SIZE)
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("pgmemcache: query result is too large to be cached")));
+      /* buf was allocated in the caller's context and stays there */
+      appendBinaryStringInfo(&buf, (char *) mtup, mtup->t_len);
+      while (buf.len != MAXALIGN(buf.len))
+        appendStringInfoChar(&buf, '\0');
+      pfree(mtup);
+    }
+
+  memcpy(hdr.magic, QUERY_CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.stamp = ((uint64) random() << 32) ^ (uint64) random() ^ (uint64) GetCurrentTimestamp();
+  hdr.fingerprint = fingerprint;
+  hdr.ntuples = SPI_processed;
+  hdr.length = buf.len;
+  hdr.nchunks = (hdr.length + QUERY_CACHE_CHUNK_SIZE - 1) / QUERY_CACHE_CHUNK_SIZE;
+  hdr.natts = tupdesc->natts;
+  memcpy(buf.data, &hdr, sizeof(hdr));
+
+  SPI_finish();
+
+  state = MemoryContextAlloc(cxt, sizeof(query_cache_state));
+  state->data = buf.data;
+  state->pos = buf.data + QUERY_CACHE_HEADER_SIZE;
+  state->end = buf.data + buf.len;
+  state->remaining = hdr.ntuples;
+  return state;
+}
+
+/* Checks that a fetched tuple matches the column definition list and that
+ * deforming it stays within the tuple.  Anything that can write to memcached
+ * can store a result, so the lengths in it aren't trusted. */
+static bool query_cache_tuple_valid(MinimalTuple mtup, uint64 size, TupleDesc tupdesc)
+{
+  bool hasnulls;
+  uint32 hoff, len, off = 0;
+  char *tp;
+  int i;
+
+  if (size < SizeofMinimalTupleHeader || mtup->t_len < SizeofMinimalTupleHeader ||
+      mtup->t_len > size || HeapTupleHeaderGetNatts(mtup) != tupdesc->natts)
+    return false;
+  /* the header must be laid out as heap_form_minimal_tuple() does */
+  hasnulls = (mtup->t_infomask & HEAP_HASNULL) != 0;
+  hoff = SizeofMinimalTupleHeader;
+  if (hasnulls)
+    hoff += BITMAPLEN(tupdesc->natts);
+  hoff = MAXALIGN(hoff);
+  if (mtup->t_hoff != hoff + MINIMAL_TUPLE_OFFSET || hoff > mtup->t_len)
+    return false;
+  tp = (char *) mtup + hoff;
+  len = mtup->t_len - hoff;
+
+  for (i = 0; i < tupdesc->natts; i++)
+    {
+      Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+      uint32 attlen;
+
+      if (hasnulls && att_isnull(i, mtup->t_bits))
+        continue;
+      if (attr->attlen == -1)
+        {
+          /* the alignment depends on the first byte of the value */
+          if (off >= len)
+            return false;
+          off = att_align_pointer(off, attr->attalign, -1, tp + off);
+          if (off >= len)
+            return false;
+          /* values were detoasted before they were cached */
+          if (VARATT_IS_1B_E(tp + off))
+            return false;
+          if (VARATT_IS_1B(tp + off))
+            attlen = VARSIZE_1B(tp + off);
+          else
+            {
+              if (len - off < VARHDRSZ || VARATT_IS_4B_C(tp + off))
+                return false;
+              attlen = VARSIZE_4B(tp + off);
+              if (attlen < VARHDRSZ)
+                return false;
+            }
+        }
+      else if (attr->attlen == -2)
+        {
+          if (off >= len)
+            return false;
+          attlen = strnlen(tp + off, len - off) + 1;
+        }
+      else
+        {
+          off = att_align_nominal(off, attr->attalign);
+          attlen = attr->attlen;
+        }
+      if (off > len || attlen > len - off)
+        return false;
+      off += attlen;
+    }
+  return true;
+}
+
+static void query_cache_store(const char *key, int key_length, query_cache_state *state,
+                              time_t ttl)
+{
+  query_cache_header hdr;
+  char chunk_key[QUERY_CACHE_KEY_LENGTH * 2];
+  memcached_return rc;
+  uint32 i;
+
+  memcpy(&hdr, state->data, sizeof(hdr));
+
+  /* the first chunk makes the result visible so it's written last */
+  for (i = hdr.nchunks; i-- > 0; )
+    {
+      uint64 offset = (uint64) i * QUERY_CACHE_CHUNK_SIZE;
+      size_t len = Min(hdr.length - offset, QUERY_CACHE_CHUNK_SIZE);
+
+      if (i == 0)
+        rc = memcache_backend.store(globals.mc, PG_MEMCACHE_CMD_SET, key, key_length,
+                                    state->data, len, ttl, 0, 0);
+      else
+        rc = memcache_backend.store(globals.mc, PG_MEMCACHE_CMD_SET, chunk_key,
+                                    query_cache_chunk_key(chunk_key, key, hdr.stamp, i),
+                                    state->data + offset, len, ttl, 0, 0);
+      if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED)
+        {
+          elog(WARNING, "pgmemcache: memcached_set: %s",
+                        memcached_strerror(globals.mc, rc));
+          return;
+        }
+      if (rc == MEMCACHED_BUFFERED)
+        globals.flush_needed = true;
+    }
+}
+
+Datum memcache_cached_query(PG_FUNCTION_ARGS)
 {
-  uint64_t val;
-  int64_t offset = 1;
-  memcached_return rc;
-  size_t key_length;
-  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  FuncCallContext *funcctx;
+  query_cache_state *state;
 
-  if (PG_NARGS() >= 2)
-    offset = PG_GETARG_INT64(1);
+  if (SRF_IS_FIRSTCALL())
+    {
+      MemoryContext oldcxt;
+      TupleDesc tupdesc;
+      char *sql;
+      time_t ttl;
+      char key[QUERY_CACHE_KEY_LENGTH];
+      int key_length, nargs, i;
+      uint64 fingerprint;
+      Oid *argtypes;
+      Datum *args;
+      char *argnulls;
 
-  if (offset < 0)
+      if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pgmemcache: query and ttl must not be NULL")));
+      if (PG_NARGS() > 2 && get_fn_expr_variadic(fcinfo->flinfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("pgmemcache: memcache_cached_query() parameters can't be passed as a VARIADIC array")));
+
+      funcctx = SRF_FIRSTCALL_INIT();
+      oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+      if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function returning record called in context that cannot accept type record")));
+      funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+      sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+      ttl = interval_to_time_t(PG_GETARG_INTERVAL_P(1));
+      nargs = PG_NARGS() - 2;
+      argtypes = palloc(sizeof(Oid) * (nargs + 1));
+      args = palloc(sizeof(Datum) * (nargs + 1));
+      argnulls = palloc(nargs + 1);
+      for (i = 0; i < nargs; i++)
+        {
+          argtypes[i] = get_fn_expr_argtype(fcinfo->flinfo, i + 2);
+          argnulls[i] = PG_ARGISNULL(i + 2) ? 'n' : ' ';
+          args[i] = PG_ARGISNULL(i + 2) ? (Datum) 0 : PG_GETARG_DATUM(i + 2);
+          /* untyped literals are passed as cstrings */
+          if (argtypes[i] == UNKNOWNOID)
+            {
+              argtypes[i] = TEXTOID;
+              if (!PG_ARGISNULL(i + 2))
+                args[i] = CStringGetTextDatum(DatumGetCString(args[i]));
+            }
+        }
+
+      fingerprint = query_cache_fingerprint(tupdesc);
+      key_length = query_cache_key(key, sql, nargs, argtypes, args, argnulls, fingerprint);
+      state = query_cache_fetch(key, key_length, fingerprint, tupdesc->natts);
+      if (state == NULL)
+        {
+          state = query_cache_run(sql, nargs, argtypes, args, argnulls, tupdesc, fingerprint);
+          query_cache_store(key, key_length, state, ttl);
+        }
+      funcctx->user_fctx = state;
+
+      MemoryContextSwitchTo(oldcxt);
+    }
+
+  funcctx = SRF_PERCALL_SETUP();
+  state = funcctx->user_fctx;
+
+  if (state->remaining > 0)
     {
-      /* memcached uses uint64_t but postgresql only has signed types, but
-       * since we have both increment and decrement operations let's just
-       * invert the operation if offset is negative.
-       */
-      offset = abs(offset);
-      increment = !increment;
+      MinimalTuple mtup = (MinimalTuple) state->pos;
+      HeapTuple tuple;
+
+      if (state->pos >= state->end ||
+          !query_cache_tuple_valid(mtup, state->end - state->pos, funcctx->tuple_desc))
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("pgmemcache: cached query result is corrupted")));
+      state->pos += MAXALIGN(mtup->t_len);
+      state->remaining--;
+
+      tuple = heap_tuple_from_minimal_tuple(mtup);
+      HeapTupleHeaderSetDatumLength(tuple->t_data, tuple->t_len);
+      HeapTupleHeaderSetTypeId(tuple->t_data, funcctx->tuple_desc->tdtypeid);
+      HeapTupleHeaderSetTypMod(tuple->t_data, funcctx->tuple_desc->tdtypmod);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90400)
+      SRF_RETURN_NEXT(funcctx, HeapTupleHeaderGetDatum(tuple->t_data));
+#else
+      SRF_RETURN_NEXT(funcctx, PointerGetDatum(tuple->t_data));
+#endif
+
     }
 
-  if (increment)
-    rc = memcached_increment_with_initial(globals.mc, key, key_length, offset, 0, MEMCACHED_EXPIRATION_NOT_ADD, &val);
-  else
-    rc = memcached_decrement_with_initial(globals.mc, key, key_length, offset, 0, MEMCACHED_EXPIRATION_NOT_ADD, &val);
+  SRF_RETURN_DONE(funcctx);
+}
 
-  if (rc == MEMCACHED_BUFFERED)
+/*
+ * HyperLogLog counters.  A sketch is stored as a header followed by
+ * HLL_REGISTERS one byte registers.  memcache_hll_add() only updates a
+ * per-transaction copy of the registers of each key, at commit they are
+ * merged into the stored sketches with gets and cas, or add for new keys,
+ * and the merge is retried if another backend wrote the sketch in between.
+ * memcache_hll_count() fetches the sketches with a single multi-get and
+ * estimates the cardinality of their union.  The registers a
+ * subtransaction changes are saved when it first touches a key so they can
+ * be restored if it aborts.
+ */
+
+#define HLL_MAGIC "PGMCHLL1"
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+#define HLL_CAS_RETRIES 10
+#define HLL_HASH_BATCH 256
+
+typedef struct
+{
+  char magic[8];
+  uint32 precision;
+  uint32 reserved;
+} hll_header;
+
+#define HLL_SKETCH_SIZE (sizeof(hll_header) + HLL_REGISTERS)
+
+typedef struct
+{
+  /* the hash key is the cluster and the zero padded memcache key */
+  memcache_cluster *cluster;
+  char key[KEY_MAX_LENGTH + 1];
+  size_t key_length;
+  uint8 registers[HLL_REGISTERS];
+} hll_entry;
+
+typedef struct
+{
+  hll_entry *entry;
+  uint8 *saved;     /* the registers before the subtransaction changed them */
+  int nest_level;
+} hll_undo_record;
+
+static void pgmemcache_discard_hll(void)
+{
+  /* both are allocated in TopTransactionContext */
+  globals.hll_sketches = NULL;
+  globals.hll_undo = NIL;
+}
+
+/* splitmix64's finalizer, spreads integer elements and the FNV-1a hashes of
+ * other elements over all 64 bits */
+static inline uint64 hll_mix(uint64 x)
+{
+  x += UINT64CONST(0x9e3779b97f4a7c15);
+  x = (x ^ (x >> 30)) * UINT64CONST(0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * UINT64CONST(0x94d049bb133111eb);
+  return x ^ (x >> 31);
+}
+
+/* The first HLL_PRECISION bits select the register, the register keeps the
+ * highest position of the first set bit in the rest.  Returns true if the
+ * register changed. */
+static inline bool hll_add_hash(uint8 *registers, uint64 hash)
+{
+  int idx = (int) (hash >> (64 - HLL_PRECISION));
+  uint64 rest = (hash << HLL_PRECISION) | (UINT64CONST(1) << (HLL_PRECISION - 1));
+  uint8 rank = 1;
+
+  while ((rest & (UINT64CONST(1) << 63)) == 0)
     {
-      globals.flush_needed = true;
-      PG_RETURN_NULL();
+      rank++;
+      rest <<= 1;
     }
-  if (rc != MEMCACHED_SUCCESS)
+  if (registers[idx] >= rank)
+    return false;
+  registers[idx] = rank;
+  return true;
+}
+
+/* Hashes the elements of an array into the registers in batches, the
+ * hashes of a batch are computed in a separate tight loop the compiler can
+ * vectorize.  Integers are hashed by value so that int2, int4 and int8
+ * elements are counted as the same values, other types by their binary
+ * representation.  Returns true if any register changed. */
+static bool hll_add_array(uint8 *registers, ArrayType *array)
+{
+  Oid element_type = ARR_ELEMTYPE(array);
+  int nelems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+  uint64 hashes[HLL_HASH_BATCH];
+  bool changed = false;
+  int16 typlen;
+  bool typbyval;
+  char typalign;
+  Datum *elems;
+  bool *nulls;
+  int i, j, n;
+
+  if (nelems == 0)
+    return false;
+
+  /* int4 and int8 arrays without NULLs are read in place */
+  if (!ARR_HASNULL(array) && (element_type == INT4OID || element_type == INT8OID))
     {
-      elog(WARNING, "pgmemcache: memcached_%s_with_initial: %s",
-                    increment ? "increment" : "decrement",
-                    memcached_strerror(globals.mc, rc));
+      for (i = 0; i < nelems; i += n)
+        {
+          n = Min(nelems - i, HLL_HASH_BATCH);
+          if (element_type == INT4OID)
+            {
+              const int32 *values = (const int32 *) ARR_DATA_PTR(array) + i;
+
+              for (j = 0; j < n; j++)
+                hashes[j] = hll_mix((uint64) (int64) values[j]);
+            }
+          else
+            {
+              const int64 *values = (const int64 *) ARR_DATA_PTR(array) + i;
+
+              for (j = 0; j < n; j++)
+                hashes[j] = hll_mix((uint64) values[j]);
+            }
+          for (j = 0; j < n; j++)
+            changed |= hll_add_hash(registers, hashes[j]);
+        }
+      return changed;
     }
-  else if (val > 0x7FFFFFFFFFFFFFFFLL && val != UINT64_MAX)
+
+  get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+  deconstruct_array(array, element_type, typlen, typbyval, typalign, &elems, &nulls, &nelems);
+  for (i = 0; i < nelems; i++)
     {
-      /* Cannot represent uint64_t values above 2^63-1 with BIGINT.  Do
-         not signal error for UINT64_MAX which just means there was no
-         reply.  */
-      elog(ERROR, "pgmemcache: memcached_%s_with_initial: %s",
-                  increment ? "increment" : "decrement",
-                  "value received from memcache is out of BIGINT range");
+      Datum d = elems[i];
+      uint64 hash;
+
+      if (nulls[i])
+        continue;
+      if (element_type == INT2OID)
+        hash = hll_mix((uint64) (int64) DatumGetInt16(d));
+      else if (element_type == INT4OID)
+        hash = hll_mix((uint64) (int64) DatumGetInt32(d));
+      else if (element_type == INT8OID)
+        hash = hll_mix((uint64) DatumGetInt64(d));
+      else if (typlen == -1)
+        {
+          struct varlena *v = pg_detoast_datum_packed((struct varlena *) DatumGetPointer(d));
+
+          hash = hll_mix(fnv1a_64(FNV1A_64_INIT, VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v)));
+        }
+      else if (typlen == -2)
+        hash = hll_mix(fnv1a_64(FNV1A_64_INIT, DatumGetCString(d), strlen(DatumGetCString(d))));
+      else if (typbyval)
+        hash = hll_mix((uint64) d);
+      else
+        hash = hll_mix(fnv1a_64(FNV1A_64_INIT, DatumGetPointer(d), typlen));
+      changed |= hll_add_hash(registers, hash);
     }
-  PG_RETURN_INT64(val);
+  pfree(elems);
+  pfree(nulls);
+  return changed;
 }
 
-Datum memcache_decr(PG_FUNCTION_ARGS)
+/* Merges a stored sketch into the registers.  Returns false if the value
+ * isn't a sketch, otherwise sets *local_newer if any of the given
+ * registers is higher than the stored one. */
+static bool hll_merge(uint8 *registers, const char *value, size_t value_length, bool *local_newer)
 {
-  return memcache_delta_op(false, fcinfo);
+  const uint8 *stored = (const uint8 *) value + sizeof(hll_header);
+  hll_header header;
+  bool newer = false;
+  int i;
+
+  if (value_length != HLL_SKETCH_SIZE)
+    return false;
+  memcpy(&header, value, sizeof(header));
+  if (memcmp(header.magic, HLL_MAGIC, sizeof(header.magic)) != 0 ||
+      header.precision != HLL_PRECISION)
+    return false;
+  for (i = 0; i < HLL_REGISTERS; i++)
+    {
+      if (registers[i] > stored[i])
+        newer = true;
+      else
+        registers[i] = stored[i];
+    }
+  if (local_newer)
+    *local_newer = newer;
+  return true;
 }
 
-Datum memcache_incr(PG_FUNCTION_ARGS)
+static double hll_estimate(const uint8 *registers)
 {
-  return memcache_delta_op(true, fcinfo);
+  double m = HLL_REGISTERS, alpha = 0.7213 / (1 + 1.079 / m), sum = 0, estimate;
+  int zeros = 0, i;
+
+  for (i = 0; i < HLL_REGISTERS; i++)
+    {
+      sum += ldexp(1.0, -registers[i]);
+      if (registers[i] == 0)
+        zeros++;
+    }
+  estimate = alpha * m * m / sum;
+  /* linear counting is more accurate for small cardinalities, the 64 bit
+   * hash needs no correction for large ones */
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log(m / zeros);
+  return estimate;
 }
 
-Datum memcache_delete(PG_FUNCTION_ARGS)
+/* Finds the local registers of a key in the active cluster. */
+static hll_entry *hll_local(const char *key, size_t key_length, bool create)
 {
-  time_t hold;
-  memcached_return rc;
-  size_t key_length;
-  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
-
-  hold = (time_t) 0.0;
-  if (PG_NARGS() >= 2 && PG_ARGISNULL(1) == false)
-    hold = interval_to_time_t(PG_GETARG_INTERVAL_P(1));
+  hll_entry *entry, hkey;
+  bool found;
 
-  rc = memcached_delete(globals.mc, key, key_length, hold);
-  if (rc == MEMCACHED_BUFFERED)
+  if (globals.hll_sketches == NULL)
     {
-      globals.flush_needed = true;
-      PG_RETURN_NULL();
+      HASHCTL ctl;
+      int flags = HASH_ELEM | HASH_CONTEXT;
+
+      if (!create)
+        return NULL;
+      memset(&ctl, 0, sizeof(ctl));
+      ctl.keysize = offsetof(hll_entry, key_length);
+      ctl.entrysize = sizeof(hll_entry);
+      ctl.hcxt = TopTransactionContext;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
+      flags |= HASH_BLOBS;
+#else
+      ctl.hash = tag_hash;
+      flags |= HASH_FUNCTION;
+#endif
+      globals.hll_sketches = hash_create("pgmemcache hyperloglog sketches", 16, &ctl, flags);
     }
-  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
-    elog(WARNING, "pgmemcache: memcached_delete: %s",
-                  memcached_strerror(globals.mc, rc));
 
-  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+  memset(&hkey, 0, offsetof(hll_entry, key_length));
+  hkey.cluster = globals.cluster;
+  memcpy(hkey.key, key, key_length);
+  entry = hash_search(globals.hll_sketches, &hkey, create ? HASH_ENTER : HASH_FIND, &found);
+  if (create && !found)
+    {
+      entry->key_length = key_length;
+      memset(entry->registers, 0, sizeof(entry->registers));
+    }
+  return entry;
 }
 
-Datum memcache_flush_all0(PG_FUNCTION_ARGS)
+/* Whether the registers of an entry have been saved at the given level */
+static bool hll_saved(List *undo, hll_entry *entry, int nest_level)
 {
-  static time_t opt_expire = 0;
-  memcached_return rc;
+  ListCell *lc;
 
-  rc = memcached_flush(globals.mc, opt_expire);
-  if (rc == MEMCACHED_BUFFERED)
+  foreach(lc, undo)
     {
-      globals.flush_needed = true;
-      PG_RETURN_NULL();
+      hll_undo_record *rec = (hll_undo_record *) lfirst(lc);
+
+      if (rec->nest_level < nest_level)
+        break;
+      if (rec->entry == entry && rec->nest_level == nest_level)
+        return true;
     }
-  if (rc != MEMCACHED_SUCCESS)
-    elog(WARNING, "pgmemcache: memcached_flush: %s",
-                  memcached_strerror(globals.mc, rc));
+  return false;
+}
 
-  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+/* Restores the registers changed in an aborted subtransaction, or moves
+ * the saved registers of a committed one to its parent. */
+static void hll_subxact_callback(SubXactEvent event, int nest_level)
+{
+  MemoryContext oldcxt;
+  List *moved = NIL;
+
+  if (event != SUBXACT_EVENT_ABORT_SUB && event != SUBXACT_EVENT_COMMIT_SUB)
+    return;
+  oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+  while (globals.hll_undo != NIL)
+    {
+      hll_undo_record *rec = (hll_undo_record *) linitial(globals.hll_undo);
+
+      if (rec->nest_level < nest_level)
+        break;
+      globals.hll_undo = list_delete_first(globals.hll_undo);
+      if (event == SUBXACT_EVENT_ABORT_SUB)
+        memcpy(rec->entry->registers, rec->saved, HLL_REGISTERS);
+      /* the top level transaction is undone by dropping the whole table */
+      else if (nest_level > 2 && !hll_saved(globals.hll_undo, rec->entry, nest_level - 1))
+        {
+          rec->nest_level = nest_level - 1;
+          moved = lappend(moved, rec);
+          continue;
+        }
+      pfree(rec->saved);
+      pfree(rec);
+    }
+  globals.hll_undo = list_concat(moved, globals.hll_undo);
+  MemoryContextSwitchTo(oldcxt);
 }
 
-Datum memcache_get(PG_FUNCTION_ARGS)
+Datum memcache_hll_add(PG_FUNCTION_ARGS)
 {
-  text *ret;
-#ifdef USE_LIBMEMCACHED
-  char *string;
-  uint32_t flags;
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-  const unsigned char *string;
-#endif /* USE_OMCACHE */
-  size_t return_value_length;
-  memcached_return rc;
   size_t key_length;
   const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
+  ArrayType *array = PG_GETARG_ARRAYTYPE_P(1);
+  int nest_level = GetCurrentTransactionNestLevel();
+  hll_entry *entry = hll_local(key, key_length, true);
 
-#ifdef USE_LIBMEMCACHED
-  string = memcached_get(globals.mc, key, key_length, &return_value_length, &flags, &rc);
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-  rc = omcache_get(globals.mc, omc_cc_to_cuc(key), key_length, &string, &return_value_length,
-                   NULL, NULL, OMCACHE_READ_TIMEOUT);
-#endif /* USE_OMCACHE */
+  if (nest_level > 1 && !hll_saved(globals.hll_undo, entry, nest_level))
+    {
+      MemoryContext oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+      hll_undo_record *rec = palloc(sizeof(hll_undo_record));
 
-  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
-    elog(ERROR, "pgmemcache: memcached_get: %s",
-                memcached_strerror(globals.mc, rc));
+      rec->entry = entry;
+      rec->saved = palloc(HLL_REGISTERS);
+      memcpy(rec->saved, entry->registers, HLL_REGISTERS);
+      rec->nest_level = nest_level;
+      globals.hll_undo = lcons(rec, globals.hll_undo);
+      MemoryContextSwitchTo(oldcxt);
+    }
 
-  if (rc == MEMCACHED_NOTFOUND)
-    PG_RETURN_NULL();
+  PG_RETURN_BOOL(hll_add_array(entry->registers, array));
+}
+
+/* Fetches a key and its CAS value from the active cluster. */
+static text *pgmemcache_gets(const char *key, size_t key_length, uint64_t *cas, memcached_return *rcp)
+{
+  text *ret;
+  memcached_return rc;
+  instr_time io_start;
 
-  ret = (text *) palloc(return_value_length + VARHDRSZ);
-  SET_VARSIZE(ret, return_value_length + VARHDRSZ);
-  memcpy(VARDATA(ret), string, return_value_length);
-#ifdef USE_LIBMEMCACHED
-  free(string);
-#endif /* USE_LIBMEMCACHED */
+  STMT_IO_START(io_start);
+  ret = memcache_backend.get(globals.mc, key, key_length, cas, &rc);
+  STMT_IO_END(io_start, "memcached_gets", key, key_length, 1, key_length,
+              ret ? VARSIZE(ret) - VARHDRSZ : 0);
 
-  PG_RETURN_TEXT_P(ret);
+  *rcp = rc;
+  return ret;
 }
 
-Datum memcache_get_multi(PG_FUNCTION_ARGS)
+/* Stores the value if the key's CAS value is still the given one. */
+static memcached_return pgmemcache_cas(const char *key, size_t key_length,
+                                       const char *value, size_t value_length, uint64_t cas)
 {
-  ArrayType *array;
-  int array_length, array_lbound, i;
-  Oid element_type;
   memcached_return rc;
-  char typalign;
-  int16 typlen;
-  bool typbyval;
-#ifdef USE_LIBMEMCACHED
-  uint32_t flags;
-  char *current_key, *current_val;
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-  const unsigned char *current_key, *current_val;
-#endif /* USE_OMCACHE */
-  size_t current_key_len, current_val_len;
-  FuncCallContext *funcctx;
-  MemoryContext oldcontext;
-  TupleDesc tupdesc;
-  AttInMetadata *attinmeta;
-  struct internal_fctx {
-      size_t *key_lens;
-#ifdef USE_LIBMEMCACHED
-      const char **keys;
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-      const unsigned char **keys;
-      omcache_req_t *requests;
-      size_t request_count;
-      omcache_value_t *values;
-      size_t value_count;
-#endif /* USE_OMCACHE */
-  } *fctx;
+  instr_time io_start;
 
-  array = PG_GETARG_ARRAYTYPE_P(0);
-  if (ARR_NDIM(array) != 1)
-    elog(ERROR, "pgmemcache: only single dimension ARRAYs are supported, "
-                "not ARRAYs with %d dimensions", ARR_NDIM(array));
+  STMT_IO_START(io_start);
+  rc = memcache_backend.store(globals.mc, PG_MEMCACHE_CMD_SET, key, key_length, value, value_length,
+                              0, 0, cas);
+  STMT_IO_END(io_start, "memcached_cas", key, key_length, 1, key_length + value_length, 0);
+  return rc;
+}
 
-  array_lbound = ARR_LBOUND(array)[0];
-  array_length = ARR_DIMS(array)[0];
-  element_type = ARR_ELEMTYPE(array);
+/* Merges the local registers of a key into the stored sketch, retrying
+ * when another backend changed the sketch after it was read. */
+static void hll_store(hll_entry *entry)
+{
+  char sketch[HLL_SKETCH_SIZE];
+  uint8 *registers = (uint8 *) sketch + sizeof(hll_header);
+  hll_header header;
+  memcached_return rc = MEMCACHED_SUCCESS;
+  const char *func = "memcached_gets";
+  int attempt, i;
 
-  if (SRF_IS_FIRSTCALL())
+  /* nothing was added or the subtransactions adding to it aborted */
+  for (i = 0; i < HLL_REGISTERS && entry->registers[i] == 0; i++)
+    ;
+  if (i == HLL_REGISTERS)
+    return;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HLL_MAGIC, sizeof(header.magic));
+  header.precision = HLL_PRECISION;
+  memcpy(sketch, &header, sizeof(header));
+
+  for (attempt = 0; attempt < HLL_CAS_RETRIES; attempt++)
     {
-      /* create a function context for cross-call persistence */
-      funcctx = SRF_FIRSTCALL_INIT();
-      oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-      funcctx->max_calls = array_length;
-      if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-        ereport(ERROR,
-                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                 errmsg("function returning record called in context that cannot accept type record")));
-      get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+      uint64_t cas = 0;
+      text *stored = pgmemcache_gets(entry->key, entry->key_length, &cas, &rc);
 
-      fctx = (struct internal_fctx *) palloc(sizeof(*fctx));
-      /* extra NULL key for last memcached_fetch call */
-      fctx->keys = palloc(sizeof(char *) * (array_length + 1));
-      fctx->key_lens = palloc(sizeof(size_t) * (array_length + 1));
-      fctx->keys[array_length] = 0;
-      fctx->key_lens[array_length] = 0;
+      func = "memcached_gets";
+      if (rc == MEMCACHED_NOTFOUND)
+        {
+          if (migration_active())
+            stored = migration_fetch(entry->key, entry->key_length);
+        }
+      else if (rc != MEMCACHED_SUCCESS)
+        break;
 
-#ifdef USE_LIBMEMCACHED
-      for (i = 0; i < array_length; i++)
+      memcpy(registers, entry->registers, HLL_REGISTERS);
+      if (stored != NULL)
         {
-          int offset = array_lbound + i;
-          bool isnull;
-          Datum elem = array_ref(array, 1, &offset, 0, typlen, typbyval, typalign, &isnull);
-          if (!isnull)
-            fctx->keys[i] = get_arg_cstring(DatumGetTextP(elem), &fctx->key_lens[i], true);
+          bool local_newer;
+
+          if (!hll_merge(registers, VARDATA(stored), VARSIZE(stored) - VARHDRSZ, &local_newer))
+            {
+              elog(WARNING, "pgmemcache: memcache_hll_add: %s is not a HyperLogLog sketch",
+                            entry->key);
+              return;
+            }
+          pfree(stored);
+          if (cas != 0 && !local_newer)
+            {
+              rc = MEMCACHED_SUCCESS;
+              break;
+            }
+        }
+
+      if (cas != 0)
+        {
+          func = "memcached_cas";
+          rc = pgmemcache_cas(entry->key, entry->key_length, sketch, sizeof(sketch), cas);
+        }
+      else
+        {
+          write_request req = { PG_MEMCACHE_CMD_ADD, entry->key, entry->key_length,
+                                sketch, sizeof(sketch), 0, 0, 0 };
+          instr_time io_start;
+
+          STMT_IO_START(io_start);
+          rc = pgmemcache_write(&req, &func, NULL);
+          STMT_IO_END(io_start, func, entry->key, entry->key_length, 1,
+                      entry->key_length + sizeof(sketch), 0);
         }
+      /* somebody else wrote the sketch first, merge again */
+      if (rc != MEMCACHED_DATA_EXISTS && rc != MEMCACHED_NOTSTORED && rc != MEMCACHED_NOTFOUND)
+        break;
+    }
+
+  if (attempt == HLL_CAS_RETRIES)
+    elog(WARNING, "pgmemcache: memcache_hll_add: %s changed by other writers %d times, giving up",
+                  entry->key, HLL_CAS_RETRIES);
+  else if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: memcache_hll_add: %s: %s", func,
+                  memcached_strerror(globals.mc, rc));
+}
+
+/* Merges the registers of the transaction into the stored sketches, called
+ * before commit. */
+static void pgmemcache_flush_hll(void)
+{
+  HASH_SEQ_STATUS status;
+  hll_entry *entry;
+  HTAB *sketches = globals.hll_sketches;
+  memcache_cluster *active = globals.cluster;
+  memcache_send_state send_state;
+  volatile bool buffering = false;
 
-      rc = memcached_mget(globals.mc, fctx->keys, fctx->key_lens, array_length);
-      if (rc != MEMCACHED_SUCCESS)
-        elog(ERROR, "pgmemcache: memcached_mget: %s",
-                    memcached_strerror(globals.mc, rc));
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-      /* persistent request structures to handle pending requests */
-      fctx->requests = palloc(sizeof(omcache_req_t) * array_length);
-      fctx->request_count = array_length;
-      fctx->values = palloc(sizeof(omcache_value_t) * array_length);
-      fctx->value_count = array_length;
+  if (sketches == NULL)
+    return;
+  pgmemcache_discard_hll();
 
-      for (i = 0; i < array_length; i++)
-        {
-          int offset = array_lbound + i;
-          bool isnull;
-          Datum elem = array_ref(array, 1, &offset, 0, typlen, typbyval, typalign, &isnull);
-          if (!isnull)
-            fctx->keys[i] = (const unsigned char *)
-              get_arg_cstring(DatumGetTextP(elem), &fctx->key_lens[i], true);
-        }
+  PG_TRY();
+  {
+    hash_seq_init(&status, sketches);
+    while ((entry = hash_seq_search(&status)) != NULL)
+      {
+        if (entry->cluster != globals.cluster)
+          pgmemcache_switch_cluster(entry->cluster);
+        /* cas and add need their replies */
+        memcache_backend.set_buffering(globals.mc, MEMCACHE_SEND_WAIT, &send_state);
+        buffering = true;
+        hll_store(entry);
+        memcache_backend.restore_buffering(globals.mc, &send_state);
+        buffering = false;
+      }
+  }
+  PG_CATCH();
+  {
+    if (buffering)
+      memcache_backend.restore_buffering(globals.mc, &send_state);
+    pgmemcache_switch_cluster(active);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  pgmemcache_switch_cluster(active);
+}
 
-      rc = omcache_get_multi(globals.mc, fctx->keys, fctx->key_lens, array_length,
-                             fctx->requests, &fctx->request_count, fctx->values, &fctx->value_count,
-                             OMCACHE_READ_TIMEOUT);
-      if (rc != OMCACHE_OK && rc != OMCACHE_AGAIN)
-        elog(ERROR, "pgmemcache: omcache_get_multi: %s", omcache_strerror(rc));
-#endif /* USE_OMCACHE */
+static void hll_count_cb(const char *key, size_t key_len,
+                         const char *value, size_t value_len,
+                         uint32_t flags, void *context)
+{
+  if (!hll_merge((uint8 *) context, value, value_len, NULL))
+    elog(WARNING, "pgmemcache: memcache_hll_count: %.*s is not a HyperLogLog sketch",
+                  (int) key_len, key);
+}
 
-      attinmeta = TupleDescGetAttInMetadata(tupdesc);
-      funcctx->attinmeta = attinmeta;
-      funcctx->user_fctx = fctx;
-      MemoryContextSwitchTo(oldcontext);
-    }
+Datum memcache_hll_count(PG_FUNCTION_ARGS)
+{
+  ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+  uint8 registers[HLL_REGISTERS];
+  const char **keys;
+  size_t *key_lens;
+  Datum *elems;
+  bool *nulls;
+  int nelems, nkeys = 0, i;
+  memcached_return rc;
 
-  funcctx = SRF_PERCALL_SETUP();
-  fctx = funcctx->user_fctx;
-  attinmeta = funcctx->attinmeta;
+  if (ARR_NDIM(array) > 1)
+    elog(ERROR, "pgmemcache: only single dimension ARRAYs are supported, "
+                "not ARRAYs with %d dimensions", ARR_NDIM(array));
 
-#ifdef USE_LIBMEMCACHED
-  current_key = (char *) fctx->keys[funcctx->call_cntr];  // cast away constness for libmemcached api
-  current_key_len = fctx->key_lens[funcctx->call_cntr];
-  current_val = memcached_fetch(globals.mc, current_key, &current_key_len, &current_val_len, &flags, &rc);
-  if (rc == MEMCACHED_END)
-    {
-      SRF_RETURN_DONE(funcctx);
-    }
-  else if (rc != MEMCACHED_SUCCESS)
-    {
-      elog(ERROR, "pgmemcache: memcached_fetch: %s",
-                  memcached_strerror(globals.mc, rc));
-      SRF_RETURN_DONE(funcctx);
-    }
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-  current_val = NULL;
-  if (fctx->value_count == 0 && fctx->request_count > 0)
-    {
-      fctx->value_count = fctx->request_count;
-      rc = omcache_io(globals.mc, fctx->requests, &fctx->request_count,
-                      fctx->values, &fctx->value_count, OMCACHE_READ_TIMEOUT);
-      if (rc != OMCACHE_OK && rc != OMCACHE_AGAIN)
-        elog(ERROR, "pgmemcache: omcache_io: %s", omcache_strerror(rc));
-    }
-  if (fctx->value_count > 0)
+  deconstruct_array(array, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+  keys = palloc(sizeof(char *) * (nelems + 1));
+  key_lens = palloc(sizeof(size_t) * (nelems + 1));
+  for (i = 0; i < nelems; i++)
+    if (!nulls[i])
+      {
+        keys[nkeys] = get_arg_cstring(DatumGetTextP(elems[i]), &key_lens[nkeys], true);
+        nkeys++;
+      }
+
+  memset(registers, 0, sizeof(registers));
+  if (nkeys > 0)
     {
-      fctx->value_count --;
-      current_key = fctx->values[fctx->value_count].key;
-      current_key_len = fctx->values[fctx->value_count].key_len;
-      current_val = fctx->values[fctx->value_count].data;
-      current_val_len = fctx->values[fctx->value_count].data_len;
+      rc = pgmemcache_mget(keys, key_lens, nkeys, hll_count_cb, registers);
+      if (rc != MEMCACHED_SUCCESS)
+        elog(ERROR, "pgmemcache: memcached_mget: %s", memcached_strerror(globals.mc, rc));
     }
-#endif /* USE_OMCACHE */
-  if (current_val != NULL)
-    {
-      char **values;
-      HeapTuple tuple;
-      Datum result;
 
-      values = (char **) palloc(2 * sizeof(char *));
-      /* make sure we have space for terminating zero character */
-      values[0] = (char *) palloc(current_key_len + 1);
-      values[1] = (char *) palloc(current_val_len + 1);
+  /* include the additions of this transaction which haven't been stored */
+  for (i = 0; i < nkeys; i++)
+    {
+      hll_entry *entry = hll_local(keys[i], key_lens[i], false);
+      int j;
 
-      memcpy(values[0], current_key, current_key_len);
-      memcpy(values[1], current_val, current_val_len);
-#ifdef USE_LIBMEMCACHED
-      free(current_val);
-#endif /* USE_LIBMEMCACHED */
+      if (entry != NULL)
+        for (j = 0; j < HLL_REGISTERS; j++)
+          registers[j] = Max(registers[j], entry->registers[j]);
+    }
 
-      /* BuildTupleFromCStrings needs correct zero-terminated C-string, so terminate our raw strings */
-      values[0][current_key_len] = '\0';
-      values[1][current_val_len] = '\0';
+  PG_RETURN_INT64((int64) rint(hll_estimate(registers)));
+}
 
-      tuple = BuildTupleFromCStrings(attinmeta, values);
-      result = HeapTupleGetDatum(tuple);
+/*
+ * Batched memcache_get() calls.
+ *
+ * The planner hook looks for plan nodes which call memcache_get() directly
+ * in their target list and puts a MemcacheBatch custom scan on top of
+ * them.  The node below computes the key instead of calling memcache_get(),
+ * the custom scan reads pgmemcache.get_batch_size rows from it, fetches all
+ * of their keys with a single multi-get and then returns the rows with the
+ * keys replaced by the fetched values.
+ */
 
-      SRF_RETURN_NEXT(funcctx, result);
-    }
-  SRF_RETURN_DONE(funcctx);
-}
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90500)
 
-Datum memcache_replace(PG_FUNCTION_ARGS)
+typedef struct
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_REPLACE | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
-}
+  char key[KEY_MAX_LENGTH + 1];  /* zero padded hash key */
+  text *value;
+  const char *source;            /* the key of a copy or NULL */
+  size_t source_length;
+} batch_entry;
 
-Datum memcache_replace_absexpire(PG_FUNCTION_ARGS)
+typedef struct
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_REPLACE | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
-}
+  CustomScanState css;
+  int batch_size;
+  List *lookups;          /* attribute numbers of the memcache_get() columns */
+  MemoryContext batch_cxt;
+  HTAB *values;           /* batch_entrys of the current batch */
+  Datum **row_values;
+  bool **row_nulls;
+  int nrows;
+  int next_row;
+  bool child_done;
+  int64 nrequests;
+} MemcacheBatchState;
 
-Datum memcache_set(PG_FUNCTION_ARGS)
-{
-  return memcache_set_cmd(PG_MEMCACHE_CMD_SET | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
-}
+static Node *memcache_batch_create_state(CustomScan *cscan);
+static void memcache_batch_begin(CustomScanState *node, EState *estate, int eflags);
+static TupleTableSlot *memcache_batch_exec(CustomScanState *node);
+static void memcache_batch_end(CustomScanState *node);
+static void memcache_batch_rescan(CustomScanState *node);
+static void memcache_batch_explain(CustomScanState *node, List *ancestors, ExplainState *es);
 
-Datum memcache_set_absexpire(PG_FUNCTION_ARGS)
+static CustomScanMethods memcache_batch_plan_methods = {
+  .CustomName = "MemcacheBatch",
+  .CreateCustomScanState = memcache_batch_create_state,
+};
+
+static CustomExecMethods memcache_batch_exec_methods = {
+  .CustomName = "MemcacheBatch",
+  .BeginCustomScan = memcache_batch_begin,
+  .ExecCustomScan = memcache_batch_exec,
+  .EndCustomScan = memcache_batch_end,
+  .ReScanCustomScan = memcache_batch_rescan,
+  .ExplainCustomScan = memcache_batch_explain,
+};
+
+static Oid memcache_get_oid = InvalidOid;
+static bool memcache_get_oid_valid = false;
+
+static void memcache_get_oid_invalidate(Datum arg, int cacheid, uint32 hashvalue)
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_SET | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+  memcache_get_oid_valid = false;
 }
 
-Datum memcache_prepend(PG_FUNCTION_ARGS)
+/* Returns the OID of memcache_get(text) or InvalidOid if the extension
+ * isn't installed in the database.  The OID is looked up once and cached
+ * until pg_proc changes, the schema the extension is installed in doesn't
+ * matter and functions of the same name elsewhere are told apart by their
+ * symbol. */
+static Oid memcache_get_func_oid(void)
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_PREPEND | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+  CatCList *candidates;
+  int i;
+
+  if (memcache_get_oid_valid)
+    return memcache_get_oid;
+
+  memcache_get_oid = InvalidOid;
+  candidates = SearchSysCacheList1(PROCNAMEARGSNSP, CStringGetDatum("memcache_get"));
+  for (i = 0; i < candidates->n_members; i++)
+    {
+      HeapTuple tuple = &candidates->members[i]->tuple;
+      Form_pg_proc proc = (Form_pg_proc) GETSTRUCT(tuple);
+      FmgrInfo finfo;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 120000)
+      Oid oid = proc->oid;
+#else
+      Oid oid = HeapTupleGetOid(tuple);
+#endif
+
+      if (proc->pronargs != 1 || proc->proargtypes.values[0] != TEXTOID ||
+          proc->prorettype != TEXTOID || proc->prolang != ClanguageId)
+        continue;
+      fmgr_info(oid, &finfo);
+      if (finfo.fn_addr == memcache_get)
+        {
+          memcache_get_oid = oid;
+          break;
+        }
+    }
+  ReleaseSysCacheList(candidates);
+  memcache_get_oid_valid = true;
+  return memcache_get_oid;
 }
 
-Datum memcache_prepend_absexpire(PG_FUNCTION_ARGS)
+static bool is_memcache_get(Expr *expr)
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_PREPEND | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+  return IsA(expr, FuncExpr) && OidIsValid(memcache_get_oid) &&
+         ((FuncExpr *) expr)->funcid == memcache_get_oid;
 }
 
-Datum memcache_append(PG_FUNCTION_ARGS)
+/* Looks for calls of memcache_get() in a query, only their funcid is
+ * compared. */
+static bool batch_get_walker(Node *node, void *context)
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_APPEND | PG_MEMCACHE_TYPE_INTERVAL, fcinfo);
+  if (node == NULL)
+    return false;
+  if (IsA(node, Query))
+    return query_tree_walker((Query *) node, batch_get_walker, context, 0);
+  if (is_memcache_get((Expr *) node))
+    return true;
+  return expression_tree_walker(node, batch_get_walker, context);
 }
 
-Datum memcache_append_absexpire(PG_FUNCTION_ARGS)
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 100000)
+static bool batch_volatile_func(Oid func_id, void *context)
 {
-  return memcache_set_cmd(PG_MEMCACHE_CMD_APPEND | PG_MEMCACHE_TYPE_TIMESTAMP, fcinfo);
+  return func_volatile(func_id) == PROVOLATILE_VOLATILE;
 }
+#endif
 
-static Datum memcache_set_cmd(int type, PG_FUNCTION_ARGS)
+/* Looks for volatile functions other than memcache_get() itself in a
+ * query.  Batching reads rows ahead of the ones returned, so their side
+ * effects would run for rows a LIMIT or a cursor never fetches and in a
+ * different order. */
+static bool batch_volatile_walker(Node *node, void *context)
 {
-  memcached_return rc = MEMCACHED_FAILURE;
-  const char *func = NULL;
-  time_t expiration = 0;
-  size_t key_length, value_length;
-  const char *key = get_arg_cstring(PG_GETARG_TEXT_P(0), &key_length, true);
-  const char *value = get_arg_cstring(PG_GETARG_TEXT_P(1), &value_length, false);
-
-  if (PG_NARGS() >= 3 && PG_ARGISNULL(2) == false)
+  if (node == NULL)
+    return false;
+  if (IsA(node, Query))
+    return query_tree_walker((Query *) node, batch_volatile_walker, context, 0);
+  /* memcache_get() only reads, the expression computing its key is still
+   * checked below */
+  if (!is_memcache_get((Expr *) node))
     {
-      if (type & PG_MEMCACHE_TYPE_INTERVAL)
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 100000)
+      if (IsA(node, NextValueExpr) ||
+          check_functions_in_node(node, batch_volatile_func, context))
+        return true;
+#else
+      if (IsA(node, FuncExpr) &&
+          func_volatile(((FuncExpr *) node)->funcid) == PROVOLATILE_VOLATILE)
+        return true;
+      if (IsA(node, OpExpr) || IsA(node, DistinctExpr) || IsA(node, NullIfExpr))
         {
-          Interval *span = PG_GETARG_INTERVAL_P(2);
-          expiration = interval_to_time_t(span);
+          set_opfuncid((OpExpr *) node);
+          if (func_volatile(((OpExpr *) node)->opfuncid) == PROVOLATILE_VOLATILE)
+            return true;
         }
-      else if (type & PG_MEMCACHE_TYPE_TIMESTAMP)
+      if (IsA(node, ScalarArrayOpExpr))
         {
-          TimestampTz timestamptz;
-          struct pg_tm tm;
-          fsec_t fsec;
+          set_sa_opfuncid((ScalarArrayOpExpr *) node);
+          if (func_volatile(((ScalarArrayOpExpr *) node)->opfuncid) == PROVOLATILE_VOLATILE)
+            return true;
+        }
+#endif
+    }
+  return expression_tree_walker(node, batch_volatile_walker, context);
+}
 
-          timestamptz = PG_GETARG_TIMESTAMPTZ(2);
+static Plan *memcache_batch_make_plan(Plan *plan)
+{
+  CustomScan *cscan;
+  List *scan_tlist = NIL, *tlist = NIL, *lookups = NIL;
+  ListCell *lc;
 
-          /* convert to timestamptz to produce consistent results */
-          if (timestamp2tm(timestamptz, NULL, &tm, &fsec, NULL, NULL) !=0)
-            ereport(ERROR,
-                    (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
-                     errmsg("timestamp out of range")));
+  foreach(lc, plan->targetlist)
+    {
+      TargetEntry *te = lfirst(lc);
+      Oid type = exprType((Node *) te->expr);
+      int32 typmod = exprTypmod((Node *) te->expr);
+      Oid collation = exprCollation((Node *) te->expr);
+      TargetEntry *out = flatCopyTargetEntry(te);
 
-#ifdef HAVE_INT64_TIMESTAMP
-          expiration = (time_t) ((timestamptz - SetEpochTimestamp()) / 1000000e0);
-#else
-          expiration = (time_t) timestamptz - SetEpochTimestamp();
-#endif
-        }
-      else
+      out->expr = (Expr *) makeVar(INDEX_VAR, te->resno, type, typmod, collation, 0);
+      tlist = lappend(tlist, out);
+
+      if (is_memcache_get(te->expr))
         {
-          elog(ERROR, "%s():%s:%u: invalid date type", __FUNCTION__, __FILE__, __LINE__);
+          /* the node below returns the key */
+          te = flatCopyTargetEntry(te);
+          te->expr = linitial(((FuncExpr *) te->expr)->args);
+          lfirst(lc) = te;
+          lookups = lappend_int(lookups, te->resno);
+          typmod = exprTypmod((Node *) te->expr);
         }
+      scan_tlist = lappend(scan_tlist,
+                           makeTargetEntry((Expr *) makeVar(OUTER_VAR, te->resno, type, typmod,
+                                                            collation, 0),
+                                           te->resno, te->resname, te->resjunk));
     }
 
-  switch (type & PG_MEMCACHE_CMD_MASK)
+  cscan = makeNode(CustomScan);
+  cscan->scan.plan.startup_cost = plan->startup_cost;
+  cscan->scan.plan.total_cost = plan->total_cost;
+  cscan->scan.plan.plan_rows = plan->plan_rows;
+  cscan->scan.plan.plan_width = plan->plan_width;
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90600)
+  cscan->scan.plan.parallel_safe = plan->parallel_safe;
+#endif
+  cscan->scan.plan.targetlist = tlist;
+  cscan->scan.plan.lefttree = plan;
+  cscan->scan.plan.extParam = bms_copy(plan->extParam);
+  cscan->scan.plan.allParam = bms_copy(plan->allParam);
+  cscan->scan.scanrelid = 0;
+  cscan->custom_scan_tlist = scan_tlist;
+  cscan->custom_private = list_make2(makeInteger(globals.get_batch_size), lookups);
+  cscan->methods = &memcache_batch_plan_methods;
+  return (Plan *) cscan;
+}
+
+/* Returns the plan with MemcacheBatch nodes added, the parent nodes refer
+ * to the columns by position so the nodes can be added anywhere. */
+static Plan *memcache_batch_rewrite(Plan *plan)
+{
+  ListCell *lc;
+
+  if (plan == NULL)
+    return NULL;
+
+  switch (nodeTag(plan))
     {
-    case PG_MEMCACHE_CMD_ADD:
-      func = "memcached_add";
-      rc = memcached_add(globals.mc, key, key_length, value, value_length, expiration, 0);
-      break;
-    case PG_MEMCACHE_CMD_REPLACE:
-      func = "memcached_replace";
-      rc = memcached_replace(globals.mc, key, key_length, value, value_length, expiration, 0);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90600)
+    case T_Gather:
+#endif
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 100000)
+    case T_GatherMerge:
+#endif
+    case T_CustomScan:
+      /* leave parallel plans and other custom nodes alone */
+      return plan;
+    case T_MergeJoin:
+      /* the inner side may need to support mark and restore */
+      plan->lefttree = memcache_batch_rewrite(plan->lefttree);
       break;
-    case PG_MEMCACHE_CMD_SET:
-      func = "memcached_set";
-      rc = memcached_set(globals.mc, key, key_length, value, value_length, expiration, 0);
+    case T_Append:
+      foreach(lc, ((Append *) plan)->appendplans)
+        lfirst(lc) = memcache_batch_rewrite(lfirst(lc));
       break;
-    case PG_MEMCACHE_CMD_PREPEND:
-      func = "memcached_prepend";
-      rc = memcached_prepend(globals.mc, key, key_length, value, value_length, expiration, 0);
+    case T_MergeAppend:
+      foreach(lc, ((MergeAppend *) plan)->mergeplans)
+        lfirst(lc) = memcache_batch_rewrite(lfirst(lc));
       break;
-    case PG_MEMCACHE_CMD_APPEND:
-      func = "memcached_append";
-      rc = memcached_append(globals.mc, key, key_length, value, value_length, expiration, 0);
+    case T_SubqueryScan:
+      ((SubqueryScan *) plan)->subplan = memcache_batch_rewrite(((SubqueryScan *) plan)->subplan);
       break;
     default:
-      elog(ERROR, "pgmemcache: unknown set command type: %d", type);
-    }
-
-  if (rc == MEMCACHED_BUFFERED)
-    {
-      globals.flush_needed = true;
-      PG_RETURN_NULL();
+      plan->lefttree = memcache_batch_rewrite(plan->lefttree);
+      plan->righttree = memcache_batch_rewrite(plan->righttree);
+      break;
     }
-  if (rc != MEMCACHED_SUCCESS)
-    elog(WARNING, "pgmemcache: %s: %s", func,
-                  memcached_strerror(globals.mc, rc));
 
-  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90600)
+  if (plan->parallel_aware)
+    return plan;
+#endif
+  /* a single row gains nothing from a multi-get */
+  if (plan->plan_rows <= 1)
+    return plan;
+  foreach(lc, plan->targetlist)
+    if (is_memcache_get(((TargetEntry *) lfirst(lc))->expr))
+      return memcache_batch_make_plan(plan);
+  return plan;
 }
 
-Datum memcache_server_add(PG_FUNCTION_ARGS)
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 130000)
+static PlannedStmt *pgmemcache_planner(Query *parse, const char *query_string,
+                                       int cursorOptions, ParamListInfo boundParams)
+#else
+static PlannedStmt *pgmemcache_planner(Query *parse, int cursorOptions,
+                                       ParamListInfo boundParams)
+#endif
 {
-  size_t host_len;
-  const char *host_buf = get_arg_cstring(PG_GETARG_TEXT_P(0), &host_len, false);
-  char *host = pnstrdup(host_buf, host_len);
-  memcached_return rc = do_server_add(host);
-  if (rc != MEMCACHED_SUCCESS)
-    elog(WARNING, "pgmemcache: memcached_server_push: %s",
-                  memcached_strerror(globals.mc, rc));
+  PlannedStmt *stmt;
+  ListCell *lc;
 
-  PG_RETURN_BOOL(rc == MEMCACHED_SUCCESS);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 130000)
+  if (prev_planner_hook)
+    stmt = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+  else
+    stmt = standard_planner(parse, query_string, cursorOptions, boundParams);
+#else
+  if (prev_planner_hook)
+    stmt = prev_planner_hook(parse, cursorOptions, boundParams);
+  else
+    stmt = standard_planner(parse, cursorOptions, boundParams);
+#endif
+
+  /* the custom scan can't scan backwards, most statements don't call
+   * memcache_get() and are only walked for that */
+  if (globals.get_batch_size <= 1 || (cursorOptions & CURSOR_OPT_SCROLL) ||
+      !OidIsValid(memcache_get_func_oid()) ||
+      !batch_get_walker((Node *) parse, NULL) ||
+      batch_volatile_walker((Node *) parse, NULL))
+    return stmt;
+
+  stmt->planTree = memcache_batch_rewrite(stmt->planTree);
+  foreach(lc, stmt->subplans)
+    lfirst(lc) = memcache_batch_rewrite(lfirst(lc));
+  return stmt;
 }
 
-static memcached_return do_server_add(const char *host_str)
+static Node *memcache_batch_create_state(CustomScan *cscan)
 {
-  memcached_server_st *servers;
-  memcached_return rc;
+  MemcacheBatchState *state = palloc0(sizeof(MemcacheBatchState));
+
+  NodeSetTag(state, T_CustomScanState);
+  state->css.methods = &memcache_batch_exec_methods;
+  state->batch_size = intVal(linitial(cscan->custom_private));
+  state->lookups = lsecond(cscan->custom_private);
+  return (Node *) state;
+}
 
-  servers = memcached_servers_parse(host_str);
-  rc = memcached_server_push(globals.mc, servers);
-  memcached_server_list_free(servers);
+static void memcache_batch_begin(CustomScanState *node, EState *estate, int eflags)
+{
+  MemcacheBatchState *state = (MemcacheBatchState *) node;
 
-  return rc;
+  outerPlanState(state) = ExecInitNode(outerPlan(node->ss.ps.plan), estate, eflags);
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90600)
+  state->batch_cxt = AllocSetContextCreate(CurrentMemoryContext, "pgmemcache batch",
+                                           ALLOCSET_DEFAULT_SIZES);
+#else
+  state->batch_cxt = AllocSetContextCreate(CurrentMemoryContext, "pgmemcache batch",
+                                           ALLOCSET_DEFAULT_MINSIZE,
+                                           ALLOCSET_DEFAULT_INITSIZE,
+                                           ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+  state->row_values = palloc(sizeof(Datum *) * state->batch_size);
+  state->row_nulls = palloc(sizeof(bool *) * state->batch_size);
 }
 
-#ifdef USE_LIBMEMCACHED
-#define MC_ENUM_INVAL -1
-#define MC_STR_TO_ENUM(d,v) \
-  if (strcmp(value, "MEMCACHED_" #d "_" #v) == 0 || strcmp(value, #v) == 0) \
-      return MEMCACHED_##d##_##v
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-#define MC_ENUM_INVAL NULL
-#define MC_STR_TO_ENUM(d,v) \
-  if (strcmp(value, "MEMCACHED_" #d "_" #v) == 0 || strcmp(value, #v) == 0) \
-      return #v
-#endif /* USE_OMCACHE */
-
-static memcached_behavior get_memcached_behavior_flag(const char *value)
-{
-  MC_STR_TO_ENUM(BEHAVIOR, BINARY_PROTOCOL);
-  MC_STR_TO_ENUM(BEHAVIOR, BUFFER_REQUESTS);
-  MC_STR_TO_ENUM(BEHAVIOR, CACHE_LOOKUPS);
-  MC_STR_TO_ENUM(BEHAVIOR, CONNECT_TIMEOUT);
-#if LIBMEMCACHED_VERSION_HEX >= 0x01000003
-  MC_STR_TO_ENUM(BEHAVIOR, DEAD_TIMEOUT);
-#endif
-  MC_STR_TO_ENUM(BEHAVIOR, DISTRIBUTION);
-  MC_STR_TO_ENUM(BEHAVIOR, HASH);
-  MC_STR_TO_ENUM(BEHAVIOR, HASH_WITH_PREFIX_KEY);
-  MC_STR_TO_ENUM(BEHAVIOR, IO_BYTES_WATERMARK);
-  MC_STR_TO_ENUM(BEHAVIOR, IO_KEY_PREFETCH);
-  MC_STR_TO_ENUM(BEHAVIOR, IO_MSG_WATERMARK);
-  MC_STR_TO_ENUM(BEHAVIOR, KETAMA);
-  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_HASH);
-#ifdef USE_OMCACHE
-  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_PRE1010);
-#endif
-  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_WEIGHTED);
-  MC_STR_TO_ENUM(BEHAVIOR, NO_BLOCK);
-  MC_STR_TO_ENUM(BEHAVIOR, NOREPLY);
-  MC_STR_TO_ENUM(BEHAVIOR, NUMBER_OF_REPLICAS);
-  MC_STR_TO_ENUM(BEHAVIOR, POLL_TIMEOUT);
-  MC_STR_TO_ENUM(BEHAVIOR, RANDOMIZE_REPLICA_READ);
-  MC_STR_TO_ENUM(BEHAVIOR, RCV_TIMEOUT);
-#if LIBMEMCACHED_VERSION_HEX >= 0x00049000
-  MC_STR_TO_ENUM(BEHAVIOR, REMOVE_FAILED_SERVERS);
-#endif
-  MC_STR_TO_ENUM(BEHAVIOR, RETRY_TIMEOUT);
-  MC_STR_TO_ENUM(BEHAVIOR, SERVER_FAILURE_LIMIT);
-  MC_STR_TO_ENUM(BEHAVIOR, SND_TIMEOUT);
-  MC_STR_TO_ENUM(BEHAVIOR, SOCKET_RECV_SIZE);
-  MC_STR_TO_ENUM(BEHAVIOR, SOCKET_SEND_SIZE);
-  MC_STR_TO_ENUM(BEHAVIOR, SORT_HOSTS);
-  MC_STR_TO_ENUM(BEHAVIOR, SUPPORT_CAS);
-  MC_STR_TO_ENUM(BEHAVIOR, TCP_NODELAY);
-  MC_STR_TO_ENUM(BEHAVIOR, USER_DATA);
-  MC_STR_TO_ENUM(BEHAVIOR, USE_UDP);
-  MC_STR_TO_ENUM(BEHAVIOR, VERIFY_KEY);
-
-  elog(ERROR, "pgmemcache: unknown behavior flag: %s", value);
-  return MC_ENUM_INVAL;
-}
-
-static memcached_hash get_memcached_hash_type(const char *value)
-{
-  MC_STR_TO_ENUM(HASH, MURMUR);
-  MC_STR_TO_ENUM(HASH, MD5);
-  MC_STR_TO_ENUM(HASH, JENKINS);
-  MC_STR_TO_ENUM(HASH, HSIEH);
-  MC_STR_TO_ENUM(HASH, FNV1A_64);
-  MC_STR_TO_ENUM(HASH, FNV1A_32);
-  MC_STR_TO_ENUM(HASH, FNV1_64);
-  MC_STR_TO_ENUM(HASH, FNV1_32);
-  MC_STR_TO_ENUM(HASH, DEFAULT);
-  MC_STR_TO_ENUM(HASH, CRC);
-
-  elog(ERROR, "pgmemcache: invalid hash name: %s", value);
-  return MC_ENUM_INVAL;
-}
-
-static memcached_server_distribution get_memcached_distribution_type(const char *value)
-{
-  MC_STR_TO_ENUM(DISTRIBUTION, RANDOM);
-  MC_STR_TO_ENUM(DISTRIBUTION, MODULA);
-  MC_STR_TO_ENUM(DISTRIBUTION, CONSISTENT_KETAMA);
-  MC_STR_TO_ENUM(DISTRIBUTION, CONSISTENT);
-
-  elog(ERROR, "pgmemcache: invalid distribution name: %s", value);
-  return MC_ENUM_INVAL;
-}
-
-static uint64_t get_memcached_behavior_data(const char *flag, const char *data, const char **val)
-{
-  char *endptr;
-  uint64_t ret;
-  memcached_behavior bkey = get_memcached_behavior_flag(flag);
-
-#ifdef USE_LIBMEMCACHED
-  switch (bkey)
-    {
-    case MEMCACHED_BEHAVIOR_HASH:
-    case MEMCACHED_BEHAVIOR_KETAMA_HASH:
-      return get_memcached_hash_type(data);
-    case MEMCACHED_BEHAVIOR_DISTRIBUTION:
-      return get_memcached_distribution_type(data);
-    default:
-#endif /* USE_LIBMEMCACHED */
-#ifdef USE_OMCACHE
-  ret = 0;
-  if (strcmp(bkey, "HASH") == 0 || strcmp(bkey, "KETAMA_HASH") == 0)
-    *val = get_memcached_hash_type(data);
-  else if (strcmp(bkey, "DISTRIBUTION") == 0)
-    *val = get_memcached_distribution_type(data);
-  else
-    {
-#endif /* USE_OMCACHE */
-      ret = strtol(data, &endptr, 10);
-      if (endptr == data)
-        elog(ERROR, "pgmemcache: invalid behavior param %s: %s", flag, data);
-    }
-  return ret;
+static void memcache_batch_value_cb(const char *key, size_t key_len,
+                                    const char *value, size_t value_len,
+                                    uint32_t flags, void *context)
+{
+  MemcacheBatchState *state = context;
+  char hkey[KEY_MAX_LENGTH + 1];
+  batch_entry *entry;
+
+  if (key_len > KEY_MAX_LENGTH)
+    return;
+  memset(hkey, 0, sizeof(hkey));
+  memcpy(hkey, key, key_len);
+  entry = hash_search(state->values, hkey, HASH_FIND, NULL);
+  if (entry != NULL && entry->value == NULL)
+    entry->value = cstring_to_text_with_len(value, value_len);
 }
 
-/* NOTE: memcached_server_fn specifies that the first argument is const, but
- * memcached_stat_get_keys wants a non-const argument so we don't define it
- * as const here.
- */
-static memcached_return_t server_stat_function(memcached_st *mc,
-                                               memcached_server_instance_st server,
-                                               void *context)
+/* Read the next batch of rows from the node below and fetch their keys. */
+static void memcache_batch_fill(MemcacheBatchState *state)
 {
-  memcached_return rc;
-  StringInfoData *strbuf = (StringInfoData *) context;
-  const char *hostname = memcached_server_name(server);
-  unsigned int port = memcached_server_port(server);
+  PlanState *outer = outerPlanState(state);
+  TupleDesc tupdesc = state->css.ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+  MemoryContext oldcxt;
+  HASHCTL ctl;
+  const char **keys;
+  size_t *key_lens;
+  List *copies = NIL;
+  ListCell *lc;
+  int nkeys = 0, i;
 
-  appendStringInfo(strbuf, "Server: %s (%u)\n", hostname, port);
+  MemoryContextReset(state->batch_cxt);
+  state->nrows = 0;
+  state->next_row = 0;
 
-  {
-#ifdef USE_LIBMEMCACHED
-  memcached_stat_st stat;
-  char **list, **stat_ptr;
+  oldcxt = MemoryContextSwitchTo(state->batch_cxt);
 
-  rc = memcached_stat_servername(&stat, NULL, hostname, port);
-  if (rc != MEMCACHED_SUCCESS)
-    return rc;
+  memset(&ctl, 0, sizeof(ctl));
+  ctl.keysize = KEY_MAX_LENGTH + 1;
+  ctl.entrysize = sizeof(batch_entry);
+  ctl.hcxt = state->batch_cxt;
+  state->values = hash_create("pgmemcache batch", state->batch_size, &ctl,
+                              HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+  keys = palloc(sizeof(char *) * state->batch_size * list_length(state->lookups));
+  key_lens = palloc(sizeof(size_t) * state->batch_size * list_length(state->lookups));
 
-  list = memcached_stat_get_keys(mc, &stat, &rc);
-  if (rc != MEMCACHED_SUCCESS)
-    return rc;
+  while (!state->child_done && state->nrows < state->batch_size)
+    {
+      TupleTableSlot *slot;
+      Datum *values;
+      bool *nulls;
+
+      /* the node below runs in the executor's memory context */
+      MemoryContextSwitchTo(oldcxt);
+      slot = ExecProcNode(outer);
+      MemoryContextSwitchTo(state->batch_cxt);
+      if (TupIsNull(slot))
+        {
+          state->child_done = true;
+          break;
+        }
+
+      slot_getallattrs(slot);
+      values = palloc(sizeof(Datum) * tupdesc->natts);
+      nulls = palloc(sizeof(bool) * tupdesc->natts);
+      for (i = 0; i < tupdesc->natts; i++)
+        {
+          Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+          nulls[i] = slot->tts_isnull[i];
+          values[i] = nulls[i] ? (Datum) 0 :
+            datumCopy(slot->tts_values[i], attr->attbyval, attr->attlen);
+        }
+
+      foreach(lc, state->lookups)
+        {
+          int attno = lfirst_int(lc) - 1;
+          char hkey[KEY_MAX_LENGTH + 1];
+          size_t key_length, read_key_length;
+          const char *key, *read_key;
+          batch_entry *entry;
+          bool found, copy;
+
+          if (nulls[attno])
+            continue;
+          /* same checks as memcache_get() */
+          values[attno] = PointerGetDatum(PG_DETOAST_DATUM(values[attno]));
+          key = get_arg_cstring(DatumGetTextP(values[attno]), &key_length, true);
+          /* each row picks the key or one of its copies like memcache_get()
+           * and keeps the name it's read as to look the value up */
+          read_key = key;
+          read_key_length = key_length;
+          copy = replica_pick(&read_key, &read_key_length);
+          if (read_key != VARDATA(DatumGetPointer(values[attno])))
+            values[attno] = PointerGetDatum(cstring_to_text_with_len(read_key, read_key_length));
+          memset(hkey, 0, sizeof(hkey));
+          memcpy(hkey, read_key, read_key_length);
+          entry = hash_search(state->values, hkey, HASH_ENTER, &found);
+          if (!found)
+            {
+              entry->value = NULL;
+              entry->source = copy ? key : NULL;
+              entry->source_length = key_length;
+              if (copy)
+                copies = lappend(copies, entry);
+              keys[nkeys] = entry->key;
+              key_lens[nkeys] = read_key_length;
+              nkeys++;
+            }
+        }
+
+      state->row_values[state->nrows] = values;
+      state->row_nulls[state->nrows] = nulls;
+      state->nrows++;
+    }
 
-  for (stat_ptr = list; stat_ptr && *stat_ptr; stat_ptr++)
+  if (nkeys > 0)
     {
-      char *value = memcached_stat_get_value(mc, &stat, *stat_ptr, &rc);
-      appendStringInfo(strbuf, "%s: %s\n", *stat_ptr, value);
-      free(value);
+      memcached_return rc = pgmemcache_mget(keys, key_lens, nkeys, memcache_batch_value_cb, state);
+
+      if (rc != MEMCACHED_SUCCESS)
+        elog(ERROR, "pgmemcache: memcached_mget: %s",
+                    memcached_strerror(globals.mc, rc));
+      state->nrequests++;
     }
-  free(list);
-#endif /* USE_LIBMEMCACHED */
 
-#ifdef USE_OMCACHE
-  size_t i, value_count = 50;
-  omcache_value_t values[50];
-  rc = omcache_stat(globals.mc, NULL, values, &value_count,
-                    server->server_index, OMCACHE_READ_TIMEOUT);
-  if (rc != OMCACHE_OK)
+  foreach(lc, copies)
     {
-      value_count = 0;
-      appendStringInfo(strbuf, "omcache_stat failed: %s\n", omcache_strerror(rc));
+      batch_entry *entry = (batch_entry *) lfirst(lc);
+      memcached_return rc;
+
+      if (entry->value != NULL)
+        continue;
+      /* a missing or unreachable copy is read from the key itself */
+      entry->value = pgmemcache_fetch(entry->source, entry->source_length, &rc);
+      if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+        elog(ERROR, "pgmemcache: memcached_get: %s",
+                    memcached_strerror(globals.mc, rc));
+      if (entry->value != NULL)
+        replica_restore(entry->key, strlen(entry->key), entry->value);
     }
 
-  for (i = 0; i < value_count; i++)
+  MemoryContextSwitchTo(oldcxt);
+}
+
+static TupleTableSlot *memcache_batch_next(ScanState *node)
+{
+  MemcacheBatchState *state = (MemcacheBatchState *) node;
+  TupleTableSlot *slot = node->ss_ScanTupleSlot;
+  int natts = slot->tts_tupleDescriptor->natts;
+  ListCell *lc;
+  int row;
+
+  if (state->next_row >= state->nrows)
     {
-      int key_len = (int) values[i].key_len,
-          data_len = (int) values[i].data_len;
-      if (key_len == 0 && data_len == 0)
-        break;
-      appendStringInfo(strbuf, "%.*s: %.*s\n",
-                       key_len, (const char *) values[i].key,
-                       data_len, (const char *) values[i].data);
+      if (state->child_done)
+        return ExecClearTuple(slot);
+      memcache_batch_fill(state);
+      if (state->nrows == 0)
+        return ExecClearTuple(slot);
     }
-#endif /* USE_OMCACHE */
-  }
 
-  appendStringInfo(strbuf, "\n");
-  return MEMCACHED_SUCCESS;
+  row = state->next_row++;
+  ExecClearTuple(slot);
+  memcpy(slot->tts_values, state->row_values[row], sizeof(Datum) * natts);
+  memcpy(slot->tts_isnull, state->row_nulls[row], sizeof(bool) * natts);
+  foreach(lc, state->lookups)
+    {
+      int attno = lfirst_int(lc) - 1;
+      char hkey[KEY_MAX_LENGTH + 1];
+      batch_entry *entry;
+      size_t key_length;
+      const char *key;
+
+      if (slot->tts_isnull[attno])
+        continue;
+      /* the row holds the name its key was read as */
+      key = get_arg_cstring(DatumGetTextP(slot->tts_values[attno]), &key_length, true);
+      memset(hkey, 0, sizeof(hkey));
+      memcpy(hkey, key, key_length);
+      entry = hash_search(state->values, hkey, HASH_FIND, NULL);
+      if (entry == NULL || entry->value == NULL)
+        slot->tts_isnull[attno] = true;
+      else
+        slot->tts_values[attno] = PointerGetDatum(entry->value);
+    }
+  return ExecStoreVirtualTuple(slot);
 }
 
-Datum memcache_stats(PG_FUNCTION_ARGS)
+static bool memcache_batch_recheck(ScanState *node, TupleTableSlot *slot)
 {
-  StringInfoData strbuf;
-  memcached_return rc;
-  memcached_server_fn callbacks[1];
+  return true;
+}
 
-  initStringInfo(&strbuf);
-  callbacks[0] = (memcached_server_fn) server_stat_function;
-  rc = memcached_server_cursor(globals.mc, callbacks, (void *) &strbuf, 1);
+static TupleTableSlot *memcache_batch_exec(CustomScanState *node)
+{
+  return ExecScan(&node->ss, (ExecScanAccessMtd) memcache_batch_next,
+                  (ExecScanRecheckMtd) memcache_batch_recheck);
+}
 
-  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_SOME_ERRORS)
-    elog(WARNING, "pgmemcache: memcache_stats: %s",
-                  memcached_strerror(globals.mc, rc));
+static void memcache_batch_end(CustomScanState *node)
+{
+  MemcacheBatchState *state = (MemcacheBatchState *) node;
 
-  PG_RETURN_DATUM(DirectFunctionCall1(textin, CStringGetDatum(strbuf.data)));
+  ExecEndNode(outerPlanState(state));
+  MemoryContextDelete(state->batch_cxt);
+}
+
+static void memcache_batch_rescan(CustomScanState *node)
+{
+  MemcacheBatchState *state = (MemcacheBatchState *) node;
+  PlanState *outer = outerPlanState(state);
+
+  state->nrows = 0;
+  state->next_row = 0;
+  state->child_done = false;
+  if (outer->chgParam == NULL)
+    ExecReScan(outer);
+}
+
+static void memcache_batch_explain(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+  MemcacheBatchState *state = (MemcacheBatchState *) node;
+
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 110000)
+  ExplainPropertyInteger("Batch Size", NULL, state->batch_size, es);
+  if (es->analyze)
+    ExplainPropertyInteger("Memcache Requests", NULL, state->nrequests, es);
+#else
+  ExplainPropertyInteger("Batch Size", state->batch_size, es);
+  if (es->analyze)
+    ExplainPropertyLong("Memcache Requests", state->nrequests, es);
+#endif
 }
+
+#endif /* PG_VERSION_NUM >= 90500 */
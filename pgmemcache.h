@@ -15,17 +15,63 @@
 
 #include "postgres.h"
 #include <inttypes.h>
+#include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "access/heapam.h"
 #include "access/htup.h"
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90300)
+#include "access/htup_details.h"
+#endif
 #include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "executor/spi.h"
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90600)
+#include "access/parallel.h"
+#endif
 #include "fmgr.h"
 #include "funcapi.h"
 #include "lib/stringinfo.h"
+#include "miscadmin.h"
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90600)
+#include "nodes/extensible.h"
+#endif
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/planner.h"
+#include "pgstat.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/datetime.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
 #include "utils/lsyscache.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/uuid.h"
+
+#if !defined(PG_VERSION_NUM) || (PG_VERSION_NUM < 110000)
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
 
 #undef PACKAGE_BUGREPORT
 #undef PACKAGE_NAME
@@ -46,6 +92,9 @@ void _PG_fini(void);
 #define PG_MEMCACHE_CMD_SET             0x0004
 #define PG_MEMCACHE_CMD_PREPEND         0x0008
 #define PG_MEMCACHE_CMD_APPEND          0x0010
+#define PG_MEMCACHE_CMD_DELETE          0x0020
+#define PG_MEMCACHE_CMD_INCR            0x0040
+#define PG_MEMCACHE_CMD_DECR            0x0080
 #define PG_MEMCACHE_CMD_MASK            0x00ff
 #define PG_MEMCACHE_TYPE_INTERVAL       0x0100
 #define PG_MEMCACHE_TYPE_TIMESTAMP      0x0200
@@ -69,6 +118,29 @@ Datum memcache_prepend_absexpire(PG_FUNCTION_ARGS);
 Datum memcache_append(PG_FUNCTION_ARGS);
 Datum memcache_append_absexpire(PG_FUNCTION_ARGS);
 Datum memcache_stats(PG_FUNCTION_ARGS);
+Datum memcache_snapshot(PG_FUNCTION_ARGS);
+Datum memcache_restore(PG_FUNCTION_ARGS);
+Datum memcache_get_lease(PG_FUNCTION_ARGS);
+Datum memcache_invalidate(PG_FUNCTION_ARGS);
+Datum memcache_counter_flush(PG_FUNCTION_ARGS);
+Datum memcache_rate_limit(PG_FUNCTION_ARGS);
+Datum memcache_nextval(PG_FUNCTION_ARGS);
+Datum memcache_setval(PG_FUNCTION_ARGS);
+Datum memcache_lock(PG_FUNCTION_ARGS);
+Datum memcache_lock_renew(PG_FUNCTION_ARGS);
+Datum memcache_unlock(PG_FUNCTION_ARGS);
+Datum memcache_cached_query(PG_FUNCTION_ARGS);
+Datum memcache_cluster_define(PG_FUNCTION_ARGS);
+Datum memcache_migration_stats(PG_FUNCTION_ARGS);
+Datum memcache_migration_reset(PG_FUNCTION_ARGS);
+Datum memcache_value_sizes(PG_FUNCTION_ARGS);
+Datum memcache_value_sizes_reset(PG_FUNCTION_ARGS);
+Datum memcache_slab_report(PG_FUNCTION_ARGS);
+Datum memcache_slab_advice(PG_FUNCTION_ARGS);
+Datum memcache_hll_add(PG_FUNCTION_ARGS);
+Datum memcache_hll_count(PG_FUNCTION_ARGS);
+Datum memcache_key(PG_FUNCTION_ARGS);
+Datum memcache_hot_keys(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(memcache_add);
 PG_FUNCTION_INFO_V1(memcache_add_absexpire);
@@ -88,5 +160,28 @@ PG_FUNCTION_INFO_V1(memcache_prepend_absexpire);
 PG_FUNCTION_INFO_V1(memcache_append);
 PG_FUNCTION_INFO_V1(memcache_append_absexpire);
 PG_FUNCTION_INFO_V1(memcache_stats);
+PG_FUNCTION_INFO_V1(memcache_snapshot);
+PG_FUNCTION_INFO_V1(memcache_restore);
+PG_FUNCTION_INFO_V1(memcache_get_lease);
+PG_FUNCTION_INFO_V1(memcache_invalidate);
+PG_FUNCTION_INFO_V1(memcache_counter_flush);
+PG_FUNCTION_INFO_V1(memcache_rate_limit);
+PG_FUNCTION_INFO_V1(memcache_nextval);
+PG_FUNCTION_INFO_V1(memcache_setval);
+PG_FUNCTION_INFO_V1(memcache_lock);
+PG_FUNCTION_INFO_V1(memcache_lock_renew);
+PG_FUNCTION_INFO_V1(memcache_unlock);
+PG_FUNCTION_INFO_V1(memcache_cached_query);
+PG_FUNCTION_INFO_V1(memcache_cluster_define);
+PG_FUNCTION_INFO_V1(memcache_migration_stats);
+PG_FUNCTION_INFO_V1(memcache_migration_reset);
+PG_FUNCTION_INFO_V1(memcache_value_sizes);
+PG_FUNCTION_INFO_V1(memcache_value_sizes_reset);
+PG_FUNCTION_INFO_V1(memcache_slab_report);
+PG_FUNCTION_INFO_V1(memcache_slab_advice);
+PG_FUNCTION_INFO_V1(memcache_hll_add);
+PG_FUNCTION_INFO_V1(memcache_hll_count);
+PG_FUNCTION_INFO_V1(memcache_key);
+PG_FUNCTION_INFO_V1(memcache_hot_keys);
 
 #endif /* !PGMEMCACHE_H */
@@ -0,0 +1,168 @@
+/*
+ * Client library backends of pgmemcache.
+ *
+ * Copyright (c) 2012-2014 Ohmu Ltd <opensource@ohmu.fi>
+ *
+ * See the file LICENSE for distribution terms.
+ *
+ * pgmemcache.c talks to memcached through the operations of the backend
+ * that was selected at build time: pgmemcache_libmemcached.c for
+ * libmemcached and the libmemcached compatible meta protocol and mock
+ * engines (USE_LIBMEMCACHED, USE_META and USE_MOCK), or pgmemcache_omcache.c
+ * for OMcache (USE_OMCACHE).  Each backend defines memcache_backend, and
+ * the context type, the return codes, memcached_strerror(),
+ * memcached_free() and the server cursor come from the libmemcached
+ * compatible API of its library.
+ */
+
+#ifndef PGMEMCACHE_BACKEND_H
+#define PGMEMCACHE_BACKEND_H
+
+#ifdef USE_OMCACHE
+/* the timeouts of the libmemcached compatible omcache API */
+extern int pgmemcache_omcache_read_timeout(void);
+extern int pgmemcache_omcache_write_timeout(void);
+#define MEMCACHED_READ_TIMEOUT pgmemcache_omcache_read_timeout()
+#define MEMCACHED_WRITE_TIMEOUT pgmemcache_omcache_write_timeout()
+#include "omcache_libmemcached.h"
+#elif defined(USE_META)
+#include "pgmemcache_meta.h"
+#else
+#include <libmemcached/memcached.h>
+#endif /* USE_OMCACHE */
+
+#include "pgmemcache.h"
+
+/* A single entry of a server list. */
+typedef struct
+{
+  char *host;         /* hostname or unix socket path */
+  unsigned int port;  /* 0 for unix sockets */
+  uint32_t weight;    /* 0 for the default weight */
+} server_spec;
+
+/* How requests are sent, see set_buffering */
+typedef enum
+{
+  MEMCACHE_SEND_WAIT,     /* send each request and wait for its reply */
+  MEMCACHE_SEND_BUFFER,   /* queue requests until flush_buffers */
+  MEMCACHE_SEND_NOREPLY   /* queue requests and never read their replies */
+} memcache_send_mode;
+
+/* The buffering settings to restore after set_buffering */
+typedef struct
+{
+  uint64_t buffer_requests;
+  uint64_t noreply;
+} memcache_send_state;
+
+/* A value returned by a multi-get, valid until the next call */
+typedef struct
+{
+  const char *key;
+  size_t key_length;
+  const char *value;
+  size_t value_length;
+  uint32_t flags;
+} memcache_value;
+
+typedef enum
+{
+  MEMCACHE_MGET_VALUE,    /* the next value was returned */
+  MEMCACHE_MGET_DONE,     /* all responses have been read */
+  MEMCACHE_MGET_EXPIRED,  /* the deadline passed, the rest were dropped */
+  MEMCACHE_MGET_ERROR
+} memcache_mget_status;
+
+/* State of a multi-get, defined by each backend */
+typedef struct memcache_mget memcache_mget;
+
+/* Called for each statistic of each server */
+typedef void (*memcache_stat_fn)(const char *server, unsigned int port,
+                                 const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 void *context);
+
+typedef struct
+{
+  /* Defines the backend's own settings, called from _PG_init */
+  void (*init)(void);
+
+  /* Creates a context with pgmemcache's defaults. */
+  memcached_st *(*create)(void);
+  /* Applies the timeout settings in milliseconds, -1 leaves the library's
+   * default or the timeout set as a behavior in place. */
+  void (*set_timeouts)(memcached_st *mc, int read_timeout, int write_timeout,
+                       int connect_timeout);
+  void (*set_sasl)(memcached_st *mc, const char *username, const char *password);
+  /* Returns why a server can't be used, NULL if it can. */
+  char *(*check_server)(const server_spec *spec);
+  /* Adds the servers in added to a context that has the ones in current. */
+  memcached_return (*add_servers)(memcached_st *mc, List *current, List *added);
+  /* Whether add_servers replaces the whole server list, so that a context
+   * doesn't have to be recreated to remove servers from it. */
+  bool replaces_servers;
+  /* Returns why a behavior can't be set, NULL if it can. */
+  char *(*check_behavior)(const char *flag, const char *data);
+  memcached_return (*set_behavior)(memcached_st *mc, const char *flag, const char *data);
+  /* Copies a behavior from another context, used to restore defaults from
+   * a fresh one.  NULL if behaviors can't be read back, the context must
+   * then be recreated instead. */
+  void (*copy_behavior)(memcached_st *mc, memcached_st *from, const char *flag);
+  /* Sets how the following requests are sent, the old settings are saved
+   * in state for restore_buffering. */
+  void (*set_buffering)(memcached_st *mc, memcache_send_mode mode, memcache_send_state *state);
+  void (*restore_buffering)(memcached_st *mc, const memcache_send_state *state);
+
+  /* Fetches a key, also returns its CAS value if cas isn't NULL. */
+  text *(*get)(memcached_st *mc, const char *key, size_t key_length, uint64_t *cas,
+               memcached_return *rc);
+  /* Sends a multi-get, responses are read with mget_next until it returns
+   * something else than MEMCACHE_MGET_VALUE and the state is freed with
+   * mget_end.  With a deadline the values received before it are
+   * returned. */
+  memcache_mget *(*mget)(memcached_st *mc, const char *const *keys, const size_t *key_lengths,
+                         size_t nkeys, TimestampTz deadline, memcached_return *rc);
+  memcache_mget_status (*mget_next)(memcached_st *mc, memcache_mget *state,
+                                    memcache_value *value, memcached_return *rc);
+  void (*mget_end)(memcached_st *mc, memcache_mget *state);
+  /* Stores with one of PG_MEMCACHE_CMD_ADD, _REPLACE, _SET, _PREPEND or
+   * _APPEND, a set with a non-zero cas only succeeds if the key's CAS value
+   * is still the same. */
+  memcached_return (*store)(memcached_st *mc, int cmd, const char *key, size_t key_length,
+                            const char *value, size_t value_length, time_t expiration,
+                            uint32_t flags, uint64_t cas);
+  /* Increments or decrements with PG_MEMCACHE_CMD_INCR or _DECR, creating
+   * the key with initial unless expiration is MEMCACHED_EXPIRATION_NOT_ADD. */
+  memcached_return (*delta)(memcached_st *mc, int cmd, const char *key, size_t key_length,
+                            uint64_t offset, uint64_t initial, time_t expiration,
+                            uint64_t *value);
+  memcached_return (*remove)(memcached_st *mc, const char *key, size_t key_length, time_t hold);
+  memcached_return (*flush)(memcached_st *mc, time_t expiration);
+  memcached_return (*flush_buffers)(memcached_st *mc);
+
+  /* Identifies the server of a key, NULL if it's not known. */
+  const void *(*server_for_key)(memcached_st *mc, const char *key, size_t key_length);
+  /* Appends host:port of the server of a key, returns false if it's not
+   * known. */
+  bool (*server_name)(memcached_st *mc, const char *key, size_t key_length, StringInfo buf);
+  /* Appends the general statistics of a server as "name: value" lines. */
+  memcached_return (*server_stats)(memcached_st *mc, memcached_server_instance_st server,
+                                   StringInfo buf);
+  /* Calls fn for every statistic of a group, e.g. "slabs", of every
+   * server. */
+  memcached_return (*group_stats)(memcached_st *mc, const char *group, memcache_stat_fn fn,
+                                  void *context);
+
+  /* Meta protocol leases and invalidation, NULL if not supported.
+   * get_lease returns NULL for a miss or an item that is only a placeholder
+   * holding the lease. */
+  text *(*get_lease)(memcached_st *mc, const char *key, size_t key_length, time_t lease,
+                     bool *stale, bool *win, memcached_return *rc);
+  memcached_return (*invalidate)(memcached_st *mc, const char *key, size_t key_length,
+                                 time_t stale);
+} memcache_backend_ops;
+
+extern const memcache_backend_ops memcache_backend;
+
+#endif /* !PGMEMCACHE_BACKEND_H */
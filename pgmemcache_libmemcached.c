@@ -0,0 +1,633 @@
+/*
+ * libmemcached backend of pgmemcache.
+ *
+ * Copyright (c) 2004-2005 Sean Chittenden <sean@chittenden.org>
+ * Copyright (c) 2007-2008 Neil Conway <neilc@samurai.com>
+ * Copyright (c) 2007 Open Technology Group, Inc. <http://www.otg-nc.com>
+ * Copyright (c) 2008-2013 Hannu Valtonen <hannu.valtonen@ohmu.fi>
+ * Copyright (c) 2012-2014 Ohmu Ltd <opensource@ohmu.fi>
+ *
+ * See the file LICENSE for distribution terms.
+ *
+ * This implements the operations of pgmemcache_backend.h with the
+ * libmemcached API, which is also provided by the meta protocol client
+ * (USE_META) and the in-process mock engine (USE_MOCK).
+ */
+
+#include "pgmemcache_backend.h"
+
+struct memcache_mget
+{
+  TimestampTz deadline;           /* end of the latency budget or 0 */
+  MemoryContext cxt;
+  char key[MEMCACHED_MAX_KEY];    /* memcached_fetch() copies keys here */
+  char *value;                    /* copy of the last value */
+};
+
+/* Milliseconds left of a latency budget, at least 1. */
+static long budget_remaining(TimestampTz deadline)
+{
+  long secs;
+  int usecs;
+
+  TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+  return Max(secs * 1000 + usecs / 1000, 1);
+}
+
+/* Limit the next request to the time left of a latency budget, returns the
+ * poll timeout to restore after it. */
+static uint64_t budget_limit_request(memcached_st *mc, TimestampTz deadline)
+{
+  uint64_t timeout = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+  long remaining = budget_remaining(deadline);
+
+#ifdef USE_META
+  meta_set_operation_timeout(mc, Min(remaining, (long) timeout));
+#else
+  if ((uint64_t) remaining < timeout)
+    memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, remaining);
+#endif /* USE_META */
+  return timeout;
+}
+
+static void lm_init(void)
+{
+#ifdef USE_MOCK
+  DefineCustomIntVariable("pgmemcache.mock_latency",
+                          "Simulated round trip time of the in-process mock engine.",
+                          "Each request that would be sent to a server waits for this many microseconds.",
+                          &mock_latency,
+                          0,
+                          0,
+                          INT_MAX,
+                          PGC_USERSET,
+                          0,
+#if defined(PG_VERSION_NUM) && (PG_VERSION_NUM >= 90100)
+                          NULL,
+#endif
+                          NULL,
+                          NULL);
+#endif /* USE_MOCK */
+}
+
+static memcached_st *lm_create(void)
+{
+  memcached_st *mc = memcached_create(NULL);
+  int rc;
+
+  /* Always use the memcache binary protocol as required for
+     memcached_(increment|decrement)_with_initial. */
+  rc = memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+  if (rc != MEMCACHED_SUCCESS)
+    elog(WARNING, "pgmemcache: memcached_behavior_set(BINARY_PROTOCOL, 1): %s",
+                  memcached_strerror(mc, rc));
+  return mc;
+}
+
+/* The socket timeouts of libmemcached apply to new connections. */
+static void lm_set_timeouts(memcached_st *mc, int read_timeout, int write_timeout,
+                            int connect_timeout)
+{
+  if (read_timeout >= 0)
+    {
+      memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, read_timeout);
+      memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_RCV_TIMEOUT, (uint64_t) read_timeout * 1000);
+    }
+  if (write_timeout >= 0)
+    memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_SND_TIMEOUT, (uint64_t) write_timeout * 1000);
+  if (connect_timeout >= 0)
+    memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, connect_timeout);
+}
+
+static void lm_set_sasl(memcached_st *mc, const char *username, const char *password)
+{
+#if LIBMEMCACHED_WITH_SASL_SUPPORT
+  static bool sasl_initialized = false;
+  int rc;
+
+  if (username == NULL || strlen(username) == 0 || password == NULL || strlen(password) == 0)
+    {
+      memcached_destroy_sasl_auth_data(mc);
+      return;
+    }
+
+  rc = memcached_set_sasl_auth_data(mc, username, password);
+  if (rc != MEMCACHED_SUCCESS)
+    elog(ERROR, "pgmemcache: memcached_set_sasl_auth_data: %s",
+                memcached_strerror(mc, rc));
+  if (!sasl_initialized)
+    {
+      rc = sasl_client_init(NULL);
+      if (rc != SASL_OK)
+        elog(ERROR, "pgmemcache: sasl_client_init failed: %d", rc);
+      sasl_initialized = true;
+    }
+#endif
+}
+
+static char *lm_check_server(const server_spec *spec)
+{
+  return NULL;
+}
+
+static memcached_return lm_add_servers(memcached_st *mc, List *current, List *added)
+{
+  memcached_return rc = MEMCACHED_SUCCESS;
+  ListCell *lc;
+
+  foreach(lc, added)
+    {
+      server_spec *spec = (server_spec *) lfirst(lc);
+
+      if (spec->port == 0)
+        rc = memcached_server_add_unix_socket_with_weight(mc, spec->host, spec->weight);
+      else
+        rc = memcached_server_add_with_weight(mc, spec->host, spec->port, spec->weight);
+      if (rc != MEMCACHED_SUCCESS)
+        break;
+    }
+  return rc;
+}
+
+#define MC_STR_TO_ENUM(d,v) \
+  if (strcmp(value, "MEMCACHED_" #d "_" #v) == 0 || strcmp(value, #v) == 0) \
+      return MEMCACHED_##d##_##v
+
+static memcached_behavior get_memcached_behavior_flag(const char *value)
+{
+  MC_STR_TO_ENUM(BEHAVIOR, BINARY_PROTOCOL);
+  MC_STR_TO_ENUM(BEHAVIOR, BUFFER_REQUESTS);
+  MC_STR_TO_ENUM(BEHAVIOR, CACHE_LOOKUPS);
+  MC_STR_TO_ENUM(BEHAVIOR, CONNECT_TIMEOUT);
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000003
+  MC_STR_TO_ENUM(BEHAVIOR, DEAD_TIMEOUT);
+#endif
+  MC_STR_TO_ENUM(BEHAVIOR, DISTRIBUTION);
+  MC_STR_TO_ENUM(BEHAVIOR, HASH);
+  MC_STR_TO_ENUM(BEHAVIOR, HASH_WITH_PREFIX_KEY);
+  MC_STR_TO_ENUM(BEHAVIOR, IO_BYTES_WATERMARK);
+  MC_STR_TO_ENUM(BEHAVIOR, IO_KEY_PREFETCH);
+  MC_STR_TO_ENUM(BEHAVIOR, IO_MSG_WATERMARK);
+  MC_STR_TO_ENUM(BEHAVIOR, KETAMA);
+  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_HASH);
+  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_WEIGHTED);
+  MC_STR_TO_ENUM(BEHAVIOR, NO_BLOCK);
+  MC_STR_TO_ENUM(BEHAVIOR, NOREPLY);
+  MC_STR_TO_ENUM(BEHAVIOR, NUMBER_OF_REPLICAS);
+  MC_STR_TO_ENUM(BEHAVIOR, POLL_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, RANDOMIZE_REPLICA_READ);
+  MC_STR_TO_ENUM(BEHAVIOR, RCV_TIMEOUT);
+#if LIBMEMCACHED_VERSION_HEX >= 0x00049000
+  MC_STR_TO_ENUM(BEHAVIOR, REMOVE_FAILED_SERVERS);
+#endif
+  MC_STR_TO_ENUM(BEHAVIOR, RETRY_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, SERVER_FAILURE_LIMIT);
+  MC_STR_TO_ENUM(BEHAVIOR, SND_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, SOCKET_RECV_SIZE);
+  MC_STR_TO_ENUM(BEHAVIOR, SOCKET_SEND_SIZE);
+  MC_STR_TO_ENUM(BEHAVIOR, SORT_HOSTS);
+  MC_STR_TO_ENUM(BEHAVIOR, SUPPORT_CAS);
+  MC_STR_TO_ENUM(BEHAVIOR, TCP_NODELAY);
+  MC_STR_TO_ENUM(BEHAVIOR, USER_DATA);
+  MC_STR_TO_ENUM(BEHAVIOR, USE_UDP);
+  MC_STR_TO_ENUM(BEHAVIOR, VERIFY_KEY);
+
+  return (memcached_behavior) -1;
+}
+
+static memcached_hash get_memcached_hash_type(const char *value)
+{
+  MC_STR_TO_ENUM(HASH, MURMUR);
+  MC_STR_TO_ENUM(HASH, MD5);
+  MC_STR_TO_ENUM(HASH, JENKINS);
+  MC_STR_TO_ENUM(HASH, HSIEH);
+  MC_STR_TO_ENUM(HASH, FNV1A_64);
+  MC_STR_TO_ENUM(HASH, FNV1A_32);
+  MC_STR_TO_ENUM(HASH, FNV1_64);
+  MC_STR_TO_ENUM(HASH, FNV1_32);
+  MC_STR_TO_ENUM(HASH, DEFAULT);
+  MC_STR_TO_ENUM(HASH, CRC);
+
+  return (memcached_hash) -1;
+}
+
+static memcached_server_distribution get_memcached_distribution_type(const char *value)
+{
+  MC_STR_TO_ENUM(DISTRIBUTION, RANDOM);
+  MC_STR_TO_ENUM(DISTRIBUTION, MODULA);
+  MC_STR_TO_ENUM(DISTRIBUTION, CONSISTENT_KETAMA);
+  MC_STR_TO_ENUM(DISTRIBUTION, CONSISTENT);
+
+  return (memcached_server_distribution) -1;
+}
+
+/* Parse a behavior flag and its data, returns why they're invalid or
+ * NULL. */
+static char *parse_behavior(const char *flag, const char *data, memcached_behavior *bkey,
+                            uint64_t *value)
+{
+  char *endptr;
+
+  *bkey = get_memcached_behavior_flag(flag);
+  if ((int) *bkey == -1)
+    return psprintf("unknown behavior flag: %s", flag);
+  switch (*bkey)
+    {
+    case MEMCACHED_BEHAVIOR_HASH:
+    case MEMCACHED_BEHAVIOR_KETAMA_HASH:
+      *value = get_memcached_hash_type(data);
+      if ((int) *value == -1)
+        return psprintf("invalid hash name: %s", data);
+      break;
+    case MEMCACHED_BEHAVIOR_DISTRIBUTION:
+      *value = get_memcached_distribution_type(data);
+      if ((int) *value == -1)
+        return psprintf("invalid distribution name: %s", data);
+      break;
+    default:
+      *value = strtol(data, &endptr, 10);
+      if (endptr == data)
+        return psprintf("invalid behavior param %s: %s", flag, data);
+    }
+  return NULL;
+}
+
+static char *lm_check_behavior(const char *flag, const char *data)
+{
+  memcached_behavior bkey;
+  uint64_t value;
+
+  return parse_behavior(flag, data, &bkey, &value);
+}
+
+static memcached_return lm_set_behavior(memcached_st *mc, const char *flag, const char *data)
+{
+  memcached_behavior bkey;
+  uint64_t value;
+  char *error = parse_behavior(flag, data, &bkey, &value);
+
+  if (error)
+    elog(ERROR, "pgmemcache: %s", error);
+  return memcached_behavior_set(mc, bkey, value);
+}
+
+static void lm_copy_behavior(memcached_st *mc, memcached_st *from, const char *flag)
+{
+  memcached_behavior bkey = get_memcached_behavior_flag(flag);
+
+  if ((int) bkey == -1)
+    elog(ERROR, "pgmemcache: unknown behavior flag: %s", flag);
+  memcached_behavior_set(mc, bkey, memcached_behavior_get(from, bkey));
+}
+
+/* libmemcached only uses the quiet binary protocol commands with noreply,
+ * buffering alone still waits for the replies of increments and
+ * decrements. */
+static void lm_set_buffering(memcached_st *mc, memcache_send_mode mode, memcache_send_state *state)
+{
+  state->buffer_requests = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+  state->noreply = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_NOREPLY);
+  memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, mode != MEMCACHE_SEND_WAIT);
+  if (mode != MEMCACHE_SEND_BUFFER)
+    memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, mode == MEMCACHE_SEND_NOREPLY);
+}
+
+static void lm_restore_buffering(memcached_st *mc, const memcache_send_state *state)
+{
+  memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, state->buffer_requests);
+  memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, state->noreply);
+}
+
+static text *lm_get(memcached_st *mc, const char *key, size_t key_length, uint64_t *cas,
+                    memcached_return *rc)
+{
+  memcached_result_st *result = NULL;
+  uint64_t old_cas;
+  text *ret = NULL;
+
+  if (cas == NULL)
+    {
+      size_t value_length = 0;
+      uint32_t flags;
+      char *value = memcached_get(mc, key, key_length, &value_length, &flags, rc);
+
+      if (*rc != MEMCACHED_SUCCESS)
+        return NULL;
+      ret = (text *) palloc(value_length + VARHDRSZ);
+      SET_VARSIZE(ret, value_length + VARHDRSZ);
+      memcpy(VARDATA(ret), value, value_length);
+      free(value);
+      return ret;
+    }
+
+  /* the text protocol only returns CAS values to gets */
+  *cas = 0;
+  old_cas = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_SUPPORT_CAS);
+  memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+  *rc = memcached_mget(mc, &key, &key_length, 1);
+  if (*rc == MEMCACHED_SUCCESS)
+    {
+      while ((result = memcached_fetch_result(mc, result, rc)) != NULL)
+        if (ret == NULL)
+          {
+            size_t length = memcached_result_length(result);
+
+            ret = (text *) palloc(length + VARHDRSZ);
+            SET_VARSIZE(ret, length + VARHDRSZ);
+            memcpy(VARDATA(ret), memcached_result_value(result), length);
+            *cas = memcached_result_cas(result);
+          }
+      if (ret != NULL)
+        *rc = MEMCACHED_SUCCESS;
+      else if (*rc == MEMCACHED_END)
+        *rc = MEMCACHED_NOTFOUND;
+    }
+  memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, old_cas);
+  return ret;
+}
+
+static memcache_mget *lm_mget(memcached_st *mc, const char *const *keys, const size_t *key_lengths,
+                              size_t nkeys, TimestampTz deadline, memcached_return *rc)
+{
+  memcache_mget *state = palloc0(sizeof(memcache_mget));
+
+  state->deadline = deadline;
+  state->cxt = CurrentMemoryContext;
+  if (deadline)
+    {
+      uint64_t timeout = budget_limit_request(mc, deadline);
+
+      *rc = memcached_mget(mc, keys, key_lengths, nkeys);
+      memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, timeout);
+      /* with a budget the results of the servers that answered in time
+       * are returned */
+      if (*rc == MEMCACHED_SOME_ERRORS || *rc == MEMCACHED_TIMEOUT)
+        *rc = MEMCACHED_SUCCESS;
+    }
+  else
+    *rc = memcached_mget(mc, keys, key_lengths, nkeys);
+  return state;
+}
+
+static memcache_mget_status lm_mget_next(memcached_st *mc, memcache_mget *state,
+                                         memcache_value *value, memcached_return *rc)
+{
+  size_t key_length = 0, value_length = 0;
+  uint32_t flags = 0;
+  char *fetched;
+
+  if (state->value != NULL)
+    {
+      pfree(state->value);
+      state->value = NULL;
+    }
+
+#ifdef USE_META
+  /* the meta client has received all responses in memcached_mget() */
+  fetched = memcached_fetch(mc, state->key, &key_length, &value_length, &flags, rc);
+#else
+  if (state->deadline)
+    {
+      for (;;)
+        {
+          uint64_t timeout;
+
+          if (GetCurrentTimestamp() >= state->deadline)
+            *rc = MEMCACHED_TIMEOUT;
+          else
+            {
+              timeout = budget_limit_request(mc, state->deadline);
+              fetched = memcached_fetch(mc, state->key, &key_length, &value_length, &flags, rc);
+              memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, timeout);
+            }
+          if (*rc == MEMCACHED_TIMEOUT)
+            {
+              /* the responses still on their way are dropped with the
+               * connections */
+              memcached_quit(mc);
+              return MEMCACHE_MGET_EXPIRED;
+            }
+          if (*rc == MEMCACHED_SUCCESS || *rc == MEMCACHED_END || *rc == MEMCACHED_NOTFOUND)
+            break;
+          /* libmemcached has reset the connection of the server whose
+           * response failed and counted the failure, the responses of
+           * the other servers are still read */
+          elog(DEBUG1, "pgmemcache: memcached_fetch: %s", memcached_strerror(mc, *rc));
+          CHECK_FOR_INTERRUPTS();
+        }
+    }
+  else
+    fetched = memcached_fetch(mc, state->key, &key_length, &value_length, &flags, rc);
+#endif /* USE_META */
+
+  if (*rc == MEMCACHED_END || *rc == MEMCACHED_NOTFOUND)
+    {
+      *rc = MEMCACHED_SUCCESS;
+      return MEMCACHE_MGET_DONE;
+    }
+  if (*rc != MEMCACHED_SUCCESS)
+    return MEMCACHE_MGET_ERROR;
+
+  state->value = MemoryContextAlloc(state->cxt, value_length + 1);
+  memcpy(state->value, fetched, value_length);
+  free(fetched);
+  value->key = state->key;
+  value->key_length = key_length;
+  value->value = state->value;
+  value->value_length = value_length;
+  value->flags = flags;
+  return MEMCACHE_MGET_VALUE;
+}
+
+static void lm_mget_end(memcached_st *mc, memcache_mget *state)
+{
+  if (state->value != NULL)
+    pfree(state->value);
+  pfree(state);
+}
+
+static memcached_return lm_store(memcached_st *mc, int cmd, const char *key, size_t key_length,
+                                 const char *value, size_t value_length, time_t expiration,
+                                 uint32_t flags, uint64_t cas)
+{
+  switch (cmd)
+    {
+    case PG_MEMCACHE_CMD_ADD:
+      return memcached_add(mc, key, key_length, value, value_length, expiration, flags);
+    case PG_MEMCACHE_CMD_REPLACE:
+      return memcached_replace(mc, key, key_length, value, value_length, expiration, flags);
+    case PG_MEMCACHE_CMD_SET:
+      if (cas != 0)
+        return memcached_cas(mc, key, key_length, value, value_length, expiration, flags, cas);
+      return memcached_set(mc, key, key_length, value, value_length, expiration, flags);
+    case PG_MEMCACHE_CMD_PREPEND:
+      return memcached_prepend(mc, key, key_length, value, value_length, expiration, flags);
+    case PG_MEMCACHE_CMD_APPEND:
+      return memcached_append(mc, key, key_length, value, value_length, expiration, flags);
+    default:
+      elog(ERROR, "pgmemcache: unknown set command type: %d", cmd);
+    }
+  return MEMCACHED_FAILURE;
+}
+
+static memcached_return lm_delta(memcached_st *mc, int cmd, const char *key, size_t key_length,
+                                 uint64_t offset, uint64_t initial, time_t expiration,
+                                 uint64_t *value)
+{
+  if (cmd == PG_MEMCACHE_CMD_INCR)
+    return memcached_increment_with_initial(mc, key, key_length, offset, initial,
+                                            expiration, value);
+  return memcached_decrement_with_initial(mc, key, key_length, offset, initial,
+                                          expiration, value);
+}
+
+static memcached_return lm_remove(memcached_st *mc, const char *key, size_t key_length, time_t hold)
+{
+  return memcached_delete(mc, key, key_length, hold);
+}
+
+static memcached_return lm_flush(memcached_st *mc, time_t expiration)
+{
+  return memcached_flush(mc, expiration);
+}
+
+static memcached_return lm_flush_buffers(memcached_st *mc)
+{
+  return memcached_flush_buffers(mc);
+}
+
+static const void *lm_server_for_key(memcached_st *mc, const char *key, size_t key_length)
+{
+  memcached_return rc;
+  memcached_server_instance_st server = memcached_server_by_key(mc, key, key_length, &rc);
+
+  return rc == MEMCACHED_SUCCESS ? (const void *) server : NULL;
+}
+
+static bool lm_server_name(memcached_st *mc, const char *key, size_t key_length, StringInfo buf)
+{
+  memcached_return rc;
+  memcached_server_instance_st server = memcached_server_by_key(mc, key, key_length, &rc);
+
+  if (server == NULL || rc != MEMCACHED_SUCCESS)
+    return false;
+  appendStringInfo(buf, "%s:%u", memcached_server_name(server), memcached_server_port(server));
+  return true;
+}
+
+static memcached_return lm_server_stats(memcached_st *mc, memcached_server_instance_st server,
+                                        StringInfo buf)
+{
+  memcached_stat_st stat;
+  memcached_return rc;
+  char **list, **stat_ptr;
+
+  rc = memcached_stat_servername(&stat, NULL, memcached_server_name(server),
+                                 memcached_server_port(server));
+  if (rc != MEMCACHED_SUCCESS)
+    return rc;
+
+  list = memcached_stat_get_keys(mc, &stat, &rc);
+  if (rc != MEMCACHED_SUCCESS)
+    return rc;
+
+  for (stat_ptr = list; stat_ptr && *stat_ptr; stat_ptr++)
+    {
+      char *value = memcached_stat_get_value(mc, &stat, *stat_ptr, &rc);
+      appendStringInfo(buf, "%s: %s\n", *stat_ptr, value);
+      free(value);
+    }
+  free(list);
+  return MEMCACHED_SUCCESS;
+}
+
+typedef struct
+{
+  memcache_stat_fn fn;
+  void *context;
+} group_stats_state;
+
+static memcached_return_t group_stat_function(memcached_server_instance_st server,
+                                              const char *key, size_t key_length,
+                                              const char *value, size_t value_length,
+                                              void *context)
+{
+  group_stats_state *state = (group_stats_state *) context;
+
+  state->fn(memcached_server_name(server), memcached_server_port(server),
+            key, key_length, value, value_length, state->context);
+  return MEMCACHED_SUCCESS;
+}
+
+static memcached_return lm_group_stats(memcached_st *mc, const char *group, memcache_stat_fn fn,
+                                       void *context)
+{
+  group_stats_state state = { fn, context };
+
+  return memcached_stat_execute(mc, group, group_stat_function, &state);
+}
+
+#ifdef USE_META
+static text *lm_get_lease(memcached_st *mc, const char *key, size_t key_length, time_t lease,
+                          bool *stale, bool *win, memcached_return *rc)
+{
+  size_t value_length;
+  uint32_t flags;
+  int lease_flags = 0;
+  char *value;
+  text *ret = NULL;
+
+  value = meta_get_lease(mc, key, key_length, lease, &value_length, &flags, &lease_flags, rc);
+  *stale = (lease_flags & META_LEASE_STALE) != 0;
+  *win = (lease_flags & META_LEASE_WIN) != 0;
+  if (value == NULL)
+    return NULL;
+  /* a miss creates an empty placeholder item holding the lease, it's not
+   * a value */
+  if (!(lease_flags & (META_LEASE_WIN | META_LEASE_WON)) || (lease_flags & META_LEASE_STALE))
+    ret = cstring_to_text_with_len(value, value_length);
+  free(value);
+  return ret;
+}
+
+static memcached_return lm_invalidate(memcached_st *mc, const char *key, size_t key_length,
+                                      time_t stale)
+{
+  return meta_invalidate(mc, key, key_length, stale > 0 ? stale : 0);
+}
+#endif /* USE_META */
+
+const memcache_backend_ops memcache_backend = {
+  lm_init,
+  lm_create,
+  lm_set_timeouts,
+  lm_set_sasl,
+  lm_check_server,
+  lm_add_servers,
+  false,
+  lm_check_behavior,
+  lm_set_behavior,
+  lm_copy_behavior,
+  lm_set_buffering,
+  lm_restore_buffering,
+  lm_get,
+  lm_mget,
+  lm_mget_next,
+  lm_mget_end,
+  lm_store,
+  lm_delta,
+  lm_remove,
+  lm_flush,
+  lm_flush_buffers,
+  lm_server_for_key,
+  lm_server_name,
+  lm_server_stats,
+  lm_group_stats,
+#ifdef USE_META
+  lm_get_lease,
+  lm_invalidate
+#else
+  NULL,
+  NULL
+#endif /* USE_META */
+};
@@ -0,0 +1,1795 @@
+/*
+ * Memcached meta protocol client for pgmemcache.
+ *
+ * Copyright (c) 2012-2014 Ohmu Ltd <opensource@ohmu.fi>
+ *
+ * See the file LICENSE for distribution terms.
+ *
+ * Every request is sent with an opaque token (O flag) and requests are
+ * appended to per-server output buffers, so a single operation can have
+ * any number of requests in flight on all servers.  Responses are matched
+ * to requests by the opaque token where the server echoes it and by order
+ * otherwise.  Multi-gets use quiet mode (q flag) followed by a no-op (mn)
+ * so that misses don't generate any traffic, and buffered stores are sent
+ * quietly and only acknowledged by the no-op sent by
+ * memcached_flush_buffers().
+ *
+ * The client requires the meta protocol syntax of memcached 1.6.13 and
+ * newer.
+ */
+
+#include "postgres.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "pgmemcache_meta.h"
+
+#if !defined(PG_VERSION_NUM) || (PG_VERSION_NUM < 90600)
+#error "the meta protocol engine requires PostgreSQL 9.6 or newer"
+#endif
+
+#define META_DEFAULT_POLL_TIMEOUT 5000     /* ms */
+#define META_DEFAULT_CONNECT_TIMEOUT 4000  /* ms */
+#define META_DEFAULT_RETRY_TIMEOUT 2       /* s */
+#define META_BUFFER_WATERMARK 8192         /* bytes */
+#define META_POINTS_PER_SERVER 160
+#define META_MAX_LINE 2048
+
+#if PG_VERSION_NUM >= 100000
+#define META_WAIT_EVENT , PG_WAIT_EXTENSION
+#else
+#define META_WAIT_EVENT
+#endif
+
+/* the waits exit when the postmaster dies, like lock_sleep() */
+#if PG_VERSION_NUM >= 120000
+#define META_WL_PM_DEATH WL_EXIT_ON_PM_DEATH
+#else
+#define META_WL_PM_DEATH WL_POSTMASTER_DEATH
+#endif
+
+typedef enum
+{
+  META_REQ_GET,
+  META_REQ_STORE,
+  META_REQ_DELTA,
+  META_REQ_DELETE,
+  META_REQ_FLUSH,
+  META_REQ_STATS
+} meta_request_kind;
+
+/* A request of the current operation and its response */
+typedef struct
+{
+  meta_request_kind kind;
+  int server;
+  int next;           /* next request sent to the same server or -1 */
+  bool quiet;
+  bool done;
+  memcached_return_t rc;
+  const char *key;
+  size_t key_length;
+  char *value;
+  size_t value_length;
+  uint32_t flags;
+  uint64_t cas;
+  int lease_flags;
+  uint64_t number;
+  memcached_stat_st *stat;
+  StringInfo stat_lines;  /* NUL separated names and values */
+} meta_request;
+
+struct meta_server
+{
+  char *hostname;       /* hostname or unix socket path */
+  unsigned int port;    /* 0 for unix sockets */
+  uint32_t weight;
+  pgsocket fd;
+  StringInfoData wbuf;  /* requests that haven't been written yet */
+  int wpos;
+  StringInfoData rbuf;  /* received data that hasn't been parsed yet */
+  int rpos;
+  int buffered;         /* quiet requests sent outside operations */
+  TimestampTz retry_at; /* don't reconnect before this after a failure */
+  /* state of the current operation */
+  bool active;          /* waiting for responses */
+  bool expect_mn;       /* the request list ends with a no-op */
+  int head;             /* first request waiting for a response */
+  int tail;
+};
+
+typedef struct
+{
+  uint32_t value;
+  int server;
+} meta_point;
+
+struct memcached_st
+{
+  MemoryContext cxt;
+  MemoryContext opcxt;    /* per operation allocations */
+  MemoryContext mgetcxt;  /* results of the last memcached_mget() */
+  MemoryContext reqcxt;   /* context of the current requests and results */
+  meta_server *servers;
+  int nservers;
+  meta_point *points;
+  int npoints;
+  uint64_t behaviors[MEMCACHED_BEHAVIOR_MAX];
+  uint32_t opaque;
+  /* the current operation */
+  meta_request *requests;
+  int nrequests;
+  int maxrequests;
+  uint32_t opaque_base;
+  /* responses to buffered requests that reported an error */
+  int buffered_errors;
+  /* timeout of the next operation set by meta_set_operation_timeout() */
+  long op_timeout;
+  /* results of memcached_mget() for memcached_fetch() */
+  meta_request *mget_requests;
+  int mget_count;
+  int mget_pos;
+  memcached_result_st *mget_result;
+  /* the latch and the connected servers, kept across operations and
+   * rebuilt when a connection is opened or closed */
+  WaitEventSet *wait_set;
+  bool wait_stale;
+  int *wait_pos;          /* position of each server or -1 */
+  uint32_t *wait_events;  /* the events each server is waited for */
+  WaitEvent *wait_occurred;
+};
+
+static const char *meta_errors[] = {
+  "SUCCESS",
+  "FAILURE",
+  "CONNECTION FAILURE",
+  "PROTOCOL ERROR",
+  "CLIENT ERROR",
+  "SERVER ERROR",
+  "CONNECTION DATA EXISTS",
+  "NOT STORED",
+  "NOT FOUND",
+  "MEMORY ALLOCATION FAILURE",
+  "SOME ERRORS WERE REPORTED",
+  "NO SERVERS DEFINED",
+  "END OF RESULTS",
+  "ACTION QUEUED",
+  "A TIMEOUT OCCURRED",
+  "ACTION NOT SUPPORTED",
+  "A BAD KEY WAS PROVIDED/CHARACTERS OUT OF RANGE",
+  "INVALID ARGUMENTS",
+};
+
+static void meta_close(memcached_st *mc, meta_server *srv);
+
+
+/*
+ * Key distribution
+ */
+
+/* libmemcached's default hash function ("one at a time" by Bob Jenkins),
+ * with the default modula distribution keys map to the same servers as
+ * with libmemcached. */
+static uint32_t meta_hash(const char *key, size_t key_length)
+{
+  const char *ptr = key;
+  uint32_t value = 0;
+
+  while (key_length--)
+    {
+      uint32_t val = (uint32_t) *ptr++;
+      value += val;
+      value += (value << 10);
+      value ^= (value >> 6);
+    }
+  value += (value << 3);
+  value ^= (value >> 11);
+  value += (value << 15);
+
+  return value;
+}
+
+static int meta_point_cmp(const void *a, const void *b)
+{
+  uint32_t va = ((const meta_point *) a)->value, vb = ((const meta_point *) b)->value;
+
+  return va < vb ? -1 : va > vb ? 1 : 0;
+}
+
+/* Build the continuum for consistent hashing.  Points are derived from the
+ * server names with meta_hash, so the distribution is not compatible with
+ * libmemcached's MD5 based ketama. */
+static void meta_update_continuum(memcached_st *mc)
+{
+  int i, j, n = 0, total = 0;
+  bool weighted = mc->behaviors[MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED] != 0;
+  char name[1024];
+
+  if (mc->points)
+    pfree(mc->points);
+  mc->points = NULL;
+  mc->npoints = 0;
+  if (mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION] != MEMCACHED_DISTRIBUTION_CONSISTENT &&
+      mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION] != MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA)
+    return;
+  if (mc->nservers == 0)
+    return;
+
+  for (i = 0; i < mc->nservers; i++)
+    total += META_POINTS_PER_SERVER * (weighted && mc->servers[i].weight ? mc->servers[i].weight : 1);
+  mc->points = MemoryContextAlloc(mc->cxt, sizeof(meta_point) * total);
+  for (i = 0; i < mc->nservers; i++)
+    {
+      meta_server *srv = &mc->servers[i];
+      int count = META_POINTS_PER_SERVER * (weighted && srv->weight ? srv->weight : 1);
+
+      for (j = 0; j < count; j++)
+        {
+          int len = srv->port ? snprintf(name, sizeof(name), "%s:%u-%d", srv->hostname, srv->port, j)
+                              : snprintf(name, sizeof(name), "%s-%d", srv->hostname, j);
+          mc->points[n].value = meta_hash(name, Min(len, (int) sizeof(name) - 1));
+          mc->points[n].server = i;
+          n++;
+        }
+    }
+  qsort(mc->points, n, sizeof(meta_point), meta_point_cmp);
+  mc->npoints = n;
+}
+
+static int meta_server_for_key(memcached_st *mc, const char *key, size_t key_length)
+{
+  uint32_t hash;
+  int lo, hi;
+
+  if (mc->nservers == 1)
+    return 0;
+  switch (mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION])
+    {
+    case MEMCACHED_DISTRIBUTION_RANDOM:
+      return random() % mc->nservers;
+    case MEMCACHED_DISTRIBUTION_CONSISTENT:
+    case MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA:
+      hash = meta_hash(key, key_length);
+      lo = 0;
+      hi = mc->npoints;
+      while (lo < hi)
+        {
+          int mid = lo + (hi - lo) / 2;
+          if (mc->points[mid].value < hash)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      return mc->points[lo == mc->npoints ? 0 : lo].server;
+    default:
+      return meta_hash(key, key_length) % mc->nservers;
+    }
+}
+
+
+/*
+ * Connections
+ */
+
+static void meta_close(memcached_st *mc, meta_server *srv)
+{
+  if (srv->fd != PGINVALID_SOCKET)
+    {
+      closesocket(srv->fd);
+      mc->wait_stale = true;
+    }
+  srv->fd = PGINVALID_SOCKET;
+  resetStringInfo(&srv->wbuf);
+  resetStringInfo(&srv->rbuf);
+  srv->wpos = 0;
+  srv->rpos = 0;
+  srv->buffered = 0;
+}
+
+/* Wait for a non-blocking connect to complete, returns the socket error */
+static int meta_wait_connect(pgsocket fd, long timeout)
+{
+  TimestampTz deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout);
+  socklen_t optlen;
+  int err = 0;
+
+  for (;;)
+    {
+      long secs;
+      int usecs, rc;
+
+      TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+      if (secs == 0 && usecs == 0)
+        return ETIMEDOUT;
+      rc = WaitLatchOrSocket(MyLatch, WL_LATCH_SET | WL_SOCKET_WRITEABLE | WL_TIMEOUT | META_WL_PM_DEATH,
+                             fd, secs * 1000 + usecs / 1000 + 1 META_WAIT_EVENT);
+      if (rc & WL_POSTMASTER_DEATH)
+        proc_exit(1);
+      if (rc & WL_LATCH_SET)
+        {
+          ResetLatch(MyLatch);
+          CHECK_FOR_INTERRUPTS();
+        }
+      if (rc & WL_SOCKET_WRITEABLE)
+        break;
+    }
+  optlen = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &optlen) != 0)
+    return errno;
+  return err;
+}
+
+static pgsocket meta_socket(memcached_st *mc, int family, int type, int protocol)
+{
+  pgsocket fd = socket(family, type, protocol);
+
+  if (fd == PGINVALID_SOCKET)
+    return fd;
+  if (!pg_set_noblock(fd))
+    {
+      closesocket(fd);
+      return PGINVALID_SOCKET;
+    }
+#ifdef SO_NOSIGPIPE
+  {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  }
+#endif
+  if (family != AF_UNIX && mc->behaviors[MEMCACHED_BEHAVIOR_TCP_NODELAY])
+    {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+  if (mc->behaviors[MEMCACHED_BEHAVIOR_SOCKET_SEND_SIZE])
+    {
+      int size = mc->behaviors[MEMCACHED_BEHAVIOR_SOCKET_SEND_SIZE];
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+  if (mc->behaviors[MEMCACHED_BEHAVIOR_SOCKET_RECV_SIZE])
+    {
+      int size = mc->behaviors[MEMCACHED_BEHAVIOR_SOCKET_RECV_SIZE];
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+  return fd;
+}
+
+static memcached_return_t meta_connect(memcached_st *mc, meta_server *srv)
+{
+  long timeout = mc->behaviors[MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT];
+  int err = ECONNREFUSED;
+
+  if (srv->fd != PGINVALID_SOCKET)
+    return MEMCACHED_SUCCESS;
+  if (srv->retry_at && GetCurrentTimestamp() < srv->retry_at)
+    return MEMCACHED_CONNECTION_FAILURE;
+
+  if (srv->port == 0)
+    {
+      struct sockaddr_un sun;
+
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      strlcpy(sun.sun_path, srv->hostname, sizeof(sun.sun_path));
+      srv->fd = meta_socket(mc, AF_UNIX, SOCK_STREAM, 0);
+      if (srv->fd != PGINVALID_SOCKET)
+        {
+          err = 0;
+          if (connect(srv->fd, (struct sockaddr *) &sun, sizeof(sun)) != 0)
+            err = (errno == EINPROGRESS || errno == EAGAIN) ? meta_wait_connect(srv->fd, timeout) : errno;
+        }
+    }
+  else
+    {
+      struct addrinfo hints, *res, *ai;
+      char portstr[16];
+
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      snprintf(portstr, sizeof(portstr), "%u", srv->port);
+      if (getaddrinfo(srv->hostname, portstr, &hints, &res) != 0)
+        res = NULL;
+      for (ai = res; ai != NULL; ai = ai->ai_next)
+        {
+          srv->fd = meta_socket(mc, ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+          if (srv->fd == PGINVALID_SOCKET)
+            continue;
+          err = 0;
+          if (connect(srv->fd, ai->ai_addr, ai->ai_addrlen) != 0)
+            err = (errno == EINPROGRESS) ? meta_wait_connect(srv->fd, timeout) : errno;
+          if (err == 0)
+            break;
+          closesocket(srv->fd);
+          srv->fd = PGINVALID_SOCKET;
+        }
+      if (res)
+        freeaddrinfo(res);
+    }
+
+  if (srv->fd == PGINVALID_SOCKET || err != 0)
+    {
+      if (srv->fd != PGINVALID_SOCKET)
+        closesocket(srv->fd);
+      srv->fd = PGINVALID_SOCKET;
+      srv->retry_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                  mc->behaviors[MEMCACHED_BEHAVIOR_RETRY_TIMEOUT] * 1000);
+      return err == ETIMEDOUT ? MEMCACHED_TIMEOUT : MEMCACHED_CONNECTION_FAILURE;
+    }
+  srv->retry_at = 0;
+  mc->wait_stale = true;
+  return MEMCACHED_SUCCESS;
+}
+
+/* Fail all outstanding requests of the server and drop the connection, the
+ * state of the stream is unknown after an error. */
+static void meta_server_reset(memcached_st *mc, meta_server *srv, memcached_return_t rc)
+{
+  int i;
+
+  for (i = srv->head; i >= 0; i = mc->requests[i].next)
+    {
+      mc->requests[i].rc = rc;
+      mc->requests[i].done = true;
+    }
+  srv->head = srv->tail = -1;
+  srv->active = false;
+  srv->expect_mn = false;
+  meta_close(mc, srv);
+}
+
+/* Like meta_server_reset(), and the server isn't tried again before the
+ * retry timeout. */
+static void meta_server_fail(memcached_st *mc, meta_server *srv, memcached_return_t rc)
+{
+  meta_server_reset(mc, srv, rc);
+  srv->retry_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                              mc->behaviors[MEMCACHED_BEHAVIOR_RETRY_TIMEOUT] * 1000);
+}
+
+static bool meta_send(meta_server *srv)
+{
+  while (srv->wpos < srv->wbuf.len)
+    {
+#ifdef MSG_NOSIGNAL
+      ssize_t n = send(srv->fd, srv->wbuf.data + srv->wpos, srv->wbuf.len - srv->wpos, MSG_NOSIGNAL);
+#else
+      ssize_t n = send(srv->fd, srv->wbuf.data + srv->wpos, srv->wbuf.len - srv->wpos, 0);
+#endif
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+      srv->wpos += n;
+    }
+  resetStringInfo(&srv->wbuf);
+  srv->wpos = 0;
+  return true;
+}
+
+static bool meta_recv(meta_server *srv)
+{
+  for (;;)
+    {
+      ssize_t n;
+
+      if (srv->rpos > 0 && srv->rpos == srv->rbuf.len)
+        {
+          resetStringInfo(&srv->rbuf);
+          srv->rpos = 0;
+        }
+      else if (srv->rpos > 65536)
+        {
+          memmove(srv->rbuf.data, srv->rbuf.data + srv->rpos, srv->rbuf.len - srv->rpos);
+          srv->rbuf.len -= srv->rpos;
+          srv->rbuf.data[srv->rbuf.len] = '\0';
+          srv->rpos = 0;
+        }
+      enlargeStringInfo(&srv->rbuf, 16384);
+      n = recv(srv->fd, srv->rbuf.data + srv->rbuf.len, srv->rbuf.maxlen - srv->rbuf.len - 1, 0);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+      if (n == 0)
+        return false;
+      srv->rbuf.len += n;
+      srv->rbuf.data[srv->rbuf.len] = '\0';
+    }
+}
+
+
+/*
+ * Requests and responses
+ */
+
+static void meta_begin(memcached_st *mc)
+{
+  int i;
+
+  MemoryContextReset(mc->opcxt);
+  mc->reqcxt = mc->opcxt;
+  mc->requests = NULL;
+  mc->nrequests = 0;
+  mc->maxrequests = 0;
+  mc->opaque_base = mc->opaque;
+  for (i = 0; i < mc->nservers; i++)
+    {
+      mc->servers[i].active = false;
+      mc->servers[i].expect_mn = false;
+      mc->servers[i].head = mc->servers[i].tail = -1;
+    }
+}
+
+static bool meta_key_is_binary(const char *key, size_t key_length)
+{
+  size_t i;
+
+  for (i = 0; i < key_length; i++)
+    if ((unsigned char) key[i] <= ' ' || (unsigned char) key[i] >= 0x7f)
+      return true;
+  return false;
+}
+
+/* Append the key to a request, keys containing whitespace, control
+ * characters or non-ASCII bytes are sent base64 encoded. */
+static bool meta_append_key(StringInfo buf, const char *key, size_t key_length)
+{
+  static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const unsigned char *k = (const unsigned char *) key;
+  size_t i;
+
+  if (!meta_key_is_binary(key, key_length))
+    {
+      appendBinaryStringInfo(buf, key, key_length);
+      return false;
+    }
+  for (i = 0; i + 2 < key_length; i += 3)
+    {
+      appendStringInfoChar(buf, b64[k[i] >> 2]);
+      appendStringInfoChar(buf, b64[((k[i] & 0x03) << 4) | (k[i + 1] >> 4)]);
+      appendStringInfoChar(buf, b64[((k[i + 1] & 0x0f) << 2) | (k[i + 2] >> 6)]);
+      appendStringInfoChar(buf, b64[k[i + 2] & 0x3f]);
+    }
+  if (i < key_length)
+    {
+      appendStringInfoChar(buf, b64[k[i] >> 2]);
+      if (i + 1 < key_length)
+        {
+          appendStringInfoChar(buf, b64[((k[i] & 0x03) << 4) | (k[i + 1] >> 4)]);
+          appendStringInfoChar(buf, b64[(k[i + 1] & 0x0f) << 2]);
+        }
+      else
+        {
+          appendStringInfoChar(buf, b64[(k[i] & 0x03) << 4]);
+          appendStringInfoChar(buf, '=');
+        }
+      appendStringInfoChar(buf, '=');
+    }
+  return true;
+}
+
+/* Start a request to a server and write its command and key to the
+ * server's output buffer.  Returns the index of the request in the current
+ * operation or -1 if the server can't be reached, in which case the
+ * request is completed with the error. */
+static int meta_request_start(memcached_st *mc, meta_request_kind kind, int server,
+                              const char *cmd, const char *key, size_t key_length,
+                              bool quiet, memcached_return_t *error)
+{
+  meta_server *srv = &mc->servers[server];
+  meta_request *req;
+  memcached_return_t rc;
+  int idx;
+
+  rc = meta_connect(mc, srv);
+  if (rc != MEMCACHED_SUCCESS)
+    {
+      if (error)
+        *error = rc;
+      return -1;
+    }
+
+  if (mc->nrequests == mc->maxrequests)
+    {
+      mc->maxrequests = mc->maxrequests ? mc->maxrequests * 2 : 16;
+      if (mc->requests)
+        mc->requests = repalloc(mc->requests, sizeof(meta_request) * mc->maxrequests);
+      else
+        mc->requests = MemoryContextAlloc(mc->reqcxt, sizeof(meta_request) * mc->maxrequests);
+    }
+  idx = mc->nrequests++;
+  mc->opaque++;
+  req = &mc->requests[idx];
+  memset(req, 0, sizeof(*req));
+  req->kind = kind;
+  req->server = server;
+  req->next = -1;
+  req->quiet = quiet;
+  req->rc = MEMCACHED_FAILURE;
+  req->key = key;
+  req->key_length = key_length;
+
+  if (srv->tail >= 0)
+    mc->requests[srv->tail].next = idx;
+  else
+    srv->head = idx;
+  srv->tail = idx;
+  srv->active = true;
+
+  appendStringInfoString(&srv->wbuf, cmd);
+  if (key)
+    {
+      appendStringInfoChar(&srv->wbuf, ' ');
+      if (meta_append_key(&srv->wbuf, key, key_length))
+        appendStringInfoString(&srv->wbuf, " b");
+    }
+  return idx;
+}
+
+/* Queue a quiet request outside of an operation, its response is only
+ * read if it fails. */
+static memcached_return_t meta_buffered_start(memcached_st *mc, int server, const char *cmd,
+                                              const char *key, size_t key_length)
+{
+  meta_server *srv = &mc->servers[server];
+  memcached_return_t rc;
+
+  rc = meta_connect(mc, srv);
+  if (rc != MEMCACHED_SUCCESS)
+    return rc;
+  mc->opaque++;
+  srv->buffered++;
+  appendStringInfoString(&srv->wbuf, cmd);
+  appendStringInfoChar(&srv->wbuf, ' ');
+  if (meta_append_key(&srv->wbuf, key, key_length))
+    appendStringInfoString(&srv->wbuf, " b");
+  return MEMCACHED_SUCCESS;
+}
+
+static void meta_buffered_end(memcached_st *mc, int server)
+{
+  meta_server *srv = &mc->servers[server];
+
+  if (srv->wbuf.len - srv->wpos >= META_BUFFER_WATERMARK ||
+      mc->behaviors[MEMCACHED_BEHAVIOR_NOREPLY])
+    if (!meta_send(srv))
+      meta_server_fail(mc, srv, MEMCACHED_CONNECTION_FAILURE);
+}
+
+static void meta_complete(memcached_st *mc, meta_server *srv, int idx)
+{
+  mc->requests[idx].done = true;
+  srv->head = mc->requests[idx].next;
+  if (srv->head < 0)
+    {
+      srv->tail = -1;
+      if (!srv->expect_mn)
+        srv->active = false;
+    }
+}
+
+/* A quiet request the server didn't respond to succeeded, or missed for
+ * gets. */
+static void meta_complete_quiet(memcached_st *mc, meta_server *srv, int until)
+{
+  while (srv->head >= 0 && srv->head != until)
+    {
+      meta_request *req = &mc->requests[srv->head];
+
+      req->rc = !req->quiet ? MEMCACHED_PROTOCOL_ERROR
+                : req->kind == META_REQ_GET ? MEMCACHED_NOTFOUND : MEMCACHED_SUCCESS;
+      meta_complete(mc, srv, srv->head);
+    }
+}
+
+static memcached_return_t meta_status(const char *code)
+{
+  if (strcmp(code, "HD") == 0 || strcmp(code, "VA") == 0 || strcmp(code, "OK") == 0 ||
+      strcmp(code, "END") == 0)
+    return MEMCACHED_SUCCESS;
+  if (strcmp(code, "EN") == 0 || strcmp(code, "NF") == 0)
+    return MEMCACHED_NOTFOUND;
+  if (strcmp(code, "NS") == 0)
+    return MEMCACHED_NOTSTORED;
+  if (strcmp(code, "EX") == 0)
+    return MEMCACHED_DATA_EXISTS;
+  if (strcmp(code, "CLIENT_ERROR") == 0)
+    return MEMCACHED_CLIENT_ERROR;
+  if (strcmp(code, "SERVER_ERROR") == 0)
+    return MEMCACHED_SERVER_ERROR;
+  return MEMCACHED_PROTOCOL_ERROR;
+}
+
+/* Parse the complete responses received from a server.  Returns false on
+ * a protocol error. */
+static bool meta_parse(memcached_st *mc, meta_server *srv)
+{
+  while (srv->active || srv->buffered > 0)
+    {
+      char line[META_MAX_LINE], *tokens[16], *saveptr = NULL, *tok, *eol, *start, *data = NULL;
+      int ntokens = 0, i, idx = -1, lease_flags = 0;
+      size_t line_len, size = 0;
+      bool has_opaque = false;
+      uint32_t opaque = 0, flags = 0;
+      uint64_t cas = 0;
+      memcached_return_t rc;
+
+      start = srv->rbuf.data + srv->rpos;
+      eol = strstr(start, "\r\n");
+      if (eol == NULL)
+        return srv->rbuf.len - srv->rpos < META_MAX_LINE;
+      line_len = eol - start;
+      if (line_len >= META_MAX_LINE)
+        return false;
+      memcpy(line, start, line_len);
+      line[line_len] = '\0';
+      for (tok = strtok_r(line, " ", &saveptr); tok && ntokens < 16; tok = strtok_r(NULL, " ", &saveptr))
+        tokens[ntokens++] = tok;
+      if (ntokens == 0)
+        return false;
+
+      if (strcmp(tokens[0], "VA") == 0)
+        {
+          if (ntokens < 2)
+            return false;
+          size = strtoul(tokens[1], NULL, 10);
+          if ((size_t) (srv->rbuf.len - srv->rpos) < line_len + 2 + size + 2)
+            return true;  /* wait for the rest of the value */
+          data = eol + 2;
+        }
+      srv->rpos += line_len + 2 + (data ? size + 2 : 0);
+
+      if (strcmp(tokens[0], "MN") == 0)
+        {
+          meta_complete_quiet(mc, srv, -1);
+          srv->expect_mn = false;
+          srv->active = false;
+          srv->buffered = 0;
+          continue;
+        }
+
+      /* the return flags of meta commands */
+      if (strlen(tokens[0]) == 2)
+        for (i = strcmp(tokens[0], "VA") == 0 ? 2 : 1; i < ntokens; i++)
+          {
+            switch (tokens[i][0])
+              {
+              case 'O':
+                has_opaque = true;
+                opaque = strtoul(tokens[i] + 1, NULL, 10);
+                break;
+              case 'f':
+                flags = strtoul(tokens[i] + 1, NULL, 10);
+                break;
+              case 'c':
+                cas = strtoull(tokens[i] + 1, NULL, 10);
+                break;
+              case 'W':
+                lease_flags |= META_LEASE_WIN;
+                break;
+              case 'X':
+                lease_flags |= META_LEASE_STALE;
+                break;
+              case 'Z':
+                lease_flags |= META_LEASE_WON;
+                break;
+              }
+          }
+
+      rc = meta_status(tokens[0]);
+      if (!has_opaque && (rc == MEMCACHED_CLIENT_ERROR || rc == MEMCACHED_SERVER_ERROR ||
+                          strcmp(tokens[0], "ERROR") == 0))
+        {
+          /* errors carry no opaque token, with pipelined or buffered
+           * requests there's no telling which one failed, so all of them
+           * fail and the rest of the stream is dropped */
+          if (srv->buffered > 0)
+            mc->buffered_errors++;
+          meta_server_reset(mc, srv, rc);
+          return true;
+        }
+      if (has_opaque)
+        {
+          uint32_t offset = opaque - mc->opaque_base - 1;
+
+          if (offset < (uint32_t) mc->nrequests && mc->requests[offset].server == srv - mc->servers &&
+              !mc->requests[offset].done)
+            idx = offset;
+        }
+      else
+        idx = srv->head;  /* the responses of other commands are in order */
+
+      if (idx < 0)
+        {
+          /* response to a buffered quiet request, only failures and
+           * misses are reported in quiet mode */
+          if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND)
+            mc->buffered_errors++;
+          continue;
+        }
+
+      meta_complete_quiet(mc, srv, idx);
+      if (srv->head != idx)
+        return false;
+
+      if (strcmp(tokens[0], "STAT") == 0)
+        {
+          meta_request *req = &mc->requests[idx];
+          memcached_stat_st *stat = req->stat;
+
+          if (req->stat_lines && ntokens >= 3)
+            {
+              size_t offset = tokens[2] - line;
+              MemoryContext oldcontext = MemoryContextSwitchTo(mc->reqcxt);
+
+              appendBinaryStringInfo(req->stat_lines, tokens[1], strlen(tokens[1]) + 1);
+              appendBinaryStringInfo(req->stat_lines, start + offset, line_len - offset);
+              appendStringInfoChar(req->stat_lines, '\0');
+              MemoryContextSwitchTo(oldcontext);
+            }
+          else if (stat && ntokens >= 3 && stat->count < MEMCACHED_META_MAX_STATS)
+            {
+              /* the value may contain spaces, take the rest of the line */
+              size_t offset = tokens[2] - line;
+
+              strlcpy(stat->names[stat->count], tokens[1], sizeof(stat->names[0]));
+              strlcpy(stat->values[stat->count], start + offset,
+                      Min(sizeof(stat->values[0]), line_len - offset + 1));
+              stat->count++;
+            }
+          continue;
+        }
+
+      mc->requests[idx].rc = rc;
+      mc->requests[idx].flags = flags;
+      mc->requests[idx].cas = cas;
+      mc->requests[idx].lease_flags = lease_flags;
+      if (data)
+        {
+          meta_request *req = &mc->requests[idx];
+
+          req->value = MemoryContextAlloc(mc->reqcxt, size + 1);
+          memcpy(req->value, data, size);
+          req->value[size] = '\0';
+          req->value_length = size;
+          if (req->kind == META_REQ_DELTA)
+            req->number = strtoull(req->value, NULL, 10);
+        }
+      meta_complete(mc, srv, idx);
+    }
+  return true;
+}
+
+/* (Re)create the wait event set with the latch and every connected
+ * server.  Servers that aren't part of the current operation are waited
+ * for readability too, as an idle socket can't be left out of a set. */
+static void meta_wait_set_build(memcached_st *mc)
+{
+  MemoryContext oldcontext;
+  int i;
+
+  if (mc->wait_set)
+    FreeWaitEventSet(mc->wait_set);
+  mc->wait_set = NULL;
+  if (mc->wait_pos)
+    {
+      pfree(mc->wait_pos);
+      pfree(mc->wait_events);
+      pfree(mc->wait_occurred);
+    }
+  oldcontext = MemoryContextSwitchTo(mc->cxt);
+  mc->wait_pos = palloc(sizeof(int) * mc->nservers);
+  mc->wait_events = palloc(sizeof(uint32_t) * mc->nservers);
+  mc->wait_occurred = palloc(sizeof(WaitEvent) * (mc->nservers + 2));
+  MemoryContextSwitchTo(oldcontext);
+
+#if PG_VERSION_NUM >= 170000
+  mc->wait_set = CreateWaitEventSet(NULL, mc->nservers + 2);
+#else
+  mc->wait_set = CreateWaitEventSet(mc->cxt, mc->nservers + 2);
+#endif
+  AddWaitEventToSet(mc->wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+  if (IsUnderPostmaster)
+    AddWaitEventToSet(mc->wait_set, META_WL_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+  for (i = 0; i < mc->nservers; i++)
+    {
+      mc->wait_pos[i] = -1;
+      if (mc->servers[i].fd == PGINVALID_SOCKET)
+        continue;
+      mc->wait_events[i] = WL_SOCKET_READABLE;
+      mc->wait_pos[i] = AddWaitEventToSet(mc->wait_set, WL_SOCKET_READABLE, mc->servers[i].fd,
+                                          NULL, &mc->servers[i]);
+    }
+  mc->wait_stale = false;
+}
+
+/* Send the requests of the current operation and wait until all of them
+ * have been responded to or the I/O timeout expires. */
+static void meta_run(memcached_st *mc)
+{
+  /* a server missing an operation's own deadline isn't considered dead */
+  bool op_deadline = mc->op_timeout > 0;
+  TimestampTz deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                     op_deadline ? mc->op_timeout :
+                                                     (long) mc->behaviors[MEMCACHED_BEHAVIOR_POLL_TIMEOUT]);
+  int i;
+
+  mc->op_timeout = 0;
+
+  PG_TRY();
+  {
+    for (;;)
+      {
+        int nactive = 0, n;
+        long secs;
+        int usecs;
+
+        for (i = 0; i < mc->nservers; i++)
+          {
+            meta_server *srv = &mc->servers[i];
+
+            if (!srv->active)
+              continue;
+            if (!meta_send(srv))
+              {
+                meta_server_fail(mc, srv, MEMCACHED_CONNECTION_FAILURE);
+                continue;
+              }
+            nactive++;
+          }
+        if (nactive == 0)
+          break;
+
+        if (mc->wait_set == NULL || mc->wait_stale)
+          meta_wait_set_build(mc);
+        for (i = 0; i < mc->nservers; i++)
+          {
+            meta_server *srv = &mc->servers[i];
+            uint32_t ev;
+
+            if (mc->wait_pos[i] < 0)
+              continue;
+            ev = WL_SOCKET_READABLE | (srv->active && srv->wbuf.len > 0 ? WL_SOCKET_WRITEABLE : 0);
+            if (ev != mc->wait_events[i])
+              ModifyWaitEvent(mc->wait_set, mc->wait_pos[i], ev, NULL);
+            mc->wait_events[i] = ev;
+          }
+
+        TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+        if (secs == 0 && usecs == 0)
+          {
+            for (i = 0; i < mc->nservers; i++)
+              if (mc->servers[i].active)
+                {
+                  meta_server_fail(mc, &mc->servers[i], MEMCACHED_TIMEOUT);
+                  if (op_deadline)
+                    mc->servers[i].retry_at = 0;
+                }
+            break;
+          }
+
+        n = WaitEventSetWait(mc->wait_set, secs * 1000 + usecs / 1000 + 1, mc->wait_occurred,
+                             mc->nservers + 2 META_WAIT_EVENT);
+        for (i = 0; i < n; i++)
+          {
+            WaitEvent *event = &mc->wait_occurred[i];
+            meta_server *srv = (meta_server *) event->user_data;
+
+            if (event->events & WL_POSTMASTER_DEATH)
+              proc_exit(1);
+            if (event->events & WL_LATCH_SET)
+              {
+                ResetLatch(MyLatch);
+                CHECK_FOR_INTERRUPTS();
+                continue;
+              }
+            /* skip events of connections closed since the set was built */
+            if (srv == NULL || srv->fd == PGINVALID_SOCKET || !(event->events & WL_SOCKET_READABLE))
+              continue;
+            if (!meta_recv(srv))
+              {
+                /* an idle server only sends failures of buffered requests
+                 * or closes the connection, which loses their outcome */
+                if (!srv->active && srv->buffered > 0)
+                  mc->buffered_errors++;
+                meta_server_fail(mc, srv, MEMCACHED_CONNECTION_FAILURE);
+              }
+            else if (!meta_parse(mc, srv))
+              meta_server_fail(mc, srv, MEMCACHED_PROTOCOL_ERROR);
+          }
+      }
+  }
+  PG_CATCH();
+  {
+    /* the streams are in an unknown state after an interruption */
+    for (i = 0; i < mc->nservers; i++)
+      if (mc->servers[i].active)
+        meta_server_fail(mc, &mc->servers[i], MEMCACHED_FAILURE);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+}
+
+
+
+/*
+ * libmemcached compatible API
+ */
+
+memcached_st *memcached_create(memcached_st *ptr)
+{
+  MemoryContext cxt;
+  memcached_st *mc;
+
+  if (ptr != NULL)
+    return NULL;
+
+  cxt = AllocSetContextCreate(TopMemoryContext, "pgmemcache meta", ALLOCSET_DEFAULT_SIZES);
+  mc = MemoryContextAllocZero(cxt, sizeof(memcached_st));
+  mc->cxt = cxt;
+  mc->opcxt = AllocSetContextCreate(cxt, "pgmemcache meta operation", ALLOCSET_DEFAULT_SIZES);
+  mc->mgetcxt = AllocSetContextCreate(cxt, "pgmemcache meta mget", ALLOCSET_DEFAULT_SIZES);
+  mc->behaviors[MEMCACHED_BEHAVIOR_POLL_TIMEOUT] = META_DEFAULT_POLL_TIMEOUT;
+  mc->behaviors[MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT] = META_DEFAULT_CONNECT_TIMEOUT;
+  mc->behaviors[MEMCACHED_BEHAVIOR_RETRY_TIMEOUT] = META_DEFAULT_RETRY_TIMEOUT;
+  mc->behaviors[MEMCACHED_BEHAVIOR_TCP_NODELAY] = 1;
+  mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION] = MEMCACHED_DISTRIBUTION_MODULA;
+  mc->behaviors[MEMCACHED_BEHAVIOR_HASH] = MEMCACHED_HASH_DEFAULT;
+  mc->behaviors[MEMCACHED_BEHAVIOR_KETAMA_HASH] = MEMCACHED_HASH_DEFAULT;
+  return mc;
+}
+
+void memcached_free(memcached_st *mc)
+{
+  int i;
+
+  if (mc == NULL)
+    return;
+  for (i = 0; i < mc->nservers; i++)
+    meta_close(mc, &mc->servers[i]);
+  if (mc->wait_set)
+    FreeWaitEventSet(mc->wait_set);
+  if (mc->mget_result)
+    free(mc->mget_result);
+  MemoryContextDelete(mc->cxt);
+}
+
+const char *memcached_strerror(const memcached_st *mc, memcached_return_t rc)
+{
+  if ((int) rc < 0 || rc >= MEMCACHED_MAXIMUM_RETURN)
+    return "UNKNOWN ERROR";
+  return meta_errors[rc];
+}
+
+memcached_return_t memcached_behavior_set(memcached_st *mc, memcached_behavior_t flag, uint64_t data)
+{
+  if ((int) flag < 0 || flag >= MEMCACHED_BEHAVIOR_MAX)
+    return MEMCACHED_INVALID_ARGUMENTS;
+
+  switch (flag)
+    {
+    case MEMCACHED_BEHAVIOR_HASH:
+    case MEMCACHED_BEHAVIOR_KETAMA_HASH:
+      if (data != MEMCACHED_HASH_DEFAULT)
+        return MEMCACHED_NOT_SUPPORTED;
+      break;
+    case MEMCACHED_BEHAVIOR_KETAMA:
+      mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION] =
+        data ? MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA : MEMCACHED_DISTRIBUTION_MODULA;
+      break;
+    case MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED:
+      mc->behaviors[MEMCACHED_BEHAVIOR_KETAMA] = data;
+      mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION] =
+        data ? MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA : MEMCACHED_DISTRIBUTION_MODULA;
+      break;
+    case MEMCACHED_BEHAVIOR_DISTRIBUTION:
+      if (data > MEMCACHED_DISTRIBUTION_RANDOM)
+        return MEMCACHED_INVALID_ARGUMENTS;
+      break;
+    case MEMCACHED_BEHAVIOR_USE_UDP:
+    case MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS:
+      if (data)
+        return MEMCACHED_NOT_SUPPORTED;
+      break;
+    default:
+      /* everything else is either implemented or meaningless with the
+       * non-blocking meta protocol client */
+      break;
+    }
+  mc->behaviors[flag] = data;
+  if (flag == MEMCACHED_BEHAVIOR_DISTRIBUTION || flag == MEMCACHED_BEHAVIOR_KETAMA ||
+      flag == MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED)
+    meta_update_continuum(mc);
+  return MEMCACHED_SUCCESS;
+}
+
+uint64_t memcached_behavior_get(memcached_st *mc, memcached_behavior_t flag)
+{
+  if ((int) flag < 0 || flag >= MEMCACHED_BEHAVIOR_MAX)
+    return 0;
+  return mc->behaviors[flag];
+}
+
+static memcached_return_t meta_server_add(memcached_st *mc, const char *hostname,
+                                          unsigned int port, uint32_t weight)
+{
+  MemoryContext oldcontext = MemoryContextSwitchTo(mc->cxt);
+  meta_server *srv;
+
+  if (mc->servers)
+    mc->servers = repalloc(mc->servers, sizeof(meta_server) * (mc->nservers + 1));
+  else
+    mc->servers = palloc(sizeof(meta_server));
+  srv = &mc->servers[mc->nservers++];
+  memset(srv, 0, sizeof(*srv));
+  srv->hostname = pstrdup(hostname);
+  srv->port = port;
+  srv->weight = weight;
+  srv->fd = PGINVALID_SOCKET;
+  srv->head = srv->tail = -1;
+  initStringInfo(&srv->wbuf);
+  initStringInfo(&srv->rbuf);
+  MemoryContextSwitchTo(oldcontext);
+  /* the servers may have moved and the set has no room for the new one */
+  mc->wait_stale = true;
+
+  meta_update_continuum(mc);
+  return MEMCACHED_SUCCESS;
+}
+
+memcached_return_t memcached_server_add_with_weight(memcached_st *mc, const char *hostname,
+                                                    unsigned int port, uint32_t weight)
+{
+  return meta_server_add(mc, hostname, port ? port : 11211, weight);
+}
+
+memcached_return_t memcached_server_add_unix_socket_with_weight(memcached_st *mc,
+                                                                const char *filename,
+                                                                uint32_t weight)
+{
+  return meta_server_add(mc, filename, 0, weight);
+}
+
+memcached_return_t memcached_server_cursor(const memcached_st *mc,
+                                           const memcached_server_fn *callback,
+                                           void *context, uint32_t number_of_callbacks)
+{
+  int i;
+  uint32_t j;
+
+  for (i = 0; i < mc->nservers; i++)
+    for (j = 0; j < number_of_callbacks; j++)
+      callback[j](mc, &mc->servers[i], context);
+  return MEMCACHED_SUCCESS;
+}
+
+const char *memcached_server_name(memcached_server_instance_st server)
+{
+  return server->hostname;
+}
+
+unsigned int memcached_server_port(memcached_server_instance_st server)
+{
+  return server->port;
+}
+
+memcached_server_instance_st memcached_server_by_key(memcached_st *mc, const char *key,
+                                                     size_t key_length, memcached_return_t *error)
+{
+  if (mc->nservers == 0)
+    {
+      *error = MEMCACHED_NO_SERVERS;
+      return NULL;
+    }
+  *error = MEMCACHED_SUCCESS;
+  return &mc->servers[meta_server_for_key(mc, key, key_length)];
+}
+
+/* Fetch a single key, optionally with a lease (N flag) */
+static char *meta_get(memcached_st *mc, const char *key, size_t key_length, uint32_t lease_ttl,
+                      size_t *value_length, uint32_t *flags, int *lease_flags,
+                      memcached_return_t *error)
+{
+  meta_request *req;
+  meta_server *srv;
+  char *value;
+  int idx;
+
+  *error = MEMCACHED_NO_SERVERS;
+  if (mc->nservers == 0)
+    return NULL;
+
+  meta_begin(mc);
+  idx = meta_request_start(mc, META_REQ_GET, meta_server_for_key(mc, key, key_length),
+                           "mg", key, key_length, false, error);
+  if (idx < 0)
+    return NULL;
+  srv = &mc->servers[mc->requests[idx].server];
+  if (lease_ttl)
+    appendStringInfo(&srv->wbuf, " v f N%u O%u\r\n", lease_ttl, mc->opaque);
+  else
+    appendStringInfo(&srv->wbuf, " v f O%u\r\n", mc->opaque);
+  meta_run(mc);
+
+  req = &mc->requests[idx];
+  *error = req->rc;
+  if (req->rc != MEMCACHED_SUCCESS)
+    return NULL;
+  value = malloc(req->value_length + 1);
+  if (value == NULL)
+    {
+      *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+  memcpy(value, req->value, req->value_length + 1);
+  *value_length = req->value_length;
+  if (flags)
+    *flags = req->flags;
+  if (lease_flags)
+    *lease_flags = req->lease_flags;
+  *error = MEMCACHED_SUCCESS;
+  return value;
+}
+
+char *memcached_get(memcached_st *mc, const char *key, size_t key_length,
+                    size_t *value_length, uint32_t *flags, memcached_return_t *error)
+{
+  return meta_get(mc, key, key_length, 0, value_length, flags, NULL, error);
+}
+
+memcached_return_t memcached_mget(memcached_st *mc, const char * const *keys,
+                                  const size_t *key_length, size_t number_of_keys)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  size_t i;
+  int s;
+
+  MemoryContextReset(mc->mgetcxt);
+  mc->mget_requests = NULL;
+  mc->mget_count = mc->mget_pos = 0;
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+
+  meta_begin(mc);
+  /* allocate the requests and values in the mget context so that they
+   * survive until the results have been fetched */
+  mc->reqcxt = mc->mgetcxt;
+  mc->maxrequests = number_of_keys > 0 ? number_of_keys : 1;
+  mc->requests = MemoryContextAlloc(mc->mgetcxt, sizeof(meta_request) * mc->maxrequests);
+
+  for (i = 0; i < number_of_keys; i++)
+    {
+      int idx;
+
+      if (keys[i] == NULL || key_length[i] == 0)
+        continue;
+      idx = meta_request_start(mc, META_REQ_GET, meta_server_for_key(mc, keys[i], key_length[i]),
+                               "mg", keys[i], key_length[i], true, &rc);
+      if (idx >= 0)
+        appendStringInfo(&mc->servers[mc->requests[idx].server].wbuf, " v f%s q O%u\r\n",
+                         mc->behaviors[MEMCACHED_BEHAVIOR_SUPPORT_CAS] ? " c" : "", mc->opaque);
+    }
+  for (s = 0; s < mc->nservers; s++)
+    if (mc->servers[s].active)
+      {
+        appendStringInfoString(&mc->servers[s].wbuf, "mn\r\n");
+        mc->servers[s].expect_mn = true;
+      }
+  meta_run(mc);
+
+  mc->mget_requests = mc->requests;
+  mc->mget_count = mc->nrequests;
+  mc->requests = NULL;
+  mc->nrequests = mc->maxrequests = 0;
+  for (i = 0; i < (size_t) mc->mget_count; i++)
+    if (mc->mget_requests[i].rc != MEMCACHED_SUCCESS && mc->mget_requests[i].rc != MEMCACHED_NOTFOUND)
+      rc = MEMCACHED_SOME_ERRORS;
+  return rc;
+}
+
+static meta_request *meta_next_result(memcached_st *mc)
+{
+  while (mc->mget_pos < mc->mget_count)
+    {
+      meta_request *req = &mc->mget_requests[mc->mget_pos++];
+      if (req->rc == MEMCACHED_SUCCESS)
+        return req;
+    }
+  return NULL;
+}
+
+char *memcached_fetch(memcached_st *mc, char *key, size_t *key_length,
+                      size_t *value_length, uint32_t *flags, memcached_return_t *error)
+{
+  meta_request *req = meta_next_result(mc);
+  char *value;
+
+  if (req == NULL)
+    {
+      *error = MEMCACHED_END;
+      return NULL;
+    }
+  value = malloc(req->value_length + 1);
+  if (value == NULL)
+    {
+      *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+  memcpy(value, req->value, req->value_length + 1);
+  if (key)
+    {
+      memcpy(key, req->key, req->key_length);
+      *key_length = req->key_length;
+    }
+  *value_length = req->value_length;
+  *flags = req->flags;
+  *error = MEMCACHED_SUCCESS;
+  return value;
+}
+
+memcached_result_st *memcached_fetch_result(memcached_st *mc, memcached_result_st *result,
+                                            memcached_return_t *error)
+{
+  meta_request *req = meta_next_result(mc);
+
+  if (req == NULL)
+    {
+      *error = MEMCACHED_END;
+      if (mc->mget_result)
+        free(mc->mget_result);
+      mc->mget_result = NULL;
+      return NULL;
+    }
+  if (result == NULL)
+    {
+      if (mc->mget_result == NULL)
+        mc->mget_result = malloc(sizeof(memcached_result_st));
+      result = mc->mget_result;
+      if (result == NULL)
+        {
+          *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+          return NULL;
+        }
+    }
+  result->key = req->key;
+  result->key_length = req->key_length;
+  result->value = req->value;
+  result->length = req->value_length;
+  result->flags = req->flags;
+  result->cas = req->cas;
+  *error = MEMCACHED_SUCCESS;
+  return result;
+}
+
+static bool meta_buffering(memcached_st *mc)
+{
+  return mc->behaviors[MEMCACHED_BEHAVIOR_BUFFER_REQUESTS] || mc->behaviors[MEMCACHED_BEHAVIOR_NOREPLY];
+}
+
+static memcached_return_t meta_store(memcached_st *mc, char mode, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags, uint64_t cas)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  meta_server *srv;
+  int server, idx;
+  char cas_flag[32] = "";
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  server = meta_server_for_key(mc, key, key_length);
+  srv = &mc->servers[server];
+  if (cas)
+    snprintf(cas_flag, sizeof(cas_flag), " C" UINT64_FORMAT, (uint64) cas);
+
+  if (meta_buffering(mc))
+    {
+      rc = meta_buffered_start(mc, server, "ms", key, key_length);
+      if (rc != MEMCACHED_SUCCESS)
+        return rc;
+      appendStringInfo(&srv->wbuf, " %zu F%u T%ld M%c%s q O%u\r\n",
+                       value_length, flags, (long) expiration, mode, cas_flag, mc->opaque);
+      appendBinaryStringInfo(&srv->wbuf, value, value_length);
+      appendStringInfoString(&srv->wbuf, "\r\n");
+      meta_buffered_end(mc, server);
+      return MEMCACHED_BUFFERED;
+    }
+
+  meta_begin(mc);
+  idx = meta_request_start(mc, META_REQ_STORE, server, "ms", key, key_length, false, &rc);
+  if (idx < 0)
+    return rc;
+  appendStringInfo(&srv->wbuf, " %zu F%u T%ld M%c%s O%u\r\n",
+                   value_length, flags, (long) expiration, mode, cas_flag, mc->opaque);
+  appendBinaryStringInfo(&srv->wbuf, value, value_length);
+  appendStringInfoString(&srv->wbuf, "\r\n");
+  meta_run(mc);
+  return mc->requests[idx].rc;
+}
+
+memcached_return_t memcached_set(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags)
+{
+  return meta_store(mc, 'S', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_add(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags)
+{
+  return meta_store(mc, 'E', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_replace(memcached_st *mc, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags)
+{
+  return meta_store(mc, 'R', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_append(memcached_st *mc, const char *key, size_t key_length,
+                                    const char *value, size_t value_length,
+                                    time_t expiration, uint32_t flags)
+{
+  return meta_store(mc, 'A', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_prepend(memcached_st *mc, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags)
+{
+  return meta_store(mc, 'P', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_cas(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags, uint64_t cas)
+{
+  return meta_store(mc, 'S', key, key_length, value, value_length, expiration, flags, cas);
+}
+
+static memcached_return_t meta_delta(memcached_st *mc, char mode, const char *key, size_t key_length,
+                                     uint64_t offset, uint64_t initial, time_t expiration,
+                                     uint64_t *value)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  StringInfoData args;
+  meta_server *srv;
+  int server, idx;
+
+  *value = UINT64_MAX;
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  server = meta_server_for_key(mc, key, key_length);
+  srv = &mc->servers[server];
+
+  /* autovivify missing keys with the initial value unless told not to */
+  initStringInfo(&args);
+  appendStringInfo(&args, " D" UINT64_FORMAT " M%c", (uint64) offset, mode);
+  if ((uint32_t) expiration != MEMCACHED_EXPIRATION_NOT_ADD)
+    appendStringInfo(&args, " N%ld J" UINT64_FORMAT, (long) expiration, (uint64) initial);
+
+  if (meta_buffering(mc))
+    {
+      rc = meta_buffered_start(mc, server, "ma", key, key_length);
+      if (rc == MEMCACHED_SUCCESS)
+        {
+          appendStringInfo(&srv->wbuf, "%s q O%u\r\n", args.data, mc->opaque);
+          meta_buffered_end(mc, server);
+          rc = MEMCACHED_BUFFERED;
+        }
+      pfree(args.data);
+      return rc;
+    }
+
+  meta_begin(mc);
+  idx = meta_request_start(mc, META_REQ_DELTA, server, "ma", key, key_length, false, &rc);
+  if (idx >= 0)
+    {
+      appendStringInfo(&srv->wbuf, "%s v O%u\r\n", args.data, mc->opaque);
+      meta_run(mc);
+      rc = mc->requests[idx].rc;
+      if (mc->requests[idx].rc == MEMCACHED_SUCCESS)
+        *value = mc->requests[idx].number;
+    }
+  pfree(args.data);
+  return rc;
+}
+
+memcached_return_t memcached_increment_with_initial(memcached_st *mc, const char *key,
+                                                    size_t key_length, uint64_t offset,
+                                                    uint64_t initial, time_t expiration,
+                                                    uint64_t *value)
+{
+  return meta_delta(mc, 'I', key, key_length, offset, initial, expiration, value);
+}
+
+memcached_return_t memcached_decrement_with_initial(memcached_st *mc, const char *key,
+                                                    size_t key_length, uint64_t offset,
+                                                    uint64_t initial, time_t expiration,
+                                                    uint64_t *value)
+{
+  return meta_delta(mc, 'D', key, key_length, offset, initial, expiration, value);
+}
+
+static memcached_return_t meta_delete(memcached_st *mc, const char *key, size_t key_length,
+                                      const char *args)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  meta_server *srv;
+  int server, idx;
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  server = meta_server_for_key(mc, key, key_length);
+  srv = &mc->servers[server];
+
+  if (meta_buffering(mc))
+    {
+      rc = meta_buffered_start(mc, server, "md", key, key_length);
+      if (rc != MEMCACHED_SUCCESS)
+        return rc;
+      appendStringInfo(&srv->wbuf, "%s q O%u\r\n", args, mc->opaque);
+      meta_buffered_end(mc, server);
+      return MEMCACHED_BUFFERED;
+    }
+
+  meta_begin(mc);
+  idx = meta_request_start(mc, META_REQ_DELETE, server, "md", key, key_length, false, &rc);
+  if (idx < 0)
+    return rc;
+  appendStringInfo(&srv->wbuf, "%s O%u\r\n", args, mc->opaque);
+  meta_run(mc);
+  return mc->requests[idx].rc;
+}
+
+memcached_return_t memcached_delete(memcached_st *mc, const char *key, size_t key_length,
+                                    time_t expiration)
+{
+  /* delete hold timers were removed from memcached long ago */
+  if (expiration != 0)
+    return MEMCACHED_INVALID_ARGUMENTS;
+  return meta_delete(mc, key, key_length, "");
+}
+
+memcached_return_t memcached_flush(memcached_st *mc, time_t expiration)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  int s;
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+
+  meta_begin(mc);
+  for (s = 0; s < mc->nservers; s++)
+    {
+      int idx = meta_request_start(mc, META_REQ_FLUSH, s, "flush_all", NULL, 0, false, &rc);
+      if (idx >= 0)
+        appendStringInfo(&mc->servers[s].wbuf, " %ld\r\n", (long) expiration);
+    }
+  meta_run(mc);
+  for (s = 0; s < mc->nrequests; s++)
+    if (mc->requests[s].rc != MEMCACHED_SUCCESS)
+      rc = MEMCACHED_SOME_ERRORS;
+  return rc;
+}
+
+memcached_return_t memcached_flush_buffers(memcached_st *mc)
+{
+  int s;
+
+  meta_begin(mc);
+  for (s = 0; s < mc->nservers; s++)
+    {
+      meta_server *srv = &mc->servers[s];
+
+      if (srv->fd == PGINVALID_SOCKET || (srv->buffered == 0 && srv->wbuf.len == 0))
+        continue;
+      appendStringInfoString(&srv->wbuf, "mn\r\n");
+      srv->expect_mn = true;
+      srv->active = true;
+    }
+  meta_run(mc);
+  for (s = 0; s < mc->nservers; s++)
+    if (mc->servers[s].buffered > 0)
+      {
+        /* the connection failed before the no-op was answered */
+        mc->servers[s].buffered = 0;
+        mc->buffered_errors++;
+      }
+  if (mc->buffered_errors > 0)
+    {
+      mc->buffered_errors = 0;
+      return MEMCACHED_SOME_ERRORS;
+    }
+  return MEMCACHED_SUCCESS;
+}
+
+memcached_return_t memcached_stat_servername(memcached_stat_st *stat, char *args,
+                                             const char *hostname, unsigned int port)
+{
+  memcached_st *mc = memcached_create(NULL);
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  int idx;
+
+  stat->count = 0;
+  if (port == 0)
+    memcached_server_add_unix_socket_with_weight(mc, hostname, 0);
+  else
+    memcached_server_add_with_weight(mc, hostname, port, 0);
+
+  PG_TRY();
+  {
+    meta_begin(mc);
+    idx = meta_request_start(mc, META_REQ_STATS, 0, "stats", NULL, 0, false, &rc);
+    if (idx >= 0)
+      {
+        mc->requests[idx].stat = stat;
+        if (args)
+          appendStringInfo(&mc->servers[0].wbuf, " %s", args);
+        appendStringInfoString(&mc->servers[0].wbuf, "\r\n");
+        meta_run(mc);
+        rc = mc->requests[idx].rc;
+      }
+  }
+  PG_CATCH();
+  {
+    memcached_free(mc);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  memcached_free(mc);
+  return rc;
+}
+
+char **memcached_stat_get_keys(memcached_st *mc, memcached_stat_st *stat,
+                               memcached_return_t *error)
+{
+  char **list = malloc(sizeof(char *) * (stat->count + 1));
+  int i;
+
+  if (list == NULL)
+    {
+      *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+  for (i = 0; i < stat->count; i++)
+    list[i] = stat->names[i];
+  list[stat->count] = NULL;
+  *error = MEMCACHED_SUCCESS;
+  return list;
+}
+
+char *memcached_stat_get_value(const memcached_st *mc, memcached_stat_st *stat,
+                               const char *key, memcached_return_t *error)
+{
+  int i;
+
+  for (i = 0; i < stat->count; i++)
+    if (strcmp(stat->names[i], key) == 0)
+      {
+        *error = MEMCACHED_SUCCESS;
+        return strdup(stat->values[i]);
+      }
+  *error = MEMCACHED_NOTFOUND;
+  return NULL;
+}
+
+/* Run a stats command on all servers at once and pass every statistic to
+ * func, which unlike memcached_stat_servername() has no limit on the number
+ * of statistics. */
+memcached_return_t memcached_stat_execute(memcached_st *mc, const char *args,
+                                          memcached_stat_fn func, void *context)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  MemoryContext oldcontext;
+  int s, i;
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+
+  meta_begin(mc);
+  for (s = 0; s < mc->nservers; s++)
+    {
+      memcached_return_t src = MEMCACHED_SUCCESS;
+      int idx = meta_request_start(mc, META_REQ_STATS, s, "stats", NULL, 0, false, &src);
+
+      if (idx < 0)
+        {
+          rc = MEMCACHED_SOME_ERRORS;
+          continue;
+        }
+      oldcontext = MemoryContextSwitchTo(mc->reqcxt);
+      mc->requests[idx].stat_lines = makeStringInfo();
+      MemoryContextSwitchTo(oldcontext);
+      if (args)
+        appendStringInfo(&mc->servers[s].wbuf, " %s", args);
+      appendStringInfoString(&mc->servers[s].wbuf, "\r\n");
+    }
+  meta_run(mc);
+
+  for (i = 0; i < mc->nrequests; i++)
+    {
+      meta_request *req = &mc->requests[i];
+      const char *pos, *end;
+
+      if (req->rc != MEMCACHED_SUCCESS)
+        {
+          rc = MEMCACHED_SOME_ERRORS;
+          continue;
+        }
+      pos = req->stat_lines->data;
+      end = pos + req->stat_lines->len;
+      while (pos < end)
+        {
+          const char *name = pos, *value = pos + strlen(pos) + 1;
+
+          pos = value + strlen(value) + 1;
+          func(&mc->servers[req->server], name, strlen(name), value, strlen(value), context);
+        }
+    }
+  return rc;
+}
+
+
+/*
+ * Meta protocol extensions
+ */
+
+/* Fetch a key with a recache lease: on a miss the first client gets the
+ * win flag and an empty placeholder item is created for lease_ttl seconds,
+ * other clients see the won flag until the winner stores the value.  Items
+ * invalidated with meta_invalidate() are returned with the stale flag and
+ * the win flag to the first client. */
+char *meta_get_lease(memcached_st *mc, const char *key, size_t key_length,
+                     uint32_t lease_ttl, size_t *value_length, uint32_t *flags,
+                     int *lease_flags, memcached_return_t *error)
+{
+  *lease_flags = 0;
+  return meta_get(mc, key, key_length, lease_ttl ? lease_ttl : 1, value_length, flags,
+                  lease_flags, error);
+}
+
+/* Mark an item stale instead of deleting it so that it can still be
+ * served while one client recaches it. */
+memcached_return_t meta_invalidate(memcached_st *mc, const char *key, size_t key_length,
+                                   uint32_t stale_ttl)
+{
+  char args[32];
+
+  if (stale_ttl)
+    snprintf(args, sizeof(args), " I T%u", stale_ttl);
+  else
+    strlcpy(args, " I", sizeof(args));
+  return meta_delete(mc, key, key_length, args);
+}
+
+/* Limit the time the next operation waits for responses, for example to
+ * return the results that arrived within a latency budget.  Servers that
+ * don't respond in time are retried right away in the next operation. */
+void meta_set_operation_timeout(memcached_st *mc, long timeout)
+{
+  mc->op_timeout = timeout > 0 ? timeout : 1;
+}
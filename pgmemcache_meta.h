@@ -0,0 +1,248 @@
+/*
+ * Memcached meta protocol client for pgmemcache.
+ *
+ * Copyright (c) 2012-2014 Ohmu Ltd <opensource@ohmu.fi>
+ *
+ * See the file LICENSE for distribution terms.
+ *
+ * This is a small non-blocking memcached client speaking the meta text
+ * protocol (mg, ms, md, ma, mn) which is used instead of libmemcached when
+ * pgmemcache is built with USE_META=1.  It implements the subset of the
+ * libmemcached API used by pgmemcache so the libmemcached code paths in
+ * pgmemcache.c are used as-is with it, plus a few functions exposing meta
+ * protocol features libmemcached doesn't have.
+ *
+ * All requests carry an opaque token and multi-gets and buffered stores use
+ * quiet mode, so any number of requests can be pipelined to all servers at
+ * once.  Socket I/O is done with PostgreSQL's WaitEventSet API and can be
+ * interrupted with the usual query cancellation.
+ *
+ * The same API is implemented by the in-process mock engine in
+ * pgmemcache_mock.c which is used instead when pgmemcache is built with
+ * USE_MOCK=1.
+ */
+
+#ifndef PGMEMCACHE_META_H
+#define PGMEMCACHE_META_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define LIBMEMCACHED_VERSION_HEX 0x01000018
+#define LIBMEMCACHED_WITH_SASL_SUPPORT 0
+
+#define MEMCACHED_MAX_KEY 251
+#define MEMCACHED_EXPIRATION_NOT_ADD 0xffffffffU
+#define MEMCACHED_META_MAX_STATS 128
+
+typedef enum
+{
+  MEMCACHED_SUCCESS,
+  MEMCACHED_FAILURE,
+  MEMCACHED_CONNECTION_FAILURE,
+  MEMCACHED_PROTOCOL_ERROR,
+  MEMCACHED_CLIENT_ERROR,
+  MEMCACHED_SERVER_ERROR,
+  MEMCACHED_DATA_EXISTS,
+  MEMCACHED_NOTSTORED,
+  MEMCACHED_NOTFOUND,
+  MEMCACHED_MEMORY_ALLOCATION_FAILURE,
+  MEMCACHED_SOME_ERRORS,
+  MEMCACHED_NO_SERVERS,
+  MEMCACHED_END,
+  MEMCACHED_BUFFERED,
+  MEMCACHED_TIMEOUT,
+  MEMCACHED_NOT_SUPPORTED,
+  MEMCACHED_BAD_KEY_PROVIDED,
+  MEMCACHED_INVALID_ARGUMENTS,
+  MEMCACHED_MAXIMUM_RETURN
+} memcached_return_t;
+typedef memcached_return_t memcached_return;
+
+typedef enum
+{
+  MEMCACHED_BEHAVIOR_NO_BLOCK,
+  MEMCACHED_BEHAVIOR_TCP_NODELAY,
+  MEMCACHED_BEHAVIOR_HASH,
+  MEMCACHED_BEHAVIOR_KETAMA,
+  MEMCACHED_BEHAVIOR_SOCKET_SEND_SIZE,
+  MEMCACHED_BEHAVIOR_SOCKET_RECV_SIZE,
+  MEMCACHED_BEHAVIOR_CACHE_LOOKUPS,
+  MEMCACHED_BEHAVIOR_SUPPORT_CAS,
+  MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+  MEMCACHED_BEHAVIOR_DISTRIBUTION,
+  MEMCACHED_BEHAVIOR_BUFFER_REQUESTS,
+  MEMCACHED_BEHAVIOR_USER_DATA,
+  MEMCACHED_BEHAVIOR_SORT_HOSTS,
+  MEMCACHED_BEHAVIOR_VERIFY_KEY,
+  MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
+  MEMCACHED_BEHAVIOR_RETRY_TIMEOUT,
+  MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED,
+  MEMCACHED_BEHAVIOR_KETAMA_HASH,
+  MEMCACHED_BEHAVIOR_BINARY_PROTOCOL,
+  MEMCACHED_BEHAVIOR_SND_TIMEOUT,
+  MEMCACHED_BEHAVIOR_RCV_TIMEOUT,
+  MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT,
+  MEMCACHED_BEHAVIOR_IO_MSG_WATERMARK,
+  MEMCACHED_BEHAVIOR_IO_BYTES_WATERMARK,
+  MEMCACHED_BEHAVIOR_IO_KEY_PREFETCH,
+  MEMCACHED_BEHAVIOR_HASH_WITH_PREFIX_KEY,
+  MEMCACHED_BEHAVIOR_NOREPLY,
+  MEMCACHED_BEHAVIOR_USE_UDP,
+  MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS,
+  MEMCACHED_BEHAVIOR_RANDOMIZE_REPLICA_READ,
+  MEMCACHED_BEHAVIOR_REMOVE_FAILED_SERVERS,
+  MEMCACHED_BEHAVIOR_DEAD_TIMEOUT,
+  MEMCACHED_BEHAVIOR_MAX
+} memcached_behavior_t;
+typedef memcached_behavior_t memcached_behavior;
+
+typedef enum
+{
+  MEMCACHED_HASH_DEFAULT,
+  MEMCACHED_HASH_MD5,
+  MEMCACHED_HASH_CRC,
+  MEMCACHED_HASH_FNV1_64,
+  MEMCACHED_HASH_FNV1A_64,
+  MEMCACHED_HASH_FNV1_32,
+  MEMCACHED_HASH_FNV1A_32,
+  MEMCACHED_HASH_HSIEH,
+  MEMCACHED_HASH_MURMUR,
+  MEMCACHED_HASH_JENKINS
+} memcached_hash_t;
+typedef memcached_hash_t memcached_hash;
+
+typedef enum
+{
+  MEMCACHED_DISTRIBUTION_MODULA,
+  MEMCACHED_DISTRIBUTION_CONSISTENT,
+  MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA,
+  MEMCACHED_DISTRIBUTION_RANDOM
+} memcached_server_distribution_t;
+typedef memcached_server_distribution_t memcached_server_distribution;
+
+typedef struct memcached_st memcached_st;
+typedef struct meta_server meta_server;
+typedef const meta_server *memcached_server_instance_st;
+typedef memcached_return_t (*memcached_server_fn)(const memcached_st *mc,
+                                                  memcached_server_instance_st server,
+                                                  void *context);
+typedef memcached_return_t (*memcached_stat_fn)(memcached_server_instance_st server,
+                                                const char *key, size_t key_length,
+                                                const char *value, size_t value_length,
+                                                void *context);
+
+/* A value returned by memcached_fetch_result(), valid until the next call */
+typedef struct
+{
+  const char *key;
+  size_t key_length;
+  const char *value;
+  size_t length;
+  uint32_t flags;
+  uint64_t cas;     /* only with MEMCACHED_BEHAVIOR_SUPPORT_CAS */
+} memcached_result_st;
+
+/* Statistics of a single server, filled by memcached_stat_servername() */
+typedef struct
+{
+  int count;
+  char names[MEMCACHED_META_MAX_STATS][64];
+  char values[MEMCACHED_META_MAX_STATS][128];
+} memcached_stat_st;
+
+/* libmemcached compatible API */
+memcached_st *memcached_create(memcached_st *ptr);
+void memcached_free(memcached_st *mc);
+const char *memcached_strerror(const memcached_st *mc, memcached_return_t rc);
+memcached_return_t memcached_behavior_set(memcached_st *mc, memcached_behavior_t flag, uint64_t data);
+uint64_t memcached_behavior_get(memcached_st *mc, memcached_behavior_t flag);
+memcached_return_t memcached_server_add_with_weight(memcached_st *mc, const char *hostname,
+                                                    unsigned int port, uint32_t weight);
+memcached_return_t memcached_server_add_unix_socket_with_weight(memcached_st *mc,
+                                                                const char *filename,
+                                                                uint32_t weight);
+memcached_return_t memcached_server_cursor(const memcached_st *mc,
+                                           const memcached_server_fn *callback,
+                                           void *context, uint32_t number_of_callbacks);
+const char *memcached_server_name(memcached_server_instance_st server);
+unsigned int memcached_server_port(memcached_server_instance_st server);
+memcached_server_instance_st memcached_server_by_key(memcached_st *mc, const char *key,
+                                                     size_t key_length, memcached_return_t *error);
+
+char *memcached_get(memcached_st *mc, const char *key, size_t key_length,
+                    size_t *value_length, uint32_t *flags, memcached_return_t *error);
+memcached_return_t memcached_mget(memcached_st *mc, const char * const *keys,
+                                  const size_t *key_length, size_t number_of_keys);
+char *memcached_fetch(memcached_st *mc, char *key, size_t *key_length,
+                      size_t *value_length, uint32_t *flags, memcached_return_t *error);
+memcached_result_st *memcached_fetch_result(memcached_st *mc, memcached_result_st *result,
+                                            memcached_return_t *error);
+#define memcached_result_key_value(r) ((r)->key)
+#define memcached_result_key_length(r) ((r)->key_length)
+#define memcached_result_value(r) ((r)->value)
+#define memcached_result_length(r) ((r)->length)
+#define memcached_result_flags(r) ((r)->flags)
+#define memcached_result_cas(r) ((r)->cas)
+
+memcached_return_t memcached_set(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags);
+memcached_return_t memcached_add(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags);
+memcached_return_t memcached_replace(memcached_st *mc, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags);
+memcached_return_t memcached_append(memcached_st *mc, const char *key, size_t key_length,
+                                    const char *value, size_t value_length,
+                                    time_t expiration, uint32_t flags);
+memcached_return_t memcached_prepend(memcached_st *mc, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags);
+memcached_return_t memcached_cas(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags, uint64_t cas);
+memcached_return_t memcached_increment_with_initial(memcached_st *mc, const char *key,
+                                                    size_t key_length, uint64_t offset,
+                                                    uint64_t initial, time_t expiration,
+                                                    uint64_t *value);
+memcached_return_t memcached_decrement_with_initial(memcached_st *mc, const char *key,
+                                                    size_t key_length, uint64_t offset,
+                                                    uint64_t initial, time_t expiration,
+                                                    uint64_t *value);
+memcached_return_t memcached_delete(memcached_st *mc, const char *key, size_t key_length,
+                                    time_t expiration);
+memcached_return_t memcached_flush(memcached_st *mc, time_t expiration);
+memcached_return_t memcached_flush_buffers(memcached_st *mc);
+
+memcached_return_t memcached_stat_servername(memcached_stat_st *stat, char *args,
+                                             const char *hostname, unsigned int port);
+char **memcached_stat_get_keys(memcached_st *mc, memcached_stat_st *stat,
+                               memcached_return_t *error);
+char *memcached_stat_get_value(const memcached_st *mc, memcached_stat_st *stat,
+                               const char *key, memcached_return_t *error);
+memcached_return_t memcached_stat_execute(memcached_st *mc, const char *args,
+                                          memcached_stat_fn func, void *context);
+
+/* Meta protocol extensions */
+
+/* mg return flags describing the state of a lease */
+#define META_LEASE_WIN    0x01  /* W: this client should recache the item */
+#define META_LEASE_STALE  0x02  /* X: the item has been invalidated */
+#define META_LEASE_WON    0x04  /* Z: another client is already recaching */
+
+char *meta_get_lease(memcached_st *mc, const char *key, size_t key_length,
+                     uint32_t lease_ttl, size_t *value_length, uint32_t *flags,
+                     int *lease_flags, memcached_return_t *error);
+memcached_return_t meta_invalidate(memcached_st *mc, const char *key, size_t key_length,
+                                   uint32_t stale_ttl);
+void meta_set_operation_timeout(memcached_st *mc, long timeout);
+
+#ifdef USE_MOCK
+/* Simulated round trip time of the mock engine in microseconds */
+extern int mock_latency;
+#endif /* USE_MOCK */
+
+#endif /* !PGMEMCACHE_META_H */
@@ -0,0 +1,1260 @@
+/*
+ * In-process mock memcached engine for pgmemcache.
+ *
+ * Copyright (c) 2012-2014 Ohmu Ltd <opensource@ohmu.fi>
+ *
+ * See the file LICENSE for distribution terms.
+ *
+ * This implements the same subset of the libmemcached API as the meta
+ * protocol client (see pgmemcache_meta.h) on top of hash tables in the
+ * backend's own memory, and is used instead of a real client when
+ * pgmemcache is built with USE_MOCK=1.  Every server added to a memcache
+ * context maps to a store named after the server, so the same key
+ * distribution, multi-server and cluster code paths are exercised as with
+ * real servers, but nothing ever leaves the backend: stores are private to
+ * each backend and are lost when it exits.
+ *
+ * Each request that would be a round trip to a server sleeps for
+ * pgmemcache.mock_latency microseconds, which makes it possible to measure
+ * pgmemcache's own per-call overhead (argument handling, tuple building,
+ * memory contexts) with the network taken out, or with a fixed simulated
+ * network cost put back in.
+ */
+
+#include "postgres.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "pgmemcache_meta.h"
+
+#if !defined(PG_VERSION_NUM) || (PG_VERSION_NUM < 90600)
+#error "the mock engine requires PostgreSQL 9.6 or newer"
+#endif
+
+#define MOCK_MAX_VALUE (1024 * 1024)             /* memcached's default item size limit */
+#define MOCK_MAX_RELATIVE_EXPIRATION (30 * 86400)
+#define MOCK_MAX_NAME 1024
+
+/* memcached's default slab settings (-f, -n, the page size and the largest
+ * chunk) and its per item memory overhead: the item header, the CAS value,
+ * the key's terminating NUL and the value's CRLF */
+#define MOCK_GROWTH_FACTOR 1.25
+#define MOCK_CHUNK_SIZE 48
+#define MOCK_PAGE_SIZE (1024 * 1024)
+#define MOCK_SLAB_CHUNK_MAX (MOCK_PAGE_SIZE / 2)
+#define MOCK_MAX_SLAB_CLASSES 63
+#define MOCK_ITEM_HEADER 48
+#define MOCK_ITEM_OVERHEAD (MOCK_ITEM_HEADER + 8 + 1 + 2)
+
+/* Simulated round trip time in microseconds, set by pgmemcache.mock_latency */
+int mock_latency = 0;
+
+typedef struct
+{
+  uint16_t length;
+  char data[MEMCACHED_MAX_KEY];
+} mock_key;
+
+typedef struct
+{
+  mock_key key;         /* hash key, must be first */
+  char *value;
+  size_t value_length;
+  uint32_t flags;
+  time_t exptime;       /* absolute, 0 for never */
+  time_t stored_at;
+  bool stale;           /* invalidated with meta_invalidate() */
+  bool win_sent;        /* a lease has been handed out for the item */
+  uint64_t cas;         /* changes with every write of the value */
+} mock_item;
+
+/* The contents of a single mock server, shared by all memcache contexts of
+ * the backend which have a server with the same name. */
+typedef struct mock_store
+{
+  char name[MOCK_MAX_NAME];
+  MemoryContext cxt;
+  HTAB *items;
+  time_t started;
+  time_t flush_at;      /* pending delayed flush or 0 */
+  uint64_t last_cas;
+  uint64_t bytes;
+  uint64_t cmd_get;
+  uint64_t get_hits;
+  uint64_t get_misses;
+  uint64_t cmd_set;
+  uint64_t total_items;
+  uint64_t cmd_flush;
+  uint64_t delete_hits;
+  uint64_t delete_misses;
+  uint64_t incr_hits;
+  uint64_t incr_misses;
+  uint64_t decr_hits;
+  uint64_t decr_misses;
+  struct mock_store *next;
+} mock_store;
+
+struct meta_server
+{
+  char *hostname;       /* hostname or unix socket path */
+  unsigned int port;    /* 0 for unix sockets */
+  uint32_t weight;
+  mock_store *store;
+};
+
+/* A result of memcached_mget() for memcached_fetch() */
+typedef struct
+{
+  char *key;
+  size_t key_length;
+  char *value;
+  size_t value_length;
+  uint32_t flags;
+  uint64_t cas;
+} mock_result;
+
+struct memcached_st
+{
+  MemoryContext cxt;
+  MemoryContext mgetcxt;  /* results of the last memcached_mget() */
+  meta_server *servers;
+  int nservers;
+  uint64_t behaviors[MEMCACHED_BEHAVIOR_MAX];
+  int buffered;           /* requests buffered since the last flush */
+  /* results of memcached_mget() for memcached_fetch() */
+  mock_result *mget_results;
+  int mget_count;
+  int mget_pos;
+  memcached_result_st *mget_result;
+};
+
+static const char *mock_errors[] = {
+  "SUCCESS",
+  "FAILURE",
+  "CONNECTION FAILURE",
+  "PROTOCOL ERROR",
+  "CLIENT ERROR",
+  "SERVER ERROR",
+  "CONNECTION DATA EXISTS",
+  "NOT STORED",
+  "NOT FOUND",
+  "MEMORY ALLOCATION FAILURE",
+  "SOME ERRORS WERE REPORTED",
+  "NO SERVERS DEFINED",
+  "END OF RESULTS",
+  "ACTION QUEUED",
+  "A TIMEOUT OCCURRED",
+  "ACTION NOT SUPPORTED",
+  "A BAD KEY WAS PROVIDED/CHARACTERS OUT OF RANGE",
+  "INVALID ARGUMENTS",
+};
+
+static mock_store *mock_stores = NULL;
+
+
+/*
+ * Stores
+ */
+
+static mock_store *mock_store_get(const char *hostname, unsigned int port)
+{
+  char name[MOCK_MAX_NAME];
+  mock_store *store;
+  HASHCTL ctl;
+
+  if (port)
+    snprintf(name, sizeof(name), "%s:%u", hostname, port);
+  else
+    strlcpy(name, hostname, sizeof(name));
+
+  for (store = mock_stores; store; store = store->next)
+    if (strcmp(store->name, name) == 0)
+      return store;
+
+  store = MemoryContextAllocZero(TopMemoryContext, sizeof(mock_store));
+  strlcpy(store->name, name, sizeof(store->name));
+  store->cxt = AllocSetContextCreate(TopMemoryContext, "pgmemcache mock store",
+                                     ALLOCSET_DEFAULT_SIZES);
+  memset(&ctl, 0, sizeof(ctl));
+  ctl.keysize = sizeof(mock_key);
+  ctl.entrysize = sizeof(mock_item);
+  ctl.hcxt = store->cxt;
+  store->items = hash_create("pgmemcache mock items", 1024, &ctl,
+                             HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+  store->started = time(NULL);
+  store->next = mock_stores;
+  mock_stores = store;
+  return store;
+}
+
+static void mock_item_remove(mock_store *store, mock_item *item)
+{
+  store->bytes -= item->value_length;
+  if (item->value)
+    pfree(item->value);
+  hash_search(store->items, &item->key, HASH_REMOVE, NULL);
+}
+
+static void mock_store_flush(mock_store *store)
+{
+  HASH_SEQ_STATUS status;
+  mock_item *item;
+
+  hash_seq_init(&status, store->items);
+  while ((item = hash_seq_search(&status)) != NULL)
+    mock_item_remove(store, item);
+  store->flush_at = 0;
+}
+
+/* memcached's expiration: 0 never expires, up to 30 days is relative to
+ * the current time and anything larger is an absolute unix time */
+static time_t mock_exptime(time_t expiration, time_t now)
+{
+  if (expiration == 0)
+    return 0;
+  if (expiration < 0)
+    return now - 1;
+  if (expiration <= MOCK_MAX_RELATIVE_EXPIRATION)
+    return now + expiration;
+  return expiration;
+}
+
+static bool mock_make_key(mock_key *mkey, const char *key, size_t key_length)
+{
+  if (key_length == 0 || key_length >= MEMCACHED_MAX_KEY)
+    return false;
+  memset(mkey, 0, sizeof(*mkey));
+  mkey->length = (uint16_t) key_length;
+  memcpy(mkey->data, key, key_length);
+  return true;
+}
+
+/* Look up a live item, expired items are removed lazily */
+static mock_item *mock_lookup(mock_store *store, const mock_key *mkey)
+{
+  time_t now = time(NULL);
+  mock_item *item;
+
+  if (store->flush_at && now >= store->flush_at)
+    mock_store_flush(store);
+  item = hash_search(store->items, mkey, HASH_FIND, NULL);
+  if (item && item->exptime && item->exptime <= now)
+    {
+      mock_item_remove(store, item);
+      item = NULL;
+    }
+  return item;
+}
+
+static void mock_item_set_value(mock_store *store, mock_item *item,
+                                const char *value, size_t value_length)
+{
+  char *copy = MemoryContextAlloc(store->cxt, value_length + 1);
+
+  memcpy(copy, value, value_length);
+  copy[value_length] = '\0';
+  store->bytes -= item->value_length;
+  if (item->value)
+    pfree(item->value);
+  item->value = copy;
+  item->value_length = value_length;
+  item->cas = ++store->last_cas;
+  store->bytes += value_length;
+}
+
+/* Simulate the network round trip of a request.  The wait is ended by
+ * interrupts and postmaster death like the waits for real servers, only
+ * the part below a millisecond is slept. */
+static void mock_round_trip(void)
+{
+  TimestampTz end = GetCurrentTimestamp() + mock_latency;
+
+  for (;;)
+    {
+      long secs;
+      int usecs, rc;
+      int64 remaining;
+
+      CHECK_FOR_INTERRUPTS();
+      TimestampDifference(GetCurrentTimestamp(), end, &secs, &usecs);
+      remaining = (int64) secs * 1000000 + usecs;
+      if (remaining <= 0)
+        break;
+      if (remaining < 1000)
+        {
+          pg_usleep(remaining);
+          continue;
+        }
+#if PG_VERSION_NUM >= 120000
+      rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                     remaining / 1000, PG_WAIT_EXTENSION);
+#elif PG_VERSION_NUM >= 100000
+      rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                     remaining / 1000, PG_WAIT_EXTENSION);
+#else
+      rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                     remaining / 1000);
+#endif
+      if (rc & WL_POSTMASTER_DEATH)
+        proc_exit(1);
+      if (rc & WL_LATCH_SET)
+        ResetLatch(MyLatch);
+    }
+}
+
+
+/*
+ * Key distribution
+ */
+
+/* libmemcached's default hash function ("one at a time" by Bob Jenkins),
+ * keys map to the same servers as with the default modula distribution of
+ * libmemcached and the meta protocol client. */
+static uint32_t mock_hash(const char *key, size_t key_length)
+{
+  const char *ptr = key;
+  uint32_t value = 0;
+
+  while (key_length--)
+    {
+      uint32_t val = (uint32_t) *ptr++;
+      value += val;
+      value += (value << 10);
+      value ^= (value >> 6);
+    }
+  value += (value << 3);
+  value ^= (value >> 11);
+  value += (value << 15);
+
+  return value;
+}
+
+/* Consistent hashing isn't simulated, the mock only needs to spread keys
+ * over the stores deterministically. */
+static meta_server *mock_server_for_key(memcached_st *mc, const char *key, size_t key_length)
+{
+  if (mc->nservers == 1)
+    return &mc->servers[0];
+  if (mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION] == MEMCACHED_DISTRIBUTION_RANDOM)
+    return &mc->servers[random() % mc->nservers];
+  return &mc->servers[mock_hash(key, key_length) % mc->nservers];
+}
+
+static bool mock_buffering(memcached_st *mc)
+{
+  return mc->behaviors[MEMCACHED_BEHAVIOR_BUFFER_REQUESTS] || mc->behaviors[MEMCACHED_BEHAVIOR_NOREPLY];
+}
+
+
+/*
+ * libmemcached compatible API
+ */
+
+memcached_st *memcached_create(memcached_st *ptr)
+{
+  MemoryContext cxt;
+  memcached_st *mc;
+
+  if (ptr != NULL)
+    return NULL;
+
+  cxt = AllocSetContextCreate(TopMemoryContext, "pgmemcache mock", ALLOCSET_DEFAULT_SIZES);
+  mc = MemoryContextAllocZero(cxt, sizeof(memcached_st));
+  mc->cxt = cxt;
+  mc->mgetcxt = AllocSetContextCreate(cxt, "pgmemcache mock mget", ALLOCSET_DEFAULT_SIZES);
+  mc->behaviors[MEMCACHED_BEHAVIOR_SUPPORT_CAS] = 1;
+  mc->behaviors[MEMCACHED_BEHAVIOR_DISTRIBUTION] = MEMCACHED_DISTRIBUTION_MODULA;
+  mc->behaviors[MEMCACHED_BEHAVIOR_HASH] = MEMCACHED_HASH_DEFAULT;
+  mc->behaviors[MEMCACHED_BEHAVIOR_KETAMA_HASH] = MEMCACHED_HASH_DEFAULT;
+  return mc;
+}
+
+void memcached_free(memcached_st *mc)
+{
+  if (mc == NULL)
+    return;
+  if (mc->mget_result)
+    free(mc->mget_result);
+  MemoryContextDelete(mc->cxt);
+}
+
+const char *memcached_strerror(const memcached_st *mc, memcached_return_t rc)
+{
+  if ((int) rc < 0 || rc >= MEMCACHED_MAXIMUM_RETURN)
+    return "UNKNOWN ERROR";
+  return mock_errors[rc];
+}
+
+memcached_return_t memcached_behavior_set(memcached_st *mc, memcached_behavior_t flag, uint64_t data)
+{
+  if ((int) flag < 0 || flag >= MEMCACHED_BEHAVIOR_MAX)
+    return MEMCACHED_INVALID_ARGUMENTS;
+
+  switch (flag)
+    {
+    case MEMCACHED_BEHAVIOR_HASH:
+    case MEMCACHED_BEHAVIOR_KETAMA_HASH:
+      if (data != MEMCACHED_HASH_DEFAULT)
+        return MEMCACHED_NOT_SUPPORTED;
+      break;
+    case MEMCACHED_BEHAVIOR_DISTRIBUTION:
+      if (data > MEMCACHED_DISTRIBUTION_RANDOM)
+        return MEMCACHED_INVALID_ARGUMENTS;
+      break;
+    case MEMCACHED_BEHAVIOR_USE_UDP:
+    case MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS:
+      if (data)
+        return MEMCACHED_NOT_SUPPORTED;
+      break;
+    default:
+      /* timeouts, socket options and the like have no meaning without a
+       * network, but they're remembered for memcached_behavior_get() */
+      break;
+    }
+  mc->behaviors[flag] = data;
+  return MEMCACHED_SUCCESS;
+}
+
+uint64_t memcached_behavior_get(memcached_st *mc, memcached_behavior_t flag)
+{
+  if ((int) flag < 0 || flag >= MEMCACHED_BEHAVIOR_MAX)
+    return 0;
+  return mc->behaviors[flag];
+}
+
+static memcached_return_t mock_server_add(memcached_st *mc, const char *hostname,
+                                          unsigned int port, uint32_t weight)
+{
+  MemoryContext oldcontext = MemoryContextSwitchTo(mc->cxt);
+  meta_server *srv;
+
+  if (mc->servers)
+    mc->servers = repalloc(mc->servers, sizeof(meta_server) * (mc->nservers + 1));
+  else
+    mc->servers = palloc(sizeof(meta_server));
+  srv = &mc->servers[mc->nservers++];
+  srv->hostname = pstrdup(hostname);
+  srv->port = port;
+  srv->weight = weight;
+  srv->store = mock_store_get(hostname, port);
+  MemoryContextSwitchTo(oldcontext);
+  return MEMCACHED_SUCCESS;
+}
+
+memcached_return_t memcached_server_add_with_weight(memcached_st *mc, const char *hostname,
+                                                    unsigned int port, uint32_t weight)
+{
+  return mock_server_add(mc, hostname, port ? port : 11211, weight);
+}
+
+memcached_return_t memcached_server_add_unix_socket_with_weight(memcached_st *mc,
+                                                                const char *filename,
+                                                                uint32_t weight)
+{
+  return mock_server_add(mc, filename, 0, weight);
+}
+
+memcached_return_t memcached_server_cursor(const memcached_st *mc,
+                                           const memcached_server_fn *callback,
+                                           void *context, uint32_t number_of_callbacks)
+{
+  int i;
+  uint32_t j;
+
+  for (i = 0; i < mc->nservers; i++)
+    for (j = 0; j < number_of_callbacks; j++)
+      callback[j](mc, &mc->servers[i], context);
+  return MEMCACHED_SUCCESS;
+}
+
+const char *memcached_server_name(memcached_server_instance_st server)
+{
+  return server->hostname;
+}
+
+unsigned int memcached_server_port(memcached_server_instance_st server)
+{
+  return server->port;
+}
+
+memcached_server_instance_st memcached_server_by_key(memcached_st *mc, const char *key,
+                                                     size_t key_length, memcached_return_t *error)
+{
+  if (mc->nservers == 0)
+    {
+      *error = MEMCACHED_NO_SERVERS;
+      return NULL;
+    }
+  *error = MEMCACHED_SUCCESS;
+  return mock_server_for_key(mc, key, key_length);
+}
+
+/* Fetch a single key, optionally with a lease following the semantics of
+ * memcached's mg N flag */
+static char *mock_get(memcached_st *mc, const char *key, size_t key_length, uint32_t lease_ttl,
+                      size_t *value_length, uint32_t *flags, int *lease_flags,
+                      memcached_return_t *error)
+{
+  mock_store *store;
+  mock_item *item;
+  mock_key mkey;
+  char *value;
+
+  if (mc->nservers == 0)
+    {
+      *error = MEMCACHED_NO_SERVERS;
+      return NULL;
+    }
+  if (!mock_make_key(&mkey, key, key_length))
+    {
+      *error = MEMCACHED_BAD_KEY_PROVIDED;
+      return NULL;
+    }
+  store = mock_server_for_key(mc, key, key_length)->store;
+  mock_round_trip();
+
+  store->cmd_get++;
+  item = mock_lookup(store, &mkey);
+  if (item == NULL && lease_ttl)
+    {
+      /* the first client to miss wins the lease and gets an empty
+       * placeholder, others see it with the won flag */
+      item = hash_search(store->items, &mkey, HASH_ENTER, NULL);
+      item->value = NULL;
+      item->value_length = 0;
+      mock_item_set_value(store, item, "", 0);
+      item->flags = 0;
+      item->exptime = mock_exptime(lease_ttl, time(NULL));
+      item->stored_at = time(NULL);
+      item->stale = false;
+      item->win_sent = true;
+      store->get_misses++;
+      *lease_flags = META_LEASE_WIN;
+    }
+  else if (item == NULL)
+    {
+      store->get_misses++;
+      *error = MEMCACHED_NOTFOUND;
+      return NULL;
+    }
+  else
+    {
+      store->get_hits++;
+      if (lease_ttl)
+        {
+          if (item->stale)
+            *lease_flags |= META_LEASE_STALE;
+          if (item->stale && !item->win_sent)
+            {
+              *lease_flags |= META_LEASE_WIN;
+              item->win_sent = true;
+            }
+          else if (item->win_sent)
+            *lease_flags |= META_LEASE_WON;
+        }
+    }
+
+  value = malloc(item->value_length + 1);
+  if (value == NULL)
+    {
+      *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+  memcpy(value, item->value, item->value_length + 1);
+  *value_length = item->value_length;
+  if (flags)
+    *flags = item->flags;
+  *error = MEMCACHED_SUCCESS;
+  return value;
+}
+
+char *memcached_get(memcached_st *mc, const char *key, size_t key_length,
+                    size_t *value_length, uint32_t *flags, memcached_return_t *error)
+{
+  return mock_get(mc, key, key_length, 0, value_length, flags, NULL, error);
+}
+
+/* All keys are looked up at once and the results are copied so that they
+ * stay valid while they're fetched even if the caller modifies the store
+ * in between. */
+memcached_return_t memcached_mget(memcached_st *mc, const char * const *keys,
+                                  const size_t *key_length, size_t number_of_keys)
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  size_t i;
+
+  MemoryContextReset(mc->mgetcxt);
+  mc->mget_results = NULL;
+  mc->mget_count = mc->mget_pos = 0;
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+
+  mock_round_trip();
+  mc->mget_results = MemoryContextAlloc(mc->mgetcxt, sizeof(mock_result) * Max(number_of_keys, 1));
+  for (i = 0; i < number_of_keys; i++)
+    {
+      mock_result *res;
+      mock_store *store;
+      mock_item *item;
+      mock_key mkey;
+
+      if (keys[i] == NULL || key_length[i] == 0)
+        continue;
+      if (!mock_make_key(&mkey, keys[i], key_length[i]))
+        {
+          rc = MEMCACHED_SOME_ERRORS;
+          continue;
+        }
+      store = mock_server_for_key(mc, keys[i], key_length[i])->store;
+      store->cmd_get++;
+      item = mock_lookup(store, &mkey);
+      if (item == NULL)
+        {
+          store->get_misses++;
+          continue;
+        }
+      store->get_hits++;
+      res = &mc->mget_results[mc->mget_count++];
+      res->key = MemoryContextAlloc(mc->mgetcxt, key_length[i] + 1);
+      memcpy(res->key, keys[i], key_length[i]);
+      res->key[key_length[i]] = '\0';
+      res->key_length = key_length[i];
+      res->value = MemoryContextAlloc(mc->mgetcxt, item->value_length + 1);
+      memcpy(res->value, item->value, item->value_length + 1);
+      res->value_length = item->value_length;
+      res->flags = item->flags;
+      res->cas = item->cas;
+    }
+  return rc;
+}
+
+char *memcached_fetch(memcached_st *mc, char *key, size_t *key_length,
+                      size_t *value_length, uint32_t *flags, memcached_return_t *error)
+{
+  mock_result *res;
+  char *value;
+
+  if (mc->mget_pos >= mc->mget_count)
+    {
+      *error = MEMCACHED_END;
+      return NULL;
+    }
+  res = &mc->mget_results[mc->mget_pos++];
+  value = malloc(res->value_length + 1);
+  if (value == NULL)
+    {
+      *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+  memcpy(value, res->value, res->value_length + 1);
+  if (key)
+    {
+      memcpy(key, res->key, res->key_length);
+      *key_length = res->key_length;
+    }
+  *value_length = res->value_length;
+  *flags = res->flags;
+  *error = MEMCACHED_SUCCESS;
+  return value;
+}
+
+memcached_result_st *memcached_fetch_result(memcached_st *mc, memcached_result_st *result,
+                                            memcached_return_t *error)
+{
+  mock_result *res;
+
+  if (mc->mget_pos >= mc->mget_count)
+    {
+      *error = MEMCACHED_END;
+      if (mc->mget_result)
+        free(mc->mget_result);
+      mc->mget_result = NULL;
+      return NULL;
+    }
+  if (result == NULL)
+    {
+      if (mc->mget_result == NULL)
+        mc->mget_result = malloc(sizeof(memcached_result_st));
+      result = mc->mget_result;
+      if (result == NULL)
+        {
+          *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+          return NULL;
+        }
+    }
+  res = &mc->mget_results[mc->mget_pos++];
+  result->key = res->key;
+  result->key_length = res->key_length;
+  result->value = res->value;
+  result->length = res->value_length;
+  result->flags = res->flags;
+  result->cas = res->cas;
+  *error = MEMCACHED_SUCCESS;
+  return result;
+}
+
+/* Buffered requests are applied right away but only pay for the round
+ * trip in memcached_flush_buffers(), like pipelined requests would */
+static memcached_return_t mock_request_done(memcached_st *mc, memcached_return_t rc)
+{
+  if (mock_buffering(mc))
+    {
+      mc->buffered++;
+      return MEMCACHED_BUFFERED;
+    }
+  return rc;
+}
+
+static memcached_return_t mock_write(memcached_st *mc, char mode, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags, uint64_t cas)
+{
+  mock_store *store;
+  mock_item *item;
+  mock_key mkey;
+  time_t now = time(NULL);
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  if (!mock_make_key(&mkey, key, key_length))
+    return MEMCACHED_BAD_KEY_PROVIDED;
+  store = mock_server_for_key(mc, key, key_length)->store;
+  if (!mock_buffering(mc))
+    mock_round_trip();
+
+  store->cmd_set++;
+  if (value_length > MOCK_MAX_VALUE)
+    return mock_request_done(mc, MEMCACHED_SERVER_ERROR);
+
+  item = mock_lookup(store, &mkey);
+  if (cas && item == NULL)
+    return mock_request_done(mc, MEMCACHED_NOTFOUND);
+  if (cas && item->cas != cas)
+    return mock_request_done(mc, MEMCACHED_DATA_EXISTS);
+  switch (mode)
+    {
+    case 'E':  /* add */
+      if (item)
+        return mock_request_done(mc, MEMCACHED_NOTSTORED);
+      break;
+    case 'R':  /* replace */
+    case 'A':  /* append */
+    case 'P':  /* prepend */
+      if (item == NULL)
+        return mock_request_done(mc, MEMCACHED_NOTSTORED);
+      break;
+    default:
+      break;
+    }
+
+  if (mode == 'A' || mode == 'P')
+    {
+      /* the item keeps its flags and expiration */
+      char *buf = palloc(item->value_length + value_length);
+
+      if (mode == 'A')
+        {
+          memcpy(buf, item->value, item->value_length);
+          memcpy(buf + item->value_length, value, value_length);
+        }
+      else
+        {
+          memcpy(buf, value, value_length);
+          memcpy(buf + value_length, item->value, item->value_length);
+        }
+      mock_item_set_value(store, item, buf, item->value_length + value_length);
+      pfree(buf);
+    }
+  else
+    {
+      if (item == NULL)
+        {
+          item = hash_search(store->items, &mkey, HASH_ENTER, NULL);
+          item->value = NULL;
+          item->value_length = 0;
+        }
+      mock_item_set_value(store, item, value, value_length);
+      item->flags = flags;
+      item->exptime = mock_exptime(expiration, now);
+    }
+  item->stored_at = now;
+  item->stale = false;
+  item->win_sent = false;
+  store->total_items++;
+  return mock_request_done(mc, MEMCACHED_SUCCESS);
+}
+
+memcached_return_t memcached_set(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags)
+{
+  return mock_write(mc, 'S', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_add(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags)
+{
+  return mock_write(mc, 'E', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_replace(memcached_st *mc, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags)
+{
+  return mock_write(mc, 'R', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_append(memcached_st *mc, const char *key, size_t key_length,
+                                    const char *value, size_t value_length,
+                                    time_t expiration, uint32_t flags)
+{
+  return mock_write(mc, 'A', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_prepend(memcached_st *mc, const char *key, size_t key_length,
+                                     const char *value, size_t value_length,
+                                     time_t expiration, uint32_t flags)
+{
+  return mock_write(mc, 'P', key, key_length, value, value_length, expiration, flags, 0);
+}
+
+memcached_return_t memcached_cas(memcached_st *mc, const char *key, size_t key_length,
+                                 const char *value, size_t value_length,
+                                 time_t expiration, uint32_t flags, uint64_t cas)
+{
+  return mock_write(mc, 'S', key, key_length, value, value_length, expiration, flags, cas);
+}
+
+static memcached_return_t mock_delta(memcached_st *mc, bool incr, const char *key, size_t key_length,
+                                     uint64_t offset, uint64_t initial, time_t expiration,
+                                     uint64_t *value)
+{
+  mock_store *store;
+  mock_item *item;
+  mock_key mkey;
+  uint64_t number;
+  char buf[32];
+  int len;
+
+  *value = UINT64_MAX;
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  if (!mock_make_key(&mkey, key, key_length))
+    return MEMCACHED_BAD_KEY_PROVIDED;
+  store = mock_server_for_key(mc, key, key_length)->store;
+  if (!mock_buffering(mc))
+    mock_round_trip();
+
+  item = mock_lookup(store, &mkey);
+  if (item == NULL)
+    {
+      if (incr)
+        store->incr_misses++;
+      else
+        store->decr_misses++;
+      /* autovivify missing keys with the initial value unless told not to */
+      if ((uint32_t) expiration == MEMCACHED_EXPIRATION_NOT_ADD)
+        return mock_request_done(mc, MEMCACHED_NOTFOUND);
+      item = hash_search(store->items, &mkey, HASH_ENTER, NULL);
+      item->value = NULL;
+      item->value_length = 0;
+      len = snprintf(buf, sizeof(buf), UINT64_FORMAT, (uint64) initial);
+      mock_item_set_value(store, item, buf, len);
+      item->flags = 0;
+      item->exptime = mock_exptime(expiration, time(NULL));
+      item->stored_at = time(NULL);
+      item->stale = false;
+      item->win_sent = false;
+      *value = initial;
+      return mock_request_done(mc, MEMCACHED_SUCCESS);
+    }
+
+  {
+    size_t i;
+    bool numeric = item->value_length > 0 && item->value_length < 21;
+
+    for (i = 0; numeric && i < item->value_length; i++)
+      if (item->value[i] < '0' || item->value[i] > '9')
+        numeric = false;
+    if (!numeric)
+      return mock_request_done(mc, MEMCACHED_CLIENT_ERROR);
+    errno = 0;
+    number = strtoull(item->value, NULL, 10);
+    if (errno == ERANGE)
+      return mock_request_done(mc, MEMCACHED_CLIENT_ERROR);
+  }
+
+  /* increments wrap around at 64 bits, decrements stop at zero */
+  if (incr)
+    {
+      store->incr_hits++;
+      number += offset;
+    }
+  else
+    {
+      store->decr_hits++;
+      number = number < offset ? 0 : number - offset;
+    }
+  len = snprintf(buf, sizeof(buf), UINT64_FORMAT, (uint64) number);
+  mock_item_set_value(store, item, buf, len);
+  *value = number;
+  return mock_request_done(mc, MEMCACHED_SUCCESS);
+}
+
+memcached_return_t memcached_increment_with_initial(memcached_st *mc, const char *key,
+                                                    size_t key_length, uint64_t offset,
+                                                    uint64_t initial, time_t expiration,
+                                                    uint64_t *value)
+{
+  return mock_delta(mc, true, key, key_length, offset, initial, expiration, value);
+}
+
+memcached_return_t memcached_decrement_with_initial(memcached_st *mc, const char *key,
+                                                    size_t key_length, uint64_t offset,
+                                                    uint64_t initial, time_t expiration,
+                                                    uint64_t *value)
+{
+  return mock_delta(mc, false, key, key_length, offset, initial, expiration, value);
+}
+
+memcached_return_t memcached_delete(memcached_st *mc, const char *key, size_t key_length,
+                                    time_t expiration)
+{
+  mock_store *store;
+  mock_item *item;
+  mock_key mkey;
+
+  /* delete hold timers were removed from memcached long ago */
+  if (expiration != 0)
+    return MEMCACHED_INVALID_ARGUMENTS;
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  if (!mock_make_key(&mkey, key, key_length))
+    return MEMCACHED_BAD_KEY_PROVIDED;
+  store = mock_server_for_key(mc, key, key_length)->store;
+  if (!mock_buffering(mc))
+    mock_round_trip();
+
+  item = mock_lookup(store, &mkey);
+  if (item == NULL)
+    {
+      store->delete_misses++;
+      return mock_request_done(mc, MEMCACHED_NOTFOUND);
+    }
+  store->delete_hits++;
+  mock_item_remove(store, item);
+  return mock_request_done(mc, MEMCACHED_SUCCESS);
+}
+
+memcached_return_t memcached_flush(memcached_st *mc, time_t expiration)
+{
+  int s;
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+
+  mock_round_trip();
+  for (s = 0; s < mc->nservers; s++)
+    {
+      mock_store *store = mc->servers[s].store;
+
+      store->cmd_flush++;
+      if (expiration > 0)
+        store->flush_at = mock_exptime(expiration, time(NULL));
+      else
+        mock_store_flush(store);
+    }
+  return MEMCACHED_SUCCESS;
+}
+
+memcached_return_t memcached_flush_buffers(memcached_st *mc)
+{
+  if (mc->buffered > 0)
+    {
+      mock_round_trip();
+      mc->buffered = 0;
+    }
+  return MEMCACHED_SUCCESS;
+}
+
+/* Where the statistics of a store go: either a memcached_stat_st or a
+ * memcached_stat_execute() callback */
+typedef struct
+{
+  memcached_stat_st *stat;
+  memcached_stat_fn func;
+  meta_server *server;
+  void *context;
+} mock_stat_sink;
+
+static void mock_stat(mock_stat_sink *sink, const char *name, const char *fmt, ...)
+  pg_attribute_printf(3, 4);
+
+static void mock_stat(mock_stat_sink *sink, const char *name, const char *fmt, ...)
+{
+  char value[128];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(value, sizeof(value), fmt, args);
+  va_end(args);
+
+  if (sink->func)
+    sink->func(sink->server, name, strlen(name), value, strlen(value), sink->context);
+  else if (sink->stat->count < MEMCACHED_META_MAX_STATS)
+    {
+      strlcpy(sink->stat->names[sink->stat->count], name, sizeof(sink->stat->names[0]));
+      strlcpy(sink->stat->values[sink->stat->count], value, sizeof(sink->stat->values[0]));
+      sink->stat->count++;
+    }
+}
+
+/* Chunk sizes of the slab classes of a memcached running with the default
+ * settings, computed like slabs_init() in memcached does */
+static int mock_slab_classes(int64 *sizes)
+{
+  double size = MOCK_ITEM_HEADER + MOCK_CHUNK_SIZE;
+  int n = 0;
+
+  while (n < MOCK_MAX_SLAB_CLASSES - 1 && size < MOCK_SLAB_CHUNK_MAX / MOCK_GROWTH_FACTOR)
+    {
+      int64 aligned = (int64) size;
+
+      if (aligned % 8)
+        aligned += 8 - aligned % 8;
+      sizes[n++] = aligned;
+      size = (double) (int64) (aligned * MOCK_GROWTH_FACTOR);
+    }
+  sizes[n++] = MOCK_SLAB_CHUNK_MAX;
+  return n;
+}
+
+/* Report the items of a store as if they were held in memcached's slab
+ * classes, items larger than the largest chunk are chained over several
+ * chunks of the largest class. */
+static void mock_slab_stats(mock_store *store, bool items, mock_stat_sink *sink)
+{
+  int64 sizes[MOCK_MAX_SLAB_CLASSES], chunks[MOCK_MAX_SLAB_CLASSES], counts[MOCK_MAX_SLAB_CLASSES];
+  int nclasses = mock_slab_classes(sizes), active = 0, i;
+  int64 malloced = 0;
+  HASH_SEQ_STATUS status;
+  mock_item *item;
+
+  memset(chunks, 0, sizeof(chunks));
+  memset(counts, 0, sizeof(counts));
+  hash_seq_init(&status, store->items);
+  while ((item = hash_seq_search(&status)) != NULL)
+    {
+      int64 size = MOCK_ITEM_OVERHEAD + item->key.length + item->value_length;
+
+      for (i = 0; i < nclasses - 1 && sizes[i] < size; i++)
+        ;
+      chunks[i] += (size + sizes[i] - 1) / sizes[i];
+      counts[i]++;
+    }
+
+  for (i = 0; i < nclasses; i++)
+    {
+      int64 per_page = MOCK_PAGE_SIZE / sizes[i];
+      int64 pages = (chunks[i] + per_page - 1) / per_page;
+      char name[64];
+
+      if (counts[i] == 0)
+        continue;
+      active++;
+      malloced += pages * MOCK_PAGE_SIZE;
+      if (items)
+        {
+          snprintf(name, sizeof(name), "items:%d:number", i + 1);
+          mock_stat(sink, name, INT64_FORMAT, counts[i]);
+          snprintf(name, sizeof(name), "items:%d:evicted", i + 1);
+          mock_stat(sink, name, "%d", 0);
+          snprintf(name, sizeof(name), "items:%d:outofmemory", i + 1);
+          mock_stat(sink, name, "%d", 0);
+          continue;
+        }
+      snprintf(name, sizeof(name), "%d:chunk_size", i + 1);
+      mock_stat(sink, name, INT64_FORMAT, sizes[i]);
+      snprintf(name, sizeof(name), "%d:chunks_per_page", i + 1);
+      mock_stat(sink, name, INT64_FORMAT, per_page);
+      snprintf(name, sizeof(name), "%d:total_pages", i + 1);
+      mock_stat(sink, name, INT64_FORMAT, pages);
+      snprintf(name, sizeof(name), "%d:total_chunks", i + 1);
+      mock_stat(sink, name, INT64_FORMAT, pages * per_page);
+      snprintf(name, sizeof(name), "%d:used_chunks", i + 1);
+      mock_stat(sink, name, INT64_FORMAT, chunks[i]);
+      snprintf(name, sizeof(name), "%d:free_chunks", i + 1);
+      mock_stat(sink, name, INT64_FORMAT, pages * per_page - chunks[i]);
+    }
+  if (!items)
+    {
+      mock_stat(sink, "active_slabs", "%d", active);
+      mock_stat(sink, "total_malloced", INT64_FORMAT, malloced);
+    }
+}
+
+/* Statistics of a store in the format of memcached's "stats" command, the
+ * "settings", "slabs" and "items" groups are supported and other groups
+ * are reported as empty. */
+static void mock_stats(mock_store *store, const char *args, mock_stat_sink *sink)
+{
+  time_t now = time(NULL);
+
+  mock_round_trip();
+  if (store->flush_at && now >= store->flush_at)
+    mock_store_flush(store);
+
+  if (args && strcmp(args, "settings") == 0)
+    {
+      mock_stat(sink, "item_size_max", "%d", MOCK_PAGE_SIZE);
+      mock_stat(sink, "growth_factor", "%.2f", MOCK_GROWTH_FACTOR);
+      mock_stat(sink, "chunk_size", "%d", MOCK_CHUNK_SIZE);
+      mock_stat(sink, "slab_chunk_max", "%d", MOCK_SLAB_CHUNK_MAX);
+      return;
+    }
+  if (args && (strcmp(args, "slabs") == 0 || strcmp(args, "items") == 0))
+    {
+      mock_slab_stats(store, strcmp(args, "items") == 0, sink);
+      return;
+    }
+  if (args && *args)
+    return;
+
+  mock_stat(sink, "pid", "%d", MyProcPid);
+  mock_stat(sink, "uptime", "%ld", (long) (now - store->started));
+  mock_stat(sink, "time", "%ld", (long) now);
+  mock_stat(sink, "version", "%s", "pgmemcache-mock");
+  mock_stat(sink, "curr_items", "%ld", hash_get_num_entries(store->items));
+  mock_stat(sink, "total_items", UINT64_FORMAT, (uint64) store->total_items);
+  mock_stat(sink, "bytes", UINT64_FORMAT, (uint64) store->bytes);
+  mock_stat(sink, "cmd_get", UINT64_FORMAT, (uint64) store->cmd_get);
+  mock_stat(sink, "cmd_set", UINT64_FORMAT, (uint64) store->cmd_set);
+  mock_stat(sink, "cmd_flush", UINT64_FORMAT, (uint64) store->cmd_flush);
+  mock_stat(sink, "get_hits", UINT64_FORMAT, (uint64) store->get_hits);
+  mock_stat(sink, "get_misses", UINT64_FORMAT, (uint64) store->get_misses);
+  mock_stat(sink, "delete_misses", UINT64_FORMAT, (uint64) store->delete_misses);
+  mock_stat(sink, "delete_hits", UINT64_FORMAT, (uint64) store->delete_hits);
+  mock_stat(sink, "incr_misses", UINT64_FORMAT, (uint64) store->incr_misses);
+  mock_stat(sink, "incr_hits", UINT64_FORMAT, (uint64) store->incr_hits);
+  mock_stat(sink, "decr_misses", UINT64_FORMAT, (uint64) store->decr_misses);
+  mock_stat(sink, "decr_hits", UINT64_FORMAT, (uint64) store->decr_hits);
+  mock_stat(sink, "evictions", "%d", 0);
+}
+
+memcached_return_t memcached_stat_servername(memcached_stat_st *stat, char *args,
+                                             const char *hostname, unsigned int port)
+{
+  mock_stat_sink sink = { stat, NULL, NULL, NULL };
+
+  stat->count = 0;
+  mock_stats(mock_store_get(hostname, port), args, &sink);
+  return MEMCACHED_SUCCESS;
+}
+
+char **memcached_stat_get_keys(memcached_st *mc, memcached_stat_st *stat,
+                               memcached_return_t *error)
+{
+  char **list = malloc(sizeof(char *) * (stat->count + 1));
+  int i;
+
+  if (list == NULL)
+    {
+      *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+  for (i = 0; i < stat->count; i++)
+    list[i] = stat->names[i];
+  list[stat->count] = NULL;
+  *error = MEMCACHED_SUCCESS;
+  return list;
+}
+
+char *memcached_stat_get_value(const memcached_st *mc, memcached_stat_st *stat,
+                               const char *key, memcached_return_t *error)
+{
+  int i;
+
+  for (i = 0; i < stat->count; i++)
+    if (strcmp(stat->names[i], key) == 0)
+      {
+        *error = MEMCACHED_SUCCESS;
+        return strdup(stat->values[i]);
+      }
+  *error = MEMCACHED_NOTFOUND;
+  return NULL;
+}
+
+memcached_return_t memcached_stat_execute(memcached_st *mc, const char *args,
+                                          memcached_stat_fn func, void *context)
+{
+  int i;
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  for (i = 0; i < mc->nservers; i++)
+    {
+      mock_stat_sink sink = { NULL, func, &mc->servers[i], context };
+
+      mock_stats(mc->servers[i].store, args, &sink);
+    }
+  return MEMCACHED_SUCCESS;
+}
+
+
+/*
+ * Meta protocol extensions
+ */
+
+char *meta_get_lease(memcached_st *mc, const char *key, size_t key_length,
+                     uint32_t lease_ttl, size_t *value_length, uint32_t *flags,
+                     int *lease_flags, memcached_return_t *error)
+{
+  *lease_flags = 0;
+  return mock_get(mc, key, key_length, lease_ttl ? lease_ttl : 1, value_length, flags,
+                  lease_flags, error);
+}
+
+memcached_return_t meta_invalidate(memcached_st *mc, const char *key, size_t key_length,
+                                   uint32_t stale_ttl)
+{
+  mock_store *store;
+  mock_item *item;
+  mock_key mkey;
+
+  if (mc->nservers == 0)
+    return MEMCACHED_NO_SERVERS;
+  if (!mock_make_key(&mkey, key, key_length))
+    return MEMCACHED_BAD_KEY_PROVIDED;
+  store = mock_server_for_key(mc, key, key_length)->store;
+  if (!mock_buffering(mc))
+    mock_round_trip();
+
+  item = mock_lookup(store, &mkey);
+  if (item == NULL)
+    {
+      store->delete_misses++;
+      return mock_request_done(mc, MEMCACHED_NOTFOUND);
+    }
+  store->delete_hits++;
+  item->stale = true;
+  item->win_sent = false;
+  if (stale_ttl)
+    item->exptime = mock_exptime(stale_ttl, time(NULL));
+  return mock_request_done(mc, MEMCACHED_SUCCESS);
+}
+
+/* Requests never wait for anything but the simulated latency */
+void meta_set_operation_timeout(memcached_st *mc, long timeout)
+{
+}
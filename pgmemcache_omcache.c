@@ -0,0 +1,701 @@
+/*
+ * OMcache backend of pgmemcache.
+ *
+ * Copyright (c) 2012-2014 Ohmu Ltd <opensource@ohmu.fi>
+ *
+ * See the file LICENSE for distribution terms.
+ *
+ * This implements the operations of pgmemcache_backend.h with OMcache's
+ * libmemcached compatible API where it's enough and with the native
+ * omcache_* functions for everything that needs a timeout of its own:
+ * queued requests are sent with a zero timeout and multi-gets read their
+ * responses with omcache_io().
+ */
+
+#include "pgmemcache_backend.h"
+#include <syslog.h>  /* for log levels */
+
+/* defaults of pgmemcache.read_timeout and pgmemcache.write_timeout */
+#ifndef OMCACHE_READ_TIMEOUT
+#define OMCACHE_READ_TIMEOUT 2000
+#endif // !OMCACHE_READ_TIMEOUT
+#ifndef OMCACHE_WRITE_TIMEOUT
+#define OMCACHE_WRITE_TIMEOUT 20
+#endif // !OMCACHE_WRITE_TIMEOUT
+
+/* most statistics of a single group read from a server */
+#define OMCACHE_MAX_STATS 4096
+
+/* Settings omcache has no place for, kept per context since every cluster
+ * has a context of its own.  The read and write timeouts are passed to each
+ * omcache call. */
+typedef struct
+{
+  memcached_st *mc;
+  int read_timeout;
+  int write_timeout;
+  bool queue_requests;  /* requests are only queued, see om_set_buffering */
+} om_settings;
+
+static List *om_contexts = NIL;
+
+/* the settings of the context used last, for the timeouts of the
+ * libmemcached compatible API */
+static om_settings *om_current = NULL;
+
+struct memcache_mget
+{
+  TimestampTz deadline;           /* end of the latency budget or 0 */
+  omcache_req_t *requests;
+  size_t request_count;
+  omcache_value_t *values;
+  size_t value_count;
+  size_t next;                    /* the next value to return */
+  size_t nkeys;
+};
+
+/* Make the settings of mc the current ones and return them. */
+static om_settings *om_use(memcached_st *mc)
+{
+  ListCell *lc;
+
+  if (om_current != NULL && om_current->mc == mc)
+    return om_current;
+  foreach(lc, om_contexts)
+    {
+      om_settings *settings = (om_settings *) lfirst(lc);
+
+      if (settings->mc == mc)
+        return om_current = settings;
+    }
+  elog(ERROR, "pgmemcache: unknown omcache context");
+  return NULL;
+}
+
+int pgmemcache_omcache_read_timeout(void)
+{
+  return om_current != NULL && om_current->read_timeout >= 0 ?
+    om_current->read_timeout : OMCACHE_READ_TIMEOUT;
+}
+
+int pgmemcache_omcache_write_timeout(void)
+{
+  return om_current != NULL && om_current->write_timeout >= 0 ?
+    om_current->write_timeout : OMCACHE_WRITE_TIMEOUT;
+}
+
+/* The read timeout limited to the time left of a latency budget. */
+static int budget_read_timeout(TimestampTz deadline)
+{
+  long secs;
+  int usecs;
+
+  if (deadline == 0)
+    return pgmemcache_omcache_read_timeout();
+  TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+  return (int) Min(Max(secs * 1000 + usecs / 1000, 1), (long) pgmemcache_omcache_read_timeout());
+}
+
+static void pgmemcache_log_func(void *context, int syslog_level, const char *msg)
+{
+  int pg_level = LOG_INFO;
+  switch (syslog_level)
+    {
+    case LOG_ERR:
+    case LOG_WARNING: pg_level = WARNING; break;
+    case LOG_NOTICE: pg_level = NOTICE; break;
+    }
+  elog(pg_level, "%s", msg);
+}
+
+static memcached_st *om_create(void)
+{
+  memcached_st *mc = memcached_create(NULL);
+  om_settings *settings = NULL;
+  ListCell *lc;
+
+  /* contexts are freed with memcached_free(), the settings of a freed one
+   * are reused when a new context gets its address */
+  foreach(lc, om_contexts)
+    if (((om_settings *) lfirst(lc))->mc == mc)
+      settings = (om_settings *) lfirst(lc);
+  if (settings == NULL)
+    {
+      MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+      settings = palloc(sizeof(om_settings));
+      om_contexts = lappend(om_contexts, settings);
+      MemoryContextSwitchTo(oldcontext);
+    }
+  settings->mc = mc;
+  settings->read_timeout = -1;
+  settings->write_timeout = -1;
+  settings->queue_requests = false;
+
+  omcache_set_log_callback(mc, 0, pgmemcache_log_func, NULL);
+  return mc;
+}
+
+static void om_set_timeouts(memcached_st *mc, int read, int write, int connect)
+{
+  om_settings *settings = om_use(mc);
+
+  settings->read_timeout = read;
+  settings->write_timeout = write;
+  if (connect >= 0)
+    omcache_set_connect_timeout(mc, connect);
+}
+
+static void om_set_sasl(memcached_st *mc, const char *username, const char *password)
+{
+}
+
+static char *om_check_server(const server_spec *spec)
+{
+  if (spec->port == 0)
+    return psprintf("unix socket server \"%s\" is not supported with omcache", spec->host);
+  if (spec->weight != 0)
+    return psprintf("server weights are not supported with omcache");
+  return NULL;
+}
+
+/* omcache replaces the whole server list on push and keeps the
+ * connections to the servers that remain on it. */
+static memcached_return om_add_servers(memcached_st *mc, List *current, List *added)
+{
+  StringInfoData buf;
+  memcached_server_st *server_list;
+  memcached_return rc;
+  List *all = list_concat(list_copy(current), list_copy(added));
+  ListCell *lc;
+
+  initStringInfo(&buf);
+  foreach(lc, all)
+    {
+      server_spec *spec = (server_spec *) lfirst(lc);
+      appendStringInfo(&buf, "%s%s%s%s:%u", buf.len ? "," : "",
+                       strchr(spec->host, ':') ? "[" : "", spec->host,
+                       strchr(spec->host, ':') ? "]" : "", spec->port);
+    }
+  server_list = memcached_servers_parse(buf.data);
+  rc = memcached_server_push(mc, server_list);
+  memcached_server_list_free(server_list);
+  list_free(all);
+  pfree(buf.data);
+  return rc;
+}
+
+#define MC_STR_TO_ENUM(d,v) \
+  if (strcmp(value, "MEMCACHED_" #d "_" #v) == 0 || strcmp(value, #v) == 0) \
+      return #v
+
+static memcached_behavior get_memcached_behavior_flag(const char *value)
+{
+  MC_STR_TO_ENUM(BEHAVIOR, BINARY_PROTOCOL);
+  MC_STR_TO_ENUM(BEHAVIOR, BUFFER_REQUESTS);
+  MC_STR_TO_ENUM(BEHAVIOR, CACHE_LOOKUPS);
+  MC_STR_TO_ENUM(BEHAVIOR, CONNECT_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, DEAD_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, DISTRIBUTION);
+  MC_STR_TO_ENUM(BEHAVIOR, HASH);
+  MC_STR_TO_ENUM(BEHAVIOR, HASH_WITH_PREFIX_KEY);
+  MC_STR_TO_ENUM(BEHAVIOR, IO_BYTES_WATERMARK);
+  MC_STR_TO_ENUM(BEHAVIOR, IO_KEY_PREFETCH);
+  MC_STR_TO_ENUM(BEHAVIOR, IO_MSG_WATERMARK);
+  MC_STR_TO_ENUM(BEHAVIOR, KETAMA);
+  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_HASH);
+  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_PRE1010);
+  MC_STR_TO_ENUM(BEHAVIOR, KETAMA_WEIGHTED);
+  MC_STR_TO_ENUM(BEHAVIOR, NO_BLOCK);
+  MC_STR_TO_ENUM(BEHAVIOR, NOREPLY);
+  MC_STR_TO_ENUM(BEHAVIOR, NUMBER_OF_REPLICAS);
+  MC_STR_TO_ENUM(BEHAVIOR, POLL_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, RANDOMIZE_REPLICA_READ);
+  MC_STR_TO_ENUM(BEHAVIOR, RCV_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, REMOVE_FAILED_SERVERS);
+  MC_STR_TO_ENUM(BEHAVIOR, RETRY_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, SERVER_FAILURE_LIMIT);
+  MC_STR_TO_ENUM(BEHAVIOR, SND_TIMEOUT);
+  MC_STR_TO_ENUM(BEHAVIOR, SOCKET_RECV_SIZE);
+  MC_STR_TO_ENUM(BEHAVIOR, SOCKET_SEND_SIZE);
+  MC_STR_TO_ENUM(BEHAVIOR, SORT_HOSTS);
+  MC_STR_TO_ENUM(BEHAVIOR, SUPPORT_CAS);
+  MC_STR_TO_ENUM(BEHAVIOR, TCP_NODELAY);
+  MC_STR_TO_ENUM(BEHAVIOR, USER_DATA);
+  MC_STR_TO_ENUM(BEHAVIOR, USE_UDP);
+  MC_STR_TO_ENUM(BEHAVIOR, VERIFY_KEY);
+
+  return NULL;
+}
+
+static memcached_hash get_memcached_hash_type(const char *value)
+{
+  MC_STR_TO_ENUM(HASH, MURMUR);
+  MC_STR_TO_ENUM(HASH, MD5);
+  MC_STR_TO_ENUM(HASH, JENKINS);
+  MC_STR_TO_ENUM(HASH, HSIEH);
+  MC_STR_TO_ENUM(HASH, FNV1A_64);
+  MC_STR_TO_ENUM(HASH, FNV1A_32);
+  MC_STR_TO_ENUM(HASH, FNV1_64);
+  MC_STR_TO_ENUM(HASH, FNV1_32);
+  MC_STR_TO_ENUM(HASH, DEFAULT);
+  MC_STR_TO_ENUM(HASH, CRC);
+
+  return NULL;
+}
+
+static memcached_server_distribution get_memcached_distribution_type(const char *value)
+{
+  MC_STR_TO_ENUM(DISTRIBUTION, RANDOM);
+  MC_STR_TO_ENUM(DISTRIBUTION, MODULA);
+  MC_STR_TO_ENUM(DISTRIBUTION, CONSISTENT_KETAMA);
+  MC_STR_TO_ENUM(DISTRIBUTION, CONSISTENT);
+
+  return NULL;
+}
+
+/* Apply a behavior to mc, or only check it when mc is NULL.  Returns why
+ * the behavior is invalid or not supported by omcache, or NULL. */
+static char *om_behavior(memcached_st *mc, const char *flag, const char *data,
+                         memcached_return *rc)
+{
+  memcached_behavior bkey = get_memcached_behavior_flag(flag);
+  const char *bvalstr = "";
+  uint64_t bval = 0;
+  char *endptr;
+
+  *rc = OMCACHE_OK;
+  if (bkey == NULL)
+    return psprintf("unknown behavior flag: %s", flag);
+  if (strcmp(bkey, "HASH") == 0 || strcmp(bkey, "KETAMA_HASH") == 0)
+    {
+      bvalstr = get_memcached_hash_type(data);
+      if (bvalstr == NULL)
+        return psprintf("invalid hash name: %s", data);
+    }
+  else if (strcmp(bkey, "DISTRIBUTION") == 0)
+    {
+      bvalstr = get_memcached_distribution_type(data);
+      if (bvalstr == NULL)
+        return psprintf("invalid distribution name: %s", data);
+    }
+  else
+    {
+      bval = strtol(data, &endptr, 10);
+      if (endptr == data)
+        return psprintf("invalid behavior param %s: %s", flag, data);
+    }
+
+  if (strcmp(bkey, "BINARY_PROTOCOL") == 0)
+    {
+      if (!bval)
+        return pstrdup("omcache always uses binary protocol");
+    }
+  else if (strcmp(bkey, "BUFFER_REQUESTS") == 0)
+    {
+      if (mc)
+        *rc = omcache_set_buffering(mc, bval);
+    }
+  else if (strcmp(bkey, "CONNECT_TIMEOUT") == 0)
+    {
+      if (mc)
+        *rc = omcache_set_connect_timeout(mc, bval);
+    }
+  else if (strcmp(bkey, "DEAD_TIMEOUT") == 0)
+    {
+      if (mc)
+        *rc = omcache_set_dead_timeout(mc, bval * 1000);
+    }
+  else if (strcmp(bkey, "DISTRIBUTION") == 0)
+    {
+      if (strcmp(bvalstr, "CONSISTENT") && strcmp(bvalstr, "CONSISTENT_KETAMA"))
+        return pstrdup("omcache always uses ketama");
+    }
+  else if (strcmp(bkey, "HASH") == 0 || strcmp(bkey, "KETAMA_HASH") == 0)
+    {
+      if (strcmp(bvalstr, "DEFAULT"))
+        return pstrdup("omcache always uses the 'default' (bob jenkins' 'one at a time') hash");
+    }
+  else if (strcmp(bkey, "KETAMA") == 0)
+    {
+      if (!bval)
+        return pstrdup("omcache always uses a ketama distribution method");
+      if (mc)
+        *rc = omcache_set_distribution_method(mc, &omcache_dist_libmemcached_ketama);
+    }
+  else if (strcmp(bkey, "KETAMA_WEIGHTED") == 0)
+    {
+      if (!bval)
+        return pstrdup("omcache always uses a ketama distribution method");
+      if (mc)
+        *rc = omcache_set_distribution_method(mc, &omcache_dist_libmemcached_ketama_weighted);
+    }
+  else if (strcmp(bkey, "KETAMA_PRE1010") == 0)
+    {
+      if (!bval)
+        return pstrdup("omcache always uses a ketama distribution method");
+      if (mc)
+        *rc = omcache_set_distribution_method(mc, &omcache_dist_libmemcached_ketama_pre1010);
+    }
+  else if (strcmp(bkey, "NO_BLOCK") == 0)
+    ;  // omcache is non-blocking by default
+  else if (strcmp(bkey, "NOREPLY") == 0)
+    ;  // this isn't really a behavior in omcache
+  else if (strcmp(bkey, "REMOVE_FAILED_SERVERS") == 0)
+    ;  // omcache doesn't have this concept
+  else if (strcmp(bkey, "RETRY_TIMEOUT") == 0)
+    {
+      if (mc)
+        *rc = omcache_set_reconnect_timeout(mc, bval * 1000);
+    }
+  else if (strcmp(bkey, "SUPPORT_CAS") == 0)
+    ;  // omcache uses binary protocol which always has cas
+  else
+    return psprintf("unsupported behavior %s for omcache", flag);
+  return NULL;
+}
+
+static char *om_check_behavior(const char *flag, const char *data)
+{
+  memcached_return rc;
+
+  return om_behavior(NULL, flag, data, &rc);
+}
+
+static memcached_return om_set_behavior(memcached_st *mc, const char *flag, const char *data)
+{
+  memcached_return rc;
+  char *error = om_behavior(mc, flag, data, &rc);
+
+  if (error)
+    elog(ERROR, "pgmemcache: %s", error);
+  return rc;
+}
+
+/* Buffered and noreply requests are queued with a zero timeout, which
+ * only waits for the replies on flush_buffers. */
+static void om_set_buffering(memcached_st *mc, memcache_send_mode mode, memcache_send_state *state)
+{
+  om_settings *settings = om_use(mc);
+
+  state->buffer_requests = settings->queue_requests;
+  state->noreply = 0;
+  settings->queue_requests = mode != MEMCACHE_SEND_WAIT;
+}
+
+static void om_restore_buffering(memcached_st *mc, const memcache_send_state *state)
+{
+  om_use(mc)->queue_requests = state->buffer_requests != 0;
+}
+
+/* Queued requests return OMCACHE_AGAIN until they're flushed. */
+static memcached_return queued(memcached_return rc)
+{
+  return rc == OMCACHE_AGAIN ? OMCACHE_BUFFERED : rc;
+}
+
+static text *om_get(memcached_st *mc, const char *key, size_t key_length, uint64_t *cas,
+                    memcached_return *rc)
+{
+  const unsigned char *value;
+  size_t value_length;
+  text *ret;
+
+  om_use(mc);
+  if (cas != NULL)
+    *cas = 0;
+  *rc = omcache_get(mc, omc_cc_to_cuc(key), key_length, &value, &value_length,
+                    NULL, cas, pgmemcache_omcache_read_timeout());
+  if (*rc != OMCACHE_OK)
+    return NULL;
+  ret = (text *) palloc(value_length + VARHDRSZ);
+  SET_VARSIZE(ret, value_length + VARHDRSZ);
+  memcpy(VARDATA(ret), value, value_length);
+  return ret;
+}
+
+static memcache_mget *om_mget(memcached_st *mc, const char *const *keys, const size_t *key_lengths,
+                              size_t nkeys, TimestampTz deadline, memcached_return *rc)
+{
+  memcache_mget *state = palloc0(sizeof(memcache_mget));
+
+  om_use(mc);
+  /* persistent request structures to handle pending requests */
+  state->deadline = deadline;
+  state->nkeys = nkeys;
+  state->requests = palloc(sizeof(omcache_req_t) * nkeys);
+  state->request_count = nkeys;
+  state->values = palloc(sizeof(omcache_value_t) * nkeys);
+  state->value_count = nkeys;
+  *rc = omcache_get_multi(mc, (const unsigned char **) keys, (size_t *) key_lengths, nkeys,
+                          state->requests, &state->request_count,
+                          state->values, &state->value_count, budget_read_timeout(deadline));
+  if (*rc == OMCACHE_AGAIN)
+    *rc = OMCACHE_OK;
+  if (*rc != OMCACHE_OK)
+    state->request_count = state->value_count = 0;
+  return state;
+}
+
+static memcache_mget_status om_mget_next(memcached_st *mc, memcache_mget *state,
+                                         memcache_value *value, memcached_return *rc)
+{
+  om_use(mc);
+  for (;;)
+    {
+      while (state->next < state->value_count)
+        {
+          omcache_value_t *v = &state->values[state->next++];
+
+          if (v->status != OMCACHE_OK)
+            continue;
+          value->key = (const char *) v->key;
+          value->key_length = v->key_len;
+          value->value = (const char *) v->data;
+          value->value_length = v->data_len;
+          value->flags = v->flags;
+          *rc = OMCACHE_OK;
+          return MEMCACHE_MGET_VALUE;
+        }
+      if (state->request_count == 0)
+        {
+          *rc = OMCACHE_OK;
+          return MEMCACHE_MGET_DONE;
+        }
+      if (state->deadline && GetCurrentTimestamp() >= state->deadline)
+        {
+          /* drop the responses still on their way */
+          omcache_reset_buffers(mc);
+          return MEMCACHE_MGET_EXPIRED;
+        }
+      state->next = 0;
+      state->value_count = state->nkeys;
+      *rc = omcache_io(mc, state->requests, &state->request_count,
+                       state->values, &state->value_count, budget_read_timeout(state->deadline));
+      if (*rc != OMCACHE_OK && *rc != OMCACHE_AGAIN)
+        return MEMCACHE_MGET_ERROR;
+    }
+}
+
+static void om_mget_end(memcached_st *mc, memcache_mget *state)
+{
+  if (state->request_count > 0)
+    omcache_reset_buffers(mc);
+  pfree(state->requests);
+  pfree(state->values);
+  pfree(state);
+}
+
+static memcached_return om_store(memcached_st *mc, int cmd, const char *key, size_t key_length,
+                                 const char *value, size_t value_length, time_t expiration,
+                                 uint32_t flags, uint64_t cas)
+{
+  const unsigned char *k = omc_cc_to_cuc(key), *v = omc_cc_to_cuc(value);
+  bool queue_requests = om_use(mc)->queue_requests;
+
+  if (queue_requests || cas != 0)
+    {
+      /* a zero timeout only queues the request */
+      int32_t timeout = queue_requests ? 0 : pgmemcache_omcache_write_timeout();
+
+      switch (cmd)
+        {
+        case PG_MEMCACHE_CMD_ADD:
+          return queued(omcache_add(mc, k, key_length, v, value_length, expiration, flags, timeout));
+        case PG_MEMCACHE_CMD_REPLACE:
+          return queued(omcache_replace(mc, k, key_length, v, value_length, expiration, flags, timeout));
+        case PG_MEMCACHE_CMD_SET:
+          return queued(omcache_set(mc, k, key_length, v, value_length, expiration, flags, cas, timeout));
+        case PG_MEMCACHE_CMD_PREPEND:
+          return queued(omcache_prepend(mc, k, key_length, v, value_length, 0, timeout));
+        case PG_MEMCACHE_CMD_APPEND:
+          return queued(omcache_append(mc, k, key_length, v, value_length, 0, timeout));
+        }
+    }
+  else
+    {
+      switch (cmd)
+        {
+        case PG_MEMCACHE_CMD_ADD:
+          return memcached_add(mc, key, key_length, value, value_length, expiration, flags);
+        case PG_MEMCACHE_CMD_REPLACE:
+          return memcached_replace(mc, key, key_length, value, value_length, expiration, flags);
+        case PG_MEMCACHE_CMD_SET:
+          return memcached_set(mc, key, key_length, value, value_length, expiration, flags);
+        case PG_MEMCACHE_CMD_PREPEND:
+          return memcached_prepend(mc, key, key_length, value, value_length, expiration, flags);
+        case PG_MEMCACHE_CMD_APPEND:
+          return memcached_append(mc, key, key_length, value, value_length, expiration, flags);
+        }
+    }
+  elog(ERROR, "pgmemcache: unknown set command type: %d", cmd);
+  return OMCACHE_FAIL;
+}
+
+static memcached_return om_delta(memcached_st *mc, int cmd, const char *key, size_t key_length,
+                                 uint64_t offset, uint64_t initial, time_t expiration,
+                                 uint64_t *value)
+{
+  if (om_use(mc)->queue_requests)
+    {
+      /* a zero timeout only queues the request, there's no value */
+      if (cmd == PG_MEMCACHE_CMD_INCR)
+        return queued(omcache_increment(mc, omc_cc_to_cuc(key), key_length, offset, initial,
+                                        expiration, NULL, 0));
+      return queued(omcache_decrement(mc, omc_cc_to_cuc(key), key_length, offset, initial,
+                                      expiration, NULL, 0));
+    }
+  if (cmd == PG_MEMCACHE_CMD_INCR)
+    return memcached_increment_with_initial(mc, key, key_length, offset, initial,
+                                            expiration, value);
+  return memcached_decrement_with_initial(mc, key, key_length, offset, initial,
+                                          expiration, value);
+}
+
+static memcached_return om_remove(memcached_st *mc, const char *key, size_t key_length, time_t hold)
+{
+  if (om_use(mc)->queue_requests)
+    return queued(omcache_delete(mc, omc_cc_to_cuc(key), key_length, 0));
+  return memcached_delete(mc, key, key_length, hold);
+}
+
+static memcached_return om_flush(memcached_st *mc, time_t expiration)
+{
+  om_use(mc);
+  return memcached_flush(mc, expiration);
+}
+
+static memcached_return om_flush_buffers(memcached_st *mc)
+{
+  om_use(mc);
+  return omcache_io(mc, NULL, NULL, NULL, NULL, pgmemcache_omcache_read_timeout());
+}
+
+static const void *om_server_for_key(memcached_st *mc, const char *key, size_t key_length)
+{
+  int idx = omcache_server_index_for_key(mc, omc_cc_to_cuc(key), key_length);
+
+  return idx >= 0 ? (const void *) (intptr_t) (idx + 1) : NULL;
+}
+
+static bool om_server_name(memcached_st *mc, const char *key, size_t key_length, StringInfo buf)
+{
+  omcache_server_info_t *info;
+  int idx = omcache_server_index_for_key(mc, omc_cc_to_cuc(key), key_length);
+
+  info = idx >= 0 ? omcache_server_info(mc, idx) : NULL;
+  if (info == NULL)
+    return false;
+  appendStringInfo(buf, "%s:%d", info->hostname, info->port);
+  omcache_server_info_free(mc, info);
+  return true;
+}
+
+static memcached_return om_server_stats(memcached_st *mc, memcached_server_instance_st server,
+                                        StringInfo buf)
+{
+  size_t i, value_count = 50;
+  omcache_value_t values[50];
+  int rc;
+
+  om_use(mc);
+  rc = omcache_stat(mc, NULL, values, &value_count,
+                    server->server_index, pgmemcache_omcache_read_timeout());
+  if (rc != OMCACHE_OK)
+    {
+      value_count = 0;
+      appendStringInfo(buf, "omcache_stat failed: %s\n", omcache_strerror(rc));
+    }
+
+  for (i = 0; i < value_count; i++)
+    {
+      int key_len = (int) values[i].key_len,
+          data_len = (int) values[i].data_len;
+      if (key_len == 0 && data_len == 0)
+        break;
+      appendStringInfo(buf, "%.*s: %.*s\n",
+                       key_len, (const char *) values[i].key,
+                       data_len, (const char *) values[i].data);
+    }
+  return OMCACHE_OK;
+}
+
+typedef struct
+{
+  memcached_st *mc;
+  const char *group;
+  memcache_stat_fn fn;
+  void *context;
+} group_stats_state;
+
+static memcached_return_t group_server_function(const memcached_st *ptr,
+                                                memcached_server_instance_st server,
+                                                void *context)
+{
+  group_stats_state *state = (group_stats_state *) context;
+  omcache_value_t *values = palloc(sizeof(omcache_value_t) * OMCACHE_MAX_STATS);
+  const char *hostname = memcached_server_name(server);
+  unsigned int port = memcached_server_port(server);
+  size_t i, value_count = OMCACHE_MAX_STATS;
+  int rc;
+
+  rc = omcache_stat(state->mc, state->group, values, &value_count,
+                    server->server_index, pgmemcache_omcache_read_timeout());
+  if (rc != OMCACHE_OK)
+    elog(WARNING, "pgmemcache: omcache_stat %s on %s:%u: %s",
+                  state->group, hostname, port, omcache_strerror(rc));
+  else
+    for (i = 0; i < value_count; i++)
+      {
+        if (values[i].key_len == 0 && values[i].data_len == 0)
+          break;
+        state->fn(hostname, port, (const char *) values[i].key, values[i].key_len,
+                  (const char *) values[i].data, values[i].data_len, state->context);
+      }
+  pfree(values);
+  return OMCACHE_OK;
+}
+
+static memcached_return om_group_stats(memcached_st *mc, const char *group, memcache_stat_fn fn,
+                                       void *context)
+{
+  group_stats_state state = { mc, group, fn, context };
+  memcached_server_fn callbacks[1];
+  memcached_return rc;
+
+  om_use(mc);
+  callbacks[0] = (memcached_server_fn) group_server_function;
+  rc = memcached_server_cursor(mc, callbacks, (void *) &state, 1);
+  /* the servers that failed were already reported */
+  return rc == MEMCACHED_SOME_ERRORS ? OMCACHE_OK : rc;
+}
+
+const memcache_backend_ops memcache_backend = {
+  NULL,
+  om_create,
+  om_set_timeouts,
+  om_set_sasl,
+  om_check_server,
+  om_add_servers,
+  true,
+  om_check_behavior,
+  om_set_behavior,
+  NULL,
+  om_set_buffering,
+  om_restore_buffering,
+  om_get,
+  om_mget,
+  om_mget_next,
+  om_mget_end,
+  om_store,
+  om_delta,
+  om_remove,
+  om_flush,
+  om_flush_buffers,
+  om_server_for_key,
+  om_server_name,
+  om_server_stats,
+  om_group_stats,
+  NULL,
+  NULL
+};
@@ -0,0 +1,20 @@
+SELECT memcache_server_add('localhost:33211');
+SELECT memcache_delete('lease');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT memcache_set('lease', 'value1');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT memcache_invalidate('lease', '10 seconds');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT memcache_set('lease', 'value2');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT memcache_delete('lease');
+SELECT memcache_invalidate('lease');
+SELECT memcache_set('key with spaces', 'spaced');
+SELECT memcache_set('meta_value', 'test_value1');
+SELECT memcache_delete('meta_missing');
+SELECT memcache_get('key with spaces');
+SELECT key, value FROM memcache_get_multi('{"key with spaces",meta_missing,meta_value}'::TEXT[]) ORDER BY key;
+SELECT memcache_delete('key with spaces');
+SELECT memcache_delete('meta_value');
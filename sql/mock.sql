@@ -0,0 +1,169 @@
+SELECT memcache_server_add('mock-a:1');
+SELECT memcache_server_add('mock-b:2');
+BEGIN;
+SELECT memcache_server_add('mock-c:3');
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY 1;
+ROLLBACK;
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY 1;
+SET pgmemcache.default_servers = 'mock-c:3';
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY 1;
+RESET pgmemcache.default_servers;
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY 1;
+BEGIN;
+SELECT memcache_server_add('/tmp/pgmemcache-mock.sock?weight=2');
+SELECT memcache_server_add('[::1]:4?weight=3');
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY line COLLATE "C";
+ROLLBACK;
+SET pgmemcache.default_servers = 'mock-c:3?weight=2, /tmp/pgmemcache-mock.sock?weight=4';
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY line COLLATE "C";
+SELECT memcache_set('weighted', 'w');
+SET pgmemcache.default_servers = 'mock-c:3?weight=3, /tmp/pgmemcache-mock.sock';
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY line COLLATE "C";
+SELECT memcache_get('weighted');
+RESET pgmemcache.default_servers;
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY line COLLATE "C";
+SELECT memcache_set('key', 'value');
+SELECT memcache_get('key');
+SELECT memcache_add('key', 'other');
+SELECT memcache_replace('missing', 'other');
+SELECT memcache_append('key', '-tail');
+SELECT memcache_prepend('key', 'head-');
+SELECT memcache_get('key');
+SELECT memcache_add('counter', '10');
+SELECT memcache_incr('counter', 30);
+SELECT memcache_decr('counter', 100);
+SELECT memcache_incr('missing');
+SELECT memcache_incr('missing', 5, 7);
+SELECT memcache_incr('key');
+SELECT memcache_set('k' || i, 'v' || i) FROM generate_series(1, 10) AS i;
+SELECT key, value FROM memcache_get_multi(ARRAY['k1', 'k3', 'nothere', 'k10', 'k7']) ORDER BY key;
+SELECT memcache_delete('k3');
+SELECT memcache_delete('k3');
+SELECT count(*) FROM memcache_get_multi(ARRAY(SELECT 'k' || i FROM generate_series(1, 10) AS i));
+SELECT memcache_set('expired', 'gone', '-1 second'::interval);
+SELECT memcache_get('expired');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT memcache_set('lease', 'value1');
+SELECT memcache_invalidate('lease', '10 seconds');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT * FROM memcache_get_lease('lease', '10 seconds');
+SELECT split_part(line, ': ', 1) AS stat, sum(split_part(line, ': ', 2)::bigint)
+  FROM regexp_split_to_table(memcache_stats(), E'\n') AS line
+  WHERE line ~ '^(curr_items|cmd_set|get_hits|get_misses): '
+  GROUP BY 1 ORDER BY 1;
+SET pgmemcache.mock_latency = 1000;
+SELECT memcache_get('key');
+RESET pgmemcache.mock_latency;
+SELECT memcache_flush_all();
+SELECT memcache_get('key');
+SELECT memcache_value_sizes_reset();
+SELECT bool_and(memcache_set('small:' || lpad(i::text, 2, '0'), repeat('x', 10))) FROM generate_series(1, 20) AS i;
+SELECT bool_and(memcache_set('large:' || i, repeat('y', 1000))) FROM generate_series(1, 5) AS i;
+SELECT memcache_set('other', repeat('z', 100));
+SELECT * FROM memcache_value_sizes() ORDER BY prefix, min_size;
+SELECT slab_class, chunk_size, sum(used_chunks) AS used_chunks, sum(items) AS items,
+       max(local_writes) AS local_writes, round(max(efficiency)::numeric, 3) AS efficiency
+  FROM memcache_slab_report() GROUP BY 1, 2 ORDER BY 1;
+SELECT memcache_flush_all();
+SELECT growth_factor, chunk_size, round(efficiency::numeric, 3) AS efficiency,
+       current_growth_factor, current_chunk_size, round(current_efficiency::numeric, 3) AS current_efficiency
+  FROM memcache_slab_advice();
+SELECT memcache_hll_add('hll:a', ARRAY(SELECT generate_series(1, 1000)));
+SELECT memcache_hll_add('hll:b', ARRAY(SELECT generate_series(501, 1500)::int8));
+SELECT memcache_hll_count(ARRAY['hll:a']) AS a, memcache_hll_count(ARRAY['hll:b']) AS b,
+       memcache_hll_count(ARRAY['hll:a', 'hll:b', 'hll:missing']) AS a_or_b;
+BEGIN;
+SELECT memcache_hll_add('hll:t', ARRAY['x', 'y', 'z']);
+SELECT memcache_hll_add('hll:t', ARRAY['z', 'y']);
+SAVEPOINT s;
+SELECT memcache_hll_add('hll:t', ARRAY(SELECT 'w' || i FROM generate_series(1, 100) AS i));
+ROLLBACK TO SAVEPOINT s;
+SELECT memcache_hll_count(ARRAY['hll:t']);
+COMMIT;
+SELECT memcache_hll_count(ARRAY['hll:t']);
+SELECT memcache_set('hll:bad', 'x');
+SELECT memcache_hll_count(ARRAY['hll:bad', 'hll:t']);
+SELECT memcache_key('user', 42, (-7)::int2, 9000000000, '-9223372036854775808'::int8, 'lit', 'abc'::varchar,
+                    'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid, 1.50, true);
+SELECT memcache_key('', 1) AS no_prefix, memcache_key('p', VARIADIC ARRAY[1, 2, 3]) AS variadic,
+       memcache_key('p', 1, NULL::int) IS NULL AS null_arg, memcache_key('p', VARIADIC ARRAY[1, NULL]) IS NULL AS null_elem;
+SELECT memcache_key('long', repeat('x', 300)), memcache_key(repeat('p', 200), repeat('x', 100)) AS long_prefix;
+SELECT memcache_set('long:' || repeat('x', 300), 'long value');
+SELECT memcache_get(memcache_key('long', repeat('x', 300)));
+SELECT key = 'long:' || repeat('x', 300) AS original_key, value FROM memcache_get_multi(ARRAY['long:' || repeat('x', 300)]);
+SELECT memcache_delete('long:' || repeat('x', 300));
+SELECT memcache_get('long:#232c2c11a5580004ad2dd7268a1981f3');
+SET pgmemcache.replicate_keys = 'hot:=2';
+SELECT memcache_set('hot:config', 'v1');
+SELECT count(*), min(v), max(v) FROM (SELECT memcache_get('hot:config') AS v FROM generate_series(1, 20)) AS s;
+RESET pgmemcache.replicate_keys;
+SELECT memcache_get('hot:config~2');
+SET pgmemcache.replicate_keys = 'hot:=2';
+SELECT memcache_delete('hot:config');
+SELECT count(memcache_get('hot:config')) FROM generate_series(1, 20);
+RESET pgmemcache.replicate_keys;
+SELECT memcache_get('hot:config~2');
+SELECT memcache_set('hot:other', 'x');
+SET pgmemcache.replicate_keys = 'hot:=2';
+SELECT count(*), min(v), max(v) FROM (SELECT memcache_get('hot:other') AS v FROM generate_series(1, 20)) AS s;
+RESET pgmemcache.replicate_keys;
+SELECT memcache_get('hot:other~2');
+SELECT memcache_delete('hot:other~2');
+SET pgmemcache.replicate_keys = 'hot:=2';
+SELECT DISTINCT key, value FROM memcache_get_multi(ARRAY(SELECT 'hot:other' FROM generate_series(1, 20)));
+RESET pgmemcache.replicate_keys;
+SELECT memcache_get('hot:other~2');
+SET pgmemcache.hot_key_threshold = 5;
+SELECT memcache_set('trend', 't1');
+SELECT count(memcache_get('trend')) FROM generate_series(1, 10);
+SELECT * FROM memcache_hot_keys();
+SELECT memcache_set('trend', 't2');
+RESET pgmemcache.hot_key_threshold;
+SELECT memcache_get('trend~1');
+SET pgmemcache.replicate_keys = 'config';
+SELECT memcache_cluster_define('alpha', 'mock-x:10');
+SET pgmemcache.cluster = 'alpha';
+SELECT line FROM regexp_split_to_table(memcache_stats(), E'\n') AS line WHERE line LIKE 'Server:%' ORDER BY line COLLATE "C";
+SELECT memcache_set('cluster_key', 'alpha');
+RESET pgmemcache.cluster;
+SELECT memcache_get('cluster_key');
+SELECT memcache_set('cluster_key', 'default'), memcache_set('moving', 'old value');
+SET pgmemcache.cluster = 'alpha';
+SELECT memcache_get('cluster_key'), memcache_get('moving');
+SET pgmemcache.cluster = 'nosuch';
+SET pgmemcache.cluster = 'bad name';
+SHOW pgmemcache.cluster;
+RESET pgmemcache.cluster;
+SELECT memcache_set('multi_moving', 'old multi');
+SELECT * FROM memcache_cached_query('SELECT 7', '1 hour') AS t(n int);
+SET pgmemcache.cluster = 'alpha';
+SET pgmemcache.migrate_from = 'default';
+SELECT memcache_migration_reset();
+SELECT memcache_get('moving');
+SELECT memcache_get('cluster_key');
+SELECT memcache_get('nowhere');
+SELECT memcache_set('mirrored', 'both');
+SELECT * FROM memcache_get_multi(ARRAY['cluster_key', 'multi_moving', 'nowhere']) ORDER BY key;
+SELECT * FROM memcache_cached_query('SELECT 7', '1 hour') AS t(n int);
+SELECT * FROM memcache_migration_stats();
+RESET pgmemcache.migrate_from;
+SELECT memcache_get('moving'), memcache_get('multi_moving'), memcache_get('mirrored');
+RESET pgmemcache.cluster;
+SELECT memcache_get('cluster_key'), memcache_get('mirrored');
+SET pgmemcache.default_behavior = 'DISTRIBUTION:RANDOM, TCP_NODELAY:1';
+SET pgmemcache.default_behavior = 'TCP_NODELAY:0';
+SELECT memcache_set('spread', 'x');
+SELECT count(memcache_get('spread')) FROM generate_series(1, 20);
+SET pgmemcache.default_behavior = 'TCP_NODELAY:1, NO_SUCH_FLAG:1';
+SET pgmemcache.default_behavior = 'HASH:NOPE';
+SET pgmemcache.default_behavior = 'TCP_NODELAY:yes';
+SHOW pgmemcache.default_behavior;
+SELECT memcache_cluster_define('beta', 'mock-y:11', 'NO_SUCH_FLAG:1');
+RESET pgmemcache.default_behavior;
+SELECT count(memcache_get('spread')) FROM generate_series(1, 20);
+SELECT memcache_cluster_define('buffered', 'mock-y:11', 'BUFFER_REQUESTS:1');
+SET pgmemcache.cluster = 'buffered';
+SELECT allowed, count FROM memcache_rate_limit('api', 1, '1 day');
+SELECT allowed, count FROM memcache_rate_limit('api', 1, '1 day');
+RESET pgmemcache.cluster;
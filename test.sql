@@ -1,4 +1,5 @@
 SELECT memcache_server_add('localhost:33211');
+SELECT memcache_server_add('localhost:33211?timeout=5');
 SELECT regexp_replace(memcache_stats(), 'pid:.*', '') AS memcache_stats;
 SELECT memcache_delete('jeah');
 SELECT memcache_set('jeah','test_value1');
@@ -9,3 +10,113 @@ SELECT memcache_decr('counter');
 SELECT memcache_delete('counter');
 SELECT memcache_get('counter');
 SELECT memcache_get('jeah');
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SELECT set_config(CASE WHEN current_setting('server_version_num')::int >= 160000 THEN 'debug_parallel_query' ELSE 'force_parallel_mode' END, 'on', false) AS force_parallel;
+SELECT memcache_get('jeah');
+SELECT * FROM memcache_get_multi(ARRAY['jeah', 'nothere']);
+SELECT set_config(CASE WHEN current_setting('server_version_num')::int >= 160000 THEN 'debug_parallel_query' ELSE 'force_parallel_mode' END, 'off', false) AS force_parallel;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+SELECT memcache_set('counter', '10');
+BEGIN;
+SET LOCAL pgmemcache.defer_counters = on;
+SELECT memcache_incr('counter', 5);
+SELECT memcache_incr('counter', 7);
+SELECT memcache_decr('counter', 2);
+SELECT memcache_get('counter');
+SAVEPOINT s1;
+SELECT memcache_incr('counter', 100);
+ROLLBACK TO SAVEPOINT s1;
+COMMIT;
+SELECT memcache_get('counter');
+BEGIN;
+SET LOCAL pgmemcache.defer_counters = on;
+SELECT memcache_incr('counter');
+ROLLBACK;
+SELECT memcache_get('counter');
+BEGIN;
+SET LOCAL pgmemcache.defer_counters = on;
+SELECT memcache_incr('counter', 3);
+SELECT memcache_counter_flush();
+SELECT memcache_get('counter');
+COMMIT;
+SELECT memcache_delete('counter');
+SELECT memcache_incr('icounter', 5, 100, '1 hour');
+SELECT memcache_incr('icounter', 5, 100, '1 hour');
+SELECT memcache_decr('icounter', 10, 0);
+SELECT memcache_delete('icounter');
+SELECT allowed, count FROM memcache_rate_limit('api', 2, '1 day');
+SELECT allowed, count FROM memcache_rate_limit('api', 2, '1 day');
+SELECT allowed, count FROM memcache_rate_limit('api', 2, '1 day');
+SELECT memcache_nextval('seq');
+SELECT memcache_setval('seq', 0);
+SELECT memcache_nextval('seq', 3) FROM generate_series(1, 4);
+SELECT memcache_get('seq');
+SELECT memcache_setval('seq', 100);
+SELECT memcache_nextval('seq');
+SELECT memcache_delete('seq');
+SELECT memcache_nextval('seq');
+SELECT memcache_lock('lock', '10 seconds');
+BEGIN;
+SELECT memcache_lock('lock', '10 seconds', '0.1 seconds');
+SELECT memcache_add('lock', 'other');
+SELECT memcache_lock_renew('lock', '20 seconds');
+SELECT memcache_unlock('lock');
+SELECT memcache_unlock('lock');
+SELECT memcache_lock('lock', '10 seconds');
+COMMIT;
+BEGIN;
+SELECT memcache_lock('lock', '10 seconds');
+PREPARE TRANSACTION 'pgmemcache_lock';
+SELECT memcache_get('lock');
+SELECT memcache_delete('lock:fence');
+SET pgmemcache.read_timeout = '1s';
+SELECT memcache_set('multi1', 'one'), memcache_set('multi2', 'two');
+SELECT * FROM memcache_get_multi(ARRAY['multi1', 'multi2', 'multi3'], '1 second') ORDER BY key;
+RESET pgmemcache.read_timeout;
+SELECT * FROM memcache_cached_query('SELECT g, g::text || $1 FROM generate_series(1, 3) g', '1 hour', 'x') AS t(n int, s text);
+SELECT * FROM memcache_cached_query('SELECT g, g::text || $1 FROM generate_series(1, 3) g', '1 hour', 'x') AS t(n int, s text);
+SELECT * FROM memcache_cached_query('SELECT 42', '1 hour') AS t(answer int);
+SELECT * FROM memcache_cached_query('SELECT 42', '1 hour') AS t(answer text);
+SELECT memcache_set('batch1', 'one'), memcache_set('batch3', 'three');
+SET pgmemcache.get_batch_size = 2;
+EXPLAIN (COSTS OFF) SELECT g, memcache_get('batch' || g) AS value FROM generate_series(1, 3) g;
+SELECT g, memcache_get('batch' || g) AS value FROM generate_series(1, 3) g;
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) SELECT g, memcache_get('batch' || g) AS value FROM generate_series(1, 3) g;
+EXPLAIN (COSTS OFF) SELECT g, memcache_get('batch' || g) AS value, random() FROM generate_series(1, 3) g;
+EXPLAIN (COSTS OFF) SELECT memcache_get('batch1');
+RESET pgmemcache.get_batch_size;
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) SELECT memcache_set('explained', 'value');
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) SELECT memcache_get('explained');
+SELECT memcache_cluster_define('other', 'localhost:33211', 'RETRY_TIMEOUT:2');
+SHOW pgmemcache.clusters;
+SET pgmemcache.cluster = 'other';
+SELECT memcache_set('cluster_key', 'other');
+RESET pgmemcache.cluster;
+SELECT memcache_get('cluster_key');
+SELECT memcache_delete('cluster_key');
+SET pgmemcache.cluster = 'other';
+SET pgmemcache.migrate_from = 'default';
+SELECT memcache_migration_reset();
+SELECT memcache_set('migrated_key', 'moved');
+SELECT memcache_get('migrated_key');
+SELECT memcache_get('missing_key');
+SELECT * FROM memcache_migration_stats();
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SELECT set_config(CASE WHEN current_setting('server_version_num')::int >= 160000 THEN 'debug_parallel_query' ELSE 'force_parallel_mode' END, 'on', false) AS force_parallel;
+SELECT memcache_get('missing_parallel');
+SELECT set_config(CASE WHEN current_setting('server_version_num')::int >= 160000 THEN 'debug_parallel_query' ELSE 'force_parallel_mode' END, 'off', false) AS force_parallel;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+SELECT * FROM memcache_migration_stats();
+RESET pgmemcache.migrate_from;
+RESET pgmemcache.cluster;
+SELECT memcache_set('snap:a', 'one'), memcache_set('snap:b', 'two');
+SELECT memcache_snapshot('snap:', 'pgmemcache_test.snapshot');
+SELECT pg_read_binary_file('pgmemcache_test.snapshot', 0, 16);
+SELECT memcache_delete('snap:a'), memcache_delete('snap:b');
+SELECT memcache_restore('pgmemcache_test.snapshot');
+SELECT memcache_get('snap:a'), memcache_get('snap:b');
+COPY (SELECT 1) TO PROGRAM 'cat > /dev/null && rm -f pgmemcache_test.snapshot';